@@ -0,0 +1,57 @@
+#pragma once
+
+#include "pnpl/inference_runner.hpp"
+#include <string>
+#include <filesystem>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Finds the fastest runner settings for a model on this host by timing short
+    // prefill and decode probes: GPU offload (if there is a GPU), generation and
+    // prompt threads, physical batch size and flash attention. Results are cached
+    // in a file keyed by model, CPU and KV cache types, so only the first start
+    // on a host pays for the probes.
+    class Autotuner {
+    public:
+        explicit Autotuner(const std::filesystem::path& cachePath);
+
+        // Fill in the tuned fields of options for a model: from the cache if this host
+        // tuned it before, else by probing (and caching the result). Other fields are
+        // kept; quantized V cache keeps flash attention on.
+        bool tune(const std::string& modelPath, RunnerOptions& options, std::string& error);
+
+        // Time prefill and decode with default pages, then with options.hugePages
+        // (transparent if off), and print both with the huge page coverage obtained
+        static bool compareHugePages(const std::string& modelPath, const RunnerOptions& options,
+                                     std::string& error);
+
+        // CPU model and hardware thread count
+        static std::string hostDescription();
+
+        // Cheap model fingerprint: file size plus the first and last few MiB (GGUF
+        // metadata and tensor data), hashed; avoids reading multi-GB files at startup
+        static bool modelFingerprint(const std::string& modelPath, uint64_t& fingerprint,
+                                     std::string& error);
+
+    private:
+        std::filesystem::path cachePath_;
+
+        static const int PROBE_PREFILL_TOKENS = 512;
+        static const int PROBE_DECODE_TOKENS = 16;
+
+        // Weighting of prefill and decode speed: seconds for a typical job
+        static const int REFERENCE_PROMPT_TOKENS = 512;
+        static const int REFERENCE_GENERATED_TOKENS = 256;
+
+        // Probe every candidate and leave the fastest settings in options
+        bool measure(const std::string& modelPath, RunnerOptions& options, std::string& error);
+
+        // Cache entries: "<key> threads=N threads_batch=N ubatch=N flash_attn=0|1 gpu_layers=N"
+        std::string cacheKey(uint64_t fingerprint, const RunnerOptions& options) const;
+        bool readCache(const std::string& key, RunnerOptions& options) const;
+        bool writeCache(const std::string& key, const RunnerOptions& options,
+                        const std::string& modelPath) const;
+    };
+
+} // namespace pnpl
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+namespace pnpl {
+
+    // Blocking FIFO with a fixed capacity, used between pipeline stages: a full
+    // queue makes the producer wait, so a slow stage backs up the ones before it
+    // instead of buffering without bound.
+    template <typename T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+        // Wait for room and add an item; false (item dropped) once closed
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notFull_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+            if (closed_) {
+                return false;
+            }
+            items_.push_back(std::move(item));
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        // Wait for an item; false once closed and drained
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+            if (items_.empty()) {
+                return false;
+            }
+            item = std::move(items_.front());
+            items_.pop_front();
+            notFull_.notify_one();
+            return true;
+        }
+
+        // Refuse new items; consumers still drain what is queued
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            notFull_.notify_all();
+            notEmpty_.notify_all();
+        }
+
+        // Accept items again after close() (the queue must be drained)
+        void reopen() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = false;
+        }
+
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return items_.size();
+        }
+
+    private:
+        const size_t capacity_;
+        std::deque<T> items_;
+        bool closed_ = false;
+        mutable std::mutex mutex_;
+        std::condition_variable notFull_;
+        std::condition_variable notEmpty_;
+    };
+
+} // namespace pnpl
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+namespace pnpl {
+
+    // Absolute path of the running executable; <cwd>/<fallbackName> if the platform
+    // can't tell (with a warning on stderr)
+    std::string getExecutablePath(const std::string& fallbackName);
+
+    // Directory above the one holding the executable: the project root for the
+    // binaries in build/, under which data/ lives
+    std::string getProjectRoot(const std::string& fallbackName);
+
+} // namespace pnpl
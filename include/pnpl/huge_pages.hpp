@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+
+namespace pnpl {
+
+    // How model weights and context buffers are backed
+    enum class HugePageMode {
+        Off,            // Kernel default pages
+        Transparent,    // Ask for transparent huge pages (madvise + collapse)
+        Explicit        // Weights from a hugetlbfs copy of the model; buffers as Transparent
+    };
+
+    // One mapping of this process, from /proc/self/maps
+    struct MemoryRange {
+        uintptr_t begin = 0;
+        uintptr_t end = 0;
+        bool anonymous = false;
+        std::string path;
+    };
+
+    // Bytes of a set of mappings and how many are resident in huge pages
+    struct HugePageUsage {
+        uint64_t bytes = 0;       // Mapped size
+        uint64_t resident = 0;    // Faulted in
+        uint64_t huge = 0;        // Faulted in as huge pages (THP or hugetlbfs)
+    };
+
+    bool parseHugePageMode(const std::string& name, HugePageMode& mode);
+    std::string hugePageModeName(HugePageMode mode);
+
+    // The host's transparent huge page policy: "always", "madvise", "never" or "" if unknown
+    std::string transparentHugePagePolicy();
+
+    // Current mappings of this process
+    std::vector<MemoryRange> memoryMappings();
+
+    // Mappings of a file (e.g. the model's mmap'd weights)
+    std::vector<MemoryRange> fileMappings(const std::string& path);
+
+    // Anonymous mappings of at least one huge page in after that are not in before
+    std::vector<MemoryRange> newAnonymousMappings(const std::vector<MemoryRange>& before,
+                                                  const std::vector<MemoryRange>& after);
+
+    // Mark ranges for transparent huge pages and collapse what is already faulted in
+    // (MADV_COLLAPSE, Linux 6.1+). False if the kernel refused; the memory is unaffected.
+    bool adviseHugePages(const std::vector<MemoryRange>& ranges);
+
+    // Residency of ranges, from /proc/self/smaps
+    HugePageUsage hugePageUsage(const std::vector<MemoryRange>& ranges);
+
+    // "<huge> of <resident> MiB in huge pages" for reports
+    std::string describeHugePageUsage(const HugePageUsage& usage);
+
+    // Where a model is copied on a hugetlbfs mount (named by its size and modification time)
+    std::filesystem::path hugePageCopyPath(const std::string& modelPath, const std::string& directory);
+
+    // Copy a model onto a hugetlbfs mount unless an up-to-date copy is there, so mapping it
+    // uses explicit huge pages from the kernel's pool (vm.nr_hugepages). Fails with a
+    // message if the directory isn't hugetlbfs or the pool is too small.
+    bool copyToHugePages(const std::string& modelPath, const std::string& directory,
+                         std::string& copyPath, std::string& error);
+
+} // namespace pnpl
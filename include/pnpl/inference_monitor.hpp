@@ -1,30 +1,171 @@
 #pragma once
 
 #include "pnpl/inference_runner.hpp"
+#include "pnpl/model_cache.hpp"
+#include "pnpl/job_queue.hpp"
+#include "pnpl/job_metadata.hpp"
+#include "pnpl/job_layout.hpp"
+#include "pnpl/job_lease.hpp"
+#include "pnpl/bounded_queue.hpp"
+#include "pnpl/worker_process.hpp"
+#include "pnpl/result_retention.hpp"
 #include <string>
 #include <filesystem>
 #include <vector>
-#include <queue>
+#include <map>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <unordered_set>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <deque>
 
 namespace pnpl {
 
+    // Outcome of a job submitted in-process
+    struct SubmitResult {
+        std::string id;
+        bool success = false;
+        std::string output;               // Generated text
+        std::vector<float> embedding;     // Set for embedding jobs instead of output
+        std::string error;
+    };
+
+    using CompletionCallback = std::function<void(const SubmitResult& result)>;
+
+    // A job submitted in-process: its input and result never touch the queue directories
+    struct InProcessJob {
+        std::string input;
+        JobMetadata metadata;
+        CompletionCallback onComplete;
+        StreamCallback onText;
+    };
+
+    // A file job's input and settings, read (and tokenized, if its model is loaded) by the
+    // prefetch stage while workers are busy with earlier jobs
+    struct PreparedInput {
+        enum class State { Pending, Loading, Ready };
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        State state = State::Pending;
+        bool prefetched = false;   // Loaded by the prefetch stage rather than the worker
+        bool found = false;        // The input file could be read
+        std::string input;
+        JobMetadata metadata;
+        TokenizedInput tokenized;
+    };
+
     class InferenceMonitor {
     public:
         InferenceMonitor(const std::string& modelPath,
                         const std::string& inputDir = "data/input",
                         const std::string& outputDir = "data/output",
-                        int numWorkers = 1);
+                        int numWorkers = 1,
+                        const RunnerOptions& runnerOptions = RunnerOptions());
         ~InferenceMonitor();
 
-        // Start monitoring and processing
+        // Name of the model given to the constructor
+        static constexpr const char* DEFAULT_MODEL = "default";
+
+        // Register an additional named model (loaded on demand). Call before start().
+        void addModel(const std::string& name, const std::string& path);
+
+        // Route jobs of a prompt category (the name of the matching prompt template) to a model
+        void addRoute(const std::string& category, const std::string& model);
+
+        // Replace the built-in prompt templates with those from a config file. Call before start().
+        bool loadPromptTemplates(const std::string& path, std::string& error);
+
+        // Bound the memory used by loaded models (0 = unbounded)
+        void setModelMemoryBudget(uint64_t bytes);
+
+        // Relative share of the workers a tenant gets while several have jobs waiting
+        // (default 1). Shares are measured in tokens, not jobs.
+        void setTenantWeight(const std::string& tenant, int weight);
+
+        // Tenant of jobs pushed without one
+        static constexpr const char* DEFAULT_TENANT = "default";
+
+        // Maximum number of embedding jobs a worker packs into one batch
+        void setEmbeddingBatchSize(int jobs);
+
+        // Split inputs too large for the context window into chunks processed in
+        // parallel, then combine the partial outputs in a final reduce job
+        void setMapReduce(bool enabled);
+
+        // Shard the input, processing and output directories. Fails if a directory holds
+        // jobs in a different layout (those need pnpl migrate). Call before start().
+        bool setLayout(LayoutMode mode, std::string& error);
+
+        // Identity and lease duration used when several servers share the queue
+        // directories. Node IDs must be unique per server process. Call before start().
+        void setNodeId(const std::string& nodeId, int leaseSeconds = 60);
+
+        // Write text results gzip-compressed as <jobId>.txt.gz (needs a build with zlib)
+        void setCompressResults(bool enabled);
+
+        // Number of queued jobs whose input is read ahead of the workers (default: two per
+        // worker; 0 reads each input when its job starts). Call before start().
+        void setPrefetchDepth(int jobs);
+
+        // Tune threads, batch size, flash attention and GPU offload for each model at
+        // start(), caching the results in this file (empty = use the options as given)
+        void setAutotune(const std::filesystem::path& cachePath);
+
+        // Run each worker's generations in its own child process (this executable, normally
+        // pnpl_worker) so a crash fails one job instead of the server; a dead child is
+        // respawned for the worker's next job. Embeddings, splitting and tokenization stay
+        // in this process. Empty = generate on the worker threads. Call before start().
+        void setIsolation(const std::string& workerExecutable);
+
+        // Split the generation of file jobs across two pools: this many prefill workers
+        // evaluate prompts and hand each job's KV state, saved as its checkpoint, to the
+        // numWorkers decode workers, which generate from it. Embedding and in-process jobs
+        // pass through to the decode workers. 0 (default) runs both phases on every worker.
+        // Call before start().
+        void setPrefillWorkers(int workers);
+
+        // Write "<jobId>.timing" (start and finish time) next to each result, for load tests
+        void setRecordTimings(bool enabled);
+
+        // Delete results beyond an age, count or size limit (oldest first) from a background
+        // thread, so the output directory and the cost of listing it stay bounded. Results
+        // are checked at start() and then every RETENTION_INTERVAL. Call before start().
+        void setRetention(const RetentionPolicy& policy);
+
+        // Claim jobs from the queue directories (default). Without it the monitor only runs
+        // jobs submitted in-process. Call before start().
+        void setWatchDirectories(bool enabled);
+
+        // Run a job on the worker pool from inside this process. Jobs share the queue, tenant
+        // shares and model routing with file jobs. onText streams generated text as it is
+        // produced; it and onComplete run on a worker thread and must not block for long.
+        // Oversize inputs are not split (map-reduce works on file jobs only).
+        // The callback form returns the job's ID, for cancel().
+        std::future<SubmitResult> submit(const std::string& input,
+                                         const JobMetadata& metadata = JobMetadata(),
+                                         StreamCallback onText = nullptr);
+        std::string submit(const std::string& input, const JobMetadata& metadata,
+                           CompletionCallback onComplete, StreamCallback onText = nullptr);
+
+        // Withdraw a job this server holds: a queued job is dropped, a running generation
+        // stops within one decode step and its worker moves on. keepPartial stores the text
+        // generated so far as the result; otherwise the job leaves nothing behind.
+        // False if the job isn't queued or running here (not yet claimed, another node's,
+        // being written out or finished). A split job is withdrawn whole: naming it or any
+        // of its map and reduce jobs cancels all of them, with nothing kept.
+        bool cancel(const std::string& jobId, bool keepPartial = false);
+
+        // Load the model, warm up every worker and start monitoring.
+        // Returns once the server is ready to take jobs (or failed to get there).
         bool start();
 
-        // Stop monitoring gracefully
+        // Stop monitoring gracefully. Running generations are checkpointed and
+        // resume from where they stopped when the server is started again.
         void stop();
 
         // Get current status
@@ -33,36 +174,290 @@ namespace pnpl {
         // Get number of jobs in queue/processing
         int getQueueSize() const;
 
+        // True once the model is loaded and all workers have finished warm-up
+        bool isReady() const;
+
     private:
         std::string modelPath_;
         std::string inputDirectory_;
         std::string outputDirectory_;
         std::string processingDirectory_;  // NEW: Directory for files being processed
+        std::string checkpointDirectory_;  // Saved state of generations interrupted by shutdown
+        std::string mapReduceDirectory_;   // <parent>/manifest and partial outputs of split jobs
+        JobLayout inputLayout_;
+        JobLayout processingLayout_;
+        JobLayout outputLayout_;
         int numWorkers_;
+        int embeddingBatchSize_ = 64;
+        bool mapReduce_ = false;
+        bool compressResults_ = false;
+        bool recordTimings_ = false;
+        bool watchDirectories_ = true;
+        std::filesystem::path autotuneCache_;
+        std::string templatesPath_;        // Prompt template file, for worker processes
+        std::atomic<uint64_t> nextInProcessId_{0};
+        static constexpr int MAP_MAX_TOKENS = 512;   // Generation budget of each map job
+        static const int ESTIMATED_GENERATION_TOKENS = 1500;   // Cost of a job without max_tokens
+        RunnerOptions runnerOptions_;
+
+        // Loaded models shared by all workers; the default model is loaded eagerly in start()
+        ModelCache models_;
+        std::map<std::string, std::string> routes_;   // prompt category -> model name
+        std::shared_ptr<PromptTemplates> promptTemplates_;
+
+        // Jobs are claimed under a lease ("<jobId>.lease" next to the job file) so several
+        // servers can share the directories; a heartbeat renews the leases this node holds
+        LeaseManager leases_;
+        std::unordered_set<std::string> heldJobs_;
+        std::unordered_set<std::string> lostJobs_;   // Taken over by another node mid-run
+        std::mutex leaseMutex_;
+        std::condition_variable heartbeatCondition_;
+        std::thread heartbeatThread_;
 
         // Thread management
         std::atomic<bool> running_{false};
+        std::atomic<bool> ready_{false};
+        std::atomic<bool> stopping_{false};   // Interrupts in-flight generations
         std::vector<std::thread> workers_;
         std::thread monitorThread_;
 
         // Job queue and synchronization
-        std::queue<std::string> jobQueue_;
+        JobQueue jobQueue_;
         mutable std::mutex queueMutex_;
         std::condition_variable jobCondition_;
 
+        // Work done per tenant since start (guarded by queueMutex_)
+        struct TenantStats {
+            uint64_t jobs = 0;
+            uint64_t tokens = 0;
+        };
+        std::map<std::string, TenantStats> tenantStats_;
+        std::chrono::steady_clock::time_point startTime_;
+
+        // Cancellation state of a job a worker is running
+        struct RunningJob {
+            std::atomic<bool> cancelled{false};
+            std::atomic<bool> keepPartial{false};
+            WorkerProcess* process = nullptr;   // Child running it, if isolated
+        };
+        std::map<std::string, std::shared_ptr<RunningJob>> runningJobs_;   // Guarded by queueMutex_
+
+        // Prefill/decode disaggregation: prefill workers take jobs from jobQueue_ and pass
+        // them on through handoffQueue_, which holds at most HANDOFFS_PER_DECODE_WORKER per
+        // decode worker so prompts aren't evaluated far ahead of the decoding
+        struct Handoff {
+            QueuedJob job;
+            std::shared_ptr<RunningJob> running;   // Tracked from the prefill on, for cancel()
+            bool prefilled = false;                // The prompt's KV state is in state or its checkpoint
+            PrefilledState state;                  // Kept in memory unless decode workers are isolated
+        };
+        int prefillWorkers_ = 0;
+        static const int HANDOFFS_PER_DECODE_WORKER = 2;
+        std::deque<Handoff> handoffQueue_;           // Guarded by queueMutex_
+        std::condition_variable handoffCondition_;   // Decode workers wait on it
+        std::vector<std::thread> prefillThreads_;
+        std::atomic<uint64_t> handoffs_{0};
+        std::atomic<uint64_t> handoffBytes_{0};
+        std::atomic<uint64_t> prefillMicros_{0};
+        std::atomic<uint64_t> handoffSaveMicros_{0};
+        std::atomic<uint64_t> handoffLoads_{0};
+        std::atomic<uint64_t> handoffLoadMicros_{0};
+
+        // Pipeline around the workers: a prefetch stage reads upcoming inputs so workers
+        // don't wait on storage, and a write-back stage persists results and cleans up
+        // after them while workers move on. Both queues are bounded.
+        struct PrefetchCandidate {
+            std::string jobId;
+            std::string model;
+            std::shared_ptr<PreparedInput> prepared;
+        };
+        struct WriteBack {
+            QueuedJob job;
+            JobMetadata metadata;
+            std::string output;
+            int64_t startedMs = 0;
+            bool partial = false;   // Output of a cancelled run
+        };
+        int prefetchDepth_ = -1;                            // -1 = two per worker
+        std::deque<PrefetchCandidate> prefetchBacklog_;     // Guarded by queueMutex_
+        int prefetchedWaiting_ = 0;                         // Loaded, not yet taken by a worker (queueMutex_)
+        std::condition_variable prefetchCondition_;
+        std::vector<std::thread> prefetchThreads_;
+        std::atomic<uint64_t> prefetchHits_{0};
+        std::atomic<uint64_t> prefetchMisses_{0};
+        std::thread writeBackThread_;
+        static const int PREFETCH_THREADS = 2;
+
+        // Crash isolation: one child per worker (indexed by worker ID) when enabled
+        std::string workerExecutable_;
+        std::vector<std::unique_ptr<WorkerProcess>> workerProcesses_;
+        std::atomic<uint64_t> workerCrashes_{0};
+
+        // Runaway generations ended by loop detection
+        std::atomic<uint64_t> loopsStopped_{0};
+        std::atomic<uint64_t> loopTokensSaved_{0};
+
+        // Result retention: a reaper thread sweeps the output directory until stop()
+        RetentionPolicy retention_;
+        static constexpr std::chrono::seconds RETENTION_INTERVAL{10};
+        std::thread reaperThread_;
+        std::mutex reaperMutex_;
+        std::condition_variable reaperCondition_;
+        std::atomic<uint64_t> resultsReaped_{0};
+        std::atomic<uint64_t> bytesReaped_{0};
+        std::atomic<uint64_t> resultsKept_{0};
+        std::atomic<uint64_t> bytesKept_{0};
+
+        // Reaper thread function
+        void enforceRetentionLoop();
+
+        // Note a repetition loop of the last run in the job's metadata and the counters
+        void recordLoop(const LoopReport& loop, JobMetadata& metadata);
+
+        // Serializes the "all parts done -> create reduce job" check between workers
+        std::mutex mapReduceMutex_;
+
+        // Worker warm-up tracking for start()
+        std::mutex startupMutex_;
+        std::condition_variable startupCondition_;
+        int workersWarm_ = 0;
+        int workersFailed_ = 0;
+
         // Monitoring thread function
         void monitorDirectory();
 
-        // Worker thread function
+        // Worker thread function (a decode worker when there are prefill workers)
         void workerFunction(int workerId);
 
-        // Process any existing files in processing directory (recovery)
+        // Prefill worker thread function
+        void prefillFunction(int workerId);
+
+        // Evaluate a file job's prompt into its checkpoint; false leaves the whole job to
+        // the decode worker, which meets (and handles) the same failure
+        bool prefillJob(int workerId, InferenceRunner& runner, std::string& currentModel,
+                        Handoff& handoff);
+
+        // Claim jobs in the processing directory whose lease expired or was never taken:
+        // leftovers of this node's previous run or of a dead node (recovery)
         void processExistingFiles();
 
-        // Process a single file
-        bool processFile(const std::string& jobId,
-                       const std::filesystem::path& inputPath,
-                       const std::filesystem::path& outputPath);
+        // Renew the leases of held jobs until stop()
+        void heartbeat();
+
+        // Lease a job for this node; false if another live node holds it
+        bool claimLease(const std::string& jobId);
+
+        // Drop this node's lease on a job
+        void releaseLease(const std::string& jobId);
+
+        // Stop work on a job whose lease another node took over: dequeue or cancel it
+        void abandonJob(const std::string& jobId);
+
+        // True (once) if another node took the job over: its files and result are the
+        // new owner's, so the caller must leave them alone
+        bool forgetLostJob(const std::string& jobId);
+
+        std::filesystem::path leasePath(const std::string& jobId) const;
+
+        // Pick the model for a claimed job and add it to that model's queue
+        void enqueueJob(const std::string& jobId);
+
+        // Tokens a job is expected to take: its input plus its generation budget
+        int estimateCost(uintmax_t inputBytes, const JobMetadata& metadata) const;
+
+        // Settle a finished job's share with its real token count and count it for status
+        void accountJob(const QueuedJob& job, size_t tokens);
+
+        // Model a job should run on: explicit metadata, then category route, then default
+        std::string resolveModel(const std::string& jobId, const JobMetadata& metadata) const;
+        std::string resolveModelForInput(const std::string& input, const JobMetadata& metadata) const;
+
+        // Generate on the worker's runner, or in its worker process when isolated
+        bool generate(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                      const std::string& input, const GenerationParams& params,
+                      const std::filesystem::path& checkpointPath, const TokenizedInput* tokenized,
+                      const StreamCallback& onText, const RunningJob& running,
+                      std::string& output, RunStatus& status,
+                      const PrefilledState* prefilled = nullptr);
+
+        // Generate for an in-process job and hand the result to its callback
+        void runInProcess(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                          const RunningJob& running);
+
+        // Deliver an in-process job's result (never throws into the worker)
+        void completeInProcess(const QueuedJob& job, SubmitResult result);
+
+        // Run a file job with the worker's runner and hand its output to the write-back stage
+        bool processFile(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                         const PreparedInput& prepared, const RunningJob& running, RunStatus& status,
+                         const PrefilledState* prefilled = nullptr);
+
+        // Act on "<jobId>.cancel" markers left by `pnpl cancel` for jobs this server holds
+        void processCancelRequests();
+
+        // Give up a queued job's read-ahead slot without running it
+        void releaseInput(PreparedInput& prepared);
+
+        // Prefetch stage thread: read queued inputs ahead of the workers
+        void prefetchFunction();
+
+        // Read a job's input and metadata into prepared, tokenizing if the model is loaded
+        void loadInput(const std::string& jobId, const std::string& model, PreparedInput& prepared,
+                       bool tokenize);
+
+        // A job's input: waits for the prefetch stage if it is loading it, else reads it now
+        PreparedInput& acquireInput(QueuedJob& job);
+
+        // Prefetch lookahead in jobs (resolves the two-per-worker default)
+        int prefetchLimit() const;
+
+        // Write-back stage thread: persist results as workers hand them over
+        void writeBackFunction();
+
+        // Write a result, then clean up and advance its job (or fail it)
+        void persistResult(WriteBack& item);
+
+        // Where a job's output goes: the output directory, or for map-reduce jobs the
+        // parent's part file (map) or the parent's own result path (reduce)
+        std::filesystem::path resultPath(const std::string& jobId, const JobMetadata& metadata) const;
+
+        // Directory holding a job's files in the processing directory
+        std::filesystem::path processingShard(const std::string& jobId) const;
+
+        // Turn an oversize job into map jobs that each fit the context; the job itself
+        // stays in processing until its reduce job finishes
+        bool splitJob(InferenceRunner& runner, const QueuedJob& job);
+
+        // Withdraw a split job with its map and reduce jobs; false if it isn't split
+        bool cancelSplitJob(const std::string& parentId);
+
+        // Queue the reduce job once every map output of a split job exists
+        void startReduceIfComplete(const std::string& parentId);
+
+        // Clean up a completed job and, for map-reduce jobs, advance the parent
+        void finishJob(const std::string& jobId);
+
+        // Embed a batch of jobs in one multi-sequence pass and write <jobId>.emb files
+        void processEmbeddingBatch(int workerId, InferenceRunner& runner,
+                                   const std::vector<QueuedJob>& jobs);
+
+        // Remove a finished job's files from the processing directory
+        void completeJob(const std::string& jobId);
+
+        // Move a failed job's files to the failed directory (workerId < 0: write-back stage)
+        void failJob(int workerId, const std::string& jobId);
+
+        // Wall-clock time as written to timing files
+        static int64_t epochMilliseconds();
+
+        // Write a finished job's timing file if enabled
+        void recordTiming(const std::string& jobId, int64_t startedMs);
+
+        // Remove the .meta and .timing written ahead of a result that then failed
+        void discardSidecars(const std::string& jobId);
+
+        // Declared last: sized from the worker count in the constructor
+        BoundedQueue<WriteBack> writeBackQueue_;
 
         // Update job status (for future use)
         void updateJobStatus(const std::string& jobId,
@@ -1,28 +1,194 @@
 #pragma once
 
+#include "pnpl/prompt_templates.hpp"
+#include "pnpl/job_metadata.hpp"
+#include "pnpl/huge_pages.hpp"
 #include <string>
+#include <vector>
 #include <filesystem>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
 
 // Forward declarations for llama.cpp types
 struct llama_model;
 struct llama_context;
+struct llama_context_params;
+struct llama_sampler;
 
 namespace pnpl {
 
+    // Settings applied to model loading and every context a runner creates
+    struct RunnerOptions {
+        int contextSize = 0;              // 0 = use the model's trained context length
+        std::string cacheTypeK = "f16";   // KV cache key type: f16, q8_0, q4_0, ...
+        std::string cacheTypeV = "f16";   // KV cache value type (quantized needs flash attention)
+        bool flashAttention = false;
+        bool useMlock = false;            // Pin model weights in RAM
+        bool prefetch = false;            // Read the model file into the page cache before mapping
+        int gpuLayers = 99;               // Layers offloaded to the GPU (ignored without one)
+        int threads = 0;                  // Generation threads (0 = llama.cpp default)
+        int threadsBatch = 0;             // Prompt processing threads (0 = llama.cpp default)
+        int ubatchSize = 0;               // Physical prompt batch size (0 = llama.cpp default)
+        HugePageMode hugePages = HugePageMode::Off;   // Backing of weights and context buffers
+        std::string hugePageDirectory = "/dev/hugepages";   // hugetlbfs mount for Explicit
+    };
+
+    // Throughput of one benchmark() probe
+    struct RunnerBenchmark {
+        double prefillTokensPerSecond = 0;
+        double decodeTokensPerSecond = 0;
+    };
+
+    // A job's content tokens computed ahead of the run (e.g. while an earlier job decodes)
+    struct TokenizedInput {
+        const llama_model* model = nullptr;   // Model whose vocabulary produced the tokens
+        std::vector<int32_t> tokens;
+    };
+
+    // Repeating cycle found in the last run's output
+    struct LoopReport {
+        int period = 0;           // Tokens per cycle (0 = none seen)
+        int generatedAt = 0;      // Generated tokens when it was last detected
+        int budgetLeft = 0;       // Tokens the job could still have generated then
+        bool penalized = false;   // The repetition penalty was raised to break it
+        bool stopped = false;     // Generation ended because of it
+    };
+
+    // Cost of moving a generation's KV state through a checkpoint file or memory
+    struct StateTransfer {
+        uint64_t bytes = 0;    // Size of the saved KV state
+        double saveMs = 0;     // Writing it
+        double loadMs = 0;     // Reading it into a fresh context
+    };
+
+    // A prompt's KV state held in memory by prefill(), for run() on another runner of the
+    // same process, with the same model and options, to decode from without a file
+    struct PrefilledState {
+        int n_ctx = 0;
+        int n_prompt = 0;
+        int n_predict = 0;
+        std::vector<int32_t> tokens;   // The prompt; all but the last are in kv
+        std::vector<uint8_t> kv;       // Sequence 0 of the prefill context
+
+        bool empty() const { return kv.empty(); }
+    };
+
+    // Receives generated text as it is produced (pieces concatenate to the final output)
+    using StreamCallback = std::function<void(const std::string& text)>;
+
     class InferenceRunner {
     public:
         InferenceRunner();
         ~InferenceRunner();
 
+        // Load a model that several runners can share; returns nullptr and sets error on failure
+        static std::shared_ptr<llama_model> loadModel(const std::string& model_path,
+                                                      const RunnerOptions& options,
+                                                      std::string& error);
+
         // Initialize with a model path
-        bool init(const std::string& model_path);
+        bool init(const std::string& model_path,
+                  const RunnerOptions& options = RunnerOptions());
+
+        // Initialize with an already loaded (shared) model
+        bool init(std::shared_ptr<llama_model> model,
+                  const RunnerOptions& options = RunnerOptions());
+
+        // Decode a few tokens so the first real job doesn't pay for lazy allocation
+        bool warmup();
+
+        // Time a prompt of prefillTokens followed by decodeTokens single-token steps
+        // with the runner's options (used to tune them for the host)
+        bool benchmark(int prefillTokens, int decodeTokens, RunnerBenchmark& result);
+
+        // Run inference on string input/output. With a checkpoint path, an interrupted
+        // run saves its KV state and partial output there and the next run resumes from it.
+        // Pre-tokenized content is used instead of tokenizing input if it matches the model.
+        // Without a checkpoint to resume, a prefilled state skips tokenization and prefill.
+        bool run(const std::string& input, std::string& output,
+                 const GenerationParams& params = GenerationParams(),
+                 const std::filesystem::path& checkpoint_path = {},
+                 const TokenizedInput* tokenized = nullptr,
+                 const PrefilledState* prefilled = nullptr);
+
+        // Evaluate only the prompt and save its KV state as a checkpoint, for run() with the
+        // same checkpoint path on a runner with the same model and options to decode from.
+        // The prompt's last token is left to that run, whose first decode yields the logits.
+        bool prefill(const std::string& input, const GenerationParams& params,
+                     const std::filesystem::path& checkpoint_path,
+                     const TokenizedInput* tokenized = nullptr);
+
+        // Same, keeping the KV state in memory for run() in this process
+        bool prefill(const std::string& input, const GenerationParams& params,
+                     PrefilledState& state, const TokenizedInput* tokenized = nullptr);
 
-        // Run inference on string input/output
-        bool run(const std::string& input, std::string& output);
+        // Write a prefilled state as a checkpoint that run() resumes like any other
+        static bool savePrefilledState(const std::filesystem::path& checkpoint_path,
+                                       const PrefilledState& state, std::string& error);
+
+        // Tokenize job content with a model's vocabulary, without a runner or context.
+        // Safe to call from any thread while other threads decode on the model.
+        static bool tokenizeContent(const llama_model* model, const std::string& input,
+                                    TokenizedInput& tokenized);
 
         // Run inference on input file, write to output file
         bool runOnFile(const std::filesystem::path& input_path,
-                      const std::filesystem::path& output_path);
+                      const std::filesystem::path& output_path,
+                      const GenerationParams& params = GenerationParams(),
+                      const std::filesystem::path& checkpoint_path = {});
+
+        // Pooled, L2-normalized embeddings for several inputs, packed into as few
+        // multi-sequence batches as the context allows
+        bool embed(const std::vector<std::string>& inputs,
+                   std::vector<std::vector<float>>& embeddings);
+
+        // Called with each new piece of generated text during run(); text that could still
+        // turn out to be the start of a stop string is held back until it can't
+        void setStreamCallback(StreamCallback callback);
+
+        // Stop generation before the next decode once *flag becomes true
+        void setInterruptFlag(const std::atomic<bool>* flag);
+
+        // True if the last run stopped because of the interrupt flag
+        bool wasInterrupted() const;
+
+        // Abort generation as soon as *flag becomes true, even in the middle of a decode
+        // (llama.cpp's abort callback); the run fails, keeping the output produced so far
+        void setCancelFlag(const std::atomic<bool>* flag);
+
+        // True if the last run stopped because of the cancel flag
+        bool wasCancelled() const;
+
+        // Delete a checkpoint and its KV state file
+        static void removeCheckpoint(const std::filesystem::path& checkpoint_path);
+
+        // True if the last run failed because the prompt doesn't fit the context window
+        bool wasInputTooLarge() const;
+
+        // Prompt plus generated tokens of the last run (or tokens embedded by the last embed)
+        size_t lastTokenCount() const;
+
+        // Repetition loop handling of the last run (see GenerationParams::onLoop)
+        const LoopReport& lastLoop() const;
+
+        // KV state saved or resumed by the last run or prefill (zero if neither happened)
+        const StateTransfer& lastTransfer() const;
+
+        // Huge page residency of the last context's KV cache and compute buffers
+        // (measured when options ask for huge pages)
+        const HugePageUsage& contextHugePages() const;
+
+        // Split an input into chunks that each fit one context alongside any template and
+        // the generation budget in params. Cuts fall on line breaks, preferring blank lines
+        // and closing braces at column 0 (function and class boundaries); a single line
+        // longer than a chunk is cut on token boundaries.
+        bool splitInput(const std::string& input, const GenerationParams& params,
+                        std::vector<std::string>& chunks);
+
+        // Templates used to wrap job input (built-in templates by default)
+        void setPromptTemplates(std::shared_ptr<const PromptTemplates> templates);
 
         // Check if model is initialized
         bool isInitialized() const;
@@ -31,20 +197,107 @@ namespace pnpl {
         std::string getLastError() const;
 
     private:
-        // Model is loaded once and reused
-        llama_model* model_ = nullptr;
+        // Model is loaded once and shared between runners
+        std::shared_ptr<llama_model> model_;
 
         // Context is created fresh for each run (like simple.cpp)
         llama_context* ctx_ = nullptr;
 
+        RunnerOptions options_;
+
+        // Prompt templates and their fixed fragments tokenized for the current model
+        struct TemplateTokens {
+            std::vector<int32_t> prefix;
+            std::vector<int32_t> suffix;
+        };
+        std::shared_ptr<const PromptTemplates> promptTemplates_;
+        std::vector<TemplateTokens> templateTokens_;
+
+        StreamCallback streamCallback_;
+        const std::atomic<bool>* interruptFlag_ = nullptr;
+        const std::atomic<bool>* cancelFlag_ = nullptr;
+        bool interrupted_ = false;
+        bool cancelled_ = false;
+        bool inputTooLarge_ = false;
+        size_t lastTokenCount_ = 0;
+        LoopReport lastLoop_;
+        StateTransfer lastTransfer_;
+        HugePageUsage contextPages_;
         std::string lastError_;
         static const int DEFAULT_CTX_SIZE = 2048;
+        static const int DEFAULT_N_PREDICT = 1500;
+        static constexpr int EMBED_BATCH_TOKENS = 4096;   // Token budget per embedding batch
+        static const int MAX_EMBED_SEQUENCES = 64;    // Sequences per embedding batch
+
+        // A loop is a cycle of up to LOOP_MAX_PERIOD tokens repeated LOOP_MIN_CYCLES times
+        // over at least LOOP_MIN_TOKENS tokens
+        static const int LOOP_MAX_PERIOD = 256;
+        static const int LOOP_MIN_CYCLES = 3;
+        static const int LOOP_MIN_TOKENS = 64;
+
+        // Context length available to a single job for the loaded model
+        int maxContextSize() const;
+
+        // One in-flight generation (defined in the .cpp)
+        struct Generation;
+
+        // Tokenize the prompt and create a context and sampler sized for it
+        bool beginGeneration(const std::string& input, Generation& gen,
+                             const TokenizedInput* tokenized = nullptr);
+
+        // Tokenize and evaluate all but the prompt's last token
+        bool prefillPrompt(const std::string& input, Generation& gen, const TokenizedInput* tokenized);
+
+        // Create a context for a prefilled state and load its KV cache into it
+        bool restorePrefilled(const PrefilledState& state, Generation& gen);
+
+        // Decode until end of generation, the token budget, or an interrupt
+        bool generate(Generation& gen, std::string& output,
+                      const std::filesystem::path& checkpoint_path);
+
+        // Free the generation's sampler and context
+        void endGeneration(Generation& gen);
+
+        // Replace the sampler with one that penalizes the detected cycle harder
+        void escalatePenalties(Generation& gen, int period);
+
+        // Context parameters with the runner's KV cache settings applied
+        llama_context_params contextParams(int n_ctx, int n_batch) const;
+
+        // llama_init_from_model, then huge pages for the context's buffers if enabled
+        llama_context* createContext(const llama_context_params& params);
+
+        // Repetition penalty followed by greedy or temperature sampling
+        llama_sampler* createSampler(const GenerationParams& params) const;
+
+        // Checkpoint files: <path> holds bookkeeping and partial output, <path>.state the KV cache
+        // (a state file, or the raw sequence state for one written from a PrefilledState)
+        static std::filesystem::path checkpointStatePath(const std::filesystem::path& checkpoint_path);
+        bool saveCheckpoint(const std::filesystem::path& checkpoint_path,
+                            const Generation& gen, const std::string& output);
+        bool resumeGeneration(const std::filesystem::path& checkpoint_path,
+                              Generation& gen, std::string& output);
+
+        // llama.cpp abort callback: polled between graph nodes during a decode
+        static bool abortRequested(void* runner);
 
         // Set error message
         void setError(const std::string& error);
 
-        // Simple prompt formatting
-        std::string formatPrompt(const std::string& input);
+        // Tokenize text in a single pass (parse_special as for the whole prompt)
+        bool tokenize(const std::string& text, bool add_special, std::vector<int32_t>& tokens) const;
+
+        // Cached tokens of a template's prefix and suffix
+        const TemplateTokens& templateTokens(size_t index);
+
+        // Template for a job: the one it names, else the first matching its input
+        size_t selectTemplate(const std::string& input, const GenerationParams& params) const;
+
+        // Tokens the job may generate before context limits apply
+        static int predictBudget(const GenerationParams& params);
+
+        // Text of a run of tokens
+        std::string detokenize(const std::vector<int32_t>& tokens, size_t begin, size_t end) const;
     };
 
 } // namespace pnpl
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <functional>
+
+namespace pnpl {
+
+    // How job files are spread over subdirectories of a queue directory
+    enum class LayoutMode {
+        Flat,     // <dir>/<id>.txt
+        Hashed,   // <dir>/<hh>/<id>.txt, hh = 2 hex digits of a hash of the job ID
+        Date      // <dir>/<yyyy>/<mm>/<dd>/<hh>/<id>.txt, date taken from the job ID
+    };
+
+    // Inclusive range of job dates as YYYYMMDD strings; an empty bound is open
+    struct DateRange {
+        std::string from;
+        std::string to;
+
+        bool unbounded() const;
+
+        // True if a YYYYMMDD prefix (or a shorter YYYY / YYYYMM prefix) can overlap the range
+        bool overlaps(const std::string& prefix) const;
+    };
+
+    // Maps job IDs to paths inside a queue directory. Each directory records its layout
+    // in a ".layout" marker so the server and the push/pop clients agree on it.
+    class JobLayout {
+    public:
+        explicit JobLayout(LayoutMode mode = LayoutMode::Flat);
+
+        // Layout recorded in a directory (flat if it has no marker)
+        static JobLayout forDirectory(const std::filesystem::path& directory);
+
+        // "flat", "hashed" or "date"
+        static bool parseMode(const std::string& name, LayoutMode& mode);
+        static const char* modeName(LayoutMode mode);
+
+        LayoutMode mode() const;
+
+        // Record this layout in the directory's marker
+        bool writeMarker(const std::filesystem::path& directory) const;
+
+        // Directory holding a job's files (created on demand by writers)
+        std::filesystem::path shardDirectory(const std::filesystem::path& directory,
+                                             const std::string& jobId) const;
+
+        // Path of a job file, e.g. pathFor(dir, id, ".txt")
+        std::filesystem::path pathFor(const std::filesystem::path& directory,
+                                      const std::string& jobId,
+                                      const std::string& extension) const;
+
+        // Visit every job file (dotfiles such as .counter are skipped). With a date range
+        // only files whose job ID falls in it are visited, and the date layout only opens
+        // the matching shards.
+        void forEachFile(const std::filesystem::path& directory,
+                         const std::function<void(const std::filesystem::path&)>& visit,
+                         const DateRange& range = DateRange()) const;
+
+        // True if the directory holds any job files
+        bool hasFiles(const std::filesystem::path& directory) const;
+
+        // Move every job file of a directory into this layout, update the marker and
+        // remove the emptied shard directories of the old layout
+        bool migrate(const std::filesystem::path& directory, size_t& moved, std::string& error) const;
+
+    private:
+        LayoutMode mode_;
+    };
+
+} // namespace pnpl
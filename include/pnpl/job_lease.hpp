@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Contents of a "<jobId>.lease" file
+    struct LeaseInfo {
+        std::string owner;        // Node ID of the holder
+        int64_t expiresMs = 0;    // Wall-clock expiry, milliseconds since the epoch
+    };
+
+    // Time-limited job ownership for several servers sharing one queue directory.
+    // A lease file is created exclusively before a job is claimed and renewed by a
+    // heartbeat; once it expires (the holder died) another node can take it over.
+    // Nodes' clocks are assumed to be NTP-synchronized well within the lease duration.
+    class LeaseManager {
+    public:
+        enum class RenewResult {
+            Renewed,
+            Failed,   // Couldn't read or rewrite it (e.g. a storage hiccup); try again
+            Lost      // Another node has taken it over, or it is gone
+        };
+
+        LeaseManager(const std::string& nodeId, std::chrono::seconds duration);
+
+        const std::string& nodeId() const;
+        std::chrono::seconds duration() const;
+
+        // Lease a job: creates the lease, or takes over an expired one (or one this node
+        // held before a restart). False if another node holds a live lease.
+        bool acquire(const std::filesystem::path& leasePath);
+
+        // Push a held lease's expiry forward
+        RenewResult renew(const std::filesystem::path& leasePath);
+
+        // Give up a lease (no-op if it belongs to someone else)
+        void release(const std::filesystem::path& leasePath);
+
+        // Read a lease file; false if it doesn't exist or can't be parsed
+        static bool read(const std::filesystem::path& leasePath, LeaseInfo& lease);
+
+        // True if a lease can be taken over by this node
+        bool claimable(const LeaseInfo& lease) const;
+
+        // Default node ID: the host name
+        static std::string defaultNodeId();
+
+    private:
+        std::string nodeId_;
+        std::chrono::seconds duration_;
+
+        // Create the lease file; false if it already exists
+        bool create(const std::filesystem::path& leasePath) const;
+
+        // Rewrite the lease file in place, as this node's
+        bool replace(const std::filesystem::path& leasePath) const;
+
+        // True if another node (with ownCounts, any node) holds a live lease in this file
+        bool held(const std::filesystem::path& leasePath, bool ownCounts = false) const;
+
+        // Clear a takeover lock left by a node that died while holding it
+        void clearAbandonedLock(const std::filesystem::path& lockPath) const;
+
+        bool write(const std::filesystem::path& path) const;
+    };
+
+} // namespace pnpl
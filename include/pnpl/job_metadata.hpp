@@ -0,0 +1,97 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+
+namespace pnpl {
+
+    // What the runner does when generation falls into a repeating cycle
+    enum class LoopAction {
+        Stop,       // End the job with the output so far
+        Penalize,   // Raise the repetition penalty once; stop if the loop persists
+        Ignore
+    };
+
+    // Decoding settings for one job
+    struct GenerationParams {
+        int maxTokens = 0;                 // 0 = server default budget
+        std::vector<std::string> stop;     // Output ends before the first occurrence of any of these
+        float temperature = 0.0f;          // 0 = greedy
+        int topK = 0;                      // 0 = disabled
+        float topP = 1.0f;                 // 1 = disabled
+        float repeatPenalty = 1.1f;
+        int repeatLastN = 64;
+        uint32_t seed = 0xFFFFFFFF;        // Random seed when sampling
+        std::string promptTemplate;        // Template to wrap the input in (empty = match rules)
+        LoopAction onLoop = LoopAction::Stop;
+
+        bool operator==(const GenerationParams& other) const;
+    };
+
+    // Place of a job in a map-reduce split of an oversize input
+    enum class JobRole {
+        Normal,     // Submitted by a client
+        Map,        // One chunk of the parent's input
+        Reduce      // Combines the parent's map outputs; its result is the parent's result
+    };
+
+    // Per-job settings written next to the job file as "<jobId>.meta" (key=value lines)
+    struct JobMetadata {
+        std::string model;             // Named model to run on (empty = routed/default model)
+        bool embedding = false;        // Produce a float32 embedding instead of generated text
+        std::string tenant;            // Team the job is accounted to (empty = default tenant)
+        GenerationParams generation;
+        JobRole role = JobRole::Normal;
+        std::string parent;            // Job that was split (map and reduce jobs)
+        int part = 0;                  // Chunk index of a map job
+
+        // Recorded with the result when a repeating loop was detected
+        std::string loop;              // "stopped" or "penalized"
+        int loopPeriod = 0;            // Tokens per cycle
+        int loopAtToken = 0;           // Generated tokens when it was detected
+
+        // True if nothing differs from the defaults (no sidecar needed)
+        bool empty() const;
+    };
+
+    // Path of the metadata sidecar for a job in the given directory
+    std::filesystem::path metadataPath(const std::filesystem::path& directory,
+                                       const std::string& jobId);
+
+    // Read a sidecar; a missing file leaves the defaults and returns false
+    bool readJobMetadata(const std::filesystem::path& path, JobMetadata& metadata);
+
+    // Write a sidecar (atomically, via a temporary file)
+    bool writeJobMetadata(const std::filesystem::path& path, const JobMetadata& metadata);
+
+    // The sidecar's key=value text, e.g. to hand a job to another process
+    std::string formatJobMetadata(const JobMetadata& metadata);
+    void parseJobMetadata(const std::string& text, JobMetadata& metadata);
+
+    // When a worker ran a job, written next to its result as "<jobId>.timing" by servers
+    // started with --job-timings (wall-clock milliseconds since the epoch)
+    struct JobTiming {
+        int64_t startedMs = 0;    // Worker picked the job up
+        int64_t finishedMs = 0;   // Result was ready to be written
+    };
+
+    const std::string JOB_TIMING_EXTENSION = ".timing";
+
+    bool readJobTiming(const std::filesystem::path& path, JobTiming& timing);
+    bool writeJobTiming(const std::filesystem::path& path, const JobTiming& timing);
+
+    // A request to withdraw a job the server has already claimed: "<jobId>.cancel" in
+    // "<input>_cancel". A server that holds the job drops it from its queue or aborts
+    // its generation, then deletes the marker.
+    struct CancelRequest {
+        bool keepPartial = false;   // Store the text generated so far as the job's result
+    };
+
+    std::filesystem::path cancelDirectory(const std::string& inputDirectory);
+
+    bool readCancelRequest(const std::filesystem::path& path, CancelRequest& request);
+    bool writeCancelRequest(const std::filesystem::path& path, const CancelRequest& request);
+
+} // namespace pnpl
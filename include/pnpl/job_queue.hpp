@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+namespace pnpl {
+
+    struct InProcessJob;
+    struct PreparedInput;
+
+    // A job waiting for a worker
+    struct QueuedJob {
+        std::string id;
+        std::string model;       // Model the job was routed to
+        bool embedding = false;  // Embedding job (batched with others for the same model)
+        std::string tenant;      // Team that pushed the job (fair-share unit)
+        int cost = 1;            // Estimated tokens (prompt + generation budget)
+        std::shared_ptr<InProcessJob> inProcess;   // Submitted through the in-process API (no files)
+        std::shared_ptr<PreparedInput> prepared;   // Input read ahead by the prefetch stage
+    };
+
+    // Per-model queues. Workers prefer jobs for the model they already have
+    // attached, but never skip past other models' waiting jobs indefinitely.
+    // Within a model, tenants share workers by deficit round-robin weighted by
+    // token cost, so one tenant's backlog can't starve the others.
+    // Not thread-safe; the owner serializes access.
+    class JobQueue {
+    public:
+        // Relative share of a tenant (default 1)
+        void setTenantWeight(const std::string& tenant, int weight);
+
+        // Add a job to its model's queue
+        void push(const QueuedJob& job);
+
+        // Take the next job for a worker currently attached to preferredModel.
+        // streak counts consecutive affinity picks and is updated in place.
+        bool pop(const std::string& preferredModel, int& streak, QueuedJob& job);
+
+        // Take up to maxJobs more waiting embedding jobs for a model, oldest first
+        size_t popEmbeddings(const std::string& model, size_t maxJobs, std::vector<QueuedJob>& jobs);
+
+        // Take a specific waiting job out of the queue (e.g. cancelled); false if not queued
+        bool remove(const std::string& jobId, QueuedJob& job);
+
+        // Correct a tenant's share once a job's real token count is known
+        // (tokens = actual - estimated cost; negative refunds)
+        void charge(const std::string& model, const std::string& tenant, int tokens);
+
+        bool empty() const;
+        size_t size() const;
+
+        // Number of waiting jobs per model
+        std::map<std::string, size_t> depthByModel() const;
+
+        // Number of waiting jobs per tenant
+        std::map<std::string, size_t> depthByTenant() const;
+
+    private:
+        // Max consecutive jobs a worker takes for its own model while others wait
+        static const int MAX_AFFINITY_STREAK = 8;
+
+        // Tokens a weight-1 tenant may spend per round
+        static const int QUANTUM_TOKENS = 2048;
+
+        struct Entry {
+            QueuedJob job;
+            uint64_t sequence;
+        };
+
+        struct TenantQueue {
+            std::deque<Entry> entries;
+            int64_t deficit = 0;   // Tokens the tenant may still spend this round
+        };
+
+        struct ModelQueue {
+            std::map<std::string, TenantQueue> tenants;
+            std::vector<std::string> active;   // Tenants with waiting jobs, in round-robin order
+            size_t cursor = 0;                 // Tenant whose turn it is
+            size_t size = 0;
+
+            // Sequence number of the oldest waiting job
+            uint64_t oldestSequence() const;
+        };
+
+        std::map<std::string, ModelQueue> queues_;
+        std::map<std::string, int> weights_;
+        uint64_t nextSequence_ = 0;
+        size_t size_ = 0;
+
+        // Remove and return the next job of a model's queue by deficit round-robin
+        QueuedJob take(ModelQueue& queue);
+
+        // Drop a tenant that ran out of jobs from the round (its unused credit is forfeited)
+        void deactivate(ModelQueue& queue, size_t index);
+    };
+
+} // namespace pnpl
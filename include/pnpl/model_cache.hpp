@@ -0,0 +1,80 @@
+#pragma once
+
+#include "pnpl/inference_runner.hpp"
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Memory-bounded LRU of named models. Models are loaded on first use and the
+    // least recently used ones that no runner holds are evicted to stay within budget.
+    class ModelCache {
+    public:
+        // memoryBudget of 0 means unbounded
+        ModelCache(const RunnerOptions& options, uint64_t memoryBudget = 0);
+
+        // Bound the memory used by loaded models (0 = unbounded)
+        void setMemoryBudget(uint64_t bytes);
+
+        // Register a model name; nothing is loaded until it is acquired
+        void registerModel(const std::string& name, const std::string& path);
+
+        // Check if a model name is registered
+        bool hasModel(const std::string& name) const;
+
+        // All registered model names
+        std::vector<std::string> modelNames() const;
+
+        // File a registered model loads from (empty if unknown)
+        std::string modelPath(const std::string& name) const;
+
+        // Settings for one model, e.g. tuned for the host; applies from its next load
+        void setModelOptions(const std::string& name, const RunnerOptions& options);
+
+        // Settings runners should use with a model (its own, else the shared ones)
+        RunnerOptions modelOptions(const std::string& name) const;
+
+        // Get a loaded model, loading it (and evicting cold ones) if needed.
+        // Returns nullptr and sets error on failure.
+        std::shared_ptr<llama_model> acquire(const std::string& name, std::string& error);
+
+        // A model if it is already loaded, else nullptr; never loads or reorders the LRU
+        std::shared_ptr<llama_model> peek(const std::string& name) const;
+
+        // Loaded models and memory use
+        std::string getStatus() const;
+
+    private:
+        struct Entry {
+            std::string path;
+            std::shared_ptr<llama_model> model;
+            uint64_t bytes = 0;
+            bool loading = false;
+            bool hasOptions = false;
+            RunnerOptions options;
+        };
+
+        RunnerOptions options_;
+        uint64_t memoryBudget_;
+        uint64_t loadedBytes_ = 0;
+
+        std::map<std::string, Entry> entries_;
+        std::list<std::string> lru_;   // Loaded models, most recently used first
+
+        mutable std::mutex mutex_;
+        std::condition_variable loadCondition_;
+
+        // Mark a model as most recently used (mutex_ held)
+        void touch(const std::string& name);
+
+        // Free idle models until `incoming` more bytes fit in the budget (mutex_ held)
+        void evictFor(uint64_t incoming);
+    };
+
+} // namespace pnpl
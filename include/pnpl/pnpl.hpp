@@ -0,0 +1,8 @@
+#pragma once
+
+// Everything needed to embed pnpl in another program (link against libpnpl):
+// InferenceMonitor runs the worker pool and takes in-process jobs via submit(),
+// PushManager/PopManager talk to a server through its queue directories.
+#include "pnpl/inference_monitor.hpp"
+#include "pnpl/push_manager.hpp"
+#include "pnpl/pop_manager.hpp"
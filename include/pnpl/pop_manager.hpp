@@ -1,9 +1,13 @@
 #pragma once
 
+#include "pnpl/job_layout.hpp"
+#include "pnpl/job_metadata.hpp"
 #include <string>
 #include <vector>
 #include <optional>
 #include <filesystem>
+#include <ostream>
+#include <cstdint>
 
 namespace pnpl {
 
@@ -13,6 +17,24 @@ namespace pnpl {
         std::string outputText;
         bool success;
         std::string errorMessage;
+        std::vector<float> embedding;   // Set for embedding jobs instead of outputText
+    };
+
+    // Which results a bulk export includes: those completed at or after sinceMs
+    // (epoch milliseconds), or only those completed after the job afterJobId. afterMs is
+    // that job's completion time from the stream header; when unknown (-1) it is read from
+    // the job's result, or taken from the job ID if the result is gone.
+    struct ExportRange {
+        int64_t sinceMs = 0;
+        std::string afterJobId;
+        int64_t afterMs = -1;
+    };
+
+    struct ExportSummary {
+        size_t records = 0;
+        uint64_t bytes = 0;          // Payload bytes written
+        std::string lastJobId;       // Resume point: the latest completion exported so far,
+        int64_t lastCompletedMs = 0; // or the starting cursor if nothing newer was found
     };
 
     class PopManager {
@@ -26,23 +48,73 @@ namespace pnpl {
         // Get the most recent result
         std::optional<JobResult> popLatest();
 
-        // List all completed jobs
-        std::vector<std::string> listCompleted() const;
+        // Take a job's result out of the output directory (with its .meta and .timing
+        // files) and return it. Of several processes consuming the same result exactly one
+        // gets it; the others see nullopt as if it never existed. With textOut, a text
+        // result is written there instead of into outputText; if that write fails the
+        // result is not put back, so it is never written out twice.
+        std::optional<JobResult> consumeResult(const std::string& jobId, std::ostream* textOut = nullptr);
+
+        // Consume the most recent result (the next most recent if another popper wins it)
+        std::optional<JobResult> consumeLatest(std::ostream* textOut = nullptr);
+
+        // ID of the most recent result (empty if there is none)
+        std::string latestJobId() const;
+
+        // Write a text result to a stream block by block without loading it whole;
+        // false if the job has no text result or it can't be read
+        bool streamResult(const std::string& jobId, std::ostream& out) const;
+
+        // Write every result in the range to a file descriptor as one framed stream, oldest
+        // completion first. Each record is a header line "<jobId> <encoding> <bytes> <completed_ms>"
+        // followed by the stored bytes and a newline; encoding is text, gzip (a .txt.gz result,
+        // not decompressed) or f32 (a raw float32 embedding). Payloads are copied by the kernel
+        // (copy_file_range or sendfile) where the platform and descriptor allow it.
+        bool exportResults(const ExportRange& range, int fd, ExportSummary& summary,
+                           std::string& error) const;
+
+        // List completed jobs, optionally only those created in a date range (with the
+        // date layout only the matching shards are read)
+        std::vector<std::string> listCompleted(const DateRange& range = DateRange()) const;
 
         // Check if a job is completed
         bool isJobCompleted(const std::string& jobId) const;
 
+        // Metadata the server recorded with a result ("<jobId>.meta", e.g. a repetition
+        // loop that ended the job); false if there is none
+        bool readOutcome(const std::string& jobId, JobMetadata& metadata) const;
+
         // Check if a job exists (even if not completed)
         bool jobExists(const std::string& jobId) const;
 
     private:
         std::string resultsDirectory_;
+        JobLayout layout_;   // Read from the directory's layout marker
 
         // Extract job ID from filename
         std::string extractJobId(const std::string& filename) const;
 
-        // Read result file
+        // Path of a job's result: <id>.txt or <id>.txt.gz for text, <id>.emb for embeddings
+        // (empty if none)
+        std::filesystem::path findResultFile(const std::string& jobId) const;
+
+        // Path of the most recently written result (empty if none)
+        std::filesystem::path findLatestResultFile() const;
+
+        static const int CONSUME_ATTEMPTS = 8;
+
+        // Claim a result file by renaming it, read it and delete it; put back if unreadable
+        std::optional<JobResult> consumeFile(const std::string& jobId, const std::filesystem::path& path,
+                                             std::ostream* textOut);
+
+        // Load a result file of either kind into a JobResult
+        JobResult loadResult(const std::string& jobId, const std::filesystem::path& path) const;
+
+        // Read a text result file, decompressing .txt.gz
         bool readResultFile(const std::filesystem::path& path, std::string& content) const;
+
+        // Read a raw float32 embedding file
+        bool readEmbeddingFile(const std::filesystem::path& path, std::vector<float>& embedding) const;
     };
 
 } // namespace pnpl
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace pnpl {
+
+    // A prompt wrapper: prefix + user content + suffix, picked by simple match rules.
+    // A template matches if any of its rules match; a template without rules matches everything.
+    // Explicit-only templates are skipped by matching and used only when a job names them.
+    struct PromptTemplate {
+        std::string name;                     // Also the prompt category used for model routing
+        size_t minLength = 0;                 // Inputs longer than this match (0 = no length rule)
+        std::vector<std::string> startsWith;  // Inputs starting with any of these match
+        std::vector<std::string> contains;    // Inputs containing any of these match
+        std::string prefix;
+        std::string suffix;
+        bool explicitOnly = false;            // Only used when a job names it, never matched
+
+        bool matches(const std::string& input) const;
+    };
+
+    // Ordered list of templates; the first matching one wins
+    class PromptTemplates {
+    public:
+        // Built-in templates for C++ code review and technical Q&A
+        PromptTemplates();
+
+        // Replace the templates with those from a config file
+        bool loadFile(const std::string& path, std::string& error);
+
+        // Index of the first template matching the input (falls back to the last non-explicit one)
+        size_t select(const std::string& input) const;
+
+        // Index of the template with this name, or npos
+        size_t find(const std::string& name) const;
+
+        static const size_t npos = static_cast<size_t>(-1);
+
+        const std::vector<PromptTemplate>& templates() const;
+
+    private:
+        std::vector<PromptTemplate> templates_;
+    };
+
+} // namespace pnpl
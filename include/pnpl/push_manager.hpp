@@ -1,41 +1,55 @@
 #pragma once
 
+#include "pnpl/job_metadata.hpp"
+#include "pnpl/job_layout.hpp"
 #include <string>
+#include <vector>
 #include <filesystem>
 #include <mutex>
 
 namespace pnpl {
 
+    // What cancelJob did
+    enum class CancelOutcome {
+        Withdrawn,   // Deleted before any server claimed it
+        Requested,   // Claimed: a cancel request was left for the server holding it
+        Failed
+    };
+
     class PushManager {
     public:
         // Constructor with default input directory
         PushManager(const std::string& inputDirectory = "data/input");
         ~PushManager() = default;
 
-        // Create a new job with the given content
+        // Create a new job with the given content and optional per-job settings
         // Returns the job ID
-        std::string createJob(const std::string& content);
+        std::string createJob(const std::string& content,
+                              const JobMetadata& metadata = JobMetadata());
 
-        // List all jobs created by this push manager
-        std::vector<std::string> listJobs() const;
+        // Withdraw a job: delete it if it is still waiting in the input directory,
+        // else ask the server that claimed it to drop or abort it
+        CancelOutcome cancelJob(const std::string& jobId,
+                                const CancelRequest& request = CancelRequest());
+
+        // List all jobs created by this push manager (optionally only those in a date range)
+        std::vector<std::string> listJobs(const DateRange& range = DateRange()) const;
 
     private:
         std::string inputDirectory_;
         std::string counterFile_;
+        JobLayout layout_;   // Read from the directory's layout marker
 
-        // Thread safety for ID generation
-        mutable std::mutex counterMutex_;
-
-        // Load the current counter value
-        int loadCounter() const;
+        // Thread safety for ID generation (the counter file is also flock'd for other processes)
+        std::mutex counterMutex_;
 
-        // Save the counter after incrementing
-        void saveCounter(int counter) const;
+        // Take the next counter value and advance the counter file; -1 on failure
+        int nextCounter();
 
         // Generate a new job ID
         std::string generateJobID();
 
-        // Write content to a file
+        // Write content to a file, publishing it atomically via rename
         bool writeToFile(const std::filesystem::path& filePath,
                         const std::string& content) const;
     };
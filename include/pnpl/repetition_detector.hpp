@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace pnpl {
+
+    // Online detector of degenerate loops in a generated token stream. For every
+    // period up to maxPeriod it tracks how many consecutive tokens equalled the
+    // token one period earlier, so each new token costs O(maxPeriod) and memory is
+    // bounded. A cycle counts as sustained once the repeated span is at least
+    // minRepeatedTokens long and covers minCycles full periods.
+    class RepetitionDetector {
+    public:
+        explicit RepetitionDetector(int maxPeriod = 256, int minCycles = 3, int minRepeatedTokens = 64);
+
+        // Add the next generated token; returns the period of a sustained cycle ending
+        // with it (the shortest, if several), or 0
+        int push(int32_t token);
+
+        // Tokens that repeat the cycle reported by the last push (0 if none)
+        int repeatedTokens() const;
+
+        // Forget the history (e.g. after sampling was changed to break the loop)
+        void reset();
+
+    private:
+        int maxPeriod_;
+        int minCycles_;
+        int minRepeatedTokens_;
+        std::vector<int32_t> history_;   // Ring buffer of the last maxPeriod tokens
+        std::vector<int> runs_;          // runs_[p]: trailing tokens equal to the one p earlier
+        size_t count_ = 0;               // Tokens pushed since the last reset
+        int repeated_ = 0;
+    };
+
+} // namespace pnpl
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <ostream>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Extension appended to compressed text results ("<id>.txt.gz", gzip format)
+    constexpr const char* COMPRESSED_RESULT_EXTENSION = ".gz";
+
+    // Result files: generated text ("<id>.txt", "<id>.txt.gz") or an embedding ("<id>.emb")
+    constexpr const char* RESULT_EXTENSIONS[] = {".txt", ".txt.gz", ".emb"};
+
+    // Length of the result extension of a filename (0 if it isn't a result file)
+    size_t resultExtensionLength(const std::string& filename);
+
+    // Name a result is renamed to while a popper consumes it (".<id>.consumed-<pid><ext>").
+    // Only one of several concurrent poppers wins the rename, and listings skip dotfiles.
+    std::filesystem::path consumingPath(const std::filesystem::path& resultPath);
+
+    // True for a filename made by consumingPath
+    bool isConsumingFile(const std::string& filename);
+
+    // True if this build can write and read compressed results (built with zlib)
+    bool resultCompressionAvailable();
+
+    // Write a result via a temporary file and rename, so readers never see a partial
+    // file. A path ending in ".gz" is written gzip-compressed at the fastest level.
+    bool writeResultFile(const std::filesystem::path& path, const std::string& content,
+                         std::string& error);
+
+    // Read a whole text result, decompressing ".gz" files
+    bool readResultFile(const std::filesystem::path& path, std::string& content);
+
+    // Copy a text result to a stream in fixed-size blocks, decompressing ".gz" files
+    bool streamResultFile(const std::filesystem::path& path, std::ostream& out);
+
+    // Totals for results written by this process
+    struct ResultStorageStats {
+        uint64_t files = 0;
+        uint64_t rawBytes = 0;      // Text size before compression
+        uint64_t storedBytes = 0;   // Size on disk
+    };
+    ResultStorageStats resultStorageStats();
+
+} // namespace pnpl
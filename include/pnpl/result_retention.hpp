@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Limits on the results kept in an output directory (0 = no limit). Results beyond
+    // any limit are deleted oldest first, by completion time.
+    struct RetentionPolicy {
+        int64_t maxAgeSeconds = 0;
+        uint64_t maxResults = 0;
+        uint64_t maxBytes = 0;    // Size of the result files on disk
+
+        bool enabled() const;
+
+        // "age 7d, 10000 results, 512 MiB" for logs
+        std::string describe() const;
+    };
+
+    // What one sweep found and did
+    struct RetentionSweep {
+        uint64_t removed = 0;        // Results deleted
+        uint64_t removedBytes = 0;
+        uint64_t kept = 0;           // Results left
+        uint64_t keptBytes = 0;
+        uint64_t abandoned = 0;      // Leftovers of poppers that died mid-consume, deleted
+        uint64_t orphaned = 0;       // .meta and .timing files left without a result, deleted
+    };
+
+    // Parse an age such as "90s", "30m", "12h" or "7d" (a bare number is seconds)
+    bool parseRetentionAge(const std::string& text, int64_t& seconds);
+
+    // Delete results (and their .meta and .timing files) until the directory is within
+    // the policy, in any layout, and sidecars whose result is long gone. Safe to run while
+    // servers write and clients pop.
+    RetentionSweep enforceRetention(const std::filesystem::path& directory, const RetentionPolicy& policy);
+
+} // namespace pnpl
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+namespace pnpl {
+
+    // Opt-in timeline tracing to a Chrome trace-event JSON file (chrome://tracing, Perfetto).
+    // Each thread records complete spans into its own lock-free ring buffer; a background
+    // thread drains the buffers to disk. When tracing is off a span costs one relaxed load.
+    class Tracer {
+    public:
+        // Start writing events to path; call once, before the traced threads start
+        static bool start(const std::string& path, std::string& error);
+
+        // Flush outstanding events and close the file
+        static void stop();
+
+        static bool enabled() {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        // Label the calling thread in the trace (e.g. "worker 0")
+        static void setThreadName(const std::string& name);
+
+        // Tag the calling thread's following spans with a job ID (empty clears it)
+        static void setThreadJob(const std::string& jobId);
+
+        // Monotonic timestamp in microseconds
+        static uint64_t now();
+
+        // Record a finished span on the calling thread; name must be a string literal
+        static void record(const char* name, uint64_t begin, uint64_t end);
+
+    private:
+        static std::atomic<bool> enabled_;
+    };
+
+    // Records the enclosing scope as a span named after a string literal
+    class TraceSpan {
+    public:
+        explicit TraceSpan(const char* name)
+            : name_(name), begin_(Tracer::enabled() ? Tracer::now() : 0) {}
+
+        ~TraceSpan() {
+            if (begin_ != 0) {
+                Tracer::record(name_, begin_, Tracer::now());
+            }
+        }
+
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+
+    private:
+        const char* name_;
+        uint64_t begin_;
+    };
+
+} // namespace pnpl
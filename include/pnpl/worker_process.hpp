@@ -0,0 +1,103 @@
+#pragma once
+
+#include "pnpl/inference_runner.hpp"
+#include "pnpl/job_metadata.hpp"
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace pnpl {
+
+    // One generation handed to a worker process
+    struct WorkerRequest {
+        std::string modelPath;
+        RunnerOptions options;
+        std::string input;
+        GenerationParams params;
+        std::filesystem::path checkpointPath;   // Empty = no checkpoint
+        std::vector<int32_t> tokens;            // Content tokenized by the supervisor (empty = tokenize in the child)
+    };
+
+    // How a generation ended, wherever it ran
+    struct RunStatus {
+        bool success = false;
+        bool interrupted = false;
+        bool cancelled = false;
+        bool inputTooLarge = false;
+        bool crashed = false;       // The worker process died during the run
+        size_t tokenCount = 0;
+        LoopReport loop;
+        std::string error;
+
+        // Outcome of a runner's last run
+        static RunStatus of(const InferenceRunner& runner, bool success);
+    };
+
+    // A child process (pnpl_worker) running the generations of one worker thread, so a
+    // crash in the inference stack costs one job instead of the server. The child is
+    // exec'd rather than forked from the multithreaded supervisor; it maps the same
+    // model file, so the weights are shared through the page cache. Requests and
+    // replies are length-prefixed frames on a socket pair.
+    class WorkerProcess {
+    public:
+        explicit WorkerProcess(const std::string& executable, const std::string& templatesPath = "");
+
+        // Closes the connection and waits for the child (killing it if it hangs)
+        ~WorkerProcess();
+
+        WorkerProcess(const WorkerProcess&) = delete;
+        WorkerProcess& operator=(const WorkerProcess&) = delete;
+
+        // Spawn the child and have it load and warm up a model
+        bool start(const std::string& modelPath, const RunnerOptions& options, std::string& error);
+
+        // Generate in the child, respawning it first if it died. Streamed text goes to
+        // onText; once *cancelFlag becomes true the child aborts like a runner with that
+        // cancel flag. A child that dies mid-run fails it with status.crashed set.
+        bool run(const WorkerRequest& request, std::string& output, RunStatus& status,
+                 const StreamCallback& onText = nullptr,
+                 const std::atomic<bool>* cancelFlag = nullptr);
+
+        // Abort the current generation (from any thread)
+        void cancel();
+
+        // Checkpoint the current generation and every later one (shutdown; from any thread)
+        void interrupt();
+
+        // Times the child died and had to be respawned
+        int crashes() const;
+
+        // Child side: serve requests on fd until the supervisor closes it (pnpl_worker)
+        static int serve(int fd, const std::string& templatesPath);
+
+    private:
+        std::string executable_;
+        std::string templatesPath_;
+
+        // Guards pid_, fd_ and writes to fd_; replies are only read by the thread in run()
+        std::mutex mutex_;
+        pid_t pid_ = -1;
+        int fd_ = -1;
+        uint64_t sequence_ = 0;      // Request the child is working on
+        bool busy_ = false;
+        bool interrupted_ = false;
+        std::atomic<int> crashes_{0};
+
+        // Seconds to wait for an idle child to exit before killing it
+        static const int EXIT_TIMEOUT_SECONDS = 5;
+
+        // fork + exec the child with its end of a new socket pair
+        bool spawn(std::string& error);
+
+        // Close the connection, wait for the child to exit and describe how it did
+        std::string reap();
+
+        // Send a frame (caller holds mutex_)
+        bool send(const std::vector<std::string>& fields);
+    };
+
+} // namespace pnpl
@@ -0,0 +1,419 @@
+#include "pnpl/autotune.hpp"
+#include "pnpl/trace.hpp"
+#include "pnpl/job_lease.hpp"
+#include "llama.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace pnpl {
+
+namespace {
+
+    // FNV-1a, continued from a previous hash
+    uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Estimated seconds for a typical job; lower is better
+    double jobSeconds(const RunnerBenchmark& bench, int promptTokens, int generatedTokens) {
+        if (bench.prefillTokensPerSecond <= 0 || bench.decodeTokensPerSecond <= 0) {
+            return 1e30;
+        }
+        return promptTokens / bench.prefillTokensPerSecond + generatedTokens / bench.decodeTokensPerSecond;
+    }
+
+    // Thread counts worth trying: all hardware threads, three quarters, half
+    // (physical cores on SMT hosts) and a quarter
+    std::vector<int> threadCandidates() {
+        int hardware = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<int> candidates;
+        for (int threads : {hardware, hardware * 3 / 4, hardware / 2, hardware / 4}) {
+            if (threads >= 1 && std::find(candidates.begin(), candidates.end(), threads) == candidates.end()) {
+                candidates.push_back(threads);
+            }
+        }
+        return candidates;
+    }
+
+    // Name for the cache while it is written, unique to this host and process: servers
+    // on several hosts may tune into one cache on shared storage at the same time
+    std::filesystem::path cacheTempPath(const std::filesystem::path& cachePath) {
+#ifdef _WIN32
+        long pid = static_cast<long>(_getpid());
+#else
+        long pid = static_cast<long>(getpid());
+#endif
+        std::filesystem::path temp = cachePath;
+        temp += "." + LeaseManager::defaultNodeId() + "." + std::to_string(pid) + ".tmp";
+        return temp;
+    }
+
+    std::string describe(const RunnerOptions& options) {
+        std::stringstream ss;
+        ss << "gpu_layers=" << options.gpuLayers << " threads=" << options.threads
+           << " threads_batch=" << options.threadsBatch << " ubatch=" << options.ubatchSize
+           << " flash_attn=" << (options.flashAttention ? 1 : 0);
+        return ss.str();
+    }
+
+} // namespace
+
+Autotuner::Autotuner(const std::filesystem::path& cachePath)
+    : cachePath_(cachePath) {
+}
+
+bool Autotuner::tune(const std::string& modelPath, RunnerOptions& options, std::string& error) {
+    uint64_t fingerprint;
+    if (!modelFingerprint(modelPath, fingerprint, error)) {
+        return false;
+    }
+
+    std::string key = cacheKey(fingerprint, options);
+    if (readCache(key, options)) {
+        std::cout << "Autotune: using cached settings for " << modelPath << ": " << describe(options) << std::endl;
+        return true;
+    }
+
+    std::cout << "Autotune: probing " << modelPath << " on " << hostDescription() << std::endl;
+    RunnerOptions tuned = options;
+    if (!measure(modelPath, tuned, error)) {
+        return false;
+    }
+    options = tuned;
+    std::cout << "Autotune: selected " << describe(options) << std::endl;
+
+    if (!writeCache(key, options, modelPath)) {
+        std::cerr << "Warning: Failed to write autotune cache " << cachePath_ << std::endl;
+    }
+    return true;
+}
+
+bool Autotuner::measure(const std::string& modelPath, RunnerOptions& options, std::string& error) {
+    TraceSpan span("autotune");
+
+    // Without a GPU backend there is nothing to offload
+    std::vector<int> offloadCandidates = {0};
+    if (llama_supports_gpu_offload()) {
+        offloadCandidates = {options.gpuLayers > 0 ? options.gpuLayers : 99, 0};
+    }
+
+    RunnerOptions best;
+    double bestSeconds = 0;
+    bool found = false;
+
+    for (int gpuLayers : offloadCandidates) {
+        RunnerOptions current = options;
+        current.gpuLayers = gpuLayers;
+
+        // A full offload may not fit the GPU; the CPU candidate can still run
+        std::shared_ptr<llama_model> model = InferenceRunner::loadModel(modelPath, current, error);
+        if (!model) {
+            std::cout << "Autotune: gpu_layers=" << gpuLayers << " failed: " << error << std::endl;
+            continue;
+        }
+
+        InferenceRunner runner;
+        RunnerBenchmark bench;
+
+        // Time one candidate; false if this configuration can't run at all
+        auto probe = [&](const RunnerOptions& candidate, RunnerBenchmark& result) {
+            if (!runner.init(model, candidate) ||
+                !runner.benchmark(PROBE_PREFILL_TOKENS, PROBE_DECODE_TOKENS, result)) {
+                std::cout << "Autotune: " << describe(candidate) << " failed: " << runner.getLastError() << std::endl;
+                return false;
+            }
+            std::cout << "Autotune: " << describe(candidate) << ": " << std::fixed << std::setprecision(1)
+                      << result.prefillTokensPerSecond << " tok/s prefill, "
+                      << result.decodeTokensPerSecond << " tok/s decode" << std::endl;
+            return true;
+        };
+
+        // The first probe pages the weights in and allocates buffers; don't count it
+        if (!runner.init(model, current) || !runner.warmup() ||
+            !runner.benchmark(PROBE_PREFILL_TOKENS, 1, bench)) {
+            std::cout << "Autotune: gpu_layers=" << gpuLayers << " failed: " << runner.getLastError() << std::endl;
+            continue;
+        }
+
+        // Coordinate search: each setting is tuned with the best of the previous ones.
+        // With every layer on the GPU the CPU thread counts hardly matter.
+        if (gpuLayers == 0) {
+            // Generation threads by decode speed
+            double bestDecode = 0;
+            for (int threads : threadCandidates()) {
+                RunnerOptions candidate = current;
+                candidate.threads = threads;
+                candidate.threadsBatch = threads;
+                if (probe(candidate, bench) && bench.decodeTokensPerSecond > bestDecode) {
+                    bestDecode = bench.decodeTokensPerSecond;
+                    current.threads = threads;
+                }
+            }
+
+            // Prompt threads by prefill speed
+            double bestPrefill = 0;
+            for (int threads : threadCandidates()) {
+                RunnerOptions candidate = current;
+                candidate.threadsBatch = threads;
+                if (probe(candidate, bench) && bench.prefillTokensPerSecond > bestPrefill) {
+                    bestPrefill = bench.prefillTokensPerSecond;
+                    current.threadsBatch = threads;
+                }
+            }
+        }
+
+        // Physical batch size by prefill speed
+        double bestPrefill = 0;
+        for (int ubatch : {512, 256, 128}) {
+            RunnerOptions candidate = current;
+            candidate.ubatchSize = ubatch;
+            if (probe(candidate, bench) && bench.prefillTokensPerSecond > bestPrefill) {
+                bestPrefill = bench.prefillTokensPerSecond;
+                current.ubatchSize = ubatch;
+            }
+        }
+
+        // Flash attention by overall job time; it stays on if the operator enabled it
+        // (a quantized V cache requires it)
+        if (!probe(current, bench)) {
+            continue;
+        }
+        double seconds = jobSeconds(bench, REFERENCE_PROMPT_TOKENS, REFERENCE_GENERATED_TOKENS);
+        if (!current.flashAttention) {
+            RunnerOptions candidate = current;
+            candidate.flashAttention = true;
+            if (probe(candidate, bench)) {
+                double flashSeconds = jobSeconds(bench, REFERENCE_PROMPT_TOKENS, REFERENCE_GENERATED_TOKENS);
+                if (flashSeconds < seconds) {
+                    seconds = flashSeconds;
+                    current.flashAttention = true;
+                }
+            }
+        }
+
+        if (!found || seconds < bestSeconds) {
+            best = current;
+            bestSeconds = seconds;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        error = "No configuration could run " + modelPath;
+        return false;
+    }
+    options = best;
+    return true;
+}
+
+bool Autotuner::compareHugePages(const std::string& modelPath, const RunnerOptions& options,
+                                 std::string& error) {
+    TraceSpan span("hugepage_benchmark");
+    const int REPEATS = 3;
+
+    HugePageMode mode = options.hugePages == HugePageMode::Off ? HugePageMode::Transparent : options.hugePages;
+    std::string policy = transparentHugePagePolicy();
+    std::cout << "Huge page benchmark on " << hostDescription() << " (transparent policy "
+              << (policy.empty() ? "unknown" : policy) << ")" << std::endl;
+
+    double baselineDecode = 0;
+    for (HugePageMode current : {HugePageMode::Off, mode}) {
+        RunnerOptions candidate = options;
+        candidate.hugePages = current;
+
+        std::shared_ptr<llama_model> model = InferenceRunner::loadModel(modelPath, candidate, error);
+        if (!model) {
+            return false;
+        }
+
+        // Warm up untimed (faults the weights in), then keep the best of a few probes
+        InferenceRunner runner;
+        RunnerBenchmark best;
+        RunnerBenchmark bench;
+        if (!runner.init(model, candidate) || !runner.warmup() ||
+            !runner.benchmark(PROBE_PREFILL_TOKENS, 1, bench)) {
+            error = runner.getLastError();
+            return false;
+        }
+        for (int i = 0; i < REPEATS; ++i) {
+            if (!runner.benchmark(PROBE_PREFILL_TOKENS, PROBE_DECODE_TOKENS * 4, bench)) {
+                error = runner.getLastError();
+                return false;
+            }
+            best.prefillTokensPerSecond = std::max(best.prefillTokensPerSecond, bench.prefillTokensPerSecond);
+            best.decodeTokensPerSecond = std::max(best.decodeTokensPerSecond, bench.decodeTokensPerSecond);
+        }
+
+        std::string weightsPath = modelPath;
+        std::filesystem::path copy = hugePageCopyPath(modelPath, candidate.hugePageDirectory);
+        if (current == HugePageMode::Explicit && std::filesystem::exists(copy)) {
+            weightsPath = copy.string();
+        }
+
+        std::cout << std::left << std::setw(9) << hugePageModeName(current) << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(9) << best.prefillTokensPerSecond << " tok/s prefill "
+                  << std::setw(8) << best.decodeTokensPerSecond << " tok/s decode";
+        if (current == HugePageMode::Off) {
+            baselineDecode = best.decodeTokensPerSecond;
+        } else if (baselineDecode > 0) {
+            std::cout << " (" << std::showpos << (best.decodeTokensPerSecond / baselineDecode - 1) * 100
+                      << std::noshowpos << "%)";
+        }
+        std::cout << std::endl;
+        std::cout << "         weights: " << describeHugePageUsage(hugePageUsage(fileMappings(weightsPath)))
+                  << std::endl;
+        if (current != HugePageMode::Off) {
+            std::cout << "         context buffers: " << describeHugePageUsage(runner.contextHugePages())
+                      << std::endl;
+        }
+    }
+    return true;
+}
+
+std::string Autotuner::hostDescription() {
+    std::string cpu;
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (cpu.empty() && std::getline(cpuinfo, line)) {
+        // x86 names the model; many ARM kernels only report the part number
+        if (line.rfind("model name", 0) == 0 || line.rfind("CPU part", 0) == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                cpu = line.substr(line.find_first_not_of(" \t", colon + 1));
+            }
+        }
+    }
+    if (cpu.empty()) {
+        cpu = "unknown CPU";
+    }
+    return cpu + " x" + std::to_string(std::thread::hardware_concurrency());
+}
+
+bool Autotuner::modelFingerprint(const std::string& modelPath, uint64_t& fingerprint,
+                                 std::string& error) {
+    const uint64_t SAMPLE_BYTES = 4 << 20;
+
+    std::ifstream file(modelPath, std::ios::binary);
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(modelPath, ec);
+    if (!file || ec) {
+        error = "Cannot read model file " + modelPath;
+        return false;
+    }
+
+    uint64_t hash = fnv1a(reinterpret_cast<const char*>(&size), sizeof(size));
+    std::vector<char> buffer(static_cast<size_t>(std::min(size, SAMPLE_BYTES)));
+    for (uint64_t offset : {uint64_t(0), size > SAMPLE_BYTES ? size - SAMPLE_BYTES : uint64_t(0)}) {
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hash = fnv1a(buffer.data(), static_cast<size_t>(file.gcount()), hash);
+        file.clear();
+    }
+
+    fingerprint = hash;
+    return true;
+}
+
+std::string Autotuner::cacheKey(uint64_t fingerprint, const RunnerOptions& options) const {
+    // KV cache types change the attention kernels, so they are part of the key
+    std::string host = hostDescription() + "|" + options.cacheTypeK + "|" + options.cacheTypeV;
+    std::stringstream ss;
+    ss << std::hex << std::setfill('0') << std::setw(16) << fingerprint << "-"
+       << std::setw(16) << fnv1a(host.data(), host.size());
+    return ss.str();
+}
+
+bool Autotuner::readCache(const std::string& key, RunnerOptions& options) const {
+    std::ifstream file(cachePath_);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string lineKey;
+        if (!(fields >> lineKey) || lineKey != key) continue;
+
+        RunnerOptions cached = options;
+        std::string field;
+        try {
+            while (fields >> field) {
+                size_t eq = field.find('=');
+                if (eq == std::string::npos) break;   // Trailing comment
+                std::string name = field.substr(0, eq);
+                int value = std::stoi(field.substr(eq + 1));
+                if (name == "threads") cached.threads = value;
+                else if (name == "threads_batch") cached.threadsBatch = value;
+                else if (name == "ubatch") cached.ubatchSize = value;
+                else if (name == "flash_attn") cached.flashAttention = cached.flashAttention || value != 0;
+                else if (name == "gpu_layers") cached.gpuLayers = value;
+            }
+        } catch (...) {
+            return false;
+        }
+        options = cached;
+        return true;
+    }
+    return false;
+}
+
+bool Autotuner::writeCache(const std::string& key, const RunnerOptions& options,
+                           const std::string& modelPath) const {
+    // Keep other models' and hosts' entries (the file may live on shared storage)
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(cachePath_);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.rfind(key + " ", 0) != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+
+    std::stringstream entry;
+    entry << key << " threads=" << options.threads << " threads_batch=" << options.threadsBatch
+          << " ubatch=" << options.ubatchSize << " flash_attn=" << (options.flashAttention ? 1 : 0)
+          << " gpu_layers=" << options.gpuLayers
+          << " # " << std::filesystem::path(modelPath).filename().string() << " on " << hostDescription();
+    lines.push_back(entry.str());
+
+    // Write a temporary file and rename it so a concurrent reader never sees half a file
+    std::error_code ec;
+    if (cachePath_.has_parent_path()) {
+        std::filesystem::create_directories(cachePath_.parent_path(), ec);
+    }
+    std::filesystem::path tempPath = cacheTempPath(cachePath_);
+    {
+        std::ofstream file(tempPath, std::ios::trunc);
+        for (const auto& line : lines) {
+            file << line << "\n";
+        }
+        if (!file) {
+            file.close();
+            std::filesystem::remove(tempPath, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tempPath, cachePath_, ec);
+    if (ec) {
+        std::error_code ignored;
+        std::filesystem::remove(tempPath, ignored);
+        return false;
+    }
+    return true;
+}
+
+} // namespace pnpl
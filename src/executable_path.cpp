@@ -0,0 +1,59 @@
+#include "pnpl/executable_path.hpp"
+#include <iostream>
+#include <filesystem>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#include <climits>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <climits>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace pnpl {
+
+std::string getExecutablePath(const std::string& fallbackName) {
+    std::string path;
+
+#ifdef __APPLE__
+    char buffer[PATH_MAX];
+    uint32_t size = sizeof(buffer);
+    if (_NSGetExecutablePath(buffer, &size) == 0) {
+        path = std::filesystem::canonical(buffer).string();
+    }
+#elif defined(__linux__)
+    char buffer[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
+    if (len != -1) {
+        buffer[len] = '\0';
+        path = std::filesystem::canonical(buffer).string();
+    }
+#elif defined(_WIN32)
+    char buffer[MAX_PATH];
+    if (GetModuleFileNameA(NULL, buffer, MAX_PATH) > 0) {
+        path = std::filesystem::canonical(buffer).string();
+    }
+#endif
+
+    if (path.empty()) {
+        // Fallback: use current working directory
+        path = (std::filesystem::current_path() / fallbackName).string();
+        std::cerr << "Warning: Could not determine executable path, using fallback" << std::endl;
+    }
+
+    return path;
+}
+
+std::string getProjectRoot(const std::string& fallbackName) {
+    std::filesystem::path exePath = getExecutablePath(fallbackName);
+    std::filesystem::path buildDir = exePath.parent_path();
+
+    // Go up one level to project root (assuming we're in build/)
+    std::filesystem::path projectRoot = buildDir.parent_path();
+
+    return projectRoot.string();
+}
+
+} // namespace pnpl
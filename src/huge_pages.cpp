@@ -0,0 +1,319 @@
+#include "pnpl/huge_pages.hpp"
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <iomanip>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25   // Linux 6.1; older headers lack it
+#endif
+#endif
+
+namespace pnpl {
+
+namespace {
+
+    const uint64_t DEFAULT_HUGE_PAGE_SIZE = 2 << 20;
+    const long HUGETLBFS_MAGIC_NUMBER = 0x958458f6;
+
+    // PMD size transparent huge pages use (2 MiB on x86-64, varies on ARM)
+    uint64_t transparentHugePageSize() {
+        std::ifstream file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+        uint64_t size = 0;
+        if (file >> size && size > 0) {
+            return size;
+        }
+        return DEFAULT_HUGE_PAGE_SIZE;
+    }
+
+    bool contains(const std::vector<MemoryRange>& ranges, uintptr_t begin, uintptr_t end) {
+        for (const auto& range : ranges) {
+            if (begin >= range.begin && end <= range.end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string mebibytes(uint64_t bytes) {
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(1) << bytes / 1048576.0;
+        return ss.str();
+    }
+
+} // namespace
+
+bool parseHugePageMode(const std::string& name, HugePageMode& mode) {
+    if (name == "off") { mode = HugePageMode::Off; return true; }
+    if (name == "thp") { mode = HugePageMode::Transparent; return true; }
+    if (name == "explicit") { mode = HugePageMode::Explicit; return true; }
+    return false;
+}
+
+std::string hugePageModeName(HugePageMode mode) {
+    switch (mode) {
+        case HugePageMode::Transparent: return "thp";
+        case HugePageMode::Explicit: return "explicit";
+        default: return "off";
+    }
+}
+
+std::string transparentHugePagePolicy() {
+    // "always [madvise] never": the bracketed word is the active policy
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string line;
+    if (!std::getline(file, line)) {
+        return "";
+    }
+    size_t open = line.find('[');
+    size_t close = line.find(']', open);
+    if (open == std::string::npos || close == std::string::npos) {
+        return "";
+    }
+    return line.substr(open + 1, close - open - 1);
+}
+
+std::vector<MemoryRange> memoryMappings() {
+    std::vector<MemoryRange> ranges;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        // begin-end perms offset dev inode [path]
+        std::istringstream fields(line);
+        std::string addresses, perms, offset, dev;
+        unsigned long inode = 0;
+        if (!(fields >> addresses >> perms >> offset >> dev >> inode)) continue;
+
+        MemoryRange range;
+        size_t dash = addresses.find('-');
+        if (dash == std::string::npos) continue;
+        range.begin = std::stoull(addresses.substr(0, dash), nullptr, 16);
+        range.end = std::stoull(addresses.substr(dash + 1), nullptr, 16);
+
+        std::getline(fields >> std::ws, range.path);
+        range.anonymous = inode == 0 && (range.path.empty() || range.path == "[heap]");
+        ranges.push_back(range);
+    }
+    return ranges;
+}
+
+std::vector<MemoryRange> fileMappings(const std::string& path) {
+    std::error_code ec;
+    std::string canonical = std::filesystem::canonical(path, ec).string();
+    if (ec) {
+        return {};
+    }
+
+    std::vector<MemoryRange> ranges;
+    for (const auto& range : memoryMappings()) {
+        if (range.path == canonical) {
+            ranges.push_back(range);
+        }
+    }
+    return ranges;
+}
+
+std::vector<MemoryRange> newAnonymousMappings(const std::vector<MemoryRange>& before,
+                                              const std::vector<MemoryRange>& after) {
+    std::set<std::pair<uintptr_t, uintptr_t>> existing;
+    for (const auto& range : before) {
+        existing.insert({range.begin, range.end});
+    }
+
+    const uint64_t pageSize = transparentHugePageSize();
+    std::vector<MemoryRange> added;
+    for (const auto& range : after) {
+        if (range.anonymous && range.end - range.begin >= pageSize &&
+            !existing.count({range.begin, range.end})) {
+            added.push_back(range);
+        }
+    }
+    return added;
+}
+
+bool adviseHugePages(const std::vector<MemoryRange>& ranges) {
+#ifdef __linux__
+    const uint64_t pageSize = transparentHugePageSize();
+    bool accepted = true;
+    for (const auto& range : ranges) {
+        // Only whole huge pages inside the range can be promoted
+        uintptr_t begin = (range.begin + pageSize - 1) / pageSize * pageSize;
+        uintptr_t end = range.end / pageSize * pageSize;
+        if (end <= begin) continue;
+
+        void* address = reinterpret_cast<void*>(begin);
+        size_t length = end - begin;
+        if (madvise(address, length, MADV_HUGEPAGE) != 0) {
+            accepted = false;
+            continue;
+        }
+        // Pages touched before the advice stay small until collapsed; kernels before
+        // 6.1 reject this and leave it to khugepaged
+        madvise(address, length, MADV_COLLAPSE);
+    }
+    return accepted;
+#else
+    (void)ranges;
+    return false;
+#endif
+}
+
+HugePageUsage hugePageUsage(const std::vector<MemoryRange>& ranges) {
+    HugePageUsage usage;
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool counting = false;
+    while (std::getline(smaps, line)) {
+        // Mapping header: "begin-end perms ..."; advice may have split a range into several
+        size_t dash = line.find('-');
+        size_t space = line.find(' ');
+        if (dash != std::string::npos && space != std::string::npos && dash < space &&
+            line.find(':') > space) {
+            try {
+                uintptr_t begin = std::stoull(line.substr(0, dash), nullptr, 16);
+                uintptr_t end = std::stoull(line.substr(dash + 1, space - dash - 1), nullptr, 16);
+                counting = contains(ranges, begin, end);
+                if (counting) {
+                    usage.bytes += end - begin;
+                }
+            } catch (const std::exception&) {
+                counting = false;
+            }
+            continue;
+        }
+        if (!counting) continue;
+
+        // "Key:   <n> kB"
+        std::istringstream fields(line);
+        std::string key;
+        uint64_t kilobytes = 0;
+        if (!(fields >> key >> kilobytes)) continue;
+        uint64_t bytes = kilobytes << 10;
+        if (key == "Rss:") {
+            usage.resident += bytes;
+        } else if (key == "AnonHugePages:" || key == "FilePmdMapped:" || key == "ShmemPmdMapped:") {
+            usage.huge += bytes;
+        } else if (key == "Shared_Hugetlb:" || key == "Private_Hugetlb:") {
+            // hugetlbfs pages are not counted in Rss
+            usage.resident += bytes;
+            usage.huge += bytes;
+        }
+    }
+    return usage;
+}
+
+std::string describeHugePageUsage(const HugePageUsage& usage) {
+    if (usage.resident == 0) {
+        return "nothing resident yet";
+    }
+    int percent = static_cast<int>(usage.huge * 100 / usage.resident);
+    return mebibytes(usage.huge) + " of " + mebibytes(usage.resident) + " MiB in huge pages (" +
+           std::to_string(percent) + "%)";
+}
+
+std::filesystem::path hugePageCopyPath(const std::string& modelPath, const std::string& directory) {
+    struct stat info {};
+    stat(modelPath.c_str(), &info);
+    std::filesystem::path model(modelPath);
+    return std::filesystem::path(directory) /
+           (model.stem().string() + "-" + std::to_string(info.st_size) + "-" +
+            std::to_string(static_cast<long long>(info.st_mtime)) + model.extension().string());
+}
+
+bool copyToHugePages(const std::string& modelPath, const std::string& directory,
+                     std::string& copyPath, std::string& error) {
+#ifdef __linux__
+    struct statfs fs;
+    if (statfs(directory.c_str(), &fs) != 0 || static_cast<long>(fs.f_type) != HUGETLBFS_MAGIC_NUMBER) {
+        error = directory + " is not a hugetlbfs mount";
+        return false;
+    }
+
+    std::filesystem::path target = hugePageCopyPath(modelPath, directory);
+    copyPath = target.string();
+    std::error_code ec;
+    if (std::filesystem::exists(target, ec)) {
+        return true;   // Copies only get their name once complete
+    }
+
+    std::ifstream source(modelPath, std::ios::binary);
+    uintmax_t size = std::filesystem::file_size(modelPath, ec);
+    if (!source || ec) {
+        error = "Cannot read model file " + modelPath;
+        return false;
+    }
+
+    // hugetlbfs files are sized in whole pages; GGUF readers ignore the zero padding
+    const uint64_t pageSize = static_cast<uint64_t>(fs.f_bsize);
+    const uint64_t length = (size + pageSize - 1) / pageSize * pageSize;
+
+    std::string tempPath = copyPath + ".tmp." + std::to_string(getpid());
+    int fd = open(tempPath.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        error = "Cannot create " + tempPath + ": " + std::strerror(errno);
+        return false;
+    }
+
+    // Reserve every page now: touching a page the pool can't supply would raise SIGBUS
+    if (fallocate(fd, 0, 0, static_cast<off_t>(length)) != 0) {
+        error = "Not enough free huge pages for " + modelPath + " (" + std::to_string(length / pageSize) +
+                " pages of " + std::to_string(pageSize >> 10) + " kB needed; raise vm.nr_hugepages)";
+        close(fd);
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        error = "Cannot map " + tempPath + ": " + std::strerror(errno);
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    // hugetlbfs has no write(); read the model straight into the mapping
+    const size_t CHUNK = 64 << 20;
+    char* cursor = static_cast<char*>(data);
+    uintmax_t remaining = size;
+    while (remaining > 0 && source.read(cursor, static_cast<std::streamsize>(std::min<uintmax_t>(CHUNK, remaining)))) {
+        cursor += source.gcount();
+        remaining -= static_cast<uintmax_t>(source.gcount());
+    }
+    munmap(data, length);
+
+    if (remaining > 0) {
+        error = "Failed reading " + modelPath + " into huge pages";
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    std::filesystem::rename(tempPath, target, ec);
+    if (ec) {
+        error = "Cannot rename " + tempPath + ": " + ec.message();
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+#else
+    (void)modelPath;
+    (void)directory;
+    copyPath.clear();
+    error = "Explicit huge pages need Linux hugetlbfs";
+    return false;
+#endif
+}
+
+} // namespace pnpl
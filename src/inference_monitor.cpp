@@ -1,26 +1,76 @@
 #include "pnpl/inference_monitor.hpp"
+#include "pnpl/job_metadata.hpp"
+#include "pnpl/result_file.hpp"
+#include "pnpl/trace.hpp"
+#include "pnpl/autotune.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <chrono>
 #include <algorithm>
+#include <iomanip>
+#include <set>
+#include <limits>
 
 namespace pnpl {
 
+namespace {
+
+    // Map jobs and their outputs are numbered with zero-padded part indices
+    std::string partSuffix(int part) {
+        std::ostringstream ss;
+        ss << std::setw(3) << std::setfill('0') << part;
+        return ss.str();
+    }
+
+    std::string readFile(const std::filesystem::path& path) {
+        std::ifstream file(path);
+        return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    }
+
+    // Number of parts recorded in a split job's manifest (0 if there is none)
+    int readManifest(const std::filesystem::path& path) {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.compare(0, 6, "parts=") == 0) {
+                return std::atoi(line.c_str() + 6);
+            }
+        }
+        return 0;
+    }
+
+} // namespace
+
 InferenceMonitor::InferenceMonitor(const std::string& modelPath,
                                  const std::string& inputDir,
                                  const std::string& outputDir,
-                                 int numWorkers)
+                                 int numWorkers,
+                                 const RunnerOptions& runnerOptions)
     : modelPath_(modelPath),
       inputDirectory_(inputDir),
       outputDirectory_(outputDir),
       processingDirectory_(inputDir + "_processing"),
-      numWorkers_(numWorkers) {
+      checkpointDirectory_(inputDir + "_checkpoints"),
+      mapReduceDirectory_(inputDir + "_mapreduce"),
+      numWorkers_(numWorkers),
+      runnerOptions_(runnerOptions),
+      models_(runnerOptions),
+      promptTemplates_(std::make_shared<PromptTemplates>()),
+      leases_(LeaseManager::defaultNodeId(), std::chrono::seconds(60)),
+      writeBackQueue_(static_cast<size_t>(std::max(1, numWorkers)) * 2) {
+
+    models_.registerModel(DEFAULT_MODEL, modelPath_);
 
     // Ensure directories exist
     std::filesystem::create_directories(inputDirectory_);
     std::filesystem::create_directories(outputDirectory_);
     std::filesystem::create_directories(processingDirectory_);
+
+    // Each queue directory records its own layout
+    inputLayout_ = JobLayout::forDirectory(inputDirectory_);
+    processingLayout_ = JobLayout::forDirectory(processingDirectory_);
+    outputLayout_ = JobLayout::forDirectory(outputDirectory_);
 }
 
 InferenceMonitor::~InferenceMonitor() {
@@ -28,43 +78,387 @@ InferenceMonitor::~InferenceMonitor() {
     stop();
 }
 
+void InferenceMonitor::addModel(const std::string& name, const std::string& path) {
+    models_.registerModel(name, path);
+}
+
+void InferenceMonitor::addRoute(const std::string& category, const std::string& model) {
+    routes_[category] = model;
+}
+
+bool InferenceMonitor::loadPromptTemplates(const std::string& path, std::string& error) {
+    if (!promptTemplates_->loadFile(path, error)) {
+        return false;
+    }
+    templatesPath_ = std::filesystem::absolute(path).string();
+    return true;
+}
+
+void InferenceMonitor::setTenantWeight(const std::string& tenant, int weight) {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    jobQueue_.setTenantWeight(tenant, weight);
+}
+
+void InferenceMonitor::setEmbeddingBatchSize(int jobs) {
+    embeddingBatchSize_ = std::max(1, jobs);
+}
+
+void InferenceMonitor::setMapReduce(bool enabled) {
+    mapReduce_ = enabled;
+}
+
+bool InferenceMonitor::setLayout(LayoutMode mode, std::string& error) {
+    const std::pair<const std::string*, JobLayout*> queues[] = {
+        {&inputDirectory_, &inputLayout_},
+        {&processingDirectory_, &processingLayout_},
+        {&outputDirectory_, &outputLayout_},
+    };
+
+    // Switching layouts only works on empty directories; existing jobs need pnpl migrate
+    for (const auto& queue : queues) {
+        if (queue.second->mode() != mode && queue.second->hasFiles(*queue.first)) {
+            error = *queue.first + " uses the " + JobLayout::modeName(queue.second->mode()) +
+                    " layout; run 'pnpl migrate " + JobLayout::modeName(mode) + "' with the server stopped";
+            return false;
+        }
+    }
+
+    for (const auto& queue : queues) {
+        JobLayout layout(mode);
+        if (!layout.writeMarker(*queue.first)) {
+            error = "Failed to record layout in " + *queue.first;
+            return false;
+        }
+        *queue.second = layout;
+    }
+    return true;
+}
+
+void InferenceMonitor::setNodeId(const std::string& nodeId, int leaseSeconds) {
+    leases_ = LeaseManager(nodeId, std::chrono::seconds(std::max(3, leaseSeconds)));
+}
+
+void InferenceMonitor::setCompressResults(bool enabled) {
+    compressResults_ = enabled;
+}
+
+void InferenceMonitor::setRecordTimings(bool enabled) {
+    recordTimings_ = enabled;
+}
+
+void InferenceMonitor::setPrefetchDepth(int jobs) {
+    prefetchDepth_ = std::max(0, jobs);
+}
+
+void InferenceMonitor::setAutotune(const std::filesystem::path& cachePath) {
+    autotuneCache_ = cachePath;
+}
+
+void InferenceMonitor::setIsolation(const std::string& workerExecutable) {
+    workerExecutable_ = workerExecutable;
+}
+
+void InferenceMonitor::setPrefillWorkers(int workers) {
+    prefillWorkers_ = std::max(0, workers);
+}
+
+void InferenceMonitor::setRetention(const RetentionPolicy& policy) {
+    retention_ = policy;
+}
+
+void InferenceMonitor::setWatchDirectories(bool enabled) {
+    watchDirectories_ = enabled;
+}
+
+std::future<SubmitResult> InferenceMonitor::submit(const std::string& input, const JobMetadata& metadata,
+                                                   StreamCallback onText) {
+    auto promise = std::make_shared<std::promise<SubmitResult>>();
+    std::future<SubmitResult> future = promise->get_future();
+    submit(input, metadata, [promise](const SubmitResult& result) { promise->set_value(result); },
+           std::move(onText));
+    return future;
+}
+
+std::string InferenceMonitor::submit(const std::string& input, const JobMetadata& metadata,
+                                     CompletionCallback onComplete, StreamCallback onText) {
+    auto inProcess = std::make_shared<InProcessJob>();
+    inProcess->input = input;
+    inProcess->metadata = metadata;
+    inProcess->onComplete = std::move(onComplete);
+    inProcess->onText = std::move(onText);
+
+    QueuedJob job{"mem_" + std::to_string(nextInProcessId_++), resolveModelForInput(input, metadata),
+                  metadata.embedding, metadata.tenant.empty() ? DEFAULT_TENANT : metadata.tenant,
+                  estimateCost(input.size(), metadata), inProcess, nullptr};
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (running_) {
+            jobQueue_.push(job);
+            inProcess.reset();
+        }
+    }
+
+    if (inProcess) {
+        SubmitResult result;
+        result.id = job.id;
+        result.error = "Server is not running";
+        completeInProcess(job, std::move(result));
+        return job.id;
+    }
+    jobCondition_.notify_all();
+    return job.id;
+}
+
+bool InferenceMonitor::cancel(const std::string& jobId, bool keepPartial) {
+    // A split job goes as a whole, whichever of its jobs was named
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(jobId), jobId), metadata);
+    if (cancelSplitJob(metadata.role != JobRole::Normal && !metadata.parent.empty() ? metadata.parent : jobId)) {
+        return true;
+    }
+
+    QueuedJob job;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (!jobQueue_.remove(jobId, job)) {
+            // Running: the worker's runner aborts at its next decode step (or inside the
+            // current one) and the worker disposes of the output
+            auto running = runningJobs_.find(jobId);
+            if (running == runningJobs_.end()) {
+                return false;
+            }
+            running->second->keepPartial = keepPartial;
+            running->second->cancelled = true;
+            if (running->second->process) {
+                running->second->process->cancel();
+            }
+            updateJobStatus(jobId, "cancelling", keepPartial ? "Keeping partial output" : "");
+            return true;
+        }
+    }
+
+    // Still queued: nothing was generated
+    if (job.prepared) {
+        releaseInput(*job.prepared);
+    }
+    updateJobStatus(jobId, "cancelled", "Removed from the queue");
+    if (job.inProcess) {
+        completeInProcess(job, SubmitResult{jobId, false, "", {}, "Cancelled"});
+    } else {
+        InferenceRunner::removeCheckpoint(std::filesystem::path(checkpointDirectory_) / (jobId + ".ckpt"));
+        completeJob(jobId);
+    }
+    return true;
+}
+
+void InferenceMonitor::processCancelRequests() {
+    std::filesystem::path directory = cancelDirectory(inputDirectory_);
+    if (!std::filesystem::exists(directory)) return;
+
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        const std::filesystem::path& markerPath = it->path();
+        if (markerPath.extension() != ".cancel") continue;
+
+        std::string jobId = markerPath.stem().string();
+        CancelRequest request;
+        if (!readCancelRequest(markerPath, request)) continue;
+
+        // Keep the marker while the job may still reach a node: claimed by another node,
+        // or between its worker and the write-back stage here
+        std::error_code removeError;
+        if (cancel(jobId, request.keepPartial) ||
+            !std::filesystem::exists(processingShard(jobId) / (jobId + ".txt"))) {
+            std::filesystem::remove(markerPath, removeError);
+        }
+    }
+}
+
+void InferenceMonitor::releaseInput(PreparedInput& prepared) {
+    std::unique_lock<std::mutex> lock(prepared.mutex);
+    if (prepared.state == PreparedInput::State::Pending) {
+        // The prefetch stage skips inputs that are no longer pending
+        prepared.state = PreparedInput::State::Ready;
+        return;
+    }
+
+    prepared.ready.wait(lock, [&prepared] { return prepared.state == PreparedInput::State::Ready; });
+    if (prepared.prefetched) {
+        prepared.prefetched = false;
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> queueLock(queueMutex_);
+            prefetchedWaiting_--;
+        }
+        prefetchCondition_.notify_one();
+    }
+}
+
+void InferenceMonitor::setModelMemoryBudget(uint64_t bytes) {
+    models_.setMemoryBudget(bytes);
+}
+
 bool InferenceMonitor::start() {
     // Don't start if already running
     if (running_) return true;
 
+    using Clock = std::chrono::steady_clock;
+    const auto startupBegin = Clock::now();
+    auto phaseBegin = startupBegin;
+
+    // Log how long each startup phase took so rollouts can see where time goes
+    auto endPhase = [&phaseBegin](const char* phase) {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - phaseBegin).count();
+        std::cout << "Startup phase '" << phase << "' took " << ms << " ms" << std::endl;
+        phaseBegin = Clock::now();
+    };
+
+    // Tune every registered model for this host before loading it for real; probes
+    // need the machine to themselves, so this runs before any worker starts
+    std::string error;
+    if (!autotuneCache_.empty()) {
+        Autotuner tuner(autotuneCache_);
+        for (const auto& name : models_.modelNames()) {
+            RunnerOptions tuned = runnerOptions_;
+            if (tuner.tune(models_.modelPath(name), tuned, error)) {
+                models_.setModelOptions(name, tuned);
+            } else {
+                std::cerr << "Warning: Autotune failed for model " << name << ": " << error << std::endl;
+            }
+        }
+        endPhase("autotune");
+    }
+
+    // Load the default model once, up front; all workers share the weights
+    std::shared_ptr<llama_model> defaultModel = models_.acquire(DEFAULT_MODEL, error);
+    if (!defaultModel) {
+        std::cerr << "Failed to load model: " << error << std::endl;
+        return false;
+    }
+    endPhase("model load");
+
     running_ = true;
+    stopping_ = false;
+    startTime_ = std::chrono::steady_clock::now();
 
     // Process any existing files in the processing directory first
-    processExistingFiles();
+    if (watchDirectories_) {
+        processExistingFiles();
+        endPhase("recovery scan");
+    }
 
-    // Start the monitor thread
-    monitorThread_ = std::thread(&InferenceMonitor::monitorDirectory, this);
+    // The write-back and prefetch stages run alongside the workers
+    writeBackQueue_.reopen();
+    writeBackThread_ = std::thread(&InferenceMonitor::writeBackFunction, this);
+    if (prefetchDepth_ != 0) {
+        for (int i = 0; i < PREFETCH_THREADS; ++i) {
+            prefetchThreads_.emplace_back(&InferenceMonitor::prefetchFunction, this);
+        }
+    }
 
-    // Start worker threads
+    // Start worker threads and wait until each has finished its warm-up decode
+    {
+        std::lock_guard<std::mutex> lock(startupMutex_);
+        workersWarm_ = 0;
+        workersFailed_ = 0;
+    }
+    workerProcesses_.clear();
+    if (!workerExecutable_.empty()) {
+        for (int i = 0; i < numWorkers_; ++i) {
+            workerProcesses_.push_back(std::make_unique<WorkerProcess>(workerExecutable_, templatesPath_));
+        }
+    }
     for (int i = 0; i < numWorkers_; ++i) {
         workers_.emplace_back(&InferenceMonitor::workerFunction, this, i);
     }
+    for (int i = 0; i < prefillWorkers_; ++i) {
+        prefillThreads_.emplace_back(&InferenceMonitor::prefillFunction, this, numWorkers_ + i);
+    }
+    {
+        std::unique_lock<std::mutex> lock(startupMutex_);
+        startupCondition_.wait(lock, [this] {
+            return workersWarm_ + workersFailed_ == numWorkers_ + prefillWorkers_;
+        });
+        if (workersFailed_ > 0) {
+            lock.unlock();
+            std::cerr << workersFailed_ << " worker(s) failed to initialize" << std::endl;
+            stop();
+            return false;
+        }
+    }
+    endPhase("worker warm-up");
+
+    // Huge pages are a request the kernel may not grant; say what the weights got
+    if (runnerOptions_.hugePages != HugePageMode::Off) {
+        std::string weightsPath = modelPath_;
+        if (runnerOptions_.hugePages == HugePageMode::Explicit) {
+            std::filesystem::path copy = hugePageCopyPath(modelPath_, runnerOptions_.hugePageDirectory);
+            if (std::filesystem::exists(copy)) {
+                weightsPath = copy.string();
+            }
+        }
+        std::string policy = transparentHugePagePolicy();
+        std::cout << "Huge pages (" << hugePageModeName(runnerOptions_.hugePages) << ", transparent policy "
+                  << (policy.empty() ? "unknown" : policy) << "): weights "
+                  << describeHugePageUsage(hugePageUsage(fileMappings(weightsPath))) << std::endl;
+    }
+
+    // Only start claiming new jobs once every worker can take one
+    if (watchDirectories_) {
+        heartbeatThread_ = std::thread(&InferenceMonitor::heartbeat, this);
+        monitorThread_ = std::thread(&InferenceMonitor::monitorDirectory, this);
+    }
+    if (retention_.enabled()) {
+        reaperThread_ = std::thread(&InferenceMonitor::enforceRetentionLoop, this);
+    }
+    ready_ = true;
 
+    auto totalMs = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - startupBegin).count();
     std::cout << "Inference monitor started with " << numWorkers_ << " workers" << std::endl;
+    if (prefillWorkers_ > 0) {
+        std::cout << "Prefill/decode disaggregation: " << prefillWorkers_ << " prefill workers, "
+                  << numWorkers_ << " decode workers" << std::endl;
+    }
     std::cout << "Input directory: " << inputDirectory_ << std::endl;
     std::cout << "Processing directory: " << processingDirectory_ << std::endl;
     std::cout << "Output directory: " << outputDirectory_ << std::endl;
+    std::cout << "Directory layout: " << JobLayout::modeName(outputLayout_.mode()) << std::endl;
+    std::cout << "Node ID: " << leases_.nodeId() << " (lease " << leases_.duration().count() << " s)" << std::endl;
+    if (retention_.enabled()) {
+        std::cout << "Result retention: " << retention_.describe() << std::endl;
+    }
+    std::cout << "Ready after " << totalMs << " ms" << std::endl;
 
     return true;
 }
 
 void InferenceMonitor::stop() {
-    // Signal all threads to stop
+    // Signal all threads to stop; workers checkpoint their current job at the next token
     running_ = false;
+    ready_ = false;
+    stopping_ = true;
 
-    // Wake up any waiting worker threads
+    // Wake up any waiting worker threads; worker processes checkpoint like the threads
     jobCondition_.notify_all();
+    handoffCondition_.notify_all();
+    for (auto& process : workerProcesses_) {
+        process->interrupt();
+    }
 
     // Wait for all threads to finish
     if (monitorThread_.joinable()) {
         monitorThread_.join();
     }
 
+    // Prefill workers first: the decode workers take no handoffs once stopping
+    for (auto& worker : prefillThreads_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    prefillThreads_.clear();
+
     for (auto& worker : workers_) {
         if (worker.joinable()) {
             worker.join();
@@ -72,11 +466,163 @@ void InferenceMonitor::stop() {
     }
 
     workers_.clear();
+    workerProcesses_.clear();
+
+    // Results already handed off are still written before the leases go
+    writeBackQueue_.close();
+    if (writeBackThread_.joinable()) {
+        writeBackThread_.join();
+    }
+
+    prefetchCondition_.notify_all();
+    for (auto& thread : prefetchThreads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    prefetchThreads_.clear();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        prefetchBacklog_.clear();
+        prefetchedWaiting_ = 0;
+    }
+
+    // Jobs still queued stay in processing for the next start, but in-process callers
+    // would wait forever: tell them their jobs won't run
+    std::vector<QueuedJob> abandoned;
+    std::vector<Handoff> waiting;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        QueuedJob job;
+        int streak = 0;
+        while (jobQueue_.pop(DEFAULT_MODEL, streak, job)) {
+            if (job.inProcess) abandoned.push_back(job);
+        }
+
+        // Handed-off file jobs stay in processing too; prefilled ones resume from their checkpoint
+        for (auto& handoff : handoffQueue_) {
+            runningJobs_.erase(handoff.job.id);
+            if (handoff.job.inProcess) abandoned.push_back(handoff.job);
+            if (!handoff.state.empty()) waiting.push_back(std::move(handoff));
+        }
+        handoffQueue_.clear();
+    }
+
+    // A prompt prefilled in memory is written out only now, so the restart skips it
+    for (const auto& handoff : waiting) {
+        std::string error;
+        if (!InferenceRunner::savePrefilledState(std::filesystem::path(checkpointDirectory_) / (handoff.job.id + ".ckpt"),
+                                                 handoff.state, error)) {
+            std::cerr << "Warning: " << error << std::endl;
+        }
+    }
+    for (const auto& job : abandoned) {
+        SubmitResult result;
+        result.id = job.id;
+        result.error = "Server stopped before the job ran";
+        completeInProcess(job, std::move(result));
+    }
+
+    heartbeatCondition_.notify_all();
+    if (heartbeatThread_.joinable()) {
+        heartbeatThread_.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(reaperMutex_);
+        reaperCondition_.notify_all();
+    }
+    if (reaperThread_.joinable()) {
+        reaperThread_.join();
+    }
+
+    // Hand back jobs still queued or checkpointed here so a restart or another node
+    // can take them without waiting for the leases to expire
+    std::unordered_set<std::string> held;
+    {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        held.swap(heldJobs_);
+    }
+    for (const auto& jobId : held) {
+        leases_.release(leasePath(jobId));
+    }
 }
 
 std::string InferenceMonitor::getStatus() const {
     std::stringstream ss;
-    ss << "Active workers: " << numWorkers_;
+    ss << "Active workers: " << numWorkers_ << "\n";
+    ss << models_.getStatus();
+
+    ResultStorageStats results = resultStorageStats();
+    if (results.files > 0) {
+        ss << "\nResults written: " << results.files << " (" << (results.rawBytes >> 10) << " KB text, "
+           << (results.storedBytes >> 10) << " KB on disk";
+        if (compressResults_ && results.storedBytes > 0) {
+            ss << ", compression ratio " << std::fixed << std::setprecision(1)
+               << static_cast<double>(results.rawBytes) / results.storedBytes << "x";
+        }
+        ss << ")";
+    }
+
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    for (const auto& depth : jobQueue_.depthByModel()) {
+        ss << "\nQueued for " << depth.first << ": " << depth.second;
+    }
+
+    // Per-tenant backlog and throughput since start
+    std::map<std::string, size_t> tenantDepth = jobQueue_.depthByTenant();
+    std::set<std::string> tenants;
+    for (const auto& depth : tenantDepth) tenants.insert(depth.first);
+    for (const auto& stats : tenantStats_) tenants.insert(stats.first);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime_).count();
+    for (const auto& tenant : tenants) {
+        auto depth = tenantDepth.find(tenant);
+        auto stats = tenantStats_.find(tenant);
+        TenantStats done = stats != tenantStats_.end() ? stats->second : TenantStats();
+        ss << "\nTenant " << tenant << ": " << (depth != tenantDepth.end() ? depth->second : 0)
+           << " queued, " << done.jobs << " done, " << done.tokens << " tokens ("
+           << std::fixed << std::setprecision(1) << (seconds > 0 ? done.tokens / seconds : 0.0) << " tok/s)";
+    }
+
+    if (prefetchDepth_ != 0) {
+        ss << "\nRead-ahead: " << prefetchHits_ << " hits, " << prefetchMisses_ << " misses, "
+           << prefetchedWaiting_ << " inputs waiting";
+    }
+    ss << "\nResults waiting to be written: " << writeBackQueue_.size();
+    if (retention_.enabled()) {
+        ss << "\nRetention (" << retention_.describe() << "): " << resultsKept_ << " results ("
+           << (bytesKept_ >> 10) << " KB) kept, " << resultsReaped_ << " (" << (bytesReaped_ >> 10)
+           << " KB) removed";
+    }
+    if (loopsStopped_ > 0) {
+        ss << "\nRepetition loops stopped: " << loopsStopped_ << " (" << loopTokensSaved_
+           << " tokens of generation budget saved)";
+    }
+    if (prefillWorkers_ > 0) {
+        // Handoff cost: KV state copied out by the prefill side and loaded by the decode side
+        auto average = [](uint64_t total, uint64_t count) {
+            return count > 0 ? static_cast<double>(total) / count : 0.0;
+        };
+        ss << "\nPrefill workers: " << prefillWorkers_ << ", decode workers: " << numWorkers_ << " ("
+           << handoffQueue_.size() << " handoffs waiting)"
+           << "\nHandoffs: " << handoffs_ << std::fixed << std::setprecision(1) << ", avg prefill "
+           << average(prefillMicros_, handoffs_) / 1000 << " ms, state "
+           << average(handoffBytes_, handoffs_) / 1024 << " KB, copy "
+           << average(handoffSaveMicros_, handoffs_) / 1000 << " ms, load "
+           << average(handoffLoadMicros_, handoffLoads_) / 1000 << " ms";
+    }
+    if (!workerExecutable_.empty()) {
+        ss << "\nWorker processes: " << numWorkers_ << " (" << workerCrashes_ << " crashes)";
+    }
+
+    if (mapReduce_ && std::filesystem::exists(mapReduceDirectory_)) {
+        std::error_code ec;
+        int splitJobs = 0;
+        for (std::filesystem::directory_iterator it(mapReduceDirectory_, ec), end; !ec && it != end; it.increment(ec)) {
+            splitJobs++;
+        }
+        ss << "\nSplit jobs in progress: " << splitJobs;
+    }
     return ss.str();
 }
 
@@ -85,83 +631,260 @@ int InferenceMonitor::getQueueSize() const {
     return jobQueue_.size();
 }
 
+bool InferenceMonitor::isReady() const {
+    return ready_;
+}
+
 void InferenceMonitor::processExistingFiles() {
     // Process any files that might be left in the processing directory
     // (in case of a previous unclean shutdown)
     try {
-        for (const auto& entry : std::filesystem::directory_iterator(processingDirectory_)) {
-            if (!entry.is_regular_file()) continue;
-
-            std::string filename = entry.path().filename().string();
-
+        std::vector<std::string> jobIds;
+        processingLayout_.forEachFile(processingDirectory_, [&jobIds](const std::filesystem::path& path) {
             // Only process .txt files
-            if (filename.size() < 4 || filename.substr(filename.size() - 4) != ".txt") {
-                continue;
+            if (path.extension() == ".txt") {
+                jobIds.push_back(path.stem().string());
             }
+        });
 
-            // Extract job ID from filename
-            std::string jobId = filename.substr(0, filename.size() - 4);
+        for (const auto& jobId : jobIds) {
+            // A split job waits for its map and reduce jobs, which are recovered on their own
+            if (std::filesystem::exists(std::filesystem::path(mapReduceDirectory_) / jobId / "manifest")) {
+                continue;
+            }
 
-            // Add to queue
+            // Skip jobs this process already holds and those leased by another live node
             {
-                std::lock_guard<std::mutex> lock(queueMutex_);
-                jobQueue_.push(jobId);
+                std::lock_guard<std::mutex> lock(leaseMutex_);
+                if (heldJobs_.count(jobId)) continue;
+            }
+            if (!claimLease(jobId)) {
+                continue;
             }
 
-            // Notify one worker
-            jobCondition_.notify_one();
+            enqueueJob(jobId);
 
             std::cout << "Recovered job from processing directory: " << jobId << std::endl;
         }
+
+        // A crash between the last map job and its reduce job leaves the reduce unqueued
+        if (std::filesystem::exists(mapReduceDirectory_)) {
+            for (const auto& entry : std::filesystem::directory_iterator(mapReduceDirectory_)) {
+                if (entry.is_directory()) {
+                    startReduceIfComplete(entry.path().filename().string());
+                }
+            }
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error processing existing files: " << e.what() << std::endl;
     }
 }
 
+void InferenceMonitor::enqueueJob(const std::string& jobId) {
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(jobId), jobId), metadata);
+
+    std::error_code ec;
+    uintmax_t inputBytes = std::filesystem::file_size(processingShard(jobId) / (jobId + ".txt"), ec);
+    QueuedJob job{jobId, resolveModel(jobId, metadata), metadata.embedding,
+                  metadata.tenant.empty() ? DEFAULT_TENANT : metadata.tenant,
+                  estimateCost(ec ? 0 : inputBytes, metadata), nullptr, nullptr};
+    if (prefetchDepth_ != 0 && !metadata.embedding) {
+        job.prepared = std::make_shared<PreparedInput>();
+    }
+
+    // Add to queue
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        jobQueue_.push(job);
+        if (job.prepared) {
+            prefetchBacklog_.push_back({job.id, job.model, job.prepared});
+        }
+    }
+
+    // Notify all workers: the one attached to this job's model should pick it up
+    jobCondition_.notify_all();
+    if (job.prepared) {
+        prefetchCondition_.notify_one();
+    }
+}
+
+int InferenceMonitor::estimateCost(uintmax_t inputBytes, const JobMetadata& metadata) const {
+    // About four bytes per token; the real count is settled in accountJob
+    int64_t tokens = static_cast<int64_t>(inputBytes / 4);
+    if (!metadata.embedding) {
+        tokens += metadata.generation.maxTokens > 0 ? metadata.generation.maxTokens : ESTIMATED_GENERATION_TOKENS;
+    }
+    return static_cast<int>(std::clamp<int64_t>(tokens, 1, std::numeric_limits<int>::max()));
+}
+
+void InferenceMonitor::accountJob(const QueuedJob& job, size_t tokens) {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    jobQueue_.charge(job.model, job.tenant, static_cast<int>(tokens) - job.cost);
+    TenantStats& stats = tenantStats_[job.tenant];
+    stats.jobs++;
+    stats.tokens += tokens;
+}
+
+bool InferenceMonitor::generate(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                                const std::string& input, const GenerationParams& params,
+                                const std::filesystem::path& checkpointPath, const TokenizedInput* tokenized,
+                                const StreamCallback& onText, const RunningJob& running,
+                                std::string& output, RunStatus& status, const PrefilledState* prefilled) {
+    if (!running.process) {
+        runner.setStreamCallback(onText);
+        bool success = runner.run(input, output, params, checkpointPath, tokenized, prefilled);
+        runner.setStreamCallback(nullptr);
+        status = RunStatus::of(runner, success);
+        return success;
+    }
+
+    // Same model file and settings as the worker's runner; the child maps the file itself
+    WorkerRequest request;
+    request.modelPath = models_.modelPath(job.model);
+    request.options = models_.modelOptions(job.model);
+    request.input = input;
+    request.params = params;
+    request.checkpointPath = checkpointPath;
+    if (tokenized) {
+        request.tokens = tokenized->tokens;
+    }
+
+    bool success = running.process->run(request, output, status, onText, &running.cancelled);
+    if (status.crashed) {
+        workerCrashes_++;
+        std::cerr << "Worker " << workerId << " lost job " << job.id << ": " << status.error << std::endl;
+    }
+    return success;
+}
+
+void InferenceMonitor::runInProcess(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                                    const RunningJob& running) {
+    TraceSpan span("job");
+    const InProcessJob& request = *job.inProcess;
+
+    SubmitResult result;
+    result.id = job.id;
+    RunStatus status;
+    result.success = generate(workerId, runner, job, request.input, request.metadata.generation, {},
+                              nullptr, request.onText, running, result.output, status);
+
+    if (result.success) {
+        accountJob(job, status.tokenCount);
+    } else if (status.cancelled) {
+        accountJob(job, status.tokenCount);
+        result.error = "Cancelled";
+        if (!running.keepPartial) {
+            result.output.clear();
+        }
+    } else {
+        result.error = status.error;
+    }
+    completeInProcess(job, std::move(result));
+}
+
+void InferenceMonitor::completeInProcess(const QueuedJob& job, SubmitResult result) {
+    if (!job.inProcess->onComplete) return;
+    try {
+        job.inProcess->onComplete(result);
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: Completion callback of job " << job.id << " threw: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Warning: Completion callback of job " << job.id << " threw" << std::endl;
+    }
+}
+
+std::string InferenceMonitor::resolveModel(const std::string& jobId, const JobMetadata& metadata) const {
+    // The input is only read when it decides the route
+    std::string input;
+    if (metadata.model.empty() && !routes_.empty() && !metadata.embedding) {
+        input = readFile(processingShard(jobId) / (jobId + ".txt"));
+    }
+    return resolveModelForInput(input, metadata);
+}
+
+std::string InferenceMonitor::resolveModelForInput(const std::string& input, const JobMetadata& metadata) const {
+    // An explicit model name wins
+    if (!metadata.model.empty()) {
+        return metadata.model;
+    }
+
+    // Otherwise route generation jobs by prompt category if any routes are configured
+    if (!routes_.empty() && !metadata.embedding) {
+        const auto& templates = promptTemplates_->templates();
+        auto route = routes_.find(templates[promptTemplates_->select(input)].name);
+        if (route != routes_.end()) {
+            return route->second;
+        }
+    }
+
+    return DEFAULT_MODEL;
+}
+
 void InferenceMonitor::monitorDirectory() {
     std::cout << "Directory monitor started" << std::endl;
+    Tracer::setThreadName("monitor");
+
+    // Other nodes' expired leases are looked for a few times per lease period
+    const auto reclaimInterval = leases_.duration() / 2;
+    auto lastReclaim = std::chrono::steady_clock::now();
 
     // Monitor for new files
     while (running_) {
-        try {
-            // Scan for new files in input directory
-            for (const auto& entry : std::filesystem::directory_iterator(inputDirectory_)) {
-                if (!entry.is_regular_file()) continue;
-
-                std::string filename = entry.path().filename().string();
-
-                // Skip counter file
-                if (filename == ".counter") continue;
+        if (std::chrono::steady_clock::now() - lastReclaim >= reclaimInterval) {
+            processExistingFiles();
+            lastReclaim = std::chrono::steady_clock::now();
+        }
 
-                // Only process .txt files
-                if (filename.size() < 4 || filename.substr(filename.size() - 4) != ".txt") {
-                    continue;
+        try {
+            // Scan for new files in input directory (every shard of a sharded layout)
+            std::vector<std::filesystem::path> newJobs;
+            TraceSpan scanSpan("scan");
+            inputLayout_.forEachFile(inputDirectory_, [&newJobs](const std::filesystem::path& path) {
+                // Only process .txt files (the counter file and .tmp files are skipped)
+                if (path.extension() == ".txt") {
+                    newJobs.push_back(path);
                 }
+            });
+
+            for (const auto& inputPath : newJobs) {
+                std::string filename = inputPath.filename().string();
 
                 // Extract job ID from filename
-                std::string jobId = filename.substr(0, filename.size() - 4);
+                std::string jobId = inputPath.stem().string();
 
                 // Move file from input to processing directory
-                std::filesystem::path inputPath = std::filesystem::path(inputDirectory_) / filename;
-                std::filesystem::path processingPath = std::filesystem::path(processingDirectory_) / filename;
+                std::filesystem::path processingPath = processingShard(jobId) / filename;
 
                 try {
+                    Tracer::setThreadJob(jobId);
+                    TraceSpan claimSpan("claim");
+                    std::filesystem::create_directories(processingPath.parent_path());
+
+                    // The lease decides which node gets the job; the rename then moves it
+                    if (!claimLease(jobId)) {
+                        continue;
+                    }
                     std::filesystem::rename(inputPath, processingPath);
                     std::cout << "Detected new job: " << jobId << " (moved to processing)" << std::endl;
 
-                    // Add to queue
-                    {
-                        std::lock_guard<std::mutex> lock(queueMutex_);
-                        jobQueue_.push(jobId);
+                    // Metadata sidecar (written before the job file) follows the job
+                    std::filesystem::path metaPath = metadataPath(inputPath.parent_path(), jobId);
+                    if (std::filesystem::exists(metaPath)) {
+                        std::filesystem::rename(metaPath, metadataPath(processingShard(jobId), jobId));
                     }
 
-                    // Notify one worker
-                    jobCondition_.notify_one();
+                    enqueueJob(jobId);
 
                 } catch (const std::filesystem::filesystem_error& e) {
+                    // Most likely another node claimed and finished it first
                     std::cerr << "Failed to move file " << filename << ": " << e.what() << std::endl;
+                    releaseLease(jobId);
                 }
             }
+            Tracer::setThreadJob("");
+
+            processCancelRequests();
         } catch (const std::exception& e) {
             std::cerr << "Error scanning directory: " << e.what() << std::endl;
         }
@@ -175,112 +898,1081 @@ void InferenceMonitor::monitorDirectory() {
 
 void InferenceMonitor::workerFunction(int workerId) {
     std::cout << "Worker " << workerId << " started" << std::endl;
+    Tracer::setThreadName("worker " + std::to_string(workerId));
 
-    // Initialize inference runner for this worker
+    // Initialize inference runner for this worker on the shared default model
     InferenceRunner runner;
+    runner.setInterruptFlag(&stopping_);
+    runner.setPromptTemplates(promptTemplates_);
+    std::string currentModel = DEFAULT_MODEL;
+    int affinityStreak = 0;
+
+    // An isolated worker's child does the warm-up: its contexts are the ones that run jobs
+    WorkerProcess* process = workerProcesses_.empty() ? nullptr : workerProcesses_[workerId].get();
+    std::string error;
+    bool initialized = runner.init(models_.acquire(currentModel, error), models_.modelOptions(currentModel));
+    if (initialized && process) {
+        initialized = process->start(models_.modelPath(currentModel), models_.modelOptions(currentModel), error);
+    } else if (initialized) {
+        initialized = runner.warmup();
+    }
+    {
+        std::lock_guard<std::mutex> lock(startupMutex_);
+        if (initialized) {
+            workersWarm_++;
+        } else {
+            workersFailed_++;
+        }
+    }
+    startupCondition_.notify_all();
 
-    if (!runner.init(modelPath_)) {
-        std::cerr << "Worker " << workerId << " failed to initialize model" << std::endl;
+    if (!initialized) {
+        std::cerr << "Worker " << workerId << " failed to initialize: "
+                  << (error.empty() ? runner.getLastError() : error) << std::endl;
         return;
     }
 
-    std::cout << "Worker " << workerId << " initialized" << std::endl;
+    std::cout << "Worker " << workerId << " initialized and warmed up"
+              << (process ? " (isolated process)" : "") << std::endl;
+    if (!process && runnerOptions_.hugePages != HugePageMode::Off) {
+        std::cout << "Worker " << workerId << " context buffers: "
+                  << describeHugePageUsage(runner.contextHugePages()) << std::endl;
+    }
+
+    // Generation jobs are tracked while they run so cancel() can abort them
+    auto untrack = [this, &runner](const std::string& jobId) {
+        runner.setCancelFlag(nullptr);
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        runningJobs_.erase(jobId);
+    };
 
     while (running_) {
-        std::string jobId;
+        QueuedJob job;
+        std::vector<QueuedJob> embeddingBatch;
+        std::shared_ptr<RunningJob> running;
+        bool prefilled = false;
+        PrefilledState prefilledState;
 
-        // Get a job from the queue
+        // Get a job from the queue, preferring the model this worker already has attached
         {
+            Tracer::setThreadJob("");
+            TraceSpan waitSpan("queue_wait");
             std::unique_lock<std::mutex> lock(queueMutex_);
 
-            // Wait for a job or stop signal
-            jobCondition_.wait(lock, [this] {
-                return !running_ || !jobQueue_.empty();
-            });
-
-            // Check if we should exit
-            if (!running_ && jobQueue_.empty()) {
-                break;
+            if (prefillWorkers_ > 0) {
+                // Decode worker: every job comes through the prefill workers, in handoff order
+                handoffCondition_.wait(lock, [this] {
+                    return !running_ || !handoffQueue_.empty();
+                });
+                if (!running_) {
+                    break;
+                }
+                Handoff handoff = std::move(handoffQueue_.front());
+                handoffQueue_.pop_front();
+                jobCondition_.notify_all();   // Room for another handoff
+                job = std::move(handoff.job);
+                running = std::move(handoff.running);
+                prefilled = handoff.prefilled;
+                prefilledState = std::move(handoff.state);
+            } else {
+                // Wait for a job or stop signal
+                jobCondition_.wait(lock, [this] {
+                    return !running_ || !jobQueue_.empty();
+                });
+
+                // Check if we should exit
+                if (!running_ && jobQueue_.empty()) {
+                    break;
+                }
+                jobQueue_.pop(currentModel, affinityStreak, job);
             }
 
-            // Get the next job
-            if (!jobQueue_.empty()) {
-                jobId = jobQueue_.front();
-                jobQueue_.pop();
+            // An embedding job brings the model's other waiting ones along
+            if (job.embedding) {
+                embeddingBatch.push_back(job);
+                jobQueue_.popEmbeddings(job.model, embeddingBatchSize_ - 1, embeddingBatch);
+            } else if (!job.id.empty()) {
+                if (!running) {
+                    running = std::make_shared<RunningJob>();
+                }
+                running->process = process;
+                runningJobs_[job.id] = running;
             }
+            Tracer::setThreadJob(job.id);
         }
 
         // Process the job if we got one
-        if (!jobId.empty()) {
-            // File should be in processing directory
-            std::filesystem::path processingPath = std::filesystem::path(processingDirectory_) / (jobId + ".txt");
-            std::filesystem::path outputPath = std::filesystem::path(outputDirectory_) / (jobId + ".txt");
-
-            std::cout << "Worker " << workerId << " processing job " << jobId << std::endl;
-
-            if (processFile(jobId, processingPath, outputPath)) {
-                std::cout << "Worker " << workerId << " completed job " << jobId << std::endl;
+        if (!job.id.empty()) {
+            const std::string& jobId = job.id;
+
+            // Switch this worker's runner to the job's model, loading it if it's cold
+            bool modelReady = true;
+            if (job.model != currentModel) {
+                TraceSpan span("model_init");
+                if (runner.init(models_.acquire(job.model, error), models_.modelOptions(job.model))) {
+                    currentModel = job.model;
+                } else {
+                    std::cerr << "Worker " << workerId << " cannot load model " << job.model
+                              << ": " << error << std::endl;
+                    modelReady = false;
+                }
+            }
 
-                // Remove the file from processing directory after successful processing
-                try {
-                    std::filesystem::remove(processingPath);
-                    std::cout << "Cleaned up processing file for job " << jobId << std::endl;
-                } catch (const std::filesystem::filesystem_error& e) {
-                    std::cerr << "Warning: Failed to clean up processing file for job " << jobId << ": " << e.what() << std::endl;
+            if (!embeddingBatch.empty()) {
+                std::cout << "Worker " << workerId << " embedding " << embeddingBatch.size()
+                          << " job(s) on model " << job.model << std::endl;
+
+                if (modelReady) {
+                    processEmbeddingBatch(workerId, runner, embeddingBatch);
+                } else {
+                    for (const auto& failed : embeddingBatch) {
+                        updateJobStatus(failed.id, "failed", "Model unavailable: " + job.model);
+                        if (failed.inProcess) {
+                            completeInProcess(failed, SubmitResult{failed.id, false, "", {}, "Model unavailable: " + job.model});
+                        } else {
+                            failJob(workerId, failed.id);
+                        }
+                    }
                 }
-            } else {
-                std::cerr << "Worker " << workerId << " failed to process job " << jobId << std::endl;
+                continue;
+            }
 
-                // On failure, you might want to move the file back to input directory
-                // or to a failed directory for manual inspection
-                std::filesystem::path failedPath = std::filesystem::path(inputDirectory_ + "_failed") / (jobId + ".txt");
+            runner.setCancelFlag(&running->cancelled);
 
-                try {
-                    std::filesystem::create_directories(inputDirectory_ + "_failed");
-                    std::filesystem::rename(processingPath, failedPath);
-                    std::cout << "Moved failed job " << jobId << " to failed directory" << std::endl;
-                } catch (const std::filesystem::filesystem_error& e) {
-                    std::cerr << "Warning: Failed to move failed job " << jobId << ": " << e.what() << std::endl;
+            if (job.inProcess) {
+                if (modelReady) {
+                    runInProcess(workerId, runner, job, *running);
+                } else {
+                    completeInProcess(job, SubmitResult{jobId, false, "", {}, "Model unavailable: " + job.model});
                 }
+                untrack(jobId);
+                continue;
             }
-        }
-    }
+
+            std::cout << "Worker " << workerId << (prefilled ? " decoding job " : " processing job ") << jobId
+                      << " on model " << job.model << std::endl;
+
+            // Usually already read by the prefetch stage
+            const PreparedInput& prepared = acquireInput(job);
+            RunStatus status;
+
+            if (!modelReady) {
+                updateJobStatus(jobId, "failed", "Model unavailable: " + job.model);
+                failJob(workerId, jobId);
+            } else if (!prepared.found) {
+                std::cerr << "Processing file not found for job " << jobId << std::endl;
+                failJob(workerId, jobId);
+            } else if (processFile(workerId, runner, job, prepared, *running, status, &prefilledState)) {
+                // The write-back stage writes the result and cleans up
+                std::cout << "Worker " << workerId << " completed job " << jobId << std::endl;
+                accountJob(job, status.tokenCount);
+            } else if (status.cancelled) {
+                // processFile kept or discarded the partial output; the worker is free now
+                std::cout << "Worker " << workerId << " cancelled job " << jobId << std::endl;
+                accountJob(job, status.tokenCount);
+            } else if (status.interrupted) {
+                // Leave the job in processing; recovery re-queues it and the checkpoint resumes it
+                std::cout << "Worker " << workerId << " interrupted job " << jobId
+                          << " (will resume on restart)" << std::endl;
+                releaseLease(jobId);
+            } else if (mapReduce_ && status.inputTooLarge && splitJob(runner, job)) {
+                // The parent now waits on its map jobs, which hold their own leases
+                std::cout << "Worker " << workerId << " split oversize job " << jobId << std::endl;
+                releaseLease(jobId);
+            } else {
+                failJob(workerId, jobId);
+            }
+
+            // Decode side of the handoff cost (an isolated worker's child doesn't report it)
+            if (prefilled && !process && modelReady && prepared.found && runner.lastTransfer().loadMs > 0) {
+                handoffLoads_++;
+                handoffLoadMicros_ += static_cast<uint64_t>(runner.lastTransfer().loadMs * 1000);
+            }
+            untrack(jobId);
+        }
+    }
 
     std::cout << "Worker " << workerId << " shutting down" << std::endl;
 }
 
-bool InferenceMonitor::processFile(const std::string& jobId,
-                                 const std::filesystem::path& inputPath,
-                                 const std::filesystem::path& outputPath) {
-    if (!std::filesystem::exists(inputPath)) {
-        std::cerr << "Processing file not found: " << inputPath << std::endl;
+void InferenceMonitor::prefillFunction(int workerId) {
+    std::cout << "Prefill worker " << workerId << " started" << std::endl;
+    Tracer::setThreadName("prefill " + std::to_string(workerId));
+
+    // Prefill always runs on this thread's runner, isolation or not
+    InferenceRunner runner;
+    runner.setInterruptFlag(&stopping_);
+    runner.setPromptTemplates(promptTemplates_);
+    std::string currentModel = DEFAULT_MODEL;
+    int affinityStreak = 0;
+
+    std::string error;
+    bool initialized = runner.init(models_.acquire(currentModel, error), models_.modelOptions(currentModel)) &&
+                       runner.warmup();
+    {
+        std::lock_guard<std::mutex> lock(startupMutex_);
+        if (initialized) {
+            workersWarm_++;
+        } else {
+            workersFailed_++;
+        }
+    }
+    startupCondition_.notify_all();
+
+    if (!initialized) {
+        std::cerr << "Prefill worker " << workerId << " failed to initialize: "
+                  << (error.empty() ? runner.getLastError() : error) << std::endl;
+        return;
+    }
+    std::cout << "Prefill worker " << workerId << " initialized and warmed up" << std::endl;
+
+    while (running_) {
+        Handoff handoff;
+        {
+            Tracer::setThreadJob("");
+            TraceSpan waitSpan("queue_wait");
+            std::unique_lock<std::mutex> lock(queueMutex_);
+
+            // Stay at most HANDOFFS_PER_DECODE_WORKER jobs per decode worker ahead of them
+            jobCondition_.wait(lock, [this] {
+                return !running_ || (!jobQueue_.empty() &&
+                                     handoffQueue_.size() < static_cast<size_t>(numWorkers_ * HANDOFFS_PER_DECODE_WORKER));
+            });
+            if (!running_) {
+                break;
+            }
+            if (!jobQueue_.pop(currentModel, affinityStreak, handoff.job)) {
+                continue;
+            }
+
+            // Generation jobs are cancellable from here on; only file jobs get a prefill
+            if (!handoff.job.embedding) {
+                handoff.running = std::make_shared<RunningJob>();
+                runningJobs_[handoff.job.id] = handoff.running;
+            }
+            Tracer::setThreadJob(handoff.job.id);
+        }
+
+        if (handoff.running && !handoff.job.inProcess) {
+            handoff.prefilled = prefillJob(workerId, runner, currentModel, handoff);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            handoffQueue_.push_back(std::move(handoff));
+        }
+        handoffCondition_.notify_one();
+    }
+
+    std::cout << "Prefill worker " << workerId << " shutting down" << std::endl;
+}
+
+bool InferenceMonitor::prefillJob(int workerId, InferenceRunner& runner, std::string& currentModel,
+                                  Handoff& handoff) {
+    QueuedJob& job = handoff.job;
+    TraceSpan span("job_prefill");
+
+    std::string error;
+    if (job.model != currentModel) {
+        TraceSpan modelSpan("model_init");
+        if (!runner.init(models_.acquire(job.model, error), models_.modelOptions(job.model))) {
+            return false;
+        }
+        currentModel = job.model;
+    }
+
+    // A job interrupted by an earlier shutdown already has a checkpoint further along
+    std::filesystem::path checkpointPath = std::filesystem::path(checkpointDirectory_) / (job.id + ".ckpt");
+    const PreparedInput& prepared = acquireInput(job);
+    if (!prepared.found || std::filesystem::exists(checkpointPath)) {
         return false;
     }
 
-    // Update status
-    updateJobStatus(jobId, "running", "Processing...");
+    // The state stays in memory for the decode workers in this process; an isolated
+    // worker's child can only resume it from the checkpoint file
+    const bool toFile = !workerProcesses_.empty();
+    const TokenizedInput* tokenized = prepared.tokenized.model ? &prepared.tokenized : nullptr;
+    const auto begin = std::chrono::steady_clock::now();
+    runner.setCancelFlag(&handoff.running->cancelled);
+    bool success = toFile ? runner.prefill(prepared.input, prepared.metadata.generation, checkpointPath, tokenized)
+                          : runner.prefill(prepared.input, prepared.metadata.generation, handoff.state, tokenized);
+    runner.setCancelFlag(nullptr);
+    if (!success) {
+        return false;
+    }
 
-    InferenceRunner runner;
+    // Prompt evaluation and the state save, timed separately
+    const StateTransfer& transfer = runner.lastTransfer();
+    const double prefillMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() -
+                             transfer.saveMs;
+    handoffs_++;
+    handoffBytes_ += transfer.bytes;
+    prefillMicros_ += static_cast<uint64_t>(prefillMs * 1000);
+    handoffSaveMicros_ += static_cast<uint64_t>(transfer.saveMs * 1000);
+    // Formatted apart from std::cout, whose flags every thread shares
+    std::ostringstream line;
+    line << "Prefill worker " << workerId << " handed off job " << job.id << " ("
+         << runner.lastTokenCount() << " prompt tokens in " << std::fixed << std::setprecision(1)
+         << prefillMs << " ms; " << (transfer.bytes >> 10) << " KB state " << (toFile ? "saved" : "copied")
+         << " in " << transfer.saveMs << " ms)";
+    std::cout << line.str() << std::endl;
+    return true;
+}
 
-    // Initialize model for this job
-    if (!runner.init(modelPath_)) {
-        std::cerr << "Failed to initialize model for job " << jobId << std::endl;
-        updateJobStatus(jobId, "failed", "Failed to initialize model");
+void InferenceMonitor::completeJob(const std::string& jobId) {
+    if (forgetLostJob(jobId)) {
+        return;
+    }
+
+    // Remove the file from processing directory after successful processing
+    try {
+        std::filesystem::remove(processingShard(jobId) / (jobId + ".txt"));
+        std::filesystem::remove(metadataPath(processingShard(jobId), jobId));
+        std::cout << "Cleaned up processing file for job " << jobId << std::endl;
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "Warning: Failed to clean up processing file for job " << jobId << ": " << e.what() << std::endl;
+    }
+    releaseLease(jobId);
+}
+
+bool InferenceMonitor::claimLease(const std::string& jobId) {
+    std::error_code ec;
+    std::filesystem::create_directories(processingShard(jobId), ec);
+    if (!leases_.acquire(leasePath(jobId))) {
         return false;
     }
 
-    // Process the file
-    bool success = runner.runOnFile(inputPath, outputPath);
+    std::lock_guard<std::mutex> lock(leaseMutex_);
+    heldJobs_.insert(jobId);
+    lostJobs_.erase(jobId);
+    return true;
+}
+
+void InferenceMonitor::releaseLease(const std::string& jobId) {
+    {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        heldJobs_.erase(jobId);
+        lostJobs_.erase(jobId);
+    }
+    leases_.release(leasePath(jobId));
+}
+
+void InferenceMonitor::abandonJob(const std::string& jobId) {
+    QueuedJob job;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (!jobQueue_.remove(jobId, job)) {
+            // A running job ends as cancelled; one being written out is dropped unwritten
+            auto running = runningJobs_.find(jobId);
+            if (running != runningJobs_.end()) {
+                running->second->keepPartial = false;
+                running->second->cancelled = true;
+                if (running->second->process) {
+                    running->second->process->cancel();
+                }
+            }
+            return;
+        }
+    }
+
+    if (job.prepared) {
+        releaseInput(*job.prepared);
+    }
+    forgetLostJob(jobId);
+}
+
+bool InferenceMonitor::forgetLostJob(const std::string& jobId) {
+    {
+        std::lock_guard<std::mutex> lock(leaseMutex_);
+        if (lostJobs_.erase(jobId) == 0) {
+            return false;
+        }
+    }
+    std::cerr << "Left job " << jobId << " to the node that took it over" << std::endl;
+    return true;
+}
+
+std::filesystem::path InferenceMonitor::leasePath(const std::string& jobId) const {
+    return processingShard(jobId) / (jobId + ".lease");
+}
+
+void InferenceMonitor::enforceRetentionLoop() {
+    std::unique_lock<std::mutex> lock(reaperMutex_);
+    while (running_) {
+        // Swept without the lock: a large directory can take a while and stop() only waits
+        // for the current sweep
+        lock.unlock();
+        RetentionSweep sweep = enforceRetention(outputDirectory_, retention_);
+        lock.lock();
+
+        resultsReaped_ += sweep.removed;
+        bytesReaped_ += sweep.removedBytes;
+        resultsKept_ = sweep.kept;
+        bytesKept_ = sweep.keptBytes;
+        if (sweep.removed > 0) {
+            std::cout << "Retention removed " << sweep.removed << " result(s), "
+                      << (sweep.removedBytes >> 10) << " KB" << std::endl;
+        }
+        if (sweep.abandoned > 0) {
+            std::cerr << "Warning: Removed " << sweep.abandoned << " result(s) left half-consumed by a popper"
+                      << std::endl;
+        }
+        if (sweep.orphaned > 0) {
+            std::cout << "Retention removed " << sweep.orphaned << " sidecar file(s) without a result" << std::endl;
+        }
+
+        reaperCondition_.wait_for(lock, RETENTION_INTERVAL, [this] { return !running_; });
+    }
+}
+
+void InferenceMonitor::heartbeat() {
+    // Renew well before expiry so one slow round (e.g. a stalled NFS server) is survivable
+    const auto interval = leases_.duration() / 3;
+
+    std::unique_lock<std::mutex> lock(leaseMutex_);
+    while (running_) {
+        heartbeatCondition_.wait_for(lock, interval, [this] { return !running_; });
+        if (!running_) break;
+
+        // Renewed under the lock so a lease released meanwhile is never rewritten. A renewal
+        // that fails is retried next round: the lease is only lost once another node has it.
+        std::vector<std::string> lost;
+        for (auto it = heldJobs_.begin(); it != heldJobs_.end();) {
+            LeaseManager::RenewResult result = leases_.renew(leasePath(*it));
+            if (result == LeaseManager::RenewResult::Lost) {
+                std::cerr << "Warning: Lost lease on job " << *it << std::endl;
+                lostJobs_.insert(*it);
+                lost.push_back(*it);
+                it = heldJobs_.erase(it);
+                continue;
+            }
+            if (result == LeaseManager::RenewResult::Failed) {
+                std::cerr << "Warning: Failed to renew lease on job " << *it << ", retrying" << std::endl;
+            }
+            ++it;
+        }
+
+        lock.unlock();
+        for (const auto& jobId : lost) {
+            abandonJob(jobId);
+        }
+        lock.lock();
+    }
+}
+
+void InferenceMonitor::failJob(int workerId, const std::string& jobId) {
+    if (forgetLostJob(jobId)) {
+        return;
+    }
+
+    if (workerId < 0) {
+        std::cerr << "Failed to write the result of job " << jobId << std::endl;
+    } else {
+        std::cerr << "Worker " << workerId << " failed to process job " << jobId << std::endl;
+    }
+
+    // A failed map or reduce job fails the job that was split; its remaining map
+    // jobs still run but find no manifest and are discarded
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(jobId), jobId), metadata);
+
+    // On failure, you might want to move the file back to input directory
+    // or to a failed directory for manual inspection
+    std::filesystem::path processingPath = processingShard(jobId) / (jobId + ".txt");
+    std::filesystem::path metaPath = metadataPath(processingShard(jobId), jobId);
+    std::filesystem::path failedPath = std::filesystem::path(inputDirectory_ + "_failed") / (jobId + ".txt");
+
+    try {
+        std::filesystem::create_directories(inputDirectory_ + "_failed");
+        std::filesystem::rename(processingPath, failedPath);
+        if (std::filesystem::exists(metaPath)) {
+            std::filesystem::rename(metaPath, metadataPath(inputDirectory_ + "_failed", jobId));
+        }
+        std::cout << "Moved failed job " << jobId << " to failed directory" << std::endl;
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "Warning: Failed to move failed job " << jobId << ": " << e.what() << std::endl;
+    }
+
+    if (metadata.role != JobRole::Normal && !metadata.parent.empty()) {
+        std::error_code ec;
+        {
+            std::lock_guard<std::mutex> lock(mapReduceMutex_);
+            std::filesystem::remove_all(std::filesystem::path(mapReduceDirectory_) / metadata.parent, ec);
+        }
+        if (std::filesystem::exists(processingShard(metadata.parent) / (metadata.parent + ".txt"))) {
+            failJob(workerId, metadata.parent);
+        }
+    }
+
+    // Held until the job has left processing, so no other node re-runs it meanwhile
+    releaseLease(jobId);
+}
+
+void InferenceMonitor::finishJob(const std::string& jobId) {
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(jobId), jobId), metadata);
+    completeJob(jobId);
+
+    if (metadata.role == JobRole::Map) {
+        startReduceIfComplete(metadata.parent);
+    } else if (metadata.role == JobRole::Reduce) {
+        // The reduce output already went to the parent's result path
+        std::error_code ec;
+        {
+            std::lock_guard<std::mutex> lock(mapReduceMutex_);
+            std::filesystem::remove_all(std::filesystem::path(mapReduceDirectory_) / metadata.parent, ec);
+        }
+        updateJobStatus(metadata.parent, "completed", "Reduced from split parts");
+        finishJob(metadata.parent);
+    }
+}
+
+std::filesystem::path InferenceMonitor::resultPath(const std::string& jobId,
+                                                   const JobMetadata& metadata) const {
+    if (metadata.role == JobRole::Map) {
+        return std::filesystem::path(mapReduceDirectory_) / metadata.parent /
+               ("part_" + partSuffix(metadata.part) + ".txt");
+    }
+    if (metadata.role == JobRole::Reduce) {
+        // A reduce job's result is its parent's result (which may itself be a reduce job)
+        JobMetadata parentMetadata;
+        readJobMetadata(metadataPath(processingShard(metadata.parent), metadata.parent), parentMetadata);
+        return resultPath(metadata.parent, parentMetadata);
+    }
+    std::string filename = jobId + ".txt";
+    if (compressResults_) {
+        filename += COMPRESSED_RESULT_EXTENSION;
+    }
+    return outputLayout_.shardDirectory(outputDirectory_, jobId) / filename;
+}
+
+std::filesystem::path InferenceMonitor::processingShard(const std::string& jobId) const {
+    return processingLayout_.shardDirectory(processingDirectory_, jobId);
+}
+
+bool InferenceMonitor::splitJob(InferenceRunner& runner, const QueuedJob& job) {
+    TraceSpan span("split");
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(job.id), job.id), metadata);
+
+    // Chunks are sized to fit, so a map job that doesn't is a genuine failure
+    if (metadata.role == JobRole::Map) {
+        return false;
+    }
+
+    // Map jobs keep the parent's settings but write shorter partial analyses
+    JobMetadata mapMetadata;
+    mapMetadata.model = job.model;
+    mapMetadata.tenant = metadata.tenant;
+    mapMetadata.generation = metadata.generation;
+    mapMetadata.generation.maxTokens = metadata.generation.maxTokens > 0 ?
+        std::min(metadata.generation.maxTokens, MAP_MAX_TOKENS) : MAP_MAX_TOKENS;
+    mapMetadata.role = JobRole::Map;
+    mapMetadata.parent = job.id;
+
+    std::vector<std::string> chunks;
+    std::string input = readFile(processingShard(job.id) / (job.id + ".txt"));
+    if (!runner.splitInput(input, mapMetadata.generation, chunks) || chunks.size() < 2) {
+        return false;
+    }
+
+    std::filesystem::path partsDir = std::filesystem::path(mapReduceDirectory_) / job.id;
+    std::vector<std::string> mapIds;
+    bool written = false;
+    try {
+        std::filesystem::create_directories(partsDir);
+
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            mapMetadata.part = static_cast<int>(i);
+            std::string mapId = job.id + "_m" + partSuffix(mapMetadata.part);
+
+            // Lease, then sidecar (as PushManager does), then the job file
+            if (!claimLease(mapId)) break;
+            mapIds.push_back(mapId);
+            std::ofstream file;
+            if (writeJobMetadata(metadataPath(processingShard(mapId), mapId), mapMetadata)) {
+                file.open(processingShard(mapId) / (mapId + ".txt"));
+                file << chunks[i];
+            }
+            if (!file) break;
+        }
+
+        // The manifest marks the parent as split; written last so recovery re-splits a partial split
+        if (mapIds.size() == chunks.size() && std::filesystem::exists(
+                processingShard(mapIds.back()) / (mapIds.back() + ".txt"))) {
+            std::ofstream manifest(partsDir / "manifest");
+            manifest << "parts=" << chunks.size() << "\n";
+            written = manifest.good();
+        }
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "Failed to split job " << job.id << ": " << e.what() << std::endl;
+    }
+
+    if (!written) {
+        // Don't leave orphaned map jobs for recovery to pick up
+        std::error_code ec;
+        for (const auto& mapId : mapIds) {
+            std::filesystem::remove(processingShard(mapId) / (mapId + ".txt"), ec);
+            std::filesystem::remove(metadataPath(processingShard(mapId), mapId), ec);
+            releaseLease(mapId);
+        }
+        std::filesystem::remove_all(partsDir, ec);
+        return false;
+    }
+
+    updateJobStatus(job.id, "split", std::to_string(chunks.size()) + " map jobs");
+    for (const auto& mapId : mapIds) {
+        enqueueJob(mapId);
+    }
+    return true;
+}
+
+bool InferenceMonitor::cancelSplitJob(const std::string& parentId) {
+    std::vector<std::string> children;
+    std::vector<QueuedJob> dequeued;
+    std::vector<std::string> idle;
+    {
+        // Held across the teardown so no reduce job is created meanwhile
+        std::lock_guard<std::mutex> lock(mapReduceMutex_);
+        std::filesystem::path partsDir = std::filesystem::path(mapReduceDirectory_) / parentId;
+        int parts = readManifest(partsDir / "manifest");
+        if (parts <= 0) {
+            return false;
+        }
+
+        // Without the manifest, map outputs still on their way are discarded
+        std::error_code ec;
+        std::filesystem::remove_all(partsDir, ec);
+
+        for (int i = 0; i < parts; ++i) {
+            children.push_back(parentId + "_m" + partSuffix(i));
+        }
+        children.push_back(parentId + "_reduce");
+
+        std::lock_guard<std::mutex> queueLock(queueMutex_);
+        for (const auto& childId : children) {
+            QueuedJob child;
+            auto running = runningJobs_.find(childId);
+            if (jobQueue_.remove(childId, child)) {
+                dequeued.push_back(child);
+            } else if (running != runningJobs_.end()) {
+                // Its worker discards the output and cleans up
+                running->second->cancelled = true;
+                if (running->second->process) {
+                    running->second->process->cancel();
+                }
+            } else {
+                idle.push_back(childId);
+            }
+        }
+    }
+
+    for (auto& child : dequeued) {
+        if (child.prepared) {
+            releaseInput(*child.prepared);
+        }
+        InferenceRunner::removeCheckpoint(std::filesystem::path(checkpointDirectory_) / (child.id + ".ckpt"));
+        completeJob(child.id);
+    }
+
+    // Left waiting for recovery, or held by another node: delete those no live node holds.
+    // Another node's run finds no manifest and discards its output.
+    for (const auto& childId : idle) {
+        {
+            std::lock_guard<std::mutex> lock(leaseMutex_);
+            if (heldJobs_.count(childId)) continue;   // Being written out here
+        }
+        if (std::filesystem::exists(processingShard(childId) / (childId + ".txt")) && claimLease(childId)) {
+            InferenceRunner::removeCheckpoint(std::filesystem::path(checkpointDirectory_) / (childId + ".ckpt"));
+            completeJob(childId);
+        }
+    }
+
+    std::cout << "Cancelled split job " << parentId << " and its map and reduce jobs" << std::endl;
+    updateJobStatus(parentId, "cancelled", "Split job withdrawn");
+    completeJob(parentId);
+    return true;
+}
+
+void InferenceMonitor::startReduceIfComplete(const std::string& parentId) {
+    std::lock_guard<std::mutex> lock(mapReduceMutex_);
+
+    std::filesystem::path partsDir = std::filesystem::path(mapReduceDirectory_) / parentId;
+    int parts = readManifest(partsDir / "manifest");
+    if (parts <= 0) {
+        // Parent failed or finished: outputs of straggling map jobs are discarded
+        std::error_code ec;
+        std::filesystem::remove_all(partsDir, ec);
+        return;
+    }
+
+    std::string reduceId = parentId + "_reduce";
+    if (std::filesystem::exists(processingShard(reduceId) / (reduceId + ".txt"))) {
+        return;
+    }
+
+    std::string combined;
+    for (int i = 0; i < parts; ++i) {
+        std::filesystem::path partPath = partsDir / ("part_" + partSuffix(i) + ".txt");
+        if (!std::filesystem::exists(partPath)) {
+            return;
+        }
+        combined += "Part " + std::to_string(i + 1) + " of " + std::to_string(parts) + ":\n";
+        combined += readFile(partPath) + "\n\n";
+    }
+
+    // The reduce job runs with the parent's settings and the combining template
+    JobMetadata parentMetadata;
+    readJobMetadata(metadataPath(processingShard(parentId), parentId), parentMetadata);
+
+    JobMetadata reduceMetadata;
+    reduceMetadata.model = parentMetadata.model.empty() ? resolveModel(parentId, parentMetadata) : parentMetadata.model;
+    reduceMetadata.tenant = parentMetadata.tenant;
+    reduceMetadata.generation = parentMetadata.generation;
+    reduceMetadata.generation.promptTemplate = "reduce";
+    reduceMetadata.role = JobRole::Reduce;
+    reduceMetadata.parent = parentId;
+
+    // With several nodes, the one whose map job finished last and wins the lease creates it
+    if (!claimLease(reduceId)) {
+        return;
+    }
+    if (!writeJobMetadata(metadataPath(processingShard(reduceId), reduceId), reduceMetadata)) {
+        std::cerr << "Failed to create reduce job for " << parentId << std::endl;
+        releaseLease(reduceId);
+        return;
+    }
+    std::ofstream file(processingShard(reduceId) / (reduceId + ".txt"));
+    file << combined;
+    file.close();
+
+    updateJobStatus(parentId, "reducing", std::to_string(parts) + " parts complete");
+    enqueueJob(reduceId);
+}
+
+void InferenceMonitor::processEmbeddingBatch(int workerId, InferenceRunner& runner,
+                                             const std::vector<QueuedJob>& jobs) {
+    const int64_t startedMs = epochMilliseconds();
+
+    // Read every input first so one multi-sequence pass covers the whole batch
+    std::vector<std::string> inputs;
+    std::vector<const QueuedJob*> batch;
+    for (const auto& job : jobs) {
+        if (job.inProcess) {
+            inputs.push_back(job.inProcess->input);
+            batch.push_back(&job);
+            continue;
+        }
+
+        std::ifstream file(processingShard(job.id) / (job.id + ".txt"));
+        if (!file) {
+            updateJobStatus(job.id, "failed", "Processing file not found");
+            failJob(workerId, job.id);
+            continue;
+        }
+        inputs.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        batch.push_back(&job);
+        updateJobStatus(job.id, "running", "Embedding...");
+    }
+
+    std::vector<std::vector<float>> embeddings;
+    if (!runner.embed(inputs, embeddings)) {
+        for (const QueuedJob* job : batch) {
+            if (job->inProcess) {
+                completeInProcess(*job, SubmitResult{job->id, false, "", {}, runner.getLastError()});
+                continue;
+            }
+            updateJobStatus(job->id, "failed", "Embedding failed: " + runner.getLastError());
+            failJob(workerId, job->id);
+        }
+        return;
+    }
+
+    // One raw float32 vector per job; the batch's token count isn't split per job,
+    // so the input estimate stands in for tenant accounting
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const QueuedJob& job = *batch[i];
+        if (job.inProcess) {
+            accountJob(job, job.cost);
+            completeInProcess(job, SubmitResult{job.id, true, "", std::move(embeddings[i]), ""});
+            continue;
+        }
+
+        if (forgetLostJob(job.id)) {
+            continue;
+        }
+
+        std::filesystem::path outputPath = outputLayout_.pathFor(outputDirectory_, job.id, ".emb");
+        std::filesystem::create_directories(outputPath.parent_path());
+        std::string vector(reinterpret_cast<const char*>(embeddings[i].data()),
+                           embeddings[i].size() * sizeof(float));
+        std::string error;
+
+        // The timing goes first: the result may be consumed the moment it exists
+        recordTiming(job.id, startedMs);
+        if (writeResultFile(outputPath, vector, error)) {
+            updateJobStatus(job.id, "completed", std::to_string(embeddings[i].size()) + "-dim embedding");
+            completeJob(job.id);
+            accountJob(job, job.cost);
+        } else {
+            discardSidecars(job.id);
+            updateJobStatus(job.id, "failed", error);
+            failJob(workerId, job.id);
+        }
+    }
+}
+
+bool InferenceMonitor::processFile(int workerId, InferenceRunner& runner, const QueuedJob& job,
+                                   const PreparedInput& prepared, const RunningJob& running,
+                                   RunStatus& status, const PrefilledState* prefilled) {
+    const std::string& jobId = job.id;
+    TraceSpan span("job");
+    const int64_t startedMs = epochMilliseconds();
+
+    // Update status
+    updateJobStatus(jobId, "running", "Processing...");
+
+    // Run on the prefetched input (and its tokens, if the prefetch stage had the model),
+    // checkpointing if shutdown interrupts it
+    std::filesystem::path checkpointPath = std::filesystem::path(checkpointDirectory_) / (jobId + ".ckpt");
+    std::string output;
+    bool success = generate(workerId, runner, job, prepared.input, prepared.metadata.generation,
+                            checkpointPath, prepared.tokenized.model ? &prepared.tokenized : nullptr,
+                            nullptr, running, output, status, prefilled);
 
     if (success) {
-        updateJobStatus(jobId, "completed", "Processing completed");
+        // The worker moves on while the write-back stage persists the result
+        WriteBack item{job, prepared.metadata, std::move(output), startedMs};
+        item.job.prepared.reset();
+        recordLoop(status.loop, item.metadata);
+        if (!writeBackQueue_.push(item)) {
+            persistResult(item);
+        }
+    } else if (status.cancelled && running.keepPartial) {
+        // The text so far becomes the result, written like any other
+        WriteBack item{job, prepared.metadata, std::move(output), startedMs, true};
+        item.job.prepared.reset();
+        if (!writeBackQueue_.push(item)) {
+            persistResult(item);
+        }
+    } else if (status.cancelled) {
+        updateJobStatus(jobId, "cancelled", "Partial output discarded");
+        completeJob(jobId);
+    } else if (status.interrupted) {
+        updateJobStatus(jobId, "interrupted", "Checkpointed for resume");
+    } else if (status.inputTooLarge && mapReduce_) {
+        updateJobStatus(jobId, "oversize", "Splitting for map-reduce");
     } else {
-        updateJobStatus(jobId, "failed", "Processing failed: " + runner.getLastError());
+        updateJobStatus(jobId, "failed", "Processing failed: " + status.error);
     }
 
     return success;
 }
 
+int InferenceMonitor::prefetchLimit() const {
+    return prefetchDepth_ < 0 ? 2 * numWorkers_ : prefetchDepth_;
+}
+
+void InferenceMonitor::loadInput(const std::string& jobId, const std::string& model,
+                                 PreparedInput& prepared, bool tokenize) {
+    TraceSpan span("read_input");
+
+    std::string input;
+    std::ifstream in(processingShard(jobId) / (jobId + ".txt"), std::ios::binary);
+    bool found = static_cast<bool>(in);
+    if (found) {
+        input.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    JobMetadata metadata;
+    readJobMetadata(metadataPath(processingShard(jobId), jobId), metadata);
+
+    // Tokenizing needs only the vocabulary, so do it here if the model is already loaded;
+    // never load one just for this
+    TokenizedInput tokenized;
+    if (found && tokenize) {
+        std::shared_ptr<llama_model> loaded = models_.peek(model);
+        if (loaded && !InferenceRunner::tokenizeContent(loaded.get(), input, tokenized)) {
+            tokenized = TokenizedInput();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(prepared.mutex);
+        prepared.found = found;
+        prepared.input = std::move(input);
+        prepared.metadata = std::move(metadata);
+        prepared.tokenized = std::move(tokenized);
+        prepared.state = PreparedInput::State::Ready;
+    }
+    prepared.ready.notify_all();
+}
+
+PreparedInput& InferenceMonitor::acquireInput(QueuedJob& job) {
+    if (!job.prepared) {
+        job.prepared = std::make_shared<PreparedInput>();
+    }
+    PreparedInput& prepared = *job.prepared;
+
+    std::unique_lock<std::mutex> lock(prepared.mutex);
+    if (prepared.state == PreparedInput::State::Pending) {
+        // The prefetch stage hasn't reached it: read it here
+        prepared.state = PreparedInput::State::Loading;
+        lock.unlock();
+        if (prefetchDepth_ != 0) {
+            prefetchMisses_++;
+        }
+        loadInput(job.id, job.model, prepared, false);
+        return prepared;
+    }
+
+    prepared.ready.wait(lock, [&prepared] { return prepared.state == PreparedInput::State::Ready; });
+    if (prepared.prefetched) {
+        // Counted once, though a handed-off job is acquired by both of its workers
+        prepared.prefetched = false;
+        lock.unlock();
+        prefetchHits_++;
+        {
+            std::lock_guard<std::mutex> queueLock(queueMutex_);
+            prefetchedWaiting_--;
+        }
+        prefetchCondition_.notify_one();
+    }
+    return prepared;
+}
+
+void InferenceMonitor::prefetchFunction() {
+    Tracer::setThreadName("prefetch");
+
+    while (true) {
+        PrefetchCandidate candidate;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex_);
+
+            // Stay at most prefetchLimit() inputs ahead of the workers
+            prefetchCondition_.wait(lock, [this] {
+                return !running_ || (!prefetchBacklog_.empty() && prefetchedWaiting_ < prefetchLimit());
+            });
+            if (!running_) {
+                break;
+            }
+            candidate = std::move(prefetchBacklog_.front());
+            prefetchBacklog_.pop_front();
+            prefetchedWaiting_++;
+        }
+
+        // A worker may have taken the job already
+        bool claimed = false;
+        {
+            std::lock_guard<std::mutex> lock(candidate.prepared->mutex);
+            if (candidate.prepared->state == PreparedInput::State::Pending) {
+                candidate.prepared->state = PreparedInput::State::Loading;
+                candidate.prepared->prefetched = true;
+                claimed = true;
+            }
+        }
+        if (!claimed) {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            prefetchedWaiting_--;
+            continue;
+        }
+
+        Tracer::setThreadJob(candidate.jobId);
+        loadInput(candidate.jobId, candidate.model, *candidate.prepared, true);
+        Tracer::setThreadJob("");
+    }
+}
+
+void InferenceMonitor::writeBackFunction() {
+    Tracer::setThreadName("write-back");
+
+    WriteBack item;
+    while (writeBackQueue_.pop(item)) {
+        Tracer::setThreadJob(item.job.id);
+        persistResult(item);
+        Tracer::setThreadJob("");
+    }
+}
+
+void InferenceMonitor::persistResult(WriteBack& item) {
+    const std::string& jobId = item.job.id;
+    if (forgetLostJob(jobId)) {
+        return;
+    }
+    std::filesystem::path outputPath = resultPath(jobId, item.metadata);
+
+    // Compressed when the path ends in .gz; written atomically either way
+    bool written;
+    std::string error;
+    {
+        TraceSpan span("write_output");
+        std::error_code ec;
+        std::filesystem::create_directories(outputPath.parent_path(), ec);
+
+        // Sidecars go first: a popper may consume the result, and its sidecars with it,
+        // the moment the result exists
+        if (item.metadata.role == JobRole::Normal) {
+            // How generation ended, when it wasn't simply the model finishing
+            if (!item.metadata.loop.empty() &&
+                !writeJobMetadata(metadataPath(outputPath.parent_path(), jobId), item.metadata)) {
+                std::cerr << "Warning: Failed to record the outcome of job " << jobId << std::endl;
+            }
+            recordTiming(jobId, item.startedMs);
+        }
+        written = writeResultFile(outputPath, item.output, error);
+    }
+
+    if (written) {
+        std::string message = item.partial ? "Partial output kept" : "Processing completed";
+        if (!item.metadata.loop.empty()) {
+            message += " (repetition loop " + item.metadata.loop + ", period " +
+                       std::to_string(item.metadata.loopPeriod) + ")";
+        }
+        updateJobStatus(jobId, item.partial ? "cancelled" : "completed", message);
+        finishJob(jobId);
+    } else {
+        if (item.metadata.role == JobRole::Normal) {
+            discardSidecars(jobId);
+        }
+        updateJobStatus(jobId, "failed", "Writing result failed: " + error);
+        failJob(-1, jobId);
+    }
+}
+
+void InferenceMonitor::recordLoop(const LoopReport& loop, JobMetadata& metadata) {
+    if (loop.period == 0) return;
+
+    metadata.loop = loop.stopped ? "stopped" : "penalized";
+    metadata.loopPeriod = loop.period;
+    metadata.loopAtToken = loop.generatedAt;
+    if (loop.stopped) {
+        loopsStopped_++;
+        loopTokensSaved_ += static_cast<uint64_t>(std::max(0, loop.budgetLeft));
+    }
+}
+
+int64_t InferenceMonitor::epochMilliseconds() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void InferenceMonitor::recordTiming(const std::string& jobId, int64_t startedMs) {
+    if (!recordTimings_) return;
+
+    JobTiming timing;
+    timing.startedMs = startedMs;
+    timing.finishedMs = epochMilliseconds();
+    if (!writeJobTiming(outputLayout_.pathFor(outputDirectory_, jobId, JOB_TIMING_EXTENSION), timing)) {
+        std::cerr << "Warning: Failed to write timing for job " << jobId << std::endl;
+    }
+}
+
+void InferenceMonitor::discardSidecars(const std::string& jobId) {
+    std::error_code ec;
+    std::filesystem::remove(metadataPath(outputLayout_.shardDirectory(outputDirectory_, jobId), jobId), ec);
+    std::filesystem::remove(outputLayout_.pathFor(outputDirectory_, jobId, JOB_TIMING_EXTENSION), ec);
+}
+
 void InferenceMonitor::updateJobStatus(const std::string& jobId,
                                      const std::string& status,
                                      const std::string& message) {
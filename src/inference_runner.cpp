@@ -1,145 +1,624 @@
 #include "pnpl/inference_runner.hpp"
+#include "pnpl/result_file.hpp"
+#include "pnpl/trace.hpp"
+#include "pnpl/repetition_detector.hpp"
 #include "llama.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 namespace pnpl {
 
-InferenceRunner::InferenceRunner() {
-    // Load all available backends (GPU, CPU, etc.)
-    ggml_backend_load_all();
+namespace {
+
+    // Map a KV cache type name (as used by llama.cpp's --cache-type-k/v) to a ggml type
+    bool parseCacheType(const std::string& name, ggml_type& type) {
+        if (name == "f32")  { type = GGML_TYPE_F32;  return true; }
+        if (name == "f16")  { type = GGML_TYPE_F16;  return true; }
+        if (name == "bf16") { type = GGML_TYPE_BF16; return true; }
+        if (name == "q8_0") { type = GGML_TYPE_Q8_0; return true; }
+        if (name == "q4_0") { type = GGML_TYPE_Q4_0; return true; }
+        if (name == "q4_1") { type = GGML_TYPE_Q4_1; return true; }
+        if (name == "q5_0") { type = GGML_TYPE_Q5_0; return true; }
+        if (name == "q5_1") { type = GGML_TYPE_Q5_1; return true; }
+        return false;
+    }
+
+    bool isQuantizedCacheType(ggml_type type) {
+        return type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_BF16;
+    }
+
+    bool validateOptions(const RunnerOptions& options, std::string& error) {
+        ggml_type type_k;
+        ggml_type type_v;
+        if (!parseCacheType(options.cacheTypeK, type_k)) {
+            error = "Unsupported KV cache type: " + options.cacheTypeK;
+            return false;
+        }
+        if (!parseCacheType(options.cacheTypeV, type_v)) {
+            error = "Unsupported KV cache type: " + options.cacheTypeV;
+            return false;
+        }
+        if (isQuantizedCacheType(type_v) && !options.flashAttention) {
+            error = "Quantized V cache (" + options.cacheTypeV + ") requires flash attention";
+            return false;
+        }
+        return true;
+    }
+
+    // Earliest stop string overlapping the text just appended to output, or npos.
+    // Only the tail that can contain a new match is searched, so each token costs
+    // O(piece + longest stop) regardless of how long the output already is.
+    size_t findStopString(const std::string& output, size_t appended,
+                          const std::vector<std::string>& stops, size_t maxStopLength) {
+        size_t tail = appended + maxStopLength - 1;
+        size_t from = output.size() > tail ? output.size() - tail : 0;
+
+        size_t earliest = std::string::npos;
+        for (const auto& stop : stops) {
+            size_t pos = output.find(stop, from);
+            if (pos < earliest) {
+                earliest = pos;
+            }
+        }
+        return earliest;
+    }
+
+    // Tokenize text in a single pass (parse_special as for the whole prompt)
+    bool tokenizeWith(const llama_vocab* vocab, const std::string& text, bool add_special,
+                      std::vector<llama_token>& tokens) {
+        // A token covers at least one byte, so this bound lets a single pass succeed
+        tokens.resize(text.size() + 2);
+        int n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, true);
+        if (n < 0) {
+            // Retry with the exact size reported by the tokenizer
+            tokens.resize(-n);
+            n = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, true);
+            if (n < 0) {
+                return false;
+            }
+        }
+
+        tokens.resize(n);
+        return true;
+    }
+
+    // Load all available backends (GPU, CPU, etc.) once per process
+    void loadBackends() {
+        static std::once_flag once;
+        std::call_once(once, [] { ggml_backend_load_all(); });
+    }
+
+    // glibc raises its mmap threshold when a large block is freed, so the buffers of the
+    // next context would come from the heap and escape huge page advice. Pin it once.
+    void keepLargeAllocationsMapped() {
+#ifdef __GLIBC__
+        static std::once_flag once;
+        std::call_once(once, [] { mallopt(M_MMAP_THRESHOLD, 1 << 20); });
+#endif
+    }
+
+    // Stream the model file through the page cache so mmap'd weights fault in as minor faults
+    void prefetchFile(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return;
+        }
+
+        std::vector<char> buffer(4 << 20);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        }
+    }
+
+} // namespace
+
+InferenceRunner::InferenceRunner()
+    : promptTemplates_(std::make_shared<PromptTemplates>()) {
+    loadBackends();
 }
 
 InferenceRunner::~InferenceRunner() {
     if (ctx_) llama_free(ctx_);
-    if (model_) llama_model_free(model_);
 }
 
-bool InferenceRunner::init(const std::string& model_path) {
+std::shared_ptr<llama_model> InferenceRunner::loadModel(const std::string& model_path,
+                                                        const RunnerOptions& options,
+                                                        std::string& error) {
+    // Validate KV cache settings before paying for the model load
+    if (!validateOptions(options, error)) {
+        return nullptr;
+    }
+
+    loadBackends();
+
+    // Explicit huge pages: map a copy of the model on hugetlbfs instead of the file itself
+    std::string load_path = model_path;
+    if (options.hugePages == HugePageMode::Explicit) {
+        std::string copyError;
+        if (!copyToHugePages(model_path, options.hugePageDirectory, load_path, copyError)) {
+            std::cerr << "Warning: " << copyError << "; using transparent huge pages for "
+                      << model_path << std::endl;
+            load_path = model_path;
+        }
+    }
+
+    if (options.prefetch && load_path == model_path) {
+        prefetchFile(model_path);
+    }
+
     // EXACTLY like simple.cpp - Initialize model parameters
     llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 99; // Use GPU
+    model_params.n_gpu_layers = options.gpuLayers; // Use GPU (99 = all layers)
+    model_params.use_mlock = options.useMlock && llama_supports_mlock();
 
     // Load model - EXACT API from simple.cpp
-    model_ = llama_model_load_from_file(model_path.c_str(), model_params);
-    if (!model_) {
-        setError("Failed to load model from " + model_path);
+    TraceSpan span("model_load");
+    llama_model* model = llama_model_load_from_file(load_path.c_str(), model_params);
+    if (!model) {
+        error = "Failed to load model from " + load_path;
+        return nullptr;
+    }
+
+    // Transparent huge pages for the mmap'd weights (read-only file THP; the kernel
+    // needs CONFIG_READ_ONLY_THP_FOR_FS). Startup reports what was actually obtained.
+    if (options.hugePages != HugePageMode::Off && load_path == model_path) {
+        adviseHugePages(fileMappings(model_path));
+    }
+
+    return std::shared_ptr<llama_model>(model, llama_model_free);
+}
+
+bool InferenceRunner::init(const std::string& model_path, const RunnerOptions& options) {
+    std::string error;
+    std::shared_ptr<llama_model> model = loadModel(model_path, options, error);
+    if (!model) {
+        setError(error);
+        return false;
+    }
+
+    return init(std::move(model), options);
+}
+
+bool InferenceRunner::init(std::shared_ptr<llama_model> model, const RunnerOptions& options) {
+    std::string error;
+    if (!validateOptions(options, error)) {
+        setError(error);
+        return false;
+    }
+    if (!model) {
+        setError("Model not loaded");
         return false;
     }
 
+    // Cached template tokens belong to the previous model's vocabulary
+    if (model != model_) {
+        templateTokens_.clear();
+    }
+
+    options_ = options;
+    model_ = std::move(model);
     return true;
 }
 
-bool InferenceRunner::run(const std::string& input, std::string& output) {
+bool InferenceRunner::warmup() {
     if (!model_) {
         setError("Model not initialized");
         return false;
     }
 
-    // Format the prompt - AI sees full context, output starts clean
-    std::string formatted_input = formatPrompt(input);
+    TraceSpan span("warmup");
 
-    // Get vocab - EXACT API from simple.cpp
-    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    const llama_vocab* vocab = llama_model_get_vocab(model_.get());
 
-    // Tokenize - EXACT pattern from simple.cpp
-    const int n_prompt = -llama_tokenize(vocab, formatted_input.c_str(), formatted_input.size(), NULL, 0, true, true);
-    if (n_prompt <= 0) {
-        setError("Failed to tokenize prompt");
+    // Small context with the production settings so the same kernels get exercised
+    ctx_ = createContext(contextParams(64, 64));
+    if (!ctx_) {
+        setError("Failed to create warm-up context");
         return false;
     }
 
-    // Allocate and tokenize - EXACT pattern from simple.cpp
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    if (llama_tokenize(vocab, formatted_input.c_str(), formatted_input.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0) {
-        setError("Failed to tokenize the prompt");
+    llama_token token = llama_vocab_bos(vocab);
+    if (token < 0) {
+        token = llama_vocab_eos(vocab);
+    }
+
+    // One prompt-style decode followed by a few single-token steps
+    bool ok = true;
+    llama_batch batch = llama_batch_get_one(&token, 1);
+    for (int step = 0; step < 4; ++step) {
+        if (llama_decode(ctx_, batch)) {
+            setError("Warm-up decode failed");
+            ok = false;
+            break;
+        }
+        batch = llama_batch_get_one(&token, 1);
+    }
+
+    llama_free(ctx_);
+    ctx_ = nullptr;
+    return ok;
+}
+
+bool InferenceRunner::benchmark(int prefillTokens, int decodeTokens, RunnerBenchmark& result) {
+    if (!model_) {
+        setError("Model not initialized");
         return false;
     }
 
-    // AI/ML RESEARCHER INSIGHT: Dynamic context sizing for efficiency
-    llama_context_params ctx_params = llama_context_default_params();
-    int n_predict = 1500; // Optimized for TinyLlama's sweet spot
+    TraceSpan span("benchmark");
+
+    // Any token IDs will do; only the cost of evaluating them matters
+    const llama_vocab* vocab = llama_model_get_vocab(model_.get());
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<llama_token> tokens(std::max(1, prefillTokens));
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        tokens[i] = static_cast<llama_token>((i * 7919 + 1) % n_vocab);
+    }
+
+    const int n_prompt = static_cast<int>(tokens.size());
+    ctx_ = createContext(contextParams(n_prompt + decodeTokens + 1, n_prompt));
+    if (!ctx_) {
+        setError("Failed to create benchmark context");
+        return false;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    bool ok = true;
+    auto begin = Clock::now();
+    if (llama_decode(ctx_, llama_batch_get_one(tokens.data(), n_prompt))) {
+        setError("Benchmark prompt decode failed");
+        ok = false;
+    }
+    double prefillSeconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    begin = Clock::now();
+    llama_token token = tokens.front();
+    for (int step = 0; ok && step < decodeTokens; ++step) {
+        if (llama_decode(ctx_, llama_batch_get_one(&token, 1))) {
+            setError("Benchmark decode failed");
+            ok = false;
+        }
+    }
+    double decodeSeconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    llama_free(ctx_);
+    ctx_ = nullptr;
+
+    if (ok) {
+        result.prefillTokensPerSecond = prefillSeconds > 0 ? n_prompt / prefillSeconds : 0;
+        result.decodeTokensPerSecond = decodeSeconds > 0 ? decodeTokens / decodeSeconds : 0;
+    }
+    return ok;
+}
+
+// One in-flight generation: sampler plus every token evaluated or queued so far
+struct InferenceRunner::Generation {
+    const GenerationParams* params = nullptr;
+    llama_sampler* sampler = nullptr;
+    std::vector<llama_token> tokens;   // Prompt followed by generated tokens
+    size_t n_evaluated = 0;            // Leading tokens already in the KV cache
+    int n_prompt = 0;
+    int n_predict = 0;
+    int n_ctx = 0;
+    GenerationParams escalated;        // params after a loop raised the penalties
+};
+
+bool InferenceRunner::run(const std::string& input, std::string& output,
+                          const GenerationParams& params,
+                          const std::filesystem::path& checkpoint_path,
+                          const TokenizedInput* tokenized,
+                          const PrefilledState* prefilled) {
+    if (!model_) {
+        setError("Model not initialized");
+        return false;
+    }
+
+    interrupted_ = false;
+    cancelled_ = false;
+    inputTooLarge_ = false;
+    lastTokenCount_ = 0;
+    lastLoop_ = LoopReport();
+    lastTransfer_ = StateTransfer();
+    Generation gen;
+    gen.params = &params;
+
+    // Pick up where an interrupted run left off, skipping tokenization and prefill
+    bool resumed = false;
+    if (!checkpoint_path.empty() && std::filesystem::exists(checkpointStatePath(checkpoint_path))) {
+        resumed = resumeGeneration(checkpoint_path, gen, output);
+        if (resumed) {
+            std::cout << "Resumed from checkpoint at token " << gen.tokens.size() - gen.n_prompt
+                      << "/" << gen.n_predict << std::endl;
+        } else {
+            std::cerr << "Warning: Discarding unusable checkpoint " << checkpoint_path << std::endl;
+            endGeneration(gen);
+            gen = Generation();
+            gen.params = &params;
+        }
+    } else if (prefilled && !prefilled->empty()) {
+        // Handed over in memory by a prefill runner
+        output = "";
+        resumed = restorePrefilled(*prefilled, gen);
+        if (!resumed) {
+            std::cerr << "Warning: Discarding unusable prefilled state" << std::endl;
+            endGeneration(gen);
+            gen = Generation();
+            gen.params = &params;
+        }
+    }
+
+    if (!resumed) {
+        // PROPER ECHO FIX: Start output cleanly, no prompt echo
+        output = "";
+
+        if (!beginGeneration(input, gen, tokenized)) {
+            endGeneration(gen);
+            return false;
+        }
+    }
+
+    bool success = generate(gen, output, checkpoint_path);
+    lastTokenCount_ = gen.tokens.size();
+    endGeneration(gen);
+
+    // A finished (or cancelled) job no longer needs its checkpoint
+    if ((success || cancelled_) && !checkpoint_path.empty()) {
+        removeCheckpoint(checkpoint_path);
+    }
+
+    return success;
+}
+
+bool InferenceRunner::prefillPrompt(const std::string& input, Generation& gen,
+                                    const TokenizedInput* tokenized) {
+    if (!model_) {
+        setError("Model not initialized");
+        return false;
+    }
+
+    interrupted_ = false;
+    cancelled_ = false;
+    inputTooLarge_ = false;
+    lastTokenCount_ = 0;
+    lastLoop_ = LoopReport();
+    lastTransfer_ = StateTransfer();
+
+    bool success = beginGeneration(input, gen, tokenized);
+    if (success && interruptFlag_ && interruptFlag_->load()) {
+        interrupted_ = true;
+        setError("Generation interrupted");
+        success = false;
+    } else if (success && cancelFlag_ && cancelFlag_->load()) {
+        cancelled_ = true;
+        setError("Generation cancelled");
+        success = false;
+    }
+
+    // Everything but the last prompt token, which stays pending for the decode side
+    if (success && gen.n_prompt > 1) {
+        TraceSpan span("prefill");
+        llama_batch batch = llama_batch_get_one(gen.tokens.data(), gen.n_prompt - 1);
+        if (llama_decode(ctx_, batch)) {
+            cancelled_ = cancelFlag_ && cancelFlag_->load();
+            setError(cancelled_ ? "Generation cancelled" : "Failed to eval batch");
+            success = false;
+        } else {
+            gen.n_evaluated = gen.n_prompt - 1;
+        }
+    }
+    lastTokenCount_ = gen.n_prompt;
+    return success;
+}
+
+bool InferenceRunner::prefill(const std::string& input, const GenerationParams& params,
+                              const std::filesystem::path& checkpoint_path,
+                              const TokenizedInput* tokenized) {
+    Generation gen;
+    gen.params = &params;
+    bool success = prefillPrompt(input, gen, tokenized);
+    if (success && !saveCheckpoint(checkpoint_path, gen, std::string())) {
+        removeCheckpoint(checkpoint_path);
+        success = false;
+    }
+    endGeneration(gen);
+    return success;
+}
+
+bool InferenceRunner::prefill(const std::string& input, const GenerationParams& params,
+                              PrefilledState& state, const TokenizedInput* tokenized) {
+    Generation gen;
+    gen.params = &params;
+    state = PrefilledState();
+    bool success = prefillPrompt(input, gen, tokenized);
+    if (success) {
+        TraceSpan span("state_copy");
+        using Clock = std::chrono::steady_clock;
+        const auto begin = Clock::now();
+        state.kv.resize(llama_state_seq_get_size(ctx_, 0));
+        if (state.kv.empty() || llama_state_seq_get_data(ctx_, state.kv.data(), state.kv.size(), 0) != state.kv.size()) {
+            setError("Failed to copy prefill state");
+            state = PrefilledState();
+            success = false;
+        } else {
+            state.n_ctx = gen.n_ctx;
+            state.n_prompt = gen.n_prompt;
+            state.n_predict = gen.n_predict;
+            state.tokens.assign(gen.tokens.begin(), gen.tokens.begin() + gen.n_prompt);
+            lastTransfer_.bytes = state.kv.size();
+            lastTransfer_.saveMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        }
+    }
+    endGeneration(gen);
+    return success;
+}
+
+bool InferenceRunner::restorePrefilled(const PrefilledState& state, Generation& gen) {
+    TraceSpan span("state_restore");
+    using Clock = std::chrono::steady_clock;
+    const auto begin = Clock::now();
+    if (state.n_ctx <= 0 || state.n_prompt <= 0 || state.n_ctx > maxContextSize() ||
+        static_cast<int>(state.tokens.size()) != state.n_prompt) {
+        return false;
+    }
+
+    // Same context shape as the prefill so the KV cache fits
+    gen.n_ctx = state.n_ctx;
+    gen.n_prompt = state.n_prompt;
+    gen.n_predict = state.n_predict;
+    ctx_ = createContext(contextParams(gen.n_ctx, gen.n_prompt));
+    if (!ctx_ || llama_state_seq_set_data(ctx_, state.kv.data(), state.kv.size(), 0) == 0) {
+        return false;
+    }
+    gen.tokens = state.tokens;
+    gen.tokens.reserve(gen.n_prompt + gen.n_predict);
+    gen.n_evaluated = gen.n_prompt - 1;
+    gen.sampler = createSampler(*gen.params);
+
+    lastTransfer_.bytes = state.kv.size();
+    lastTransfer_.loadMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    return true;
+}
+
+bool InferenceRunner::beginGeneration(const std::string& input, Generation& gen,
+                                      const TokenizedInput* tokenized) {
+    // Only the user content is tokenized per job; the template's fixed fragments
+    // were tokenized once and are spliced around it
+    const TemplateTokens& fixed = templateTokens(selectTemplate(input, *gen.params));
+
+    // Content tokenized ahead of time is used if it came from this runner's model
+    std::vector<llama_token> content_tokens;
+    if (tokenized && tokenized->model == model_.get()) {
+        content_tokens = tokenized->tokens;
+    } else {
+        TraceSpan span("tokenize");
+        if (!tokenize(input, false, content_tokens)) {
+            setError("Failed to tokenize prompt");
+            return false;
+        }
+    }
+
+    gen.tokens.reserve(fixed.prefix.size() + content_tokens.size() + fixed.suffix.size() + DEFAULT_N_PREDICT);
+    gen.tokens.insert(gen.tokens.end(), fixed.prefix.begin(), fixed.prefix.end());
+    gen.tokens.insert(gen.tokens.end(), content_tokens.begin(), content_tokens.end());
+    gen.tokens.insert(gen.tokens.end(), fixed.suffix.begin(), fixed.suffix.end());
+
+    const int n_prompt = gen.tokens.size();
+    if (n_prompt <= 0) {
+        setError("Failed to tokenize prompt");
+        return false;
+    }
 
-    // Dynamic context calculation to maximize model efficiency
+    // AI/ML RESEARCHER INSIGHT: Dynamic context sizing for efficiency.
+    // A job asking for fewer tokens also gets a smaller (cheaper) context.
+    int n_predict = predictBudget(*gen.params);
+    const int min_predict = std::min(n_predict, 200);
+
+    // Dynamic context calculation bounded by what the loaded model was trained on
     int required_context = n_prompt + n_predict + 100;
-    int max_context = 2048; // TinyLlama's architectural limit
+    int max_context = maxContextSize();
 
     if (required_context > max_context) {
         // Graceful degradation: reduce generation length to fit context
         n_predict = max_context - n_prompt - 100;
-        if (n_predict < 200) {
-            setError("Input too large for model context window");
+        if (n_predict < min_predict) {
+            inputTooLarge_ = true;
+            setError("Input too large for model context window (" + std::to_string(n_prompt) +
+                     " prompt tokens, context " + std::to_string(max_context) + ")");
             return false;
         }
         std::cerr << "Warning: Reduced generation to " << n_predict << " tokens due to context limits" << std::endl;
     }
 
-    ctx_params.n_ctx = n_prompt + n_predict + 100;
-    ctx_params.n_batch = n_prompt;
-    ctx_params.no_perf = false; // Enable performance counters like simple.cpp
+    gen.n_prompt = n_prompt;
+    gen.n_predict = n_predict;
+    gen.n_ctx = n_prompt + n_predict + 100;
 
     // Create context - EXACT API from simple.cpp
-    ctx_ = llama_init_from_model(model_, ctx_params);
+    {
+        TraceSpan span("context_init");
+        ctx_ = createContext(contextParams(gen.n_ctx, n_prompt));
+    }
     if (!ctx_) {
         setError("Failed to create context");
         return false;
     }
 
-    // Initialize sampler - EXACT pattern from simple.cpp
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false; // Same as simple.cpp
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+    gen.sampler = createSampler(*gen.params);
+    return true;
+}
 
-    // Add repetition penalty BEFORE greedy sampler
-    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
-        64,    // last_n tokens to consider
-        1.1f,  // repeat penalty (>1.0 reduces repetition)
-        0.0f,  // frequency penalty
-        0.0f   // presence penalty
-    ));
-    // AI/ML INSIGHT: Greedy sampling for deterministic, production-ready output
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+bool InferenceRunner::generate(Generation& gen, std::string& output,
+                               const std::filesystem::path& checkpoint_path) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.get());
 
-    // PROPER ECHO FIX: Start output cleanly, no prompt echo
-    output = "";
+    const std::vector<std::string>& stops = gen.params->stop;
+    size_t maxStopLength = 0;
+    for (const auto& stop : stops) {
+        maxStopLength = std::max(maxStopLength, stop.size());
+    }
 
-    // Print prompt tokens like simple.cpp (to debug)
-    //for (auto id: prompt_tokens) {
-    /*    char buf[128];
-        int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-            setError("Failed to convert prompt token to piece");
-            llama_sampler_free(smpl);
-            llama_free(ctx_);
-            ctx_ = nullptr;
+    // Streamed text never includes a stop string, so a partial match stays held back
+    const size_t holdBack = maxStopLength > 0 ? maxStopLength - 1 : 0;
+
+    // Greedy decoding of small models tends to fall into repeating paragraphs
+    const bool detectLoops = gen.params->onLoop != LoopAction::Ignore;
+    RepetitionDetector detector(LOOP_MAX_PERIOD, LOOP_MIN_CYCLES, LOOP_MIN_TOKENS);
+    size_t streamed = 0;
+    auto stream = [&](size_t end) {
+        if (streamCallback_ && end > streamed) {
+            streamCallback_(output.substr(streamed, end - streamed));
+            streamed = end;
+        }
+    };
+
+    // Main generation loop - EXACT pattern from simple.cpp, with the pending
+    // tokens (prompt first, then each sampled token) kept in gen.tokens
+    while (static_cast<int>(gen.tokens.size()) < gen.n_prompt + gen.n_predict) {
+        // Shutdown requested: save what we have so a restart can continue from here
+        if (interruptFlag_ && interruptFlag_->load()) {
+            interrupted_ = true;
+            if (!checkpoint_path.empty() && gen.n_evaluated > 0 && saveCheckpoint(checkpoint_path, gen, output)) {
+                std::cout << "Checkpointed generation at token " << gen.tokens.size() - gen.n_prompt
+                          << "/" << gen.n_predict << " to " << checkpoint_path << std::endl;
+            }
+            setError("Generation interrupted");
             return false;
         }
-        // Add to output for debugging
-        output += std::string(buf, n);
-    }*/
 
-    // Prepare batch - EXACT pattern from simple.cpp
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+        if (cancelFlag_ && cancelFlag_->load()) {
+            cancelled_ = true;
+            setError("Generation cancelled");
+            return false;
+        }
 
-    // Main generation loop - EXACT pattern from simple.cpp
-    int n_decode = 0;
-    llama_token new_token_id;
+        // Prepare batch - EXACT pattern from simple.cpp
+        llama_batch batch = llama_batch_get_one(gen.tokens.data() + gen.n_evaluated,
+                                                gen.tokens.size() - gen.n_evaluated);
 
-    for (int n_pos = 0; n_pos + batch.n_tokens < n_prompt + n_predict; ) {
         // Evaluate batch - EXACT API from simple.cpp
-        if (llama_decode(ctx_, batch)) {
-            setError("Failed to eval batch");
-            llama_sampler_free(smpl);
-            llama_free(ctx_);
-            ctx_ = nullptr;
-            return false;
+        {
+            // The first batch of a run carries the prompt (or the rest of it after a resume)
+            TraceSpan span(gen.n_evaluated < static_cast<size_t>(gen.n_prompt) ? "prefill" : "decode");
+            if (llama_decode(ctx_, batch)) {
+                // The abort callback stops a decode (even a long prefill) part way through
+                cancelled_ = cancelFlag_ && cancelFlag_->load();
+                setError(cancelled_ ? "Generation cancelled" : "Failed to eval batch");
+                return false;
+            }
         }
-
-        n_pos += batch.n_tokens;
+        gen.n_evaluated = gen.tokens.size();
 
         // Sample next token - EXACT pattern from simple.cpp
-        new_token_id = llama_sampler_sample(smpl, ctx_, -1);
+        llama_token new_token_id = llama_sampler_sample(gen.sampler, ctx_, -1);
 
         // Check for end of generation - EXACT pattern from simple.cpp
         if (llama_vocab_is_eog(vocab, new_token_id)) {
@@ -151,88 +630,588 @@ bool InferenceRunner::run(const std::string& input, std::string& output) {
         int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, true);
         if (n < 0) {
             setError("Failed to convert token to piece");
-            llama_sampler_free(smpl);
-            llama_free(ctx_);
-            ctx_ = nullptr;
             return false;
         }
         output += std::string(buf, n);
 
-        // Prepare next batch - EXACT pattern from simple.cpp
-        batch = llama_batch_get_one(&new_token_id, 1);
-        n_decode += 1;
+        // Stop strings end generation; the matched text is not part of the output
+        if (maxStopLength > 0) {
+            size_t stopPos = findStopString(output, n, stops, maxStopLength);
+            if (stopPos != std::string::npos) {
+                output.resize(stopPos);
+                break;
+            }
+        }
+
+        stream(output.size() > holdBack ? output.size() - holdBack : 0);
+
+        // Queue the token for the next batch
+        gen.tokens.push_back(new_token_id);
+
+        // A sustained cycle only burns budget: end it, or first try to break it
+        int period = detectLoops ? detector.push(new_token_id) : 0;
+        if (period > 0) {
+            lastLoop_.period = period;
+            lastLoop_.generatedAt = static_cast<int>(gen.tokens.size()) - gen.n_prompt;
+            lastLoop_.budgetLeft = gen.n_prompt + gen.n_predict - static_cast<int>(gen.tokens.size());
+            if (gen.params->onLoop == LoopAction::Penalize && !lastLoop_.penalized) {
+                lastLoop_.penalized = true;
+                escalatePenalties(gen, period);
+                detector.reset();
+                continue;
+            }
+            lastLoop_.stopped = true;
+            break;
+        }
+    }
+
+    stream(output.size());
+    return true;
+}
+
+void InferenceRunner::escalatePenalties(Generation& gen, int period) {
+    // Penalize at least the whole repeated span, noticeably harder than before
+    gen.escalated = *gen.params;
+    gen.escalated.repeatPenalty = std::max(1.3f, gen.params->repeatPenalty * 1.25f);
+    gen.escalated.repeatLastN = std::max(gen.params->repeatLastN, period * LOOP_MIN_CYCLES);
+    gen.params = &gen.escalated;
+
+    llama_sampler_free(gen.sampler);
+    gen.sampler = createSampler(gen.escalated);
+
+    // The new penalty sampler starts without history; replay the recent output
+    size_t from = gen.tokens.size() - std::min<size_t>(gen.tokens.size() - gen.n_prompt,
+                                                         static_cast<size_t>(gen.escalated.repeatLastN));
+    for (size_t i = from; i < gen.tokens.size(); ++i) {
+        llama_sampler_accept(gen.sampler, gen.tokens[i]);
     }
+}
 
+void InferenceRunner::endGeneration(Generation& gen) {
     // Cleanup - EXACT pattern from simple.cpp
-    llama_sampler_free(smpl);
+    if (gen.sampler) {
+        llama_sampler_free(gen.sampler);
+        gen.sampler = nullptr;
+    }
+    if (ctx_) {
+        llama_free(ctx_);
+        ctx_ = nullptr;
+    }
+}
+
+bool InferenceRunner::embed(const std::vector<std::string>& inputs,
+                            std::vector<std::vector<float>>& embeddings) {
+    if (!model_) {
+        setError("Model not initialized");
+        return false;
+    }
+
+    embeddings.assign(inputs.size(), {});
+    lastTokenCount_ = 0;
+    if (inputs.empty()) {
+        return true;
+    }
+
+    // Tokenize everything up front; each input becomes one sequence
+    const int max_tokens = maxContextSize();
+    std::vector<std::vector<llama_token>> tokenized(inputs.size());
+    int longest = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (!tokenize(inputs[i], true, tokenized[i]) || tokenized[i].empty()) {
+            setError("Failed to tokenize embedding input");
+            return false;
+        }
+        if (static_cast<int>(tokenized[i].size()) > max_tokens) {
+            std::cerr << "Warning: Truncating embedding input to " << max_tokens << " tokens" << std::endl;
+            tokenized[i].resize(max_tokens);
+        }
+        lastTokenCount_ += tokenized[i].size();
+        longest = std::max(longest, static_cast<int>(tokenized[i].size()));
+    }
+
+    // One context for all batches. Non-causal embedding models need a whole
+    // sequence inside one ubatch, so ubatch == batch == context size.
+    const int n_batch_tokens = std::min(max_tokens, std::max(EMBED_BATCH_TOKENS, longest));
+    llama_context_params ctx_params = contextParams(n_batch_tokens, n_batch_tokens);
+    ctx_params.n_ubatch = n_batch_tokens;
+    ctx_params.n_seq_max = MAX_EMBED_SEQUENCES;
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+
+    ctx_ = createContext(ctx_params);
+    if (ctx_ && llama_pooling_type(ctx_) == LLAMA_POOLING_TYPE_NONE) {
+        // Generation models have no pooling of their own; average the token states
+        llama_free(ctx_);
+        ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx_ = createContext(ctx_params);
+    }
+    if (!ctx_) {
+        setError("Failed to create embedding context");
+        return false;
+    }
+
+    const int n_embd = llama_model_n_embd(model_.get());
+    const bool use_encoder = llama_model_has_encoder(model_.get()) && !llama_model_has_decoder(model_.get());
+    llama_batch batch = llama_batch_init(n_batch_tokens, 0, 1);
+
+    bool ok = true;
+    size_t next = 0;
+    while (ok && next < inputs.size()) {
+        // Pack as many sequences as fit in the token budget and sequence limit
+        const size_t first = next;
+        batch.n_tokens = 0;
+        while (next < inputs.size() && next - first < static_cast<size_t>(MAX_EMBED_SEQUENCES) &&
+               batch.n_tokens + static_cast<int>(tokenized[next].size()) <= n_batch_tokens) {
+            const llama_seq_id seq = static_cast<llama_seq_id>(next - first);
+            for (size_t pos = 0; pos < tokenized[next].size(); ++pos) {
+                const int n = batch.n_tokens++;
+                batch.token[n] = tokenized[next][pos];
+                batch.pos[n] = static_cast<llama_pos>(pos);
+                batch.n_seq_id[n] = 1;
+                batch.seq_id[n][0] = seq;
+                batch.logits[n] = true;
+            }
+            next++;
+        }
+
+        llama_kv_self_clear(ctx_);
+        TraceSpan span("embed_batch");
+        if ((use_encoder ? llama_encode(ctx_, batch) : llama_decode(ctx_, batch)) != 0) {
+            setError("Failed to evaluate embedding batch");
+            ok = false;
+            break;
+        }
+
+        // Pooled vector per sequence, L2-normalized for cosine retrieval
+        for (size_t i = first; i < next; ++i) {
+            const float* pooled = llama_get_embeddings_seq(ctx_, static_cast<llama_seq_id>(i - first));
+            if (!pooled) {
+                setError("Failed to get sequence embedding");
+                ok = false;
+                break;
+            }
+
+            double norm = 0.0;
+            for (int d = 0; d < n_embd; ++d) {
+                norm += static_cast<double>(pooled[d]) * pooled[d];
+            }
+            const float scale = norm > 0.0 ? static_cast<float>(1.0 / std::sqrt(norm)) : 0.0f;
+
+            embeddings[i].resize(n_embd);
+            for (int d = 0; d < n_embd; ++d) {
+                embeddings[i][d] = pooled[d] * scale;
+            }
+        }
+    }
+
+    llama_batch_free(batch);
     llama_free(ctx_);
     ctx_ = nullptr;
+    return ok;
+}
+
+bool InferenceRunner::tokenize(const std::string& text, bool add_special,
+                               std::vector<llama_token>& tokens) const {
+    return tokenizeWith(llama_model_get_vocab(model_.get()), text, add_special, tokens);
+}
+
+bool InferenceRunner::tokenizeContent(const llama_model* model, const std::string& input,
+                                      TokenizedInput& tokenized) {
+    tokenized.model = nullptr;
+    if (!model || !tokenizeWith(llama_model_get_vocab(model), input, false, tokenized.tokens)) {
+        return false;
+    }
+    tokenized.model = model;
+    return true;
+}
+
+const InferenceRunner::TemplateTokens& InferenceRunner::templateTokens(size_t index) {
+    // Tokenize every template's fragments the first time any of them is needed
+    if (templateTokens_.empty()) {
+        for (const auto& tmpl : promptTemplates_->templates()) {
+            TemplateTokens fixed;
+            tokenize(tmpl.prefix, true, fixed.prefix);   // Prefix carries BOS
+            tokenize(tmpl.suffix, false, fixed.suffix);
+            templateTokens_.push_back(std::move(fixed));
+        }
+    }
+    return templateTokens_[index];
+}
+
+void InferenceRunner::setPromptTemplates(std::shared_ptr<const PromptTemplates> templates) {
+    promptTemplates_ = templates ? std::move(templates) : std::make_shared<PromptTemplates>();
+    templateTokens_.clear();
+}
+
+llama_context_params InferenceRunner::contextParams(int n_ctx, int n_batch) const {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_batch = n_batch;
+    ctx_params.no_perf = false; // Enable performance counters like simple.cpp
+
+    // KV cache precision and attention kernel (validated in init)
+    parseCacheType(options_.cacheTypeK, ctx_params.type_k);
+    parseCacheType(options_.cacheTypeV, ctx_params.type_v);
+    ctx_params.flash_attn = options_.flashAttention;
+
+    // Cancellation takes effect within the decode in progress
+    ctx_params.abort_callback = &InferenceRunner::abortRequested;
+    ctx_params.abort_callback_data = const_cast<InferenceRunner*>(this);
+
+    // Thread counts and physical batch size (tuned per host by --autotune)
+    if (options_.threads > 0) ctx_params.n_threads = options_.threads;
+    if (options_.threadsBatch > 0) ctx_params.n_threads_batch = options_.threadsBatch;
+    if (options_.ubatchSize > 0) ctx_params.n_ubatch = std::min(options_.ubatchSize, n_batch);
+
+    return ctx_params;
+}
+
+llama_context* InferenceRunner::createContext(const llama_context_params& params) {
+    if (options_.hugePages == HugePageMode::Off) {
+        return llama_init_from_model(model_.get(), params);
+    }
+
+    // The KV cache and compute buffers are the anonymous mappings the new context adds.
+    // Another thread's allocation may be caught as well; advising it too is harmless.
+    keepLargeAllocationsMapped();
+    std::vector<MemoryRange> before = memoryMappings();
+    llama_context* ctx = llama_init_from_model(model_.get(), params);
+    if (ctx) {
+        std::vector<MemoryRange> buffers = newAnonymousMappings(before, memoryMappings());
+        adviseHugePages(buffers);
+        contextPages_ = hugePageUsage(buffers);
+    }
+    return ctx;
+}
+
+llama_sampler* InferenceRunner::createSampler(const GenerationParams& params) const {
+    // Initialize sampler - EXACT pattern from simple.cpp
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = false; // Same as simple.cpp
+    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+
+    // Add repetition penalty BEFORE the final sampler
+    llama_sampler_chain_add(smpl, llama_sampler_init_penalties(
+        params.repeatLastN,    // last_n tokens to consider
+        params.repeatPenalty,  // repeat penalty (>1.0 reduces repetition)
+        0.0f,                  // frequency penalty
+        0.0f                   // presence penalty
+    ));
+
+    if (params.temperature <= 0.0f) {
+        // AI/ML INSIGHT: Greedy sampling for deterministic, production-ready output
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+        return smpl;
+    }
+
+    if (params.topK > 0) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.topK));
+    }
+    if (params.topP < 1.0f) {
+        llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.topP, 1));
+    }
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
+
+    return smpl;
+}
+
+std::filesystem::path InferenceRunner::checkpointStatePath(const std::filesystem::path& checkpoint_path) {
+    std::filesystem::path path = checkpoint_path;
+    path += ".state";
+    return path;
+}
+
+bool InferenceRunner::saveCheckpoint(const std::filesystem::path& checkpoint_path,
+                                     const Generation& gen, const std::string& output) {
+    TraceSpan span("checkpoint_save");
+    using Clock = std::chrono::steady_clock;
+    const auto begin = Clock::now();
+    std::filesystem::create_directories(checkpoint_path.parent_path());
+
+    // KV cache and evaluated tokens
+    std::filesystem::path statePath = checkpointStatePath(checkpoint_path);
+    if (!llama_state_save_file(ctx_, statePath.string().c_str(), gen.tokens.data(), gen.n_evaluated)) {
+        setError("Failed to save checkpoint state");
+        return false;
+    }
+
+    // Generation bookkeeping, the sampled-but-not-evaluated token, then the partial output
+    std::ofstream file(checkpoint_path, std::ios::binary);
+    if (!file) {
+        setError("Failed to write checkpoint: " + checkpoint_path.string());
+        return false;
+    }
+    file << "n_ctx=" << gen.n_ctx << "\n"
+         << "n_prompt=" << gen.n_prompt << "\n"
+         << "n_predict=" << gen.n_predict << "\n";
+    for (size_t i = gen.n_evaluated; i < gen.tokens.size(); ++i) {
+        file << "pending=" << gen.tokens[i] << "\n";
+    }
+    file << "output\n" << output;
+    file.close();
+
+    std::error_code ec;
+    lastTransfer_.bytes = std::filesystem::file_size(statePath, ec);
+    lastTransfer_.saveMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    if (file.fail()) {
+        setError("Failed to write checkpoint: " + checkpoint_path.string());
+        return false;
+    }
+    return true;
+}
+
+bool InferenceRunner::resumeGeneration(const std::filesystem::path& checkpoint_path,
+                                       Generation& gen, std::string& output) {
+    TraceSpan span("checkpoint_resume");
+    using Clock = std::chrono::steady_clock;
+    const auto begin = Clock::now();
+    std::ifstream file(checkpoint_path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
 
+    std::vector<llama_token> pending;
+    PrefilledState prefilled;   // Set for a checkpoint written from one
+    bool sequenceState = false;
+    std::string line;
+    while (std::getline(file, line) && line != "output") {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        std::string key = line.substr(0, eq);
+        int value = std::atoi(line.c_str() + eq + 1);
+        if (key == "n_ctx") gen.n_ctx = value;
+        else if (key == "n_prompt") gen.n_prompt = value;
+        else if (key == "n_predict") gen.n_predict = value;
+        else if (key == "pending") pending.push_back(value);
+        else if (key == "sequence_state") sequenceState = value != 0;
+        else if (key == "token") prefilled.tokens.push_back(value);
+    }
+    output.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    if (gen.n_ctx <= 0 || gen.n_prompt <= 0 || gen.n_ctx > maxContextSize()) {
+        return false;
+    }
+
+    if (sequenceState) {
+        std::ifstream state(checkpointStatePath(checkpoint_path), std::ios::binary);
+        prefilled.kv.assign(std::istreambuf_iterator<char>(state), std::istreambuf_iterator<char>());
+        prefilled.n_ctx = gen.n_ctx;
+        prefilled.n_prompt = gen.n_prompt;
+        prefilled.n_predict = gen.n_predict;
+        if (!state || prefilled.kv.empty() || !output.empty() || !restorePrefilled(prefilled, gen)) {
+            return false;
+        }
+        lastTransfer_.loadMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+
+    // Same context shape as the original run so the saved KV cache fits
+    ctx_ = createContext(contextParams(gen.n_ctx, gen.n_prompt));
+    if (!ctx_) {
+        return false;
+    }
+
+    // A prefill handoff leaves the prompt's last token pending rather than evaluated
+    size_t n_loaded = 0;
+    gen.tokens.resize(gen.n_ctx);
+    std::filesystem::path statePath = checkpointStatePath(checkpoint_path);
+    if (!llama_state_load_file(ctx_, statePath.string().c_str(), gen.tokens.data(),
+                               gen.tokens.size(), &n_loaded) ||
+        static_cast<int>(n_loaded + pending.size()) < gen.n_prompt) {
+        return false;
+    }
+    gen.tokens.resize(n_loaded);
+    gen.n_evaluated = n_loaded;
+    gen.tokens.insert(gen.tokens.end(), pending.begin(), pending.end());
+
+    // Rebuild the repetition penalty history from the tokens generated so far
+    gen.sampler = createSampler(*gen.params);
+    for (size_t i = gen.n_prompt; i < gen.tokens.size(); ++i) {
+        llama_sampler_accept(gen.sampler, gen.tokens[i]);
+    }
+
+    std::error_code ec;
+    lastTransfer_.bytes = std::filesystem::file_size(statePath, ec);
+    lastTransfer_.loadMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
     return true;
 }
 
-std::string InferenceRunner::formatPrompt(const std::string& input) {
-    // AI/ML RESEARCHER APPROACH: Optimal prompt engineering for small models
-
-    // For large code files - include full context but guide output structure
-    if (input.length() > 500) {
-        return "You are a senior software engineer conducting a code review. "
-               "Analyze the following C++ code and provide a comprehensive technical analysis.\n\n"
-               "CODE TO ANALYZE:\n" + input + "\n\n"
-               "TECHNICAL ANALYSIS:\n"
-               "1. Purpose: What does this code accomplish?\n"
-               "2. Architecture: Key classes, methods, and design patterns\n"
-               "3. Implementation: Notable technical details and algorithms\n"
-               "4. Quality: Code quality, best practices, potential improvements\n"
-               "5. Usage: How this code fits into a larger system\n\n"
-               "Provide detailed analysis:\n\n";
-    }
-
-    // For code snippets - focused technical analysis
-    if (input.find("```") != std::string::npos ||
-        input.find("#include") != std::string::npos ||
-        input.find("class ") != std::string::npos) {
-        return "Analyze this C++ code and explain its technical implementation:\n\n"
-               + input + "\n\n"
-               "Technical Analysis:\n"
-               "- Purpose and functionality\n"
-               "- Key components and algorithms\n"
-               "- Design patterns and best practices\n"
-               "- Performance considerations\n\n"
-               "Detailed explanation:\n\n";
-    }
-
-    // For technical explanations - structured educational format
-    if (input.find("Explain") == 0 || input.find("What") == 0) {
-        return "Technical Question: " + input + "\n\n"
-               "Provide a comprehensive technical explanation with:\n"
-               "1. Clear concept definitions\n"
-               "2. Practical C++ code examples\n"
-               "3. Real-world usage scenarios\n"
-               "4. Best practices and common pitfalls\n\n"
-               "Technical Answer:\n\n";
-    }
-
-    // For comprehensive guides - structured technical writing
-    if (input.find("comprehensive") != std::string::npos ||
-        input.find("guide") != std::string::npos) {
-        return "Create a comprehensive technical guide: " + input + "\n\n"
-               "Structure your guide with:\n"
-               "1. Core concepts and definitions\n"
-               "2. Detailed code examples with explanations\n"
-               "3. Practical implementation patterns\n"
-               "4. Performance considerations and best practices\n"
-               "5. Common pitfalls and how to avoid them\n\n"
-               "Technical Guide:\n\n";
-    }
-
-    // Default - clean technical analysis
-    return "Technical Request: " + input + "\n\n"
-           "Provide a detailed technical response with examples and practical guidance:\n\n";
+bool InferenceRunner::savePrefilledState(const std::filesystem::path& checkpoint_path,
+                                         const PrefilledState& state, std::string& error) {
+    std::error_code ec;
+    std::filesystem::create_directories(checkpoint_path.parent_path(), ec);
+
+    // The sequence state as llama.cpp produced it, then the bookkeeping with the prompt
+    std::ofstream stateFile(checkpointStatePath(checkpoint_path), std::ios::binary | std::ios::trunc);
+    stateFile.write(reinterpret_cast<const char*>(state.kv.data()), static_cast<std::streamsize>(state.kv.size()));
+    stateFile.close();
+
+    std::ofstream file(checkpoint_path, std::ios::binary | std::ios::trunc);
+    file << "n_ctx=" << state.n_ctx << "\n"
+         << "n_prompt=" << state.n_prompt << "\n"
+         << "n_predict=" << state.n_predict << "\n"
+         << "sequence_state=1\n";
+    for (llama_token token : state.tokens) {
+        file << "token=" << token << "\n";
+    }
+    file << "output\n";
+    file.close();
+
+    if (stateFile.fail() || file.fail()) {
+        error = "Failed to write checkpoint: " + checkpoint_path.string();
+        removeCheckpoint(checkpoint_path);
+        return false;
+    }
+    return true;
+}
+
+void InferenceRunner::removeCheckpoint(const std::filesystem::path& checkpoint_path) {
+    std::error_code ec;
+    std::filesystem::remove(checkpoint_path, ec);
+    std::filesystem::remove(checkpointStatePath(checkpoint_path), ec);
+}
+
+void InferenceRunner::setCancelFlag(const std::atomic<bool>* flag) {
+    cancelFlag_ = flag;
+}
+
+bool InferenceRunner::wasCancelled() const {
+    return cancelled_;
+}
+
+bool InferenceRunner::abortRequested(void* runner) {
+    const std::atomic<bool>* flag = static_cast<const InferenceRunner*>(runner)->cancelFlag_;
+    return flag && flag->load(std::memory_order_relaxed);
+}
+
+void InferenceRunner::setInterruptFlag(const std::atomic<bool>* flag) {
+    interruptFlag_ = flag;
+}
+
+bool InferenceRunner::wasInterrupted() const {
+    return interrupted_;
+}
+
+bool InferenceRunner::wasInputTooLarge() const {
+    return inputTooLarge_;
+}
+
+void InferenceRunner::setStreamCallback(StreamCallback callback) {
+    streamCallback_ = std::move(callback);
+}
+
+const LoopReport& InferenceRunner::lastLoop() const {
+    return lastLoop_;
+}
+
+const StateTransfer& InferenceRunner::lastTransfer() const {
+    return lastTransfer_;
+}
+
+const HugePageUsage& InferenceRunner::contextHugePages() const {
+    return contextPages_;
+}
+
+size_t InferenceRunner::lastTokenCount() const {
+    return lastTokenCount_;
+}
+
+bool InferenceRunner::splitInput(const std::string& input, const GenerationParams& params,
+                                 std::vector<std::string>& chunks) {
+    if (!model_) {
+        setError("Model not initialized");
+        return false;
+    }
+
+    // Budget per chunk: the context minus the largest template wrapper, the
+    // generation budget and the same 100-token margin beginGeneration keeps
+    size_t overhead = 0;
+    const auto& templates = promptTemplates_->templates();
+    for (size_t i = 0; i < templates.size(); ++i) {
+        const TemplateTokens& fixed = templateTokens(i);
+        overhead = std::max(overhead, fixed.prefix.size() + fixed.suffix.size());
+    }
+    const int budget = maxContextSize() - static_cast<int>(overhead) - predictBudget(params) - 100;
+    if (budget < 64) {
+        setError("Context window too small to split input (" + std::to_string(budget) + " tokens per chunk)");
+        return false;
+    }
+
+    // Token count per line; BPE merges rarely cross a newline, so the sum is a close bound
+    std::vector<std::string> lines;
+    std::vector<int> lineTokens;
+    std::vector<llama_token> tokens;
+    for (size_t start = 0; start < input.size();) {
+        size_t end = input.find('\n', start);
+        end = (end == std::string::npos) ? input.size() : end + 1;
+        lines.push_back(input.substr(start, end - start));
+        if (!tokenize(lines.back(), false, tokens)) {
+            setError("Failed to tokenize input");
+            return false;
+        }
+        lineTokens.push_back(tokens.size());
+        start = end;
+    }
+
+    auto isBoundary = [](const std::string& line) {
+        return line.find_first_not_of(" \t\r\n") == std::string::npos || line[0] == '}';
+    };
+
+    chunks.clear();
+    std::string current;
+    int currentTokens = 0;
+    size_t boundary = std::string::npos;   // Length of current up to the last boundary line
+    int boundaryTokens = 0;
+
+    auto flush = [&](size_t length, int tokensUsed) {
+        chunks.push_back(current.substr(0, length));
+        current.erase(0, length);
+        currentTokens -= tokensUsed;
+        boundary = std::string::npos;
+    };
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (lineTokens[i] > budget) {
+            // One enormous line (minified code, data): cut it on token boundaries
+            if (!current.empty()) flush(current.size(), currentTokens);
+            tokenize(lines[i], false, tokens);
+            for (size_t begin = 0; begin < tokens.size(); begin += budget) {
+                chunks.push_back(detokenize(tokens, begin, std::min(tokens.size(), begin + budget)));
+            }
+            continue;
+        }
+
+        if (currentTokens + lineTokens[i] > budget) {
+            // Cut at the last function/block boundary unless that leaves a tiny chunk
+            if (boundary != std::string::npos && boundaryTokens >= budget / 2) {
+                flush(boundary, boundaryTokens);
+            }
+            // What followed the boundary may still leave no room for this line
+            if (currentTokens + lineTokens[i] > budget) {
+                flush(current.size(), currentTokens);
+            }
+        }
+
+        current += lines[i];
+        currentTokens += lineTokens[i];
+        if (isBoundary(lines[i])) {
+            boundary = current.size();
+            boundaryTokens = currentTokens;
+        }
+    }
+    if (!current.empty()) {
+        chunks.push_back(current);
+    }
+
+    return true;
 }
 
 bool InferenceRunner::runOnFile(const std::filesystem::path& input_path,
-                              const std::filesystem::path& output_path) {
+                              const std::filesystem::path& output_path,
+                              const GenerationParams& params,
+                              const std::filesystem::path& checkpoint_path) {
     if (!std::filesystem::exists(input_path)) {
         setError("Input file not found: " + input_path.string());
         return false;
@@ -249,24 +1228,67 @@ bool InferenceRunner::runOnFile(const std::filesystem::path& input_path,
     in_file.close();
 
     std::string output;
-    if (!run(input, output)) {
+    if (!run(input, output, params, checkpoint_path)) {
         return false;
     }
 
     std::filesystem::create_directories(output_path.parent_path());
 
-    std::ofstream out_file(output_path);
-    if (!out_file) {
-        setError("Failed to create output file: " + output_path.string());
+    // Compressed when the path ends in .gz; written atomically either way
+    TraceSpan span("write_output");
+    std::string error;
+    if (!writeResultFile(output_path, output, error)) {
+        setError(error);
         return false;
     }
 
-    out_file << output;
-    out_file.close();
-
     return true;
 }
 
+size_t InferenceRunner::selectTemplate(const std::string& input, const GenerationParams& params) const {
+    if (!params.promptTemplate.empty()) {
+        size_t index = promptTemplates_->find(params.promptTemplate);
+        if (index != PromptTemplates::npos) {
+            return index;
+        }
+        std::cerr << "Warning: Unknown prompt template '" << params.promptTemplate
+                  << "', matching by content" << std::endl;
+    }
+    return promptTemplates_->select(input);
+}
+
+int InferenceRunner::predictBudget(const GenerationParams& params) {
+    return params.maxTokens > 0 ? params.maxTokens : DEFAULT_N_PREDICT;
+}
+
+std::string InferenceRunner::detokenize(const std::vector<llama_token>& tokens,
+                                        size_t begin, size_t end) const {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.get());
+
+    std::string text;
+    char buf[256];
+    for (size_t i = begin; i < end; ++i) {
+        int n = llama_token_to_piece(vocab, tokens[i], buf, sizeof(buf), 0, true);
+        if (n > 0) {
+            text.append(buf, n);
+        }
+    }
+    return text;
+}
+
+int InferenceRunner::maxContextSize() const {
+    int n_ctx_train = llama_model_n_ctx_train(model_.get());
+    if (n_ctx_train <= 0) {
+        n_ctx_train = DEFAULT_CTX_SIZE;
+    }
+
+    // An explicit context size may shrink the window but never exceed the trained length
+    if (options_.contextSize > 0) {
+        return std::min(options_.contextSize, n_ctx_train);
+    }
+    return n_ctx_train;
+}
+
 bool InferenceRunner::isInitialized() const {
     return model_ != nullptr;
 }
@@ -0,0 +1,233 @@
+#include "pnpl/job_layout.hpp"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+
+namespace pnpl {
+
+namespace {
+
+    const char* const MARKER_FILE = ".layout";
+    const char* const UNDATED_SHARD = "undated";
+
+    // Two hex digits from an FNV-1a hash of the job ID: 256 evenly filled shards
+    std::string hashShard(const std::string& jobId) {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : jobId) {
+            hash = (hash ^ c) * 16777619u;
+        }
+        char shard[3];
+        std::snprintf(shard, sizeof(shard), "%02x", hash & 0xff);
+        return shard;
+    }
+
+    // Job IDs start with their creation time (YYYYMMDDHHMMSS_counter)
+    bool hasDatePrefix(const std::string& name) {
+        return name.size() >= 8 &&
+               std::all_of(name.begin(), name.begin() + 8, [](unsigned char c) { return std::isdigit(c); });
+    }
+
+    bool isJobFile(const std::filesystem::path& path) {
+        std::string name = path.filename().string();
+        return !name.empty() && name[0] != '.';
+    }
+
+    // Shard directory levels below the queue directory
+    int shardDepth(LayoutMode mode) {
+        switch (mode) {
+            case LayoutMode::Hashed: return 1;
+            case LayoutMode::Date: return 4;
+            default: return 0;
+        }
+    }
+
+    void visitShard(const std::filesystem::path& directory, LayoutMode mode, int level,
+                    const std::string& datePrefix, const DateRange& range,
+                    const std::function<void(const std::filesystem::path&)>& visit) {
+        std::error_code ec;
+        const int depth = shardDepth(mode);
+
+        for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string name = it->path().filename().string();
+
+            if (level < depth) {
+                if (!it->is_directory(ec)) continue;
+
+                // Date levels (year, month, day) prune shards outside the range
+                std::string prefix = datePrefix;
+                if (mode == LayoutMode::Date && level < 3) {
+                    if (name == UNDATED_SHARD) {
+                        if (!range.unbounded()) continue;
+                        visitShard(it->path(), mode, 3, datePrefix, range, visit);
+                        continue;
+                    }
+                    prefix += name;
+                    if (!range.overlaps(prefix)) continue;
+                }
+                visitShard(it->path(), mode, level + 1, prefix, range, visit);
+                continue;
+            }
+
+            if (!it->is_regular_file(ec) || !isJobFile(it->path())) continue;
+            if (!range.unbounded() && !(hasDatePrefix(name) && range.overlaps(name.substr(0, 8)))) continue;
+            visit(it->path());
+        }
+    }
+
+} // namespace
+
+bool DateRange::unbounded() const {
+    return from.empty() && to.empty();
+}
+
+bool DateRange::overlaps(const std::string& prefix) const {
+    if (!from.empty() && prefix < from.substr(0, prefix.size())) return false;
+    if (!to.empty() && prefix > to.substr(0, prefix.size())) return false;
+    return true;
+}
+
+JobLayout::JobLayout(LayoutMode mode) : mode_(mode) {}
+
+JobLayout JobLayout::forDirectory(const std::filesystem::path& directory) {
+    std::ifstream file(directory / MARKER_FILE);
+    std::string name;
+    LayoutMode mode = LayoutMode::Flat;
+    if (file >> name) {
+        parseMode(name, mode);
+    }
+    return JobLayout(mode);
+}
+
+bool JobLayout::parseMode(const std::string& name, LayoutMode& mode) {
+    if (name == "flat") mode = LayoutMode::Flat;
+    else if (name == "hashed") mode = LayoutMode::Hashed;
+    else if (name == "date") mode = LayoutMode::Date;
+    else return false;
+    return true;
+}
+
+const char* JobLayout::modeName(LayoutMode mode) {
+    switch (mode) {
+        case LayoutMode::Hashed: return "hashed";
+        case LayoutMode::Date: return "date";
+        default: return "flat";
+    }
+}
+
+LayoutMode JobLayout::mode() const {
+    return mode_;
+}
+
+bool JobLayout::writeMarker(const std::filesystem::path& directory) const {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+
+    // A flat directory needs no marker; removing it keeps old clients working
+    if (mode_ == LayoutMode::Flat) {
+        std::filesystem::remove(directory / MARKER_FILE, ec);
+        return !ec;
+    }
+
+    std::ofstream file(directory / MARKER_FILE);
+    file << modeName(mode_) << "\n";
+    return !file.fail();
+}
+
+std::filesystem::path JobLayout::shardDirectory(const std::filesystem::path& directory,
+                                                const std::string& jobId) const {
+    switch (mode_) {
+        case LayoutMode::Hashed:
+            return directory / hashShard(jobId);
+        case LayoutMode::Date:
+            if (!hasDatePrefix(jobId)) {
+                return directory / UNDATED_SHARD / hashShard(jobId);
+            }
+            return directory / jobId.substr(0, 4) / jobId.substr(4, 2) / jobId.substr(6, 2) / hashShard(jobId);
+        default:
+            return directory;
+    }
+}
+
+std::filesystem::path JobLayout::pathFor(const std::filesystem::path& directory,
+                                         const std::string& jobId,
+                                         const std::string& extension) const {
+    return shardDirectory(directory, jobId) / (jobId + extension);
+}
+
+void JobLayout::forEachFile(const std::filesystem::path& directory,
+                            const std::function<void(const std::filesystem::path&)>& visit,
+                            const DateRange& range) const {
+    visitShard(directory, mode_, 0, "", range, visit);
+}
+
+bool JobLayout::hasFiles(const std::filesystem::path& directory) const {
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec) && isJobFile(it->path())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool JobLayout::migrate(const std::filesystem::path& directory, size_t& moved, std::string& error) const {
+    moved = 0;
+    if (!std::filesystem::exists(directory)) {
+        return writeMarker(directory);
+    }
+
+    // Collect first: moving while iterating would revisit files. Files are picked up at any
+    // depth, so an interrupted migration can simply be run again.
+    std::vector<std::filesystem::path> files;
+    std::vector<std::filesystem::path> directories;
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec)) {
+            directories.push_back(it->path());
+        } else if (it->is_regular_file(ec) && isJobFile(it->path())) {
+            files.push_back(it->path());
+        }
+    }
+    if (ec) {
+        error = "Failed to scan " + directory.string() + ": " + ec.message();
+        return false;
+    }
+
+    for (const auto& file : files) {
+        // The job ID is the filename up to the first dot (<id>.txt, <id>.meta, <id>.txt.gz)
+        std::string name = file.filename().string();
+        std::string jobId = name.substr(0, name.find('.'));
+
+        std::filesystem::path target = shardDirectory(directory, jobId) / name;
+        if (target == file) continue;
+
+        std::filesystem::create_directories(target.parent_path(), ec);
+        std::filesystem::rename(file, target, ec);
+        if (ec) {
+            error = "Failed to move " + file.string() + ": " + ec.message();
+            return false;
+        }
+        moved++;
+    }
+
+    // Deepest first, so emptied parents can go too; non-empty directories are kept
+    std::sort(directories.begin(), directories.end(), [](const auto& a, const auto& b) {
+        return a.string().size() > b.string().size();
+    });
+    for (const auto& dir : directories) {
+        if (std::filesystem::is_empty(dir, ec)) {
+            std::filesystem::remove(dir, ec);
+        }
+    }
+
+    if (!writeMarker(directory)) {
+        error = "Failed to write layout marker in " + directory.string();
+        return false;
+    }
+    return true;
+}
+
+} // namespace pnpl
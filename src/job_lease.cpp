@@ -0,0 +1,213 @@
+#include "pnpl/job_lease.hpp"
+#include <fstream>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace pnpl {
+
+namespace {
+
+    int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Name for a file written before it becomes the lease, unique to this node and call
+    std::filesystem::path tempPath(const std::filesystem::path& leasePath, const std::string& nodeId) {
+        static std::atomic<uint64_t> sequence{0};
+        std::filesystem::path temp = leasePath;
+        temp += "." + nodeId + "." + std::to_string(++sequence) + ".tmp";
+        return temp;
+    }
+
+} // namespace
+
+LeaseManager::LeaseManager(const std::string& nodeId, std::chrono::seconds duration)
+    : nodeId_(nodeId), duration_(duration) {}
+
+const std::string& LeaseManager::nodeId() const {
+    return nodeId_;
+}
+
+std::chrono::seconds LeaseManager::duration() const {
+    return duration_;
+}
+
+bool LeaseManager::acquire(const std::filesystem::path& leasePath) {
+    // Common case: nobody has touched this job yet
+    if (create(leasePath)) {
+        return true;
+    }
+
+    if (held(leasePath)) {
+        return false;
+    }
+
+    // Take over under a lock so only one node replaces the expired lease. The lease is
+    // rewritten in place, never moved away, so no third node can create it meanwhile.
+    std::filesystem::path lockPath = leasePath;
+    lockPath += ".lock";
+    if (!create(lockPath)) {
+        clearAbandonedLock(lockPath);
+        return false;
+    }
+
+    // The holder may have renewed it (or released it) since it was read
+    bool taken = false;
+    std::error_code ec;
+    if (!std::filesystem::exists(leasePath, ec) && !ec) {
+        taken = create(leasePath);
+    } else if (!ec && !held(leasePath)) {
+        taken = replace(leasePath);
+    }
+    std::filesystem::remove(lockPath, ec);
+    return taken;
+}
+
+LeaseManager::RenewResult LeaseManager::renew(const std::filesystem::path& leasePath) {
+    LeaseInfo current;
+    if (!read(leasePath, current)) {
+        // Only a lease that is really gone is lost; one that can't be read now may be later
+        std::error_code ec;
+        bool exists = std::filesystem::exists(leasePath, ec);
+        return exists || ec ? RenewResult::Failed : RenewResult::Lost;
+    }
+    if (current.owner != nodeId_) {
+        return RenewResult::Lost;
+    }
+    return replace(leasePath) ? RenewResult::Renewed : RenewResult::Failed;
+}
+
+void LeaseManager::release(const std::filesystem::path& leasePath) {
+    LeaseInfo current;
+    if (read(leasePath, current) && current.owner == nodeId_) {
+        std::error_code ec;
+        std::filesystem::remove(leasePath, ec);
+    }
+}
+
+bool LeaseManager::read(const std::filesystem::path& leasePath, LeaseInfo& lease) {
+    std::ifstream file(leasePath);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        std::string key = line.substr(0, eq);
+        if (key == "owner") lease.owner = line.substr(eq + 1);
+        else if (key == "expires") lease.expiresMs = std::atoll(line.c_str() + eq + 1);
+    }
+    return !lease.owner.empty();
+}
+
+bool LeaseManager::claimable(const LeaseInfo& lease) const {
+    return lease.owner == nodeId_ || lease.expiresMs <= nowMs();
+}
+
+std::string LeaseManager::defaultNodeId() {
+#ifdef _WIN32
+    char name[MAX_COMPUTERNAME_LENGTH + 1];
+    DWORD size = sizeof(name);
+    if (GetComputerNameA(name, &size)) {
+        return std::string(name, size);
+    }
+#else
+    char name[256];
+    if (gethostname(name, sizeof(name)) == 0) {
+        name[sizeof(name) - 1] = '\0';
+        return name;
+    }
+#endif
+    return "localhost";
+}
+
+bool LeaseManager::create(const std::filesystem::path& leasePath) const {
+    // Written in full under a private name, then linked into place: linking fails if the
+    // lease exists, making creation an atomic claim, and the lease is never seen half-written
+    std::filesystem::path temp = tempPath(leasePath, nodeId_);
+    if (!write(temp)) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_hard_link(temp, leasePath, ec);
+    std::error_code ignored;
+    std::filesystem::remove(temp, ignored);
+    return !ec;
+}
+
+bool LeaseManager::replace(const std::filesystem::path& leasePath) const {
+    // Via a temporary file and rename so readers never see a half-written lease
+    std::filesystem::path temp = tempPath(leasePath, nodeId_);
+    if (!write(temp)) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, leasePath, ec);
+    if (ec) {
+        std::error_code ignored;
+        std::filesystem::remove(temp, ignored);
+    }
+    return !ec;
+}
+
+bool LeaseManager::held(const std::filesystem::path& leasePath, bool ownCounts) const {
+    LeaseInfo lease;
+    if (read(leasePath, lease)) {
+        return ownCounts ? lease.expiresMs > nowMs() : !claimable(lease);
+    }
+
+    // Missing, or unreadable (e.g. left empty by an older version that crashed while
+    // writing it): live until it is older than a lease could be
+    std::error_code ec;
+    auto modified = std::filesystem::last_write_time(leasePath, ec);
+    if (ec) {
+        return false;
+    }
+    return std::filesystem::file_time_type::clock::now() - modified < duration_;
+}
+
+void LeaseManager::clearAbandonedLock(const std::filesystem::path& lockPath) const {
+    // A takeover holds its lock for moments; one that outlived a lease is abandoned. It is
+    // moved aside first so that of several nodes clearing it, only one does.
+    if (held(lockPath, true)) {
+        return;
+    }
+    std::filesystem::path moved = lockPath;
+    moved += "." + nodeId_ + ".stale";
+    std::error_code ec;
+    std::filesystem::rename(lockPath, moved, ec);
+    if (ec) {
+        return;
+    }
+
+    // Another node replaced it between the check and the rename: give it back
+    if (held(moved, true)) {
+        std::filesystem::create_hard_link(moved, lockPath, ec);
+    }
+    std::filesystem::remove(moved, ec);
+}
+
+bool LeaseManager::write(const std::filesystem::path& path) const {
+    std::FILE* file = std::fopen(path.string().c_str(), "w");
+    if (!file) {
+        return false;
+    }
+
+    int64_t expires = nowMs() + std::chrono::duration_cast<std::chrono::milliseconds>(duration_).count();
+    bool ok = std::fprintf(file, "owner=%s\nexpires=%lld\n", nodeId_.c_str(),
+                           static_cast<long long>(expires)) > 0;
+    return std::fclose(file) == 0 && ok;
+}
+
+} // namespace pnpl
@@ -0,0 +1,219 @@
+#include "pnpl/job_metadata.hpp"
+#include <fstream>
+#include <sstream>
+
+namespace pnpl {
+
+namespace {
+
+    // Values are single lines; escape newlines and backslashes (stop strings often contain "\n")
+    std::string escapeValue(const std::string& value) {
+        std::string result;
+        for (char c : value) {
+            if (c == '\\') result += "\\\\";
+            else if (c == '\n') result += "\\n";
+            else if (c == '\r') result += "\\r";
+            else result += c;
+        }
+        return result;
+    }
+
+    std::string unescapeValue(const std::string& value) {
+        std::string result;
+        for (size_t i = 0; i < value.size(); ++i) {
+            if (value[i] == '\\' && i + 1 < value.size()) {
+                char next = value[++i];
+                if (next == 'n') result += '\n';
+                else if (next == 'r') result += '\r';
+                else result += next;
+            } else {
+                result += value[i];
+            }
+        }
+        return result;
+    }
+
+    // Via a temporary file and rename, so a reader never sees a sidecar half-written
+    bool writeSidecar(const std::filesystem::path& path, const std::string& content) {
+        std::filesystem::path tempPath = path;
+        tempPath += ".tmp";
+        {
+            std::ofstream file(tempPath);
+            file << content;
+            file.close();
+            if (file.fail()) {
+                std::error_code ec;
+                std::filesystem::remove(tempPath, ec);
+                return false;
+            }
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tempPath, path, ec);
+        if (ec) {
+            std::filesystem::remove(tempPath, ec);
+            return false;
+        }
+        return true;
+    }
+
+} // namespace
+
+bool GenerationParams::operator==(const GenerationParams& other) const {
+    return maxTokens == other.maxTokens && stop == other.stop &&
+           temperature == other.temperature && topK == other.topK && topP == other.topP &&
+           repeatPenalty == other.repeatPenalty && repeatLastN == other.repeatLastN &&
+           seed == other.seed && promptTemplate == other.promptTemplate && onLoop == other.onLoop;
+}
+
+bool JobMetadata::empty() const {
+    return model.empty() && !embedding && tenant.empty() && generation == GenerationParams() &&
+           role == JobRole::Normal && parent.empty() && loop.empty();
+}
+
+std::filesystem::path metadataPath(const std::filesystem::path& directory,
+                                   const std::string& jobId) {
+    return directory / (jobId + ".meta");
+}
+
+bool readJobMetadata(const std::filesystem::path& path, JobMetadata& metadata) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::stringstream text;
+    text << file.rdbuf();
+    parseJobMetadata(text.str(), metadata);
+    return true;
+}
+
+void parseJobMetadata(const std::string& text, JobMetadata& metadata) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        std::string key = line.substr(0, eq);
+        std::string value = unescapeValue(line.substr(eq + 1));
+        GenerationParams& gen = metadata.generation;
+
+        // Unknown keys are ignored so older servers accept newer clients
+        try {
+            if (key == "model") metadata.model = value;
+            else if (key == "type") metadata.embedding = (value == "embed");
+            else if (key == "tenant") metadata.tenant = value;
+            else if (key == "max_tokens") gen.maxTokens = std::stoi(value);
+            else if (key == "stop") gen.stop.push_back(value);
+            else if (key == "temperature") gen.temperature = std::stof(value);
+            else if (key == "top_k") gen.topK = std::stoi(value);
+            else if (key == "top_p") gen.topP = std::stof(value);
+            else if (key == "repeat_penalty") gen.repeatPenalty = std::stof(value);
+            else if (key == "repeat_last_n") gen.repeatLastN = std::stoi(value);
+            else if (key == "seed") gen.seed = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "template") gen.promptTemplate = value;
+            else if (key == "on_loop") gen.onLoop = value == "penalize" ? LoopAction::Penalize :
+                                                    value == "off" ? LoopAction::Ignore : LoopAction::Stop;
+            else if (key == "role") metadata.role = value == "map" ? JobRole::Map :
+                                                    value == "reduce" ? JobRole::Reduce : JobRole::Normal;
+            else if (key == "parent") metadata.parent = value;
+            else if (key == "part") metadata.part = std::stoi(value);
+            else if (key == "loop") metadata.loop = value;
+            else if (key == "loop_period") metadata.loopPeriod = std::stoi(value);
+            else if (key == "loop_at") metadata.loopAtToken = std::stoi(value);
+        } catch (const std::exception&) {
+            // Keep the default for a malformed value
+        }
+    }
+}
+
+bool writeJobMetadata(const std::filesystem::path& path, const JobMetadata& metadata) {
+    return writeSidecar(path, formatJobMetadata(metadata));
+}
+
+std::string formatJobMetadata(const JobMetadata& metadata) {
+    std::ostringstream file;
+    const GenerationParams defaults;
+    const GenerationParams& gen = metadata.generation;
+
+    // Only non-default settings are written
+    if (!metadata.model.empty()) file << "model=" << escapeValue(metadata.model) << "\n";
+    if (metadata.embedding) file << "type=embed\n";
+    if (!metadata.tenant.empty()) file << "tenant=" << escapeValue(metadata.tenant) << "\n";
+    if (gen.maxTokens != defaults.maxTokens) file << "max_tokens=" << gen.maxTokens << "\n";
+    for (const auto& stop : gen.stop) file << "stop=" << escapeValue(stop) << "\n";
+    if (gen.temperature != defaults.temperature) file << "temperature=" << gen.temperature << "\n";
+    if (gen.topK != defaults.topK) file << "top_k=" << gen.topK << "\n";
+    if (gen.topP != defaults.topP) file << "top_p=" << gen.topP << "\n";
+    if (gen.repeatPenalty != defaults.repeatPenalty) file << "repeat_penalty=" << gen.repeatPenalty << "\n";
+    if (gen.repeatLastN != defaults.repeatLastN) file << "repeat_last_n=" << gen.repeatLastN << "\n";
+    if (gen.seed != defaults.seed) file << "seed=" << gen.seed << "\n";
+    if (!gen.promptTemplate.empty()) file << "template=" << escapeValue(gen.promptTemplate) << "\n";
+    if (gen.onLoop == LoopAction::Penalize) file << "on_loop=penalize\n";
+    if (gen.onLoop == LoopAction::Ignore) file << "on_loop=off\n";
+    if (metadata.role == JobRole::Map) file << "role=map\npart=" << metadata.part << "\n";
+    if (metadata.role == JobRole::Reduce) file << "role=reduce\n";
+    if (!metadata.parent.empty()) file << "parent=" << escapeValue(metadata.parent) << "\n";
+    if (!metadata.loop.empty()) {
+        file << "loop=" << escapeValue(metadata.loop) << "\nloop_period=" << metadata.loopPeriod
+             << "\nloop_at=" << metadata.loopAtToken << "\n";
+    }
+
+    return file.str();
+}
+
+bool readJobTiming(const std::filesystem::path& path, JobTiming& timing) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+
+        try {
+            std::string key = line.substr(0, eq);
+            if (key == "started_ms") timing.startedMs = std::stoll(line.substr(eq + 1));
+            else if (key == "finished_ms") timing.finishedMs = std::stoll(line.substr(eq + 1));
+        } catch (const std::exception&) {
+            // Keep the default for a malformed value
+        }
+    }
+
+    return timing.finishedMs > 0;
+}
+
+bool writeJobTiming(const std::filesystem::path& path, const JobTiming& timing) {
+    std::ostringstream file;
+    file << "started_ms=" << timing.startedMs << "\n";
+    file << "finished_ms=" << timing.finishedMs << "\n";
+    return writeSidecar(path, file.str());
+}
+
+std::filesystem::path cancelDirectory(const std::string& inputDirectory) {
+    return std::filesystem::path(inputDirectory + "_cancel");
+}
+
+bool readCancelRequest(const std::filesystem::path& path, CancelRequest& request) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line == "partial=keep") request.keepPartial = true;
+    }
+    return true;
+}
+
+bool writeCancelRequest(const std::filesystem::path& path, const CancelRequest& request) {
+    std::ofstream file(path);
+    file << "partial=" << (request.keepPartial ? "keep" : "discard") << "\n";
+    return !file.fail();
+}
+
+} // namespace pnpl
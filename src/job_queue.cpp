@@ -0,0 +1,201 @@
+#include "pnpl/job_queue.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace pnpl {
+
+uint64_t JobQueue::ModelQueue::oldestSequence() const {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (const auto& tenant : active) {
+        oldest = std::min(oldest, tenants.at(tenant).entries.front().sequence);
+    }
+    return oldest;
+}
+
+void JobQueue::setTenantWeight(const std::string& tenant, int weight) {
+    weights_[tenant] = std::max(1, weight);
+}
+
+void JobQueue::push(const QueuedJob& job) {
+    ModelQueue& queue = queues_[job.model];
+    TenantQueue& tenant = queue.tenants[job.tenant];
+    if (tenant.entries.empty()) {
+        // Joins the round just before the current tenant, i.e. last in line
+        queue.active.insert(queue.active.begin() + std::min(queue.cursor, queue.active.size()), job.tenant);
+        if (queue.active.size() > 1) queue.cursor++;
+    }
+    tenant.entries.push_back(Entry{job, nextSequence_++});
+    queue.size++;
+    size_++;
+}
+
+bool JobQueue::pop(const std::string& preferredModel, int& streak, QueuedJob& job) {
+    if (size_ == 0) {
+        return false;
+    }
+
+    // Oldest waiting job across all other models
+    auto preferred = queues_.find(preferredModel);
+    auto oldestOther = queues_.end();
+    for (auto it = queues_.begin(); it != queues_.end(); ++it) {
+        if (it == preferred || it->second.size == 0) continue;
+        if (oldestOther == queues_.end() ||
+            it->second.oldestSequence() < oldestOther->second.oldestSequence()) {
+            oldestOther = it;
+        }
+    }
+
+    bool havePreferred = preferred != queues_.end() && preferred->second.size > 0;
+
+    if (havePreferred && oldestOther == queues_.end()) {
+        // Nobody else is waiting: stay on the attached model
+        streak = 0;
+        job = take(preferred->second);
+    } else if (havePreferred && streak < MAX_AFFINITY_STREAK) {
+        streak++;
+        job = take(preferred->second);
+    } else {
+        streak = 0;
+        job = take((oldestOther != queues_.end() ? oldestOther : preferred)->second);
+    }
+
+    return true;
+}
+
+size_t JobQueue::popEmbeddings(const std::string& model, size_t maxJobs,
+                               std::vector<QueuedJob>& jobs) {
+    auto it = queues_.find(model);
+    if (it == queues_.end()) {
+        return 0;
+    }
+
+    // Pull embedding jobs out of the model's queue, leaving generation jobs in order.
+    // Batched jobs still count against their tenant's share.
+    size_t taken = 0;
+    ModelQueue& queue = it->second;
+    for (size_t i = 0; i < queue.active.size() && taken < maxJobs; ) {
+        TenantQueue& tenant = queue.tenants[queue.active[i]];
+        for (auto entry = tenant.entries.begin(); entry != tenant.entries.end() && taken < maxJobs; ) {
+            if (entry->job.embedding) {
+                tenant.deficit -= entry->job.cost;
+                jobs.push_back(std::move(entry->job));
+                entry = tenant.entries.erase(entry);
+                queue.size--;
+                size_--;
+                taken++;
+            } else {
+                ++entry;
+            }
+        }
+
+        if (tenant.entries.empty()) {
+            deactivate(queue, i);
+        } else {
+            ++i;
+        }
+    }
+    return taken;
+}
+
+bool JobQueue::remove(const std::string& jobId, QueuedJob& job) {
+    for (auto& model : queues_) {
+        ModelQueue& queue = model.second;
+        for (size_t i = 0; i < queue.active.size(); ++i) {
+            TenantQueue& tenant = queue.tenants[queue.active[i]];
+            auto entry = std::find_if(tenant.entries.begin(), tenant.entries.end(),
+                                      [&jobId](const Entry& e) { return e.job.id == jobId; });
+            if (entry == tenant.entries.end()) continue;
+
+            // The tenant isn't charged for a job that never ran
+            job = std::move(entry->job);
+            tenant.entries.erase(entry);
+            queue.size--;
+            size_--;
+            if (tenant.entries.empty()) {
+                deactivate(queue, i);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobQueue::charge(const std::string& model, const std::string& tenant, int tokens) {
+    auto queue = queues_.find(model);
+    if (queue == queues_.end()) return;
+
+    // Only tenants still in the round carry credit or debt forward
+    auto it = queue->second.tenants.find(tenant);
+    if (it != queue->second.tenants.end() && !it->second.entries.empty()) {
+        it->second.deficit -= tokens;
+    }
+}
+
+bool JobQueue::empty() const {
+    return size_ == 0;
+}
+
+size_t JobQueue::size() const {
+    return size_;
+}
+
+std::map<std::string, size_t> JobQueue::depthByModel() const {
+    std::map<std::string, size_t> depth;
+    for (const auto& queue : queues_) {
+        if (queue.second.size > 0) {
+            depth[queue.first] = queue.second.size;
+        }
+    }
+    return depth;
+}
+
+std::map<std::string, size_t> JobQueue::depthByTenant() const {
+    std::map<std::string, size_t> depth;
+    for (const auto& queue : queues_) {
+        for (const auto& tenant : queue.second.tenants) {
+            if (!tenant.second.entries.empty()) {
+                depth[tenant.first] += tenant.second.entries.size();
+            }
+        }
+    }
+    return depth;
+}
+
+QueuedJob JobQueue::take(ModelQueue& queue) {
+    // Deficit round-robin: the tenant whose turn it is runs jobs while its credit covers
+    // them; otherwise it gets another quantum (scaled by weight) and the turn moves on
+    for (;;) {
+        if (queue.cursor >= queue.active.size()) {
+            queue.cursor = 0;
+        }
+
+        const std::string& name = queue.active[queue.cursor];
+        TenantQueue& tenant = queue.tenants[name];
+        if (tenant.deficit >= tenant.entries.front().job.cost) {
+            QueuedJob job = std::move(tenant.entries.front().job);
+            tenant.entries.pop_front();
+            tenant.deficit -= job.cost;
+            queue.size--;
+            size_--;
+
+            if (tenant.entries.empty()) {
+                deactivate(queue, queue.cursor);
+            }
+            return job;
+        }
+
+        auto weight = weights_.find(name);
+        tenant.deficit += static_cast<int64_t>(QUANTUM_TOKENS) * (weight != weights_.end() ? weight->second : 1);
+        queue.cursor++;
+    }
+}
+
+void JobQueue::deactivate(ModelQueue& queue, size_t index) {
+    queue.tenants[queue.active[index]].deficit = 0;
+    queue.active.erase(queue.active.begin() + index);
+    if (index < queue.cursor) {
+        queue.cursor--;
+    }
+}
+
+} // namespace pnpl
@@ -0,0 +1,419 @@
+#include "pnpl/push_manager.hpp"
+#include "pnpl/pop_manager.hpp"
+#include "pnpl/job_metadata.hpp"
+#include "pnpl/job_layout.hpp"
+#include "pnpl/executable_path.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <cmath>
+#include <cstdint>
+
+void printUsage(const char* program) {
+    std::cout << "PNPL Load Generator: replay a workload against a running server" << std::endl;
+    std::cout << "Usage: " << program << " [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Workload (one of):" << std::endl;
+    std::cout << "  --trace <file>       Replay a trace: one job per line, \"<arrival_s> <prompt_tokens> [max_tokens]\"" << std::endl;
+    std::cout << "  --jobs <n>           Synthetic workload of n jobs (default: 100)" << std::endl;
+    std::cout << "    --prompt-tokens <n>  Mean prompt size, uniform in [n/2, 3n/2] (default: 256)" << std::endl;
+    std::cout << "    --max-tokens <n>   Generation budget per job (default: 128)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Arrivals:" << std::endl;
+    std::cout << "  --mode open|closed   Open loop submits on schedule regardless of completions;" << std::endl;
+    std::cout << "                       closed loop keeps a fixed number of jobs in flight (default: open)" << std::endl;
+    std::cout << "  --rate <jobs/s>      Open loop: Poisson arrivals at this rate (default: trace times, else 1)" << std::endl;
+    std::cout << "  --speed <x>          Open loop: replay trace arrival times x times faster (default: 1)" << std::endl;
+    std::cout << "  --concurrency <n>    Closed loop: jobs in flight (default: 4)" << std::endl;
+    std::cout << "  --seed <n>           Random seed for arrivals and prompt sizes (default: 1)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --input-dir <dir>    Input directory (default: <project>/data/input)" << std::endl;
+    std::cout << "  --output-dir <dir>   Output directory (default: <project>/data/output)" << std::endl;
+    std::cout << "  --tenant <name>      Tenant to push the jobs as" << std::endl;
+    std::cout << "  --timeout <s>        Give up on results this long after the last push (default: 600)" << std::endl;
+    std::cout << "  --report <file>      Write the JSON report here instead of stdout" << std::endl;
+    std::cout << "  --keep-results       Leave result files in the output directory" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Queue and service latency need a server started with --job-timings." << std::endl;
+}
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    // One job of the workload
+    struct WorkItem {
+        double arrivalSeconds = 0;   // Offset from the start of the run (open loop)
+        int promptTokens = 0;
+        int maxTokens = 0;
+    };
+
+    // A pushed job and what we learned about it
+    struct Submission {
+        std::string id;
+        int64_t pushedMs = 0;        // Wall clock, comparable with the server's timing files
+        Clock::time_point pushed;
+        Clock::time_point seen;      // First poll that found the result
+        bool done = false;
+        bool failed = false;
+        pnpl::JobTiming timing;
+    };
+
+    // A result without a timing file yet is re-polled this long before giving up on it
+    const auto TIMING_GRACE = std::chrono::milliseconds(1000);
+    const auto POLL_INTERVAL = std::chrono::milliseconds(5);
+
+    int64_t epochMilliseconds() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    double millisecondsBetween(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    bool readTrace(const std::string& path, std::vector<WorkItem>& items) {
+        std::ifstream file(path);
+        if (!file) {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::istringstream fields(line);
+            WorkItem item;
+            if (fields >> item.arrivalSeconds >> item.promptTokens) {
+                fields >> item.maxTokens;
+                items.push_back(item);
+            }
+        }
+
+        std::stable_sort(items.begin(), items.end(), [](const WorkItem& a, const WorkItem& b) {
+            return a.arrivalSeconds < b.arrivalSeconds;
+        });
+        return true;
+    }
+
+    // Filler text of roughly the requested number of tokens (common words are one token each)
+    std::string makePrompt(int tokens, std::mt19937& rng) {
+        static const char* words[] = {
+            "the", "queue", "server", "job", "result", "worker", "model", "batch", "input", "output",
+            "file", "time", "data", "report", "value", "system", "process", "review", "code", "test"
+        };
+        std::uniform_int_distribution<size_t> pick(0, sizeof(words) / sizeof(words[0]) - 1);
+
+        std::string prompt = "Summarize the following notes.\n";
+        for (int i = 0; i < tokens; ++i) {
+            prompt += words[pick(rng)];
+            prompt += (i % 16 == 15) ? '\n' : ' ';
+        }
+        return prompt;
+    }
+
+    struct Percentiles {
+        size_t count = 0;
+        double mean = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+    };
+
+    Percentiles percentiles(std::vector<double> samples) {
+        Percentiles result;
+        if (samples.empty()) {
+            return result;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        // Nearest rank
+        auto rank = [&samples](double p) {
+            size_t index = static_cast<size_t>(std::ceil(p * samples.size()));
+            return samples[std::min(samples.size() - 1, index > 0 ? index - 1 : 0)];
+        };
+
+        result.count = samples.size();
+        for (double sample : samples) result.mean += sample;
+        result.mean /= samples.size();
+        result.p50 = rank(0.50);
+        result.p95 = rank(0.95);
+        result.p99 = rank(0.99);
+        result.max = samples.back();
+        return result;
+    }
+
+    void writePercentiles(std::ostream& out, const char* name, const Percentiles& p, bool last) {
+        out << "    \"" << name << "\": ";
+        if (p.count == 0) {
+            out << "null";
+        } else {
+            out << "{\"count\": " << p.count << ", \"mean\": " << p.mean << ", \"p50\": " << p.p50
+                << ", \"p95\": " << p.p95 << ", \"p99\": " << p.p99 << ", \"max\": " << p.max << "}";
+        }
+        out << (last ? "\n" : ",\n");
+    }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string projectRoot = pnpl::getProjectRoot("pnpl_loadgen");
+    std::string inputDir = projectRoot + "/data/input";
+    std::string outputDir = projectRoot + "/data/output";
+    std::string traceFile;
+    std::string reportFile;
+    std::string tenant;
+    std::string mode = "open";
+    int jobs = 100;
+    int promptTokens = 256;
+    int maxTokens = 128;
+    double rate = 0;
+    double speed = 1;
+    int concurrency = 4;
+    unsigned seed = 1;
+    int timeoutSeconds = 600;
+    bool keepResults = false;
+
+    // Parse options
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        try {
+            if (arg == "--trace" && i + 1 < argc) traceFile = argv[++i];
+            else if (arg == "--jobs" && i + 1 < argc) jobs = std::stoi(argv[++i]);
+            else if (arg == "--prompt-tokens" && i + 1 < argc) promptTokens = std::stoi(argv[++i]);
+            else if (arg == "--max-tokens" && i + 1 < argc) maxTokens = std::stoi(argv[++i]);
+            else if (arg == "--mode" && i + 1 < argc) mode = argv[++i];
+            else if (arg == "--rate" && i + 1 < argc) rate = std::stod(argv[++i]);
+            else if (arg == "--speed" && i + 1 < argc) speed = std::stod(argv[++i]);
+            else if (arg == "--concurrency" && i + 1 < argc) concurrency = std::stoi(argv[++i]);
+            else if (arg == "--seed" && i + 1 < argc) seed = static_cast<unsigned>(std::stoul(argv[++i]));
+            else if (arg == "--timeout" && i + 1 < argc) timeoutSeconds = std::stoi(argv[++i]);
+            else if (arg == "--input-dir" && i + 1 < argc) inputDir = std::filesystem::absolute(argv[++i]).string();
+            else if (arg == "--output-dir" && i + 1 < argc) outputDir = std::filesystem::absolute(argv[++i]).string();
+            else if (arg == "--tenant" && i + 1 < argc) tenant = argv[++i];
+            else if (arg == "--report" && i + 1 < argc) reportFile = argv[++i];
+            else if (arg == "--keep-results") keepResults = true;
+            else if (arg == "--help" || arg == "-h") {
+                printUsage(argv[0]);
+                return 0;
+            } else {
+                std::cerr << "Error: Unknown option " << arg << std::endl;
+                return 1;
+            }
+        } catch (...) {
+            std::cerr << "Error: Invalid value for " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (mode != "open" && mode != "closed") {
+        std::cerr << "Error: --mode must be open or closed" << std::endl;
+        return 1;
+    }
+
+    // Build the workload
+    std::mt19937 rng(seed);
+    std::vector<WorkItem> items;
+    if (!traceFile.empty()) {
+        if (!readTrace(traceFile, items)) {
+            std::cerr << "Error: Cannot read trace " << traceFile << std::endl;
+            return 1;
+        }
+    } else {
+        std::uniform_int_distribution<int> size(std::max(1, promptTokens / 2), std::max(1, promptTokens * 3 / 2));
+        items.resize(std::max(0, jobs));
+        for (auto& item : items) {
+            item.promptTokens = size(rng);
+            item.maxTokens = maxTokens;
+        }
+    }
+    if (items.empty()) {
+        std::cerr << "Error: Empty workload" << std::endl;
+        return 1;
+    }
+
+    // Open loop: Poisson arrivals when a rate is given or the workload has no times
+    if (mode == "open" && (rate > 0 || traceFile.empty())) {
+        std::exponential_distribution<double> gap(rate > 0 ? rate : 1.0);
+        double t = 0;
+        for (auto& item : items) {
+            item.arrivalSeconds = t;
+            t += gap(rng);
+        }
+        speed = 1;
+    }
+
+    pnpl::PushManager pushManager(inputDir);
+    pnpl::PopManager popManager(outputDir);
+    pnpl::JobLayout outputLayout = pnpl::JobLayout::forDirectory(outputDir);
+    const std::filesystem::path failedDir = inputDir + "_failed";
+
+    std::cerr << "Replaying " << items.size() << " job(s) in " << mode << "-loop mode against "
+              << inputDir << std::endl;
+
+    std::vector<Submission> submissions;
+    submissions.reserve(items.size());
+    std::deque<size_t> outstanding;   // Indexes into submissions
+    size_t next = 0;
+    size_t finished = 0;
+    const Clock::time_point start = Clock::now();
+    Clock::time_point lastPush = start;
+
+    auto push = [&](const WorkItem& item) {
+        pnpl::JobMetadata metadata;
+        metadata.tenant = tenant;
+        metadata.generation.maxTokens = item.maxTokens;
+
+        Submission submission;
+        submission.pushedMs = epochMilliseconds();
+        submission.pushed = Clock::now();
+        submission.id = pushManager.createJob(makePrompt(item.promptTokens, rng), metadata);
+        if (submission.id.empty()) {
+            std::cerr << "Warning: Failed to push job" << std::endl;
+            submission.failed = true;
+            submission.done = true;
+            finished++;
+        } else {
+            outstanding.push_back(submissions.size());
+        }
+        submissions.push_back(submission);
+        lastPush = Clock::now();
+    };
+
+    // Check outstanding jobs; returns how many finished in this pass
+    auto poll = [&]() {
+        size_t completed = 0;
+        const auto now = Clock::now();
+        for (auto it = outstanding.begin(); it != outstanding.end();) {
+            Submission& job = submissions[*it];
+
+            if (job.seen == Clock::time_point() && popManager.isJobCompleted(job.id)) {
+                job.seen = now;
+            } else if (job.seen == Clock::time_point() &&
+                       std::filesystem::exists(failedDir / (job.id + ".txt"))) {
+                job.failed = true;
+            }
+
+            // Servers write the timing file before the result (older ones just after it)
+            bool resolved = job.failed;
+            if (!resolved && job.seen != Clock::time_point()) {
+                resolved = pnpl::readJobTiming(outputLayout.pathFor(outputDir, job.id, pnpl::JOB_TIMING_EXTENSION),
+                                               job.timing) ||
+                           now - job.seen > TIMING_GRACE;
+            }
+
+            if (resolved) {
+                job.done = true;
+                completed++;
+                it = outstanding.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        finished += completed;
+        return completed;
+    };
+
+    const auto timeout = std::chrono::seconds(timeoutSeconds);
+    if (mode == "open") {
+        while (finished < items.size()) {
+            const auto now = Clock::now();
+            while (next < items.size() &&
+                   now - start >= std::chrono::duration<double>(items[next].arrivalSeconds / speed)) {
+                push(items[next++]);
+            }
+            if (next == items.size() && now - lastPush > timeout) break;
+
+            poll();
+
+            auto wake = Clock::now() + POLL_INTERVAL;
+            if (next < items.size()) {
+                auto arrival = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(items[next].arrivalSeconds / speed));
+                wake = std::min(wake, arrival);
+            }
+            std::this_thread::sleep_until(wake);
+        }
+    } else {
+        while (finished < items.size()) {
+            while (next < items.size() && outstanding.size() < static_cast<size_t>(std::max(1, concurrency))) {
+                push(items[next++]);
+            }
+            if (Clock::now() - lastPush > timeout) break;
+
+            if (poll() == 0) {
+                std::this_thread::sleep_for(POLL_INTERVAL);
+            }
+        }
+    }
+    const Clock::time_point end = Clock::now();
+
+    // Latencies in milliseconds
+    std::vector<double> queueLatency, serviceLatency, endToEnd;
+    size_t completed = 0, failed = 0;
+    for (const auto& job : submissions) {
+        if (!job.done) continue;
+        if (job.failed) {
+            failed++;
+            continue;
+        }
+        completed++;
+
+        if (job.timing.finishedMs > 0) {
+            queueLatency.push_back(static_cast<double>(std::max<int64_t>(0, job.timing.startedMs - job.pushedMs)));
+            serviceLatency.push_back(static_cast<double>(job.timing.finishedMs - job.timing.startedMs));
+            endToEnd.push_back(static_cast<double>(job.timing.finishedMs - job.pushedMs));
+        } else {
+            endToEnd.push_back(millisecondsBetween(job.pushed, job.seen));
+        }
+
+        if (!keepResults) {
+            std::error_code ec;
+            for (const char* extension : {".txt", ".txt.gz", ".emb", ".meta", pnpl::JOB_TIMING_EXTENSION.c_str()}) {
+                std::filesystem::remove(outputLayout.pathFor(outputDir, job.id, extension), ec);
+            }
+        }
+    }
+
+    if (!endToEnd.empty() && queueLatency.empty()) {
+        std::cerr << "Note: No timing files found; start the server with --job-timings for queue/service latency"
+                  << std::endl;
+    }
+
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    std::ofstream reportStream;
+    if (!reportFile.empty()) {
+        reportStream.open(reportFile);
+        if (!reportStream) {
+            std::cerr << "Error: Cannot write report " << reportFile << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = reportFile.empty() ? std::cout : reportStream;
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"mode\": \"" << mode << "\",\n";
+    out << "  \"jobs\": " << items.size() << ",\n";
+    out << "  \"completed\": " << completed << ",\n";
+    out << "  \"failed\": " << failed << ",\n";
+    out << "  \"timed_out\": " << items.size() - completed - failed << ",\n";
+    out << "  \"duration_s\": " << seconds << ",\n";
+    out << "  \"throughput_jobs_per_s\": " << (seconds > 0 ? completed / seconds : 0.0) << ",\n";
+    out << "  \"latency_ms\": {\n";
+    writePercentiles(out, "queue", percentiles(queueLatency), false);
+    writePercentiles(out, "service", percentiles(serviceLatency), false);
+    writePercentiles(out, "end_to_end", percentiles(endToEnd), true);
+    out << "  }\n";
+    out << "}" << std::endl;
+
+    return completed + failed == items.size() ? 0 : 2;
+}
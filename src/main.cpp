@@ -1,6 +1,7 @@
 #include "pnpl/push_manager.hpp"
 #include "pnpl/pop_manager.hpp"
 #include "pnpl/inference_runner.hpp"
+#include "pnpl/executable_path.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -8,55 +9,70 @@
 #include <filesystem>
 #include <algorithm>
 #include <iomanip>
-
-#ifdef __APPLE__
-#include <mach-o/dyld.h>
-#elif defined(__linux__)
+#include <sstream>
+#include <chrono>
+#include <ctime>
+#include <fcntl.h>
 #include <unistd.h>
-#elif defined(_WIN32)
-#include <windows.h>
-#endif
-
-std::string getExecutablePath() {
-    std::string path;
-
-#ifdef __APPLE__
-    char buffer[PATH_MAX];
-    uint32_t size = sizeof(buffer);
-    if (_NSGetExecutablePath(buffer, &size) == 0) {
-        path = std::filesystem::canonical(buffer).string();
-    }
-#elif defined(__linux__)
-    char buffer[PATH_MAX];
-    ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
-    if (len != -1) {
-        buffer[len] = '\0';
-        path = std::filesystem::canonical(buffer).string();
-    }
-#elif defined(_WIN32)
-    char buffer[MAX_PATH];
-    if (GetModuleFileNameA(NULL, buffer, MAX_PATH) > 0) {
-        path = std::filesystem::canonical(buffer).string();
-    }
-#endif
 
-    if (path.empty()) {
-        // Fallback: use current working directory
-        path = std::filesystem::current_path().string() + "/pnpl";
-        std::cerr << "Warning: Could not determine executable path, using fallback" << std::endl;
+// Print a result's text, or an embedding as space-separated floats
+void printResult(const pnpl::JobResult& result) {
+    if (result.embedding.empty()) {
+        std::cout << result.outputText << std::endl;
+        return;
     }
 
-    return path;
+    for (size_t i = 0; i < result.embedding.size(); ++i) {
+        if (i > 0) std::cout << ' ';
+        std::cout << result.embedding[i];
+    }
+    std::cout << std::endl;
 }
 
-std::string getProjectRoot() {
-    std::filesystem::path exePath = getExecutablePath();
-    std::filesystem::path buildDir = exePath.parent_path();
+// Starting point of a bulk export: a job ID ("YYYYMMDDhhmmss_NNNNNN") or a local time
+// "YYYY-MM-DD[ hh:mm[:ss]]" (a 'T' may separate date and time)
+bool parseExportStart(const std::string& value, pnpl::ExportRange& range) {
+    // A job ID, optionally with its completion time from the stream header: <id>@<completed_ms>
+    size_t at = value.find('@');
+    std::string jobId = value.substr(0, at);
+    if (jobId.find('_') == 14 && jobId.find_first_not_of("0123456789_") == std::string::npos) {
+        if (at != std::string::npos) {
+            std::string completed = value.substr(at + 1);
+            if (completed.empty() || completed.size() > 18 ||
+                completed.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            range.afterMs = std::stoll(completed);
+        }
+        range.afterJobId = jobId;
+        return true;
+    }
 
-    // Go up one level to project root (assuming we're in build/)
-    std::filesystem::path projectRoot = buildDir.parent_path();
+    std::tm tm = {};
+    std::istringstream in(value);
+    in >> std::get_time(&tm, "%Y-%m-%d");
+    if (!in.fail() && !in.eof()) {
+        char separator = static_cast<char>(in.get());
+        if (separator != 'T' && separator != ' ') {
+            return false;
+        }
+        in >> std::get_time(&tm, "%H:%M");
+        if (!in.fail() && !in.eof() && in.get() == ':') {
+            in >> tm.tm_sec;
+        }
+    }
+    // The whole value must have been consumed
+    if (in.fail() || !in.eof()) {
+        return false;
+    }
 
-    return projectRoot.string();
+    tm.tm_isdst = -1;
+    std::time_t time = std::mktime(&tm);
+    if (time == -1) {
+        return false;
+    }
+    range.sinceMs = static_cast<int64_t>(time) * 1000;
+    return true;
 }
 
 void printUsage(const char* program) {
@@ -66,11 +82,35 @@ void printUsage(const char* program) {
     std::cout << "Commands:" << std::endl;
     std::cout << "  push <content>       Create a new job with the given content" << std::endl;
     std::cout << "  push --file <path>   Create a new job from file content" << std::endl;
+    std::cout << "    --model <name>     Run the job on a named server model" << std::endl;
+    std::cout << "    --embed            Compute an embedding vector instead of generating text" << std::endl;
+    std::cout << "    --max-tokens <n>   Maximum number of tokens to generate" << std::endl;
+    std::cout << "    --stop <text>      Stop generating at this text (repeatable)" << std::endl;
+    std::cout << "    --temp <t>         Sampling temperature (default: 0 = greedy)" << std::endl;
+    std::cout << "    --top-k <n>        Top-k sampling (with --temp)" << std::endl;
+    std::cout << "    --top-p <p>        Nucleus sampling (with --temp)" << std::endl;
+    std::cout << "    --repeat-penalty <p>  Repetition penalty (default: 1.1)" << std::endl;
+    std::cout << "    --seed <n>         Sampling seed" << std::endl;
+    std::cout << "    --on-loop <action> When output starts repeating itself: stop (default)," << std::endl;
+    std::cout << "                       penalize (raise the repeat penalty first) or off" << std::endl;
+    std::cout << "    --template <name>  Wrap the input in this prompt template" << std::endl;
+    std::cout << "    --tenant <name>    Account the job to a team for fair-share scheduling" << std::endl;
     std::cout << "  pop [job_id]         Get results for a job (defaults to latest)" << std::endl;
+    std::cout << "    --consume          Remove the result as it is read (each result goes to one popper)" << std::endl;
+    std::cout << "  pop --all            Export all results as one framed stream (see README)" << std::endl;
+    std::cout << "    --since <when>     Only results completed after a job ID or local time" << std::endl;
+    std::cout << "                       YYYY-MM-DD[Thh:mm[:ss]]" << std::endl;
+    std::cout << "    --output <file>    Write the stream to a file instead of stdout" << std::endl;
     std::cout << "  list                 List all available jobs" << std::endl;
+    std::cout << "    --since <date>     Only jobs created on or after YYYY-MM-DD" << std::endl;
+    std::cout << "    --until <date>     Only jobs created on or before YYYY-MM-DD" << std::endl;
+    std::cout << "  migrate <layout>     Move queued jobs and results to the flat, hashed or date" << std::endl;
+    std::cout << "                       directory layout (stop the server first)" << std::endl;
     std::cout << "  status <job_id>      Check status of a job" << std::endl;
+    std::cout << "  cancel <job_id>      Withdraw a queued job or stop a running one" << std::endl;
+    std::cout << "    --keep-partial     Keep the text generated so far as the job's result" << std::endl;
     std::cout << std::endl;
-    std::cout << "Data directory: " << getProjectRoot() << "/data" << std::endl;
+    std::cout << "Data directory: " << pnpl::getProjectRoot("pnpl") << "/data" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -81,7 +121,7 @@ int main(int argc, char* argv[]) {
     }
 
     // Setup directories - use project root, not build directory
-    std::string projectRoot = getProjectRoot();
+    std::string projectRoot = pnpl::getProjectRoot("pnpl");
     std::string dataDir = projectRoot + "/data";
     std::string inputDir = dataDir + "/input";
     std::string outputDir = dataDir + "/output";
@@ -105,40 +145,97 @@ int main(int argc, char* argv[]) {
         }
 
         std::string content;
-        bool is_file = false;
-
-        // Check if using --file option
-        if (std::string(argv[2]) == "--file") {
-            if (argc < 4) {
-                std::cerr << "Error: --file option requires a path" << std::endl;
-                return 1;
-            }
-            is_file = true;
-            std::string file_path = argv[3];
-
-            // Check if file exists
-            if (!std::filesystem::exists(file_path)) {
-                std::cerr << "Error: File not found: " << file_path << std::endl;
-                return 1;
+        pnpl::JobMetadata metadata;
+
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+
+            // Check if using --file option
+            if (arg == "--file") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --file option requires a path" << std::endl;
+                    return 1;
+                }
+                std::string file_path = argv[++i];
+
+                // Check if file exists
+                if (!std::filesystem::exists(file_path)) {
+                    std::cerr << "Error: File not found: " << file_path << std::endl;
+                    return 1;
+                }
+
+                // Read file content
+                std::ifstream file(file_path);
+                if (!file) {
+                    std::cerr << "Error: Failed to open file: " << file_path << std::endl;
+                    return 1;
+                }
+
+                content = std::string((std::istreambuf_iterator<char>(file)),
+                                     std::istreambuf_iterator<char>());
+            } else if (arg == "--model") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --model option requires a name" << std::endl;
+                    return 1;
+                }
+                metadata.model = argv[++i];
+            } else if (arg == "--template") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --template option requires a name" << std::endl;
+                    return 1;
+                }
+                metadata.generation.promptTemplate = argv[++i];
+            } else if (arg == "--tenant") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --tenant option requires a name" << std::endl;
+                    return 1;
+                }
+                metadata.tenant = argv[++i];
+            } else if (arg == "--on-loop") {
+                std::string action = i + 1 < argc ? argv[++i] : "";
+                if (action == "stop") metadata.generation.onLoop = pnpl::LoopAction::Stop;
+                else if (action == "penalize") metadata.generation.onLoop = pnpl::LoopAction::Penalize;
+                else if (action == "off") metadata.generation.onLoop = pnpl::LoopAction::Ignore;
+                else {
+                    std::cerr << "Error: --on-loop expects stop, penalize or off" << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--embed") {
+                metadata.embedding = true;
+            } else if (arg == "--stop") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --stop option requires text" << std::endl;
+                    return 1;
+                }
+                metadata.generation.stop.push_back(argv[++i]);
+            } else if (arg == "--max-tokens" || arg == "--temp" || arg == "--top-k" ||
+                       arg == "--top-p" || arg == "--repeat-penalty" || arg == "--seed") {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: " << arg << " option requires a value" << std::endl;
+                    return 1;
+                }
+                std::string value = argv[++i];
+                pnpl::GenerationParams& gen = metadata.generation;
+                try {
+                    if (arg == "--max-tokens") gen.maxTokens = std::stoi(value);
+                    else if (arg == "--temp") gen.temperature = std::stof(value);
+                    else if (arg == "--top-k") gen.topK = std::stoi(value);
+                    else if (arg == "--top-p") gen.topP = std::stof(value);
+                    else if (arg == "--repeat-penalty") gen.repeatPenalty = std::stof(value);
+                    else gen.seed = static_cast<uint32_t>(std::stoul(value));
+                } catch (...) {
+                    std::cerr << "Error: Invalid value for " << arg << ": " << value << std::endl;
+                    return 1;
+                }
+            } else {
+                // Use direct content from command line
+                content = arg;
             }
-
-            // Read file content
-            std::ifstream file(file_path);
-            if (!file) {
-                std::cerr << "Error: Failed to open file: " << file_path << std::endl;
-                return 1;
-            }
-
-            content = std::string((std::istreambuf_iterator<char>(file)),
-                                 std::istreambuf_iterator<char>());
-        } else {
-            // Use direct content from command line
-            content = argv[2];
         }
 
         // Create the job using explicit input directory
         pnpl::PushManager pushManager(inputDir);
-        std::string jobId = pushManager.createJob(content);
+        std::string jobId = pushManager.createJob(content, metadata);
 
         if (jobId.empty()) {
             std::cerr << "Error: Failed to create job" << std::endl;
@@ -153,9 +250,107 @@ int main(int argc, char* argv[]) {
     else if (command == "pop") {
         pnpl::PopManager popManager(outputDir);
 
+        // Bulk export: every result (since a point) as one stream, for ETL
+        if (argc >= 3 && std::string(argv[2]) == "--all") {
+            pnpl::ExportRange range;
+            std::string outputFile;
+            for (int i = 3; i < argc; i++) {
+                std::string arg = argv[i];
+                if (arg == "--since" && i + 1 < argc) {
+                    if (!parseExportStart(argv[++i], range)) {
+                        std::cerr << "Error: --since expects <job ID>[@<completed_ms>] or YYYY-MM-DD[Thh:mm[:ss]]" << std::endl;
+                        return 1;
+                    }
+                } else if (arg == "--output" && i + 1 < argc) {
+                    outputFile = argv[++i];
+                } else {
+                    std::cerr << "Error: Unknown option " << arg << std::endl;
+                    return 1;
+                }
+            }
+
+            int fd = STDOUT_FILENO;
+            if (!outputFile.empty()) {
+                fd = ::open(outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    std::cerr << "Error: Cannot open " << outputFile << std::endl;
+                    return 1;
+                }
+            }
+
+            // Records go straight to the descriptor, bypassing std::cout
+            std::cout.flush();
+            auto start = std::chrono::steady_clock::now();
+            pnpl::ExportSummary summary;
+            std::string error;
+            bool ok = popManager.exportResults(range, fd, summary, error);
+            if (fd != STDOUT_FILENO && ::close(fd) != 0) {
+                ok = false;
+                error = "Failed to close " + outputFile;
+            }
+            if (!ok) {
+                std::cerr << "Error: " << error << std::endl;
+                return 1;
+            }
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cerr << "Exported " << summary.records << " result(s), " << (summary.bytes >> 10) << " KB in "
+                      << std::fixed << std::setprecision(2) << seconds << " s";
+            if (!summary.lastJobId.empty()) {
+                std::cerr << "; resume with --since " << summary.lastJobId << "@" << summary.lastCompletedMs;
+            }
+            std::cerr << std::endl;
+            return 0;
+        }
+
+        std::string jobId;
+        bool consume = false;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--consume") {
+                consume = true;
+            } else if (arg.rfind("--", 0) == 0 || !jobId.empty()) {
+                std::cerr << "Error: Unknown option " << arg << std::endl;
+                return 1;
+            } else {
+                jobId = arg;
+            }
+        }
+
+        // Consume: the result is removed as it is read, and concurrent poppers never get
+        // the same one; text goes to stdout once read in full
+        if (consume) {
+            auto result = jobId.empty() ? popManager.consumeLatest(&std::cout)
+                                        : popManager.consumeResult(jobId, &std::cout);
+            if (!result) {
+                std::cerr << "Error: " << (jobId.empty() ? "No completed jobs found"
+                                                         : "Job " + jobId + " not found, not completed or already consumed")
+                          << std::endl;
+                return 1;
+            }
+            if (!result->success) {
+                std::cerr << "Error: " << result->errorMessage << std::endl;
+                return 1;
+            }
+            if (result->embedding.empty()) {
+                std::cout << std::endl;
+            } else {
+                printResult(*result);
+            }
+            if (jobId.empty()) {
+                std::cerr << "Consumed job " << result->id << std::endl;
+            }
+            return 0;
+        }
+
         // Check if job ID is provided
-        if (argc >= 3) {
-            std::string jobId = argv[2];
+        if (!jobId.empty()) {
+            // Text results are streamed (and decompressed) straight to stdout
+            if (popManager.streamResult(jobId, std::cout)) {
+                std::cout << std::endl;
+                return 0;
+            }
+
             auto result = popManager.popResult(jobId);
 
             if (!result) {
@@ -169,45 +364,68 @@ int main(int argc, char* argv[]) {
             }
 
             // Output the result
-            std::cout << result->outputText << std::endl;
+            printResult(*result);
         } else {
             // Get latest result
-            auto result = popManager.popLatest();
+            std::string latestId = popManager.latestJobId();
 
-            if (!result) {
+            if (latestId.empty()) {
                 std::cerr << "Error: No completed jobs found" << std::endl;
                 return 1;
             }
 
-            if (!result->success) {
-                std::cerr << "Error: " << result->errorMessage << std::endl;
+            std::cout << "Latest job: " << latestId << std::endl;
+            std::cout << "-----------------------------------" << std::endl;
+            if (popManager.streamResult(latestId, std::cout)) {
+                std::cout << std::endl;
+                return 0;
+            }
+
+            auto result = popManager.popResult(latestId);
+
+            if (!result || !result->success) {
+                std::cerr << "Error: " << (result ? result->errorMessage : "Result disappeared") << std::endl;
                 return 1;
             }
 
             // Output the result
-            std::cout << "Latest job: " << result->id << std::endl;
-            std::cout << "-----------------------------------" << std::endl;
-            std::cout << result->outputText << std::endl;
+            printResult(*result);
         }
 
         return 0;
     }
     // Handle list command
     else if (command == "list") {
+        // Optional creation date range; with the date layout only those shards are read
+        pnpl::DateRange range;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if ((arg == "--since" || arg == "--until") && i + 1 < argc) {
+                std::string date = argv[++i];
+                date.erase(std::remove(date.begin(), date.end(), '-'), date.end());
+                if (date.size() != 8 || date.find_first_not_of("0123456789") != std::string::npos) {
+                    std::cerr << "Error: " << arg << " expects a date as YYYY-MM-DD" << std::endl;
+                    return 1;
+                }
+                (arg == "--since" ? range.from : range.to) = date;
+            }
+        }
+
         pnpl::PushManager pushManager(inputDir);
         pnpl::PopManager popManager(outputDir);
 
-        // Get all jobs
-        auto jobs = pushManager.listJobs();
+        // Pending jobs still in the input directory plus completed ones
+        auto jobs = pushManager.listJobs(range);
+        auto completed = popManager.listCompleted(range);
+        jobs.insert(jobs.end(), completed.begin(), completed.end());
+        std::sort(jobs.begin(), jobs.end());
+        jobs.erase(std::unique(jobs.begin(), jobs.end()), jobs.end());
 
         if (jobs.empty()) {
             std::cout << "No jobs found" << std::endl;
             return 0;
         }
 
-        // Sort jobs by ID (which includes timestamp)
-        std::sort(jobs.begin(), jobs.end());
-
         // Display jobs
         std::cout << "Available jobs:" << std::endl;
         std::cout << std::left << std::setw(30) << "Job ID" << "Status" << std::endl;
@@ -243,6 +461,11 @@ int main(int argc, char* argv[]) {
 
         if (popManager.isJobCompleted(jobId)) {
             std::cout << "Status: Completed" << std::endl;
+            pnpl::JobMetadata outcome;
+            if (popManager.readOutcome(jobId, outcome) && !outcome.loop.empty()) {
+                std::cout << "Repetition loop: " << outcome.loop << " (cycle of " << outcome.loopPeriod
+                          << " tokens detected after " << outcome.loopAtToken << " generated tokens)" << std::endl;
+            }
             std::cout << "Result is available. Use 'pop " << jobId << "' to view." << std::endl;
         } else {
             std::cout << "Status: Pending" << std::endl;
@@ -251,6 +474,69 @@ int main(int argc, char* argv[]) {
 
         return 0;
     }
+    // Handle cancel command
+    else if (command == "cancel") {
+        if (argc < 3) {
+            std::cerr << "Error: 'cancel' requires a job ID" << std::endl;
+            return 1;
+        }
+
+        std::string jobId = argv[2];
+        pnpl::CancelRequest request;
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--keep-partial") {
+                request.keepPartial = true;
+            } else {
+                std::cerr << "Error: Unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+
+        pnpl::PopManager popManager(outputDir);
+        if (popManager.isJobCompleted(jobId)) {
+            std::cerr << "Error: Job " << jobId << " has already completed" << std::endl;
+            return 1;
+        }
+
+        pnpl::PushManager pushManager(inputDir);
+        switch (pushManager.cancelJob(jobId, request)) {
+        case pnpl::CancelOutcome::Withdrawn:
+            std::cout << "Cancelled job " << jobId << " before it started" << std::endl;
+            return 0;
+        case pnpl::CancelOutcome::Requested:
+            std::cout << "Cancellation of job " << jobId << " requested; the server stops it within a second"
+                      << std::endl;
+            return 0;
+        case pnpl::CancelOutcome::Failed:
+            break;
+        }
+        std::cerr << "Error: Failed to write cancel request for job " << jobId << std::endl;
+        return 1;
+    }
+    // Handle migrate command
+    else if (command == "migrate") {
+        pnpl::LayoutMode mode;
+        if (argc < 3 || !pnpl::JobLayout::parseMode(argv[2], mode)) {
+            std::cerr << "Error: 'migrate' requires a layout: flat, hashed or date" << std::endl;
+            return 1;
+        }
+
+        // Run with the server stopped: files move between shards
+        pnpl::JobLayout layout(mode);
+        for (const std::string& dir : {inputDir, inputDir + "_processing", outputDir}) {
+            size_t moved = 0;
+            std::string error;
+            if (!layout.migrate(dir, moved, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                return 1;
+            }
+            std::cout << dir << ": moved " << moved << " file(s) to the "
+                      << pnpl::JobLayout::modeName(mode) << " layout" << std::endl;
+        }
+
+        return 0;
+    }
     // Handle help command
     else if (command == "help" || command == "--help" || command == "-h") {
         printUsage(argv[0]);
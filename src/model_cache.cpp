@@ -0,0 +1,151 @@
+#include "pnpl/model_cache.hpp"
+#include "llama.h"
+#include <iostream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+
+namespace pnpl {
+
+ModelCache::ModelCache(const RunnerOptions& options, uint64_t memoryBudget)
+    : options_(options), memoryBudget_(memoryBudget) {
+}
+
+void ModelCache::setMemoryBudget(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    memoryBudget_ = bytes;
+}
+
+void ModelCache::registerModel(const std::string& name, const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[name].path = path;
+}
+
+bool ModelCache::hasModel(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(name) > 0;
+}
+
+std::string ModelCache::modelPath(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    return it != entries_.end() ? it->second.path : std::string();
+}
+
+void ModelCache::setModelOptions(const std::string& name, const RunnerOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    if (it == entries_.end()) return;
+    it->second.options = options;
+    it->second.hasOptions = true;
+}
+
+RunnerOptions ModelCache::modelOptions(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    return it != entries_.end() && it->second.hasOptions ? it->second.options : options_;
+}
+
+std::shared_ptr<llama_model> ModelCache::peek(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(name);
+    return it != entries_.end() ? it->second.model : nullptr;
+}
+
+std::vector<std::string> ModelCache::modelNames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    for (const auto& entry : entries_) {
+        names.push_back(entry.first);
+    }
+    return names;
+}
+
+std::shared_ptr<llama_model> ModelCache::acquire(const std::string& name, std::string& error) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(name);
+    if (it == entries_.end()) {
+        error = "Unknown model: " + name;
+        return nullptr;
+    }
+    Entry& entry = it->second;
+
+    // Another worker may already be loading this model
+    loadCondition_.wait(lock, [&entry] { return !entry.loading; });
+
+    if (entry.model) {
+        touch(name);
+        return entry.model;
+    }
+
+    // Make room using the file size as the estimate; the mapped weights dominate
+    std::error_code ec;
+    uint64_t estimate = std::filesystem::file_size(entry.path, ec);
+    if (ec) estimate = 0;
+    evictFor(estimate);
+
+    // Load without holding the lock so other models stay available meanwhile
+    entry.loading = true;
+    std::string path = entry.path;
+    RunnerOptions options = entry.hasOptions ? entry.options : options_;
+    lock.unlock();
+
+    std::cout << "Loading model '" << name << "' from " << path << std::endl;
+    std::shared_ptr<llama_model> model = InferenceRunner::loadModel(path, options, error);
+
+    lock.lock();
+    entry.loading = false;
+    if (model) {
+        entry.model = model;
+        entry.bytes = std::max<uint64_t>(llama_model_size(model.get()), estimate);
+        loadedBytes_ += entry.bytes;
+        touch(name);
+    }
+    loadCondition_.notify_all();
+
+    return model;
+}
+
+std::string ModelCache::getStatus() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::stringstream ss;
+    ss << "Models loaded: " << lru_.size() << "/" << entries_.size()
+       << " (" << (loadedBytes_ >> 20) << " MiB";
+    if (memoryBudget_ > 0) {
+        ss << " of " << (memoryBudget_ >> 20) << " MiB";
+    }
+    ss << ")";
+    for (const auto& name : lru_) {
+        ss << " " << name;
+    }
+    return ss.str();
+}
+
+void ModelCache::touch(const std::string& name) {
+    lru_.remove(name);
+    lru_.push_front(name);
+}
+
+void ModelCache::evictFor(uint64_t incoming) {
+    if (memoryBudget_ == 0) return;
+
+    // Walk from the coldest end; models still held by a runner can't be freed
+    for (auto it = lru_.end(); it != lru_.begin() && loadedBytes_ + incoming > memoryBudget_; ) {
+        --it;
+        Entry& entry = entries_[*it];
+        if (entry.model.use_count() > 1) continue;
+
+        std::cout << "Evicting model '" << *it << "' (" << (entry.bytes >> 20) << " MiB)" << std::endl;
+        entry.model.reset();
+        loadedBytes_ -= entry.bytes;
+        entry.bytes = 0;
+        it = lru_.erase(it);
+    }
+
+    if (loadedBytes_ + incoming > memoryBudget_) {
+        std::cerr << "Warning: model cache over budget; all loaded models are in use" << std::endl;
+    }
+}
+
+} // namespace pnpl
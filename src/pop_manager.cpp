@@ -1,11 +1,117 @@
 #include "pnpl/pop_manager.hpp"
+#include "pnpl/result_file.hpp"
 #include <fstream>
 #include <iostream>
 #include <algorithm>
-#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace pnpl {
 
+namespace {
+
+    // Results are timed by their mtime, set when the temporary file is last written, and
+    // published by a later rename. A result renamed after a later-written one was exported
+    // sorts before the resume point, so incremental exports re-scan this far back for it.
+    const int64_t EXPORT_OVERLAP_MS = 5000;
+
+    bool hasSuffix(const std::string& filename, const std::string& suffix) {
+        return filename.size() > suffix.size() &&
+               filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    bool isResultFile(const std::string& filename) {
+        return resultExtensionLength(filename) > 0;
+    }
+
+    // Write all of a buffer, retrying short writes
+    bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    // Copies file contents to an output descriptor, remembering which kernel copy the
+    // descriptor supports so an unsupported call is only tried once per export
+    class DescriptorCopier {
+    public:
+        explicit DescriptorCopier(int out) : out_(out) {}
+
+        bool copy(int in, uint64_t size) {
+#ifdef __linux__
+            // copy_file_range needs a regular output file; sendfile takes pipes and sockets too
+            while (useCopyFileRange_ && size > 0) {
+                ssize_t copied = ::copy_file_range(in, nullptr, out_, nullptr, size, 0);
+                if (copied > 0) {
+                    size -= static_cast<uint64_t>(copied);
+                } else if (copied < 0 && errno == EINTR) {
+                    continue;
+                } else if (copied < 0 && offset(in) == 0 && fallbackError()) {
+                    useCopyFileRange_ = false;
+                } else {
+                    return false;
+                }
+            }
+            while (useSendfile_ && size > 0) {
+                ssize_t copied = ::sendfile(out_, in, nullptr, size);
+                if (copied > 0) {
+                    size -= static_cast<uint64_t>(copied);
+                } else if (copied < 0 && errno == EINTR) {
+                    continue;
+                } else if (copied < 0 && offset(in) == 0 && fallbackError()) {
+                    useSendfile_ = false;
+                } else {
+                    return false;
+                }
+            }
+#endif
+            // Portable fallback through a user-space buffer
+            char buffer[1 << 16];
+            while (size > 0) {
+                ssize_t got = ::read(in, buffer, static_cast<size_t>(std::min<uint64_t>(size, sizeof(buffer))));
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0 || !writeAll(out_, buffer, static_cast<size_t>(got))) {
+                    return false;
+                }
+                size -= static_cast<uint64_t>(got);
+            }
+            return true;
+        }
+
+    private:
+        int out_;
+        bool useCopyFileRange_ = true;
+        bool useSendfile_ = true;
+
+        static off_t offset(int fd) {
+            return ::lseek(fd, 0, SEEK_CUR);
+        }
+
+        // Errors meaning "not for this pair of descriptors", as opposed to real I/O errors
+        static bool fallbackError() {
+            return errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                   errno == EOPNOTSUPP || errno == EBADF;
+        }
+    };
+
+} // namespace
+
 PopManager::PopManager(const std::string& outputDirectory)
     : resultsDirectory_(outputDirectory) {
 
@@ -13,78 +119,101 @@ PopManager::PopManager(const std::string& outputDirectory)
     if (!std::filesystem::exists(resultsDirectory_)) {
         std::filesystem::create_directories(resultsDirectory_);
     }
+
+    layout_ = JobLayout::forDirectory(resultsDirectory_);
 }
 
 std::optional<JobResult> PopManager::popResult(const std::string& jobId) {
-    std::filesystem::path resultPath = std::filesystem::path(resultsDirectory_) / (jobId + ".txt");
+    std::filesystem::path resultPath = findResultFile(jobId);
 
-    if (!std::filesystem::exists(resultPath)) {
+    if (resultPath.empty()) {
         return std::nullopt;
     }
 
-    std::string content;
-    if (!readResultFile(resultPath, content)) {
-        return JobResult{jobId, "", false, "Failed to read result file"};
+    return loadResult(jobId, resultPath);
+}
+
+std::optional<JobResult> PopManager::consumeResult(const std::string& jobId, std::ostream* textOut) {
+    std::filesystem::path resultPath = findResultFile(jobId);
+    if (resultPath.empty()) {
+        return std::nullopt;
     }
+    return consumeFile(jobId, resultPath, textOut);
+}
 
-    return JobResult{jobId, content, true, ""};
+std::optional<JobResult> PopManager::consumeLatest(std::ostream* textOut) {
+    // Losing the race for the latest result means someone else consumed it: try the next
+    for (int attempt = 0; attempt < CONSUME_ATTEMPTS; ++attempt) {
+        std::filesystem::path latestPath = findLatestResultFile();
+        if (latestPath.empty()) {
+            return std::nullopt;
+        }
+        auto result = consumeFile(extractJobId(latestPath.filename().string()), latestPath, textOut);
+        if (result) {
+            return result;
+        }
+    }
+    return std::nullopt;
 }
 
 std::optional<JobResult> PopManager::popLatest() {
-    auto jobs = listCompleted();
+    std::filesystem::path latestPath = findLatestResultFile();
 
-    if (jobs.empty()) {
-        return std::nullopt;
+    if (latestPath.empty()) {
+        return std::nullopt;  // No valid files found
+    }
+
+    // Extract the job ID from the path
+    std::string jobId = extractJobId(latestPath.filename().string());
+
+    return loadResult(jobId, latestPath);
+}
+
+std::string PopManager::latestJobId() const {
+    std::filesystem::path latestPath = findLatestResultFile();
+    return latestPath.empty() ? std::string() : extractJobId(latestPath.filename().string());
+}
+
+bool PopManager::streamResult(const std::string& jobId, std::ostream& out) const {
+    std::filesystem::path path = findResultFile(jobId);
+    if (path.empty() || path.extension() == ".emb") {
+        return false;
     }
+    return streamResultFile(path, out);
+}
 
-    // Find the latest job by modification time
+std::filesystem::path PopManager::findLatestResultFile() const {
+    // One pass and one stat per result: this runs on every plain "pop"
     std::filesystem::path latestPath;
     std::filesystem::file_time_type latestTime;
-    bool first = true;
 
-    for (const auto& jobId : jobs) {
-        std::filesystem::path path = std::filesystem::path(resultsDirectory_) / (jobId + ".txt");
+    layout_.forEachFile(resultsDirectory_, [&](const std::filesystem::path& path) {
+        if (!isResultFile(path.filename().string())) return;
 
-        if (!std::filesystem::exists(path)) continue;
+        std::error_code ec;
+        auto modTime = std::filesystem::last_write_time(path, ec);
+        if (ec) return;   // Consumed or removed by retention meanwhile
 
-        auto modTime = std::filesystem::last_write_time(path);
-
-        if (first || modTime > latestTime) {
+        if (latestPath.empty() || modTime > latestTime) {
             latestPath = path;
             latestTime = modTime;
-            first = false;
         }
-    }
-
-    if (first) {
-        return std::nullopt;  // No valid files found
-    }
-
-    // Extract the job ID from the path
-    std::string jobId = extractJobId(latestPath.filename().string());
-
-    std::string content;
-    if (!readResultFile(latestPath, content)) {
-        return JobResult{jobId, "", false, "Failed to read result file"};
-    }
+    });
 
-    return JobResult{jobId, content, true, ""};
+    return latestPath;
 }
 
-std::vector<std::string> PopManager::listCompleted() const {
+std::vector<std::string> PopManager::listCompleted(const DateRange& range) const {
     std::vector<std::string> jobs;
 
-    for (const auto& entry : std::filesystem::directory_iterator(resultsDirectory_)) {
-        if (!entry.is_regular_file()) continue;
+    layout_.forEachFile(resultsDirectory_, [this, &jobs](const std::filesystem::path& path) {
+        std::string filename = path.filename().string();
 
-        std::string filename = entry.path().filename().string();
-
-        // Extract job ID (remove .txt extension)
-        if (filename.size() > 4 && filename.substr(filename.size() - 4) == ".txt") {
-            std::string jobId = filename.substr(0, filename.size() - 4);
-            jobs.push_back(jobId);
+        // Extract job ID (remove .txt/.txt.gz/.emb extension)
+        if (isResultFile(filename)) {
+            jobs.push_back(extractJobId(filename));
         }
-    }
+    }, range);
 
     // Sort by job ID (which includes timestamps)
     std::sort(jobs.begin(), jobs.end());
@@ -92,38 +221,224 @@ std::vector<std::string> PopManager::listCompleted() const {
     return jobs;
 }
 
+bool PopManager::exportResults(const ExportRange& range, int fd, ExportSummary& summary,
+                               std::string& error) const {
+    struct Record {
+        int64_t completedMs;
+        std::string jobId;
+        std::filesystem::path path;
+    };
+
+    // Completion time is the result's mtime; the ctime is set by the rename that published it
+    auto times = [](const std::filesystem::path& path, int64_t& completedMs, int64_t& publishedNs) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+#ifdef __APPLE__
+        completedMs = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000 + st.st_mtimespec.tv_nsec / 1000000;
+        publishedNs = static_cast<int64_t>(st.st_ctimespec.tv_sec) * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+        completedMs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+        publishedNs = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+        return true;
+    };
+    auto isAfter = [](const Record& a, int64_t completedMs, const std::string& jobId) {
+        return a.completedMs != completedMs ? a.completedMs > completedMs : a.jobId > jobId;
+    };
+
+    Record after{range.sinceMs - 1, "", {}};
+    const bool resuming = !range.afterJobId.empty();
+    if (resuming) {
+        after.jobId = range.afterJobId;
+        after.completedMs = range.afterMs;
+        int64_t publishedNs = 0;
+        std::filesystem::path path = after.completedMs < 0 ? findResultFile(after.jobId) : "";
+        if (after.completedMs < 0 && (path.empty() || !times(path, after.completedMs, publishedNs))) {
+            // Consumed or reaped since: the job completed after it was created, which the ID records
+            std::tm tm = {};
+            std::istringstream in(after.jobId.substr(0, 14));
+            in >> std::get_time(&tm, "%Y%m%d%H%M%S");
+            tm.tm_isdst = -1;
+            std::time_t created = in.fail() ? -1 : std::mktime(&tm);
+            if (created == -1) {
+                error = "Job " + after.jobId + " has no result, and its ID has no creation time to export after";
+                return false;
+            }
+            after.completedMs = static_cast<int64_t>(created) * 1000 - 1;
+        }
+        summary.lastJobId = after.jobId;
+        summary.lastCompletedMs = after.completedMs;
+    }
+
+    // Results completed after the starting point, and late arrivals in the overlap before it
+    // that were published after the resume point completed. Anything published before then
+    // was visible to the export that produced the resume point.
+    std::vector<Record> records;
+    layout_.forEachFile(resultsDirectory_, [&](const std::filesystem::path& path) {
+        std::string filename = path.filename().string();
+        Record record{0, "", path};
+        int64_t publishedNs = 0;
+        if (!isResultFile(filename) || !times(path, record.completedMs, publishedNs)) {
+            return;
+        }
+        record.jobId = extractJobId(filename);
+        bool late = resuming && record.jobId != after.jobId &&
+                    record.completedMs >= after.completedMs - EXPORT_OVERLAP_MS &&
+                    publishedNs >= after.completedMs * 1000000;
+        if (late || isAfter(record, after.completedMs, after.jobId)) {
+            records.push_back(std::move(record));
+        }
+    });
+    std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+        return a.completedMs != b.completedMs ? a.completedMs < b.completedMs : a.jobId < b.jobId;
+    });
+
+    DescriptorCopier copier(fd);
+    for (const auto& record : records) {
+        int in = ::open(record.path.c_str(), O_RDONLY);
+        struct stat st;
+        if (in < 0 || ::fstat(in, &st) != 0) {
+            // Popped by someone else meanwhile
+            if (in >= 0) ::close(in);
+            continue;
+        }
+
+        const std::string filename = record.path.filename().string();
+        const char* encoding = hasSuffix(filename, ".emb") ? "f32" :
+                               hasSuffix(filename, COMPRESSED_RESULT_EXTENSION) ? "gzip" : "text";
+        std::string header = record.jobId + " " + encoding + " " + std::to_string(st.st_size) + " " +
+                             std::to_string(record.completedMs) + "\n";
+
+        bool ok = writeAll(fd, header.data(), header.size()) &&
+                  copier.copy(in, static_cast<uint64_t>(st.st_size)) &&
+                  writeAll(fd, "\n", 1);
+        ::close(in);
+        if (!ok) {
+            error = "Failed to write result of job " + record.jobId + ": " + std::strerror(errno);
+            return false;
+        }
+
+        summary.records++;
+        summary.bytes += static_cast<uint64_t>(st.st_size);
+        // Late arrivals sort before the resume point and must not move it back
+        if (summary.lastJobId.empty() || isAfter(record, summary.lastCompletedMs, summary.lastJobId)) {
+            summary.lastJobId = record.jobId;
+            summary.lastCompletedMs = record.completedMs;
+        }
+    }
+
+    return true;
+}
+
 bool PopManager::isJobCompleted(const std::string& jobId) const {
-    std::filesystem::path resultPath = std::filesystem::path(resultsDirectory_) / (jobId + ".txt");
-    return std::filesystem::exists(resultPath);
+    return !findResultFile(jobId).empty();
+}
+
+bool PopManager::readOutcome(const std::string& jobId, JobMetadata& metadata) const {
+    return readJobMetadata(metadataPath(layout_.shardDirectory(resultsDirectory_, jobId), jobId), metadata);
 }
 
 bool PopManager::jobExists(const std::string& jobId) const {
     // Check if either input or output file exists
     std::filesystem::path inputPath = std::filesystem::path("input") / (jobId + ".txt");
-    std::filesystem::path outputPath = std::filesystem::path(resultsDirectory_) / (jobId + ".txt");
 
-    return std::filesystem::exists(inputPath) || std::filesystem::exists(outputPath);
+    return std::filesystem::exists(inputPath) || isJobCompleted(jobId);
 }
 
 std::string PopManager::extractJobId(const std::string& filename) const {
-    // Remove .txt extension
-    if (filename.size() > 4 && filename.substr(filename.size() - 4) == ".txt") {
-        return filename.substr(0, filename.size() - 4);
+    // Remove .txt/.txt.gz/.emb extension
+    size_t extLength = resultExtensionLength(filename);
+    if (extLength > 0) {
+        return filename.substr(0, filename.size() - extLength);
     }
 
     return filename;
 }
 
+std::filesystem::path PopManager::findResultFile(const std::string& jobId) const {
+    for (const char* ext : RESULT_EXTENSIONS) {
+        std::filesystem::path path = layout_.pathFor(resultsDirectory_, jobId, ext);
+        if (std::filesystem::exists(path)) {
+            return path;
+        }
+    }
+    return {};
+}
+
+std::optional<JobResult> PopManager::consumeFile(const std::string& jobId, const std::filesystem::path& path,
+                                                std::ostream* textOut) {
+    // The rename is the claim: of several poppers (or a popper and the retention
+    // reaper) only one can move the file away
+    std::filesystem::path claimed = consumingPath(path);
+    std::error_code ec;
+    std::filesystem::rename(path, claimed, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+
+    // Read in full before anything is written out: an unreadable result goes back
+    // rather than being lost, and nothing of it has been emitted for a retry to repeat
+    JobResult result = loadResult(jobId, claimed);
+    if (!result.success) {
+        std::filesystem::rename(claimed, path, ec);
+        return result;
+    }
+
+    if (textOut && claimed.extension() != ".emb") {
+        textOut->write(result.outputText.data(), result.outputText.size());
+        textOut->flush();
+        result.outputText.clear();
+        if (!textOut->good()) {
+            // Part of it may have gone out: keep the claim (the retention reaper deletes
+            // it once abandoned) so no retry emits the result a second time
+            return JobResult{jobId, "", false, "Failed to write result", {}};
+        }
+    }
+
+    std::filesystem::remove(claimed, ec);
+    std::filesystem::remove(metadataPath(path.parent_path(), jobId), ec);
+    std::filesystem::remove(path.parent_path() / (jobId + JOB_TIMING_EXTENSION), ec);
+    return result;
+}
+
+JobResult PopManager::loadResult(const std::string& jobId, const std::filesystem::path& path) const {
+    if (path.extension() == ".emb") {
+        JobResult result{jobId, "", true, "", {}};
+        if (!readEmbeddingFile(path, result.embedding)) {
+            return JobResult{jobId, "", false, "Failed to read embedding file", {}};
+        }
+        return result;
+    }
+
+    std::string content;
+    if (!readResultFile(path, content)) {
+        return JobResult{jobId, "", false, "Failed to read result file", {}};
+    }
+
+    return JobResult{jobId, content, true, "", {}};
+}
+
 bool PopManager::readResultFile(const std::filesystem::path& path, std::string& content) const {
-    std::ifstream file(path);
+    return pnpl::readResultFile(path, content);
+}
+
+bool PopManager::readEmbeddingFile(const std::filesystem::path& path, std::vector<float>& embedding) const {
+    std::ifstream file(path, std::ios::binary);
     if (!file) {
         return false;
     }
 
-    content = std::string((std::istreambuf_iterator<char>(file)),
-                         std::istreambuf_iterator<char>());
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec || size % sizeof(float) != 0) {
+        return false;
+    }
 
-    return true;
+    embedding.resize(size / sizeof(float));
+    file.read(reinterpret_cast<char*>(embedding.data()), size);
+    return static_cast<bool>(file);
 }
 
-} // namespace pnpl
\ No newline at end of file
+} // namespace pnpl
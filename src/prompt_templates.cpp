@@ -0,0 +1,258 @@
+#include "pnpl/prompt_templates.hpp"
+#include <fstream>
+
+namespace pnpl {
+
+namespace {
+
+    std::string trim(const std::string& value) {
+        size_t begin = value.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) return "";
+        size_t end = value.find_last_not_of(" \t\r");
+        return value.substr(begin, end - begin + 1);
+    }
+
+    // Values may be double-quoted (to keep surrounding spaces) and use \n, \t, \" and \\ escapes
+    std::string unescape(const std::string& raw) {
+        std::string value = raw;
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+
+        std::string result;
+        for (size_t i = 0; i < value.size(); ++i) {
+            if (value[i] == '\\' && i + 1 < value.size()) {
+                char next = value[++i];
+                if (next == 'n') result += '\n';
+                else if (next == 't') result += '\t';
+                else result += next;
+            } else {
+                result += value[i];
+            }
+        }
+        return result;
+    }
+
+    // Split a "|"-separated list
+    std::vector<std::string> splitList(const std::string& value) {
+        std::vector<std::string> items;
+        size_t start = 0;
+        while (start <= value.size()) {
+            size_t bar = value.find('|', start);
+            if (bar == std::string::npos) bar = value.size();
+            if (bar > start) items.push_back(value.substr(start, bar - start));
+            start = bar + 1;
+        }
+        return items;
+    }
+
+} // namespace
+
+bool PromptTemplate::matches(const std::string& input) const {
+    if (minLength == 0 && startsWith.empty() && contains.empty()) {
+        return true;
+    }
+
+    // Cheapest checks first: length, then prefixes, and only then a scan of the input
+    if (minLength > 0 && input.length() > minLength) {
+        return true;
+    }
+    for (const auto& prefix : startsWith) {
+        if (input.compare(0, prefix.size(), prefix) == 0) {
+            return true;
+        }
+    }
+    for (const auto& needle : contains) {
+        if (input.find(needle) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+PromptTemplates::PromptTemplates() {
+    // For large code files - include full context but guide output structure
+    PromptTemplate codeReview;
+    codeReview.name = "code_review";
+    codeReview.minLength = 500;
+    codeReview.prefix =
+        "You are a senior software engineer conducting a code review. "
+        "Analyze the following C++ code and provide a comprehensive technical analysis.\n\n"
+        "CODE TO ANALYZE:\n";
+    codeReview.suffix =
+        "\n\n"
+        "TECHNICAL ANALYSIS:\n"
+        "1. Purpose: What does this code accomplish?\n"
+        "2. Architecture: Key classes, methods, and design patterns\n"
+        "3. Implementation: Notable technical details and algorithms\n"
+        "4. Quality: Code quality, best practices, potential improvements\n"
+        "5. Usage: How this code fits into a larger system\n\n"
+        "Provide detailed analysis:\n\n";
+    templates_.push_back(codeReview);
+
+    // For code snippets - focused technical analysis
+    PromptTemplate code;
+    code.name = "code";
+    code.contains = {"```", "#include", "class "};
+    code.prefix = "Analyze this C++ code and explain its technical implementation:\n\n";
+    code.suffix =
+        "\n\n"
+        "Technical Analysis:\n"
+        "- Purpose and functionality\n"
+        "- Key components and algorithms\n"
+        "- Design patterns and best practices\n"
+        "- Performance considerations\n\n"
+        "Detailed explanation:\n\n";
+    templates_.push_back(code);
+
+    // For technical explanations - structured educational format
+    PromptTemplate question;
+    question.name = "question";
+    question.startsWith = {"Explain", "What"};
+    question.prefix = "Technical Question: ";
+    question.suffix =
+        "\n\n"
+        "Provide a comprehensive technical explanation with:\n"
+        "1. Clear concept definitions\n"
+        "2. Practical C++ code examples\n"
+        "3. Real-world usage scenarios\n"
+        "4. Best practices and common pitfalls\n\n"
+        "Technical Answer:\n\n";
+    templates_.push_back(question);
+
+    // For comprehensive guides - structured technical writing
+    PromptTemplate guide;
+    guide.name = "guide";
+    guide.contains = {"comprehensive", "guide"};
+    guide.prefix = "Create a comprehensive technical guide: ";
+    guide.suffix =
+        "\n\n"
+        "Structure your guide with:\n"
+        "1. Core concepts and definitions\n"
+        "2. Detailed code examples with explanations\n"
+        "3. Practical implementation patterns\n"
+        "4. Performance considerations and best practices\n"
+        "5. Common pitfalls and how to avoid them\n\n"
+        "Technical Guide:\n\n";
+    templates_.push_back(guide);
+
+    // For combining the partial analyses of an input too large for one context
+    PromptTemplate reduce;
+    reduce.name = "reduce";
+    reduce.explicitOnly = true;
+    reduce.prefix =
+        "You are a senior software engineer. The following are technical analyses of "
+        "consecutive parts of one large source file. Combine them into a single analysis "
+        "of the whole file, merging duplicate points and keeping every important finding.\n\n"
+        "PARTIAL ANALYSES:\n";
+    reduce.suffix =
+        "\n\n"
+        "COMBINED TECHNICAL ANALYSIS:\n"
+        "1. Purpose\n"
+        "2. Architecture\n"
+        "3. Implementation\n"
+        "4. Quality\n"
+        "5. Usage\n\n"
+        "Provide the combined analysis:\n\n";
+    templates_.push_back(reduce);
+
+    // Default - clean technical analysis
+    PromptTemplate general;
+    general.name = "general";
+    general.prefix = "Technical Request: ";
+    general.suffix = "\n\nProvide a detailed technical response with examples and practical guidance:\n\n";
+    templates_.push_back(general);
+}
+
+bool PromptTemplates::loadFile(const std::string& path, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "Failed to open prompt templates: " + path;
+        return false;
+    }
+
+    std::vector<PromptTemplate> loaded;
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(file, line)) {
+        lineNumber++;
+        std::string trimmed = trim(line);
+        if (trimmed.empty() || trimmed[0] == '#') continue;
+
+        // [name] starts a new template
+        if (trimmed.front() == '[' && trimmed.back() == ']') {
+            PromptTemplate entry;
+            entry.name = trimmed.substr(1, trimmed.size() - 2);
+            loaded.push_back(entry);
+            continue;
+        }
+
+        size_t eq = trimmed.find('=');
+        if (eq == std::string::npos || loaded.empty()) {
+            error = path + ":" + std::to_string(lineNumber) + ": expected [name] or key = value";
+            return false;
+        }
+
+        std::string key = trim(trimmed.substr(0, eq));
+        std::string value = unescape(trim(trimmed.substr(eq + 1)));
+        PromptTemplate& entry = loaded.back();
+
+        if (key == "min_length") {
+            try {
+                entry.minLength = std::stoul(value);
+            } catch (...) {
+                error = path + ":" + std::to_string(lineNumber) + ": invalid min_length";
+                return false;
+            }
+        } else if (key == "starts_with") {
+            entry.startsWith = splitList(value);
+        } else if (key == "contains") {
+            entry.contains = splitList(value);
+        } else if (key == "prefix") {
+            entry.prefix = value;
+        } else if (key == "suffix") {
+            entry.suffix = value;
+        } else if (key == "explicit") {
+            entry.explicitOnly = (value == "true" || value == "1");
+        } else {
+            error = path + ":" + std::to_string(lineNumber) + ": unknown key '" + key + "'";
+            return false;
+        }
+    }
+
+    if (loaded.empty()) {
+        error = "No templates defined in " + path;
+        return false;
+    }
+
+    templates_ = std::move(loaded);
+    return true;
+}
+
+size_t PromptTemplates::select(const std::string& input) const {
+    size_t fallback = templates_.size() - 1;
+    for (size_t i = 0; i < templates_.size(); ++i) {
+        if (templates_[i].explicitOnly) continue;
+        if (templates_[i].matches(input)) {
+            return i;
+        }
+        fallback = i;
+    }
+    return fallback;
+}
+
+size_t PromptTemplates::find(const std::string& name) const {
+    for (size_t i = 0; i < templates_.size(); ++i) {
+        if (templates_[i].name == name) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+const std::vector<PromptTemplate>& PromptTemplates::templates() const {
+    return templates_;
+}
+
+} // namespace pnpl
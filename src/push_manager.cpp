@@ -4,6 +4,11 @@
 #include <sstream>
 #include <chrono>
 #include <iostream>
+#include <ctime>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 namespace pnpl {
 
@@ -14,9 +19,11 @@ PushManager::PushManager(const std::string& inputDirectory)
     if (!std::filesystem::exists(inputDirectory_)) {
         std::filesystem::create_directories(inputDirectory_);
     }
+
+    layout_ = JobLayout::forDirectory(inputDirectory_);
 }
 
-std::string PushManager::createJob(const std::string& content) {
+std::string PushManager::createJob(const std::string& content, const JobMetadata& metadata) {
     if (content.empty()) {
         std::cerr << "Cannot create job with empty content" << std::endl;
         return "";
@@ -24,9 +31,24 @@ std::string PushManager::createJob(const std::string& content) {
 
     // Generate a unique job ID
     std::string jobId = generateJobID();
+    if (jobId.empty()) {
+        return "";
+    }
+
+    // Shard directory for this job (the input directory itself in the flat layout)
+    std::filesystem::path shard = layout_.shardDirectory(inputDirectory_, jobId);
+    std::error_code ec;
+    std::filesystem::create_directories(shard, ec);
+
+    // Write the metadata sidecar first so the server never sees a job without it
+    if (!metadata.empty() &&
+        !writeJobMetadata(metadataPath(shard, jobId), metadata)) {
+        std::cerr << "Failed to write job metadata" << std::endl;
+        return "";
+    }
 
     // Create the input file
-    std::filesystem::path filePath = std::filesystem::path(inputDirectory_) / (jobId + ".txt");
+    std::filesystem::path filePath = shard / (jobId + ".txt");
 
     if (!writeToFile(filePath, content)) {
         std::cerr << "Failed to write job content to file" << std::endl;
@@ -36,81 +58,117 @@ std::string PushManager::createJob(const std::string& content) {
     return jobId;
 }
 
-std::vector<std::string> PushManager::listJobs() const {
-    std::vector<std::string> jobs;
+CancelOutcome PushManager::cancelJob(const std::string& jobId, const CancelRequest& request) {
+    // A server claims a job by renaming it away, so whichever side gets the file wins
+    std::filesystem::path shard = layout_.shardDirectory(inputDirectory_, jobId);
+    std::error_code ec;
+    if (std::filesystem::remove(shard / (jobId + ".txt"), ec)) {
+        std::filesystem::remove(metadataPath(shard, jobId), ec);
+        return CancelOutcome::Withdrawn;
+    }
 
-    for (const auto& entry : std::filesystem::directory_iterator(inputDirectory_)) {
-        if (!entry.is_regular_file()) continue;
+    std::filesystem::path directory = cancelDirectory(inputDirectory_);
+    std::filesystem::create_directories(directory, ec);
 
-        std::string filename = entry.path().filename().string();
+    // Published by rename like job files, so the server never reads half a request
+    std::filesystem::path markerPath = directory / (jobId + ".cancel");
+    std::filesystem::path tempPath = markerPath;
+    tempPath += ".tmp";
+    if (!writeCancelRequest(tempPath, request)) {
+        return CancelOutcome::Failed;
+    }
+    std::filesystem::rename(tempPath, markerPath, ec);
+    return ec ? CancelOutcome::Failed : CancelOutcome::Requested;
+}
 
-        // Skip the counter file
-        if (filename == ".counter") continue;
+std::vector<std::string> PushManager::listJobs(const DateRange& range) const {
+    std::vector<std::string> jobs;
 
-        // Extract job ID (remove .txt extension)
-        if (filename.size() > 4 && filename.substr(filename.size() - 4) == ".txt") {
-            std::string jobId = filename.substr(0, filename.size() - 4);
-            jobs.push_back(jobId);
+    layout_.forEachFile(inputDirectory_, [&jobs](const std::filesystem::path& path) {
+        // Extract job ID (remove .txt extension); the counter file is skipped by the layout
+        if (path.extension() == ".txt") {
+            jobs.push_back(path.stem().string());
         }
-    }
+    }, range);
 
     return jobs;
 }
 
-int PushManager::loadCounter() const {
+int PushManager::nextCounter() {
     std::lock_guard<std::mutex> lock(counterMutex_);
 
-    // Try to read counter from file
-    std::ifstream file(counterFile_);
-    if (file) {
-        int counter = 0;
-        file >> counter;
-        return counter;
+    // The mutex covers this process's threads; flock covers other pushers on the same
+    // directory. Both are held across read, increment and write so no two jobs share an ID.
+    int fd = open(counterFile_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open counter file " << counterFile_ << std::endl;
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        std::cerr << "Failed to lock counter file " << counterFile_ << std::endl;
+        close(fd);
+        return -1;
     }
 
-    // If file doesn't exist or can't be read, start from 1
-    return 1;
-}
-
-void PushManager::saveCounter(int counter) const {
-    std::lock_guard<std::mutex> lock(counterMutex_);
+    // An empty (new) file starts from 1
+    char buffer[32] = {};
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    int counter = length > 0 ? std::atoi(buffer) : 0;
+    if (counter < 1) {
+        counter = 1;
+    }
 
-    std::ofstream file(counterFile_);
-    if (!file) {
+    std::string next = std::to_string(counter + 1);
+    if (ftruncate(fd, 0) != 0 ||
+        pwrite(fd, next.data(), next.size(), 0) != static_cast<ssize_t>(next.size())) {
         std::cerr << "Failed to save counter to " << counterFile_ << std::endl;
-        return;
     }
 
-    file << counter;
+    close(fd);   // Releases the lock
+    return counter;
 }
 
 std::string PushManager::generateJobID() {
-    int counter = loadCounter();
+    int counter = nextCounter();
+    if (counter < 0) {
+        return "";
+    }
 
     // Get current time
     auto now = std::chrono::system_clock::now();
     auto time_t_now = std::chrono::system_clock::to_time_t(now);
+    std::tm local {};
+    localtime_r(&time_t_now, &local);
 
     // Format with timestamp and sequence number
     std::stringstream ss;
-    ss << std::put_time(std::localtime(&time_t_now), "%Y%m%d%H%M%S")
+    ss << std::put_time(&local, "%Y%m%d%H%M%S")
        << "_" << std::setw(6) << std::setfill('0') << counter;
 
-    // Increment counter for next job
-    saveCounter(counter + 1);
-
     return ss.str();
 }
 
 bool PushManager::writeToFile(const std::filesystem::path& filePath,
                              const std::string& content) const {
-    std::ofstream file(filePath);
-    if (!file) {
-        return false;
+    // Write under a name the server ignores, then rename so it never reads a partial job
+    std::filesystem::path tempPath = filePath;
+    tempPath += ".tmp";
+
+    {
+        std::ofstream file(tempPath);
+        if (!file) {
+            return false;
+        }
+
+        file << content;
+        if (file.fail()) {
+            return false;
+        }
     }
 
-    file << content;
-    return !file.fail();
+    std::error_code ec;
+    std::filesystem::rename(tempPath, filePath, ec);
+    return !ec;
 }
 
 } // namespace pnpl
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include "pnpl/repetition_detector.hpp"
+#include <algorithm>
+
+namespace pnpl {
+
+RepetitionDetector::RepetitionDetector(int maxPeriod, int minCycles, int minRepeatedTokens)
+    : maxPeriod_(std::max(1, maxPeriod)),
+      minCycles_(std::max(2, minCycles)),
+      minRepeatedTokens_(std::max(1, minRepeatedTokens)),
+      history_(static_cast<size_t>(maxPeriod_)),
+      runs_(static_cast<size_t>(maxPeriod_) + 1, 0) {
+}
+
+int RepetitionDetector::push(int32_t token) {
+    int found = 0;
+    repeated_ = 0;
+
+    // Compare against the token p back for every period that fits the history so far
+    const int available = static_cast<int>(std::min(count_, static_cast<size_t>(maxPeriod_)));
+    for (int p = 1; p <= available; ++p) {
+        int32_t previous = history_[(count_ - p) % maxPeriod_];
+        runs_[p] = previous == token ? runs_[p] + 1 : 0;
+
+        // runs_[p] + p tokens are copies of one p-token cycle
+        if (found == 0 && runs_[p] >= minRepeatedTokens_ && runs_[p] >= (minCycles_ - 1) * p) {
+            found = p;
+            repeated_ = runs_[p];
+        }
+    }
+
+    history_[count_ % maxPeriod_] = token;
+    count_++;
+    return found;
+}
+
+int RepetitionDetector::repeatedTokens() const {
+    return repeated_;
+}
+
+void RepetitionDetector::reset() {
+    std::fill(runs_.begin(), runs_.end(), 0);
+    count_ = 0;
+    repeated_ = 0;
+}
+
+} // namespace pnpl
@@ -0,0 +1,180 @@
+#include "pnpl/result_file.hpp"
+#include <fstream>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+
+#ifdef PNPL_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace pnpl {
+
+namespace {
+
+    const size_t BLOCK_SIZE = 64 * 1024;
+    const char* const CONSUMING_MARKER = ".consumed-";
+
+    std::atomic<uint64_t> filesWritten{0};
+    std::atomic<uint64_t> rawBytesWritten{0};
+    std::atomic<uint64_t> storedBytesWritten{0};
+
+    bool isCompressed(const std::filesystem::path& path) {
+        return path.extension() == COMPRESSED_RESULT_EXTENSION;
+    }
+
+#ifdef PNPL_WITH_ZLIB
+    bool writeCompressed(const std::filesystem::path& path, const std::string& content) {
+        // Level 1: analyses are repetitive prose, so even the fastest level shrinks them several-fold
+        gzFile file = gzopen(path.string().c_str(), "wb1");
+        if (!file) {
+            return false;
+        }
+
+        bool ok = true;
+        for (size_t offset = 0; ok && offset < content.size(); offset += BLOCK_SIZE) {
+            unsigned len = static_cast<unsigned>(std::min(BLOCK_SIZE, content.size() - offset));
+            ok = gzwrite(file, content.data() + offset, len) == static_cast<int>(len);
+        }
+        return gzclose(file) == Z_OK && ok;
+    }
+
+    // Call sink(data, size) for each decompressed block
+    template <typename Sink>
+    bool readCompressed(const std::filesystem::path& path, Sink sink) {
+        gzFile file = gzopen(path.string().c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+        gzbuffer(file, BLOCK_SIZE);
+
+        std::vector<char> buffer(BLOCK_SIZE);
+        int n;
+        while ((n = gzread(file, buffer.data(), buffer.size())) > 0) {
+            sink(buffer.data(), static_cast<size_t>(n));
+        }
+        return gzclose(file) == Z_OK && n == 0;
+    }
+#endif
+
+    template <typename Sink>
+    bool readPlain(const std::filesystem::path& path, Sink sink) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        std::vector<char> buffer(BLOCK_SIZE);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            sink(buffer.data(), static_cast<size_t>(file.gcount()));
+        }
+        return file.eof();
+    }
+
+    template <typename Sink>
+    bool readResult(const std::filesystem::path& path, Sink sink) {
+        if (isCompressed(path)) {
+#ifdef PNPL_WITH_ZLIB
+            return readCompressed(path, sink);
+#else
+            return false;   // Written by a build with compression; this one can't read it
+#endif
+        }
+        return readPlain(path, sink);
+    }
+
+} // namespace
+
+size_t resultExtensionLength(const std::string& filename) {
+    for (const char* ext : RESULT_EXTENSIONS) {
+        size_t length = std::char_traits<char>::length(ext);
+        if (filename.size() > length && filename.compare(filename.size() - length, length, ext) == 0) {
+            return length;
+        }
+    }
+    return 0;
+}
+
+std::filesystem::path consumingPath(const std::filesystem::path& resultPath) {
+    // The extension is kept so the claimed file still reads as text, gzip or embedding
+    std::string filename = resultPath.filename().string();
+    size_t extLength = resultExtensionLength(filename);
+    std::string stem = filename.substr(0, filename.size() - extLength);
+    std::string ext = filename.substr(filename.size() - extLength);
+    return resultPath.parent_path() / ("." + stem + CONSUMING_MARKER + std::to_string(getpid()) + ext);
+}
+
+bool isConsumingFile(const std::string& filename) {
+    return !filename.empty() && filename[0] == '.' && filename.find(CONSUMING_MARKER) != std::string::npos;
+}
+
+bool resultCompressionAvailable() {
+#ifdef PNPL_WITH_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool writeResultFile(const std::filesystem::path& path, const std::string& content,
+                     std::string& error) {
+    std::filesystem::path tempPath = path;
+    tempPath += ".tmp";
+
+    bool written = false;
+    if (isCompressed(path)) {
+#ifdef PNPL_WITH_ZLIB
+        written = writeCompressed(tempPath, content);
+#else
+        error = "Compressed results not supported by this build: " + path.string();
+        return false;
+#endif
+    } else {
+        std::ofstream file(tempPath, std::ios::binary);
+        file << content;
+        file.close();
+        written = !file.fail();
+    }
+
+    std::error_code ec;
+    if (!written) {
+        std::filesystem::remove(tempPath, ec);
+        error = "Failed to write result file: " + path.string();
+        return false;
+    }
+
+    std::filesystem::rename(tempPath, path, ec);
+    if (ec) {
+        std::filesystem::remove(tempPath, ec);
+        error = "Failed to create result file: " + path.string();
+        return false;
+    }
+
+    filesWritten++;
+    rawBytesWritten += content.size();
+    storedBytesWritten += std::filesystem::file_size(path, ec);
+    return true;
+}
+
+bool readResultFile(const std::filesystem::path& path, std::string& content) {
+    content.clear();
+    return readResult(path, [&content](const char* data, size_t size) {
+        content.append(data, size);
+    });
+}
+
+bool streamResultFile(const std::filesystem::path& path, std::ostream& out) {
+    return readResult(path, [&out](const char* data, size_t size) {
+        out.write(data, size);
+    }) && out.good();
+}
+
+ResultStorageStats resultStorageStats() {
+    ResultStorageStats stats;
+    stats.files = filesWritten;
+    stats.rawBytes = rawBytesWritten;
+    stats.storedBytes = storedBytesWritten;
+    return stats;
+}
+
+} // namespace pnpl
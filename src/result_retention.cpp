@@ -0,0 +1,192 @@
+#include "pnpl/result_retention.hpp"
+#include "pnpl/result_file.hpp"
+#include "pnpl/job_metadata.hpp"
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <sys/stat.h>
+
+namespace pnpl {
+
+namespace {
+
+    // A popper renames a result away, reads it and deletes it within moments; a claim
+    // this old belongs to one that died, and the result is already gone for everyone else
+    const int64_t ABANDONED_CLAIM_SECONDS = 600;
+
+    // Sidecars are written moments before their result and deleted with it; one this old
+    // without a result lost it to a popper or cleanup that ran in between
+    const int64_t ORPHANED_SIDECAR_SECONDS = 600;
+
+    struct StoredResult {
+        std::string jobId;
+        std::filesystem::path path;
+        int64_t completed = 0;   // mtime: results are published by rename once written
+        uint64_t bytes = 0;
+    };
+
+    bool statFile(const std::filesystem::path& path, struct stat& st) {
+        return ::stat(path.c_str(), &st) == 0;
+    }
+
+    // Length of a sidecar extension (.meta or .timing) of a filename, 0 if it has none
+    size_t sidecarExtensionLength(const std::string& filename) {
+        for (const std::string& ext : {std::string(".meta"), JOB_TIMING_EXTENSION}) {
+            if (filename.size() > ext.size() &&
+                filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+                return ext.size();
+            }
+        }
+        return 0;
+    }
+
+    void removeResult(const StoredResult& result) {
+        std::error_code ec;
+        std::filesystem::remove(result.path, ec);
+        std::filesystem::path shard = result.path.parent_path();
+        std::filesystem::remove(metadataPath(shard, result.jobId), ec);
+        std::filesystem::remove(shard / (result.jobId + JOB_TIMING_EXTENSION), ec);
+    }
+
+} // namespace
+
+bool RetentionPolicy::enabled() const {
+    return maxAgeSeconds > 0 || maxResults > 0 || maxBytes > 0;
+}
+
+std::string RetentionPolicy::describe() const {
+    std::vector<std::string> limits;
+    if (maxAgeSeconds > 0) limits.push_back("age " + std::to_string(maxAgeSeconds) + " s");
+    if (maxResults > 0) limits.push_back(std::to_string(maxResults) + " results");
+    if (maxBytes > 0) limits.push_back(std::to_string(maxBytes >> 20) + " MiB");
+    if (limits.empty()) {
+        return "keep everything";
+    }
+
+    std::string text;
+    for (const auto& limit : limits) {
+        text += (text.empty() ? "" : ", ") + limit;
+    }
+    return text;
+}
+
+bool parseRetentionAge(const std::string& text, int64_t& seconds) {
+    size_t digits = 0;
+    while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits]))) {
+        ++digits;
+    }
+    if (digits == 0 || digits + 1 < text.size()) {
+        return false;
+    }
+
+    int64_t unit = 1;
+    if (digits < text.size()) {
+        switch (text[digits]) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            default: return false;
+        }
+    }
+
+    try {
+        seconds = std::stoll(text.substr(0, digits)) * unit;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return seconds > 0;
+}
+
+RetentionSweep enforceRetention(const std::filesystem::path& directory, const RetentionPolicy& policy) {
+    RetentionSweep sweep;
+    const int64_t now = static_cast<int64_t>(std::time(nullptr));
+
+    // Walked directly rather than through the layout: every layout nests results below
+    // the directory, and consume claims are dotfiles the layout would skip
+    std::vector<StoredResult> results;
+    std::vector<std::filesystem::path> oldSidecars;
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec)) continue;
+
+        std::string filename = it->path().filename().string();
+        struct stat st;
+        if (!statFile(it->path(), st)) continue;   // Popped meanwhile
+
+        // A rename sets ctime, so it dates the claim rather than the result
+        if (isConsumingFile(filename)) {
+            if (now - static_cast<int64_t>(st.st_ctime) > ABANDONED_CLAIM_SECONDS) {
+                std::error_code removeError;
+                if (std::filesystem::remove(it->path(), removeError)) {
+                    sweep.abandoned++;
+                }
+            }
+            continue;
+        }
+
+        if (filename[0] == '.') continue;
+
+        if (sidecarExtensionLength(filename) > 0) {
+            if (now - static_cast<int64_t>(st.st_mtime) > ORPHANED_SIDECAR_SECONDS) {
+                oldSidecars.push_back(it->path());
+            }
+            continue;
+        }
+
+        size_t extLength = resultExtensionLength(filename);
+        if (extLength == 0) continue;
+
+        results.push_back(StoredResult{filename.substr(0, filename.size() - extLength), it->path(),
+                                       static_cast<int64_t>(st.st_mtime), static_cast<uint64_t>(st.st_size)});
+    }
+
+    // Sidecars whose result is gone would otherwise stay forever: only results are swept
+    std::unordered_set<std::string> resultKeys;
+    for (const auto& result : results) {
+        resultKeys.insert((result.path.parent_path() / result.jobId).string());
+    }
+    for (const auto& path : oldSidecars) {
+        std::string filename = path.filename().string();
+        std::string jobId = filename.substr(0, filename.size() - sidecarExtensionLength(filename));
+        std::error_code removeError;
+        if (!resultKeys.count((path.parent_path() / jobId).string()) &&
+            std::filesystem::remove(path, removeError)) {
+            sweep.orphaned++;
+        }
+    }
+
+    // Oldest first; IDs start with their creation time, which breaks ties within a second
+    std::sort(results.begin(), results.end(), [](const StoredResult& a, const StoredResult& b) {
+        return a.completed != b.completed ? a.completed < b.completed : a.jobId < b.jobId;
+    });
+
+    uint64_t count = results.size();
+    uint64_t bytes = 0;
+    for (const auto& result : results) {
+        bytes += result.bytes;
+    }
+
+    for (const auto& result : results) {
+        bool expired = policy.maxAgeSeconds > 0 && now - result.completed > policy.maxAgeSeconds;
+        bool overCount = policy.maxResults > 0 && count > policy.maxResults;
+        bool overBytes = policy.maxBytes > 0 && bytes > policy.maxBytes;
+        if (!expired && !overCount && !overBytes) {
+            break;   // Everything newer is within the policy too
+        }
+
+        removeResult(result);
+        sweep.removed++;
+        sweep.removedBytes += result.bytes;
+        count--;
+        bytes -= result.bytes;
+    }
+
+    sweep.kept = count;
+    sweep.keptBytes = bytes;
+    return sweep;
+}
+
+} // namespace pnpl
@@ -1,18 +1,19 @@
 #include "pnpl/inference_monitor.hpp"
+#include "pnpl/autotune.hpp"
+#include "pnpl/result_file.hpp"
+#include "pnpl/trace.hpp"
+#include "pnpl/executable_path.hpp"
 #include <iostream>
 #include <string>
 #include <thread>
 #include <chrono>
 #include <csignal>
 #include <filesystem>
-
-#ifdef __APPLE__
-#include <mach-o/dyld.h>
-#elif defined(__linux__)
-#include <unistd.h>
-#elif defined(_WIN32)
-#include <windows.h>
-#endif
+#include <fstream>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
 
 // Global signal handler
 std::atomic<bool> g_running(true);
@@ -22,56 +23,55 @@ void signalHandler(int signal) {
     g_running = false;
 }
 
-std::string getExecutablePath() {
-    std::string path;
-
-#ifdef __APPLE__
-    char buffer[PATH_MAX];
-    uint32_t size = sizeof(buffer);
-    if (_NSGetExecutablePath(buffer, &size) == 0) {
-        path = std::filesystem::canonical(buffer).string();
-    }
-#elif defined(__linux__)
-    char buffer[PATH_MAX];
-    ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer) - 1);
-    if (len != -1) {
-        buffer[len] = '\0';
-        path = std::filesystem::canonical(buffer).string();
-    }
-#elif defined(_WIN32)
-    char buffer[MAX_PATH];
-    if (GetModuleFileNameA(NULL, buffer, MAX_PATH) > 0) {
-        path = std::filesystem::canonical(buffer).string();
-    }
-#endif
-
-    if (path.empty()) {
-        // Fallback: use current working directory
-        path = std::filesystem::current_path().string() + "/pnpl_server";
-        std::cerr << "Warning: Could not determine executable path, using fallback" << std::endl;
-    }
-
-    return path;
-}
-
-std::string getProjectRoot() {
-    std::filesystem::path exePath = getExecutablePath();
-    std::filesystem::path buildDir = exePath.parent_path();
-
-    // Go up one level to project root (assuming we're in build/)
-    std::filesystem::path projectRoot = buildDir.parent_path();
-
-    return projectRoot.string();
-}
-
 void printUsage(const char* program) {
     std::cout << "PNPL Server: Monitor and process jobs" << std::endl;
     std::cout << "Usage: " << program << " <model_path> [options]" << std::endl;
     std::cout << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  --workers <n>        Number of worker threads (default: 1)" << std::endl;
+    std::cout << "  --prefill-workers <n>  Evaluate prompts on n extra workers and hand the KV state" << std::endl;
+    std::cout << "                       to the --workers pool for decoding (default: 0 = off)" << std::endl;
     std::cout << "  --input-dir <dir>    Input directory (default: <project>/data/input)" << std::endl;
     std::cout << "  --output-dir <dir>   Output directory (default: <project>/data/output)" << std::endl;
+    std::cout << "  --ctx-size <n>       Max context per job (default: model's trained context)" << std::endl;
+    std::cout << "  --cache-type-k <t>   KV cache key type: f16, q8_0, q4_0 (default: f16)" << std::endl;
+    std::cout << "  --cache-type-v <t>   KV cache value type: f16, q8_0, q4_0 (default: f16)" << std::endl;
+    std::cout << "  --flash-attn         Enable flash attention (required for quantized V cache)" << std::endl;
+    std::cout << "  --mlock              Lock model weights in RAM" << std::endl;
+    std::cout << "  --prefetch           Read the model into the page cache before loading" << std::endl;
+    std::cout << "  --hugepages <mode>   Back weights and context buffers with huge pages: thp (transparent)" << std::endl;
+    std::cout << "                       or explicit (model copied to hugetlbfs; buffers use thp)" << std::endl;
+    std::cout << "  --hugepages-dir <dir>  hugetlbfs mount for --hugepages explicit (default: /dev/hugepages)" << std::endl;
+    std::cout << "  --hugepages-benchmark  Compare decode speed with and without huge pages, then exit" << std::endl;
+    std::cout << "  --autotune           Probe threads, batch size, flash attention and GPU offload" << std::endl;
+    std::cout << "                       at startup and use the fastest (cached per model and host)" << std::endl;
+    std::cout << "  --autotune-cache <file>  Where tuned settings are kept (default: <project>/data/autotune.txt)" << std::endl;
+    std::cout << "  --ready-file <path>  Create this file once the server is ready for jobs" << std::endl;
+    std::cout << "  --model <name>=<path>  Register an extra model jobs can name (loaded on demand)" << std::endl;
+    std::cout << "  --route <category>=<name>  Send a prompt category (code_review, code, question," << std::endl;
+    std::cout << "                       guide, general) to a named model" << std::endl;
+    std::cout << "  --model-cache-mb <n> Memory budget for loaded models (default: unbounded)" << std::endl;
+    std::cout << "  --tenant-weight <tenant>=<n>  Relative share of workers for a tenant (default: 1)" << std::endl;
+    std::cout << "  --embed-batch <n>    Max embedding jobs packed into one batch (default: 64)" << std::endl;
+    std::cout << "  --prompt-templates <file>  Load prompt templates (see config/prompt_templates.conf)" << std::endl;
+    std::cout << "  --layout <mode>      Shard job directories: flat, hashed or date (default: as recorded)" << std::endl;
+    std::cout << "  --node-id <id>       Unique name of this server when several share the queue" << std::endl;
+    std::cout << "                       directories (default: host name)" << std::endl;
+    std::cout << "  --lease-seconds <n>  Job lease duration; a dead node's jobs are reclaimed after it" << std::endl;
+    std::cout << "                       (default: 60)" << std::endl;
+    std::cout << "  --trace <file>       Write a Chrome/Perfetto trace of job and decode timelines" << std::endl;
+    std::cout << "  --no-compress        Write results as plain .txt instead of .txt.gz" << std::endl;
+    std::cout << "  --job-timings        Write <id>.timing (worker start/finish) next to results, for pnpl_loadgen" << std::endl;
+    std::cout << "  --retain-age <age>   Delete results older than this: 90s, 30m, 12h or 7d" << std::endl;
+    std::cout << "  --retain-count <n>   Keep at most n results, deleting the oldest" << std::endl;
+    std::cout << "  --retain-mb <n>      Keep at most n MiB of results, deleting the oldest" << std::endl;
+    std::cout << "  --read-ahead <n>     Read and tokenize up to n queued inputs ahead of the workers" << std::endl;
+    std::cout << "                       (default: 2 per worker, 0 = off)" << std::endl;
+    std::cout << "  --isolate            Run each worker's generations in its own process (pnpl_worker);" << std::endl;
+    std::cout << "                       a crash fails that job and the process is respawned" << std::endl;
+    std::cout << "  --worker-exe <path>  Worker process executable (default: pnpl_worker next to this one)" << std::endl;
+    std::cout << "  --map-reduce         Split inputs larger than the context window into parallel" << std::endl;
+    std::cout << "                       chunks and combine the partial results" << std::endl;
     std::cout << std::endl;
     std::cout << "Note: If input/output dirs are relative, they're relative to project root" << std::endl;
 }
@@ -86,10 +86,43 @@ int main(int argc, char* argv[]) {
     std::string modelPath = argv[1];
 
     // Get project root for default paths
-    std::string projectRoot = getProjectRoot();
+    std::string projectRoot = pnpl::getProjectRoot("pnpl_server");
     std::string inputDir = projectRoot + "/data/input";
     std::string outputDir = projectRoot + "/data/output";
     int numWorkers = 1;
+    int prefillWorkers = 0;
+    pnpl::RunnerOptions runnerOptions;
+    std::string readyFile;
+    std::vector<std::pair<std::string, std::string>> extraModels;
+    std::vector<std::pair<std::string, std::string>> routes;
+    std::vector<std::pair<std::string, std::string>> tenantWeights;
+    uint64_t modelCacheBytes = 0;
+    std::string promptTemplatesFile;
+    int embeddingBatchSize = 64;
+    bool mapReduce = false;
+    std::string layoutName;
+    std::string traceFile;
+    std::string nodeId = pnpl::LeaseManager::defaultNodeId();
+    int leaseSeconds = 60;
+    bool compressResults = pnpl::resultCompressionAvailable();
+    bool jobTimings = false;
+    pnpl::RetentionPolicy retention;
+    int readAhead = -1;
+    bool autotune = false;
+    std::string autotuneCache = projectRoot + "/data/autotune.txt";
+    bool isolate = false;
+    bool hugePagesBenchmark = false;
+    std::string workerExecutable = (std::filesystem::path(pnpl::getExecutablePath("pnpl_server")).parent_path() / "pnpl_worker").string();
+
+    // Split a "<key>=<value>" option argument
+    auto splitPair = [](const std::string& value, std::pair<std::string, std::string>& pair) {
+        size_t eq = value.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == value.size()) {
+            return false;
+        }
+        pair = {value.substr(0, eq), value.substr(eq + 1)};
+        return true;
+    };
 
     // Parse options
     for (int i = 2; i < argc; i++) {
@@ -103,6 +136,13 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Invalid worker count, using default" << std::endl;
             }
         }
+        else if (arg == "--prefill-workers" && i + 1 < argc) {
+            try {
+                prefillWorkers = std::max(0, std::stoi(argv[++i]));
+            } catch (...) {
+                std::cerr << "Invalid prefill worker count, running prefill on every worker" << std::endl;
+            }
+        }
         else if (arg == "--input-dir" && i + 1 < argc) {
             std::string dir = argv[++i];
             // If relative path, resolve it relative to current working directory
@@ -121,6 +161,156 @@ int main(int argc, char* argv[]) {
                 outputDir = dir;
             }
         }
+        else if (arg == "--ctx-size" && i + 1 < argc) {
+            try {
+                runnerOptions.contextSize = std::stoi(argv[++i]);
+                if (runnerOptions.contextSize < 0) runnerOptions.contextSize = 0;
+            } catch (...) {
+                std::cerr << "Invalid context size, using model default" << std::endl;
+            }
+        }
+        else if (arg == "--cache-type-k" && i + 1 < argc) {
+            runnerOptions.cacheTypeK = argv[++i];
+        }
+        else if (arg == "--cache-type-v" && i + 1 < argc) {
+            runnerOptions.cacheTypeV = argv[++i];
+        }
+        else if (arg == "--flash-attn") {
+            runnerOptions.flashAttention = true;
+        }
+        else if (arg == "--mlock") {
+            runnerOptions.useMlock = true;
+        }
+        else if (arg == "--prefetch") {
+            runnerOptions.prefetch = true;
+        }
+        else if (arg == "--ready-file" && i + 1 < argc) {
+            readyFile = std::filesystem::absolute(argv[++i]).string();
+        }
+        else if (arg == "--model" && i + 1 < argc) {
+            std::pair<std::string, std::string> model;
+            if (splitPair(argv[++i], model)) {
+                extraModels.push_back(model);
+            } else {
+                std::cerr << "Invalid --model value, expected <name>=<path>" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--route" && i + 1 < argc) {
+            std::pair<std::string, std::string> route;
+            if (splitPair(argv[++i], route)) {
+                routes.push_back(route);
+            } else {
+                std::cerr << "Invalid --route value, expected <category>=<name>" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--tenant-weight" && i + 1 < argc) {
+            std::pair<std::string, std::string> weight;
+            if (splitPair(argv[++i], weight)) {
+                tenantWeights.push_back(weight);
+            } else {
+                std::cerr << "Invalid --tenant-weight value, expected <tenant>=<weight>" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--embed-batch" && i + 1 < argc) {
+            try {
+                embeddingBatchSize = std::stoi(argv[++i]);
+            } catch (...) {
+                std::cerr << "Invalid embedding batch size, using default" << std::endl;
+            }
+        }
+        else if (arg == "--prompt-templates" && i + 1 < argc) {
+            promptTemplatesFile = argv[++i];
+        }
+        else if (arg == "--map-reduce") {
+            mapReduce = true;
+        }
+        else if (arg == "--layout" && i + 1 < argc) {
+            layoutName = argv[++i];
+        }
+        else if (arg == "--node-id" && i + 1 < argc) {
+            nodeId = argv[++i];
+        }
+        else if (arg == "--lease-seconds" && i + 1 < argc) {
+            try {
+                leaseSeconds = std::stoi(argv[++i]);
+            } catch (...) {
+                std::cerr << "Invalid lease duration, using default" << std::endl;
+            }
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        }
+        else if (arg == "--no-compress") {
+            compressResults = false;
+        }
+        else if (arg == "--job-timings") {
+            jobTimings = true;
+        }
+        else if (arg == "--retain-age" && i + 1 < argc) {
+            std::string age = argv[++i];
+            if (!pnpl::parseRetentionAge(age, retention.maxAgeSeconds)) {
+                std::cerr << "Error: Invalid retention age '" << age << "' (e.g. 90s, 30m, 12h, 7d)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--retain-count" && i + 1 < argc) {
+            try {
+                retention.maxResults = std::stoull(argv[++i]);
+            } catch (...) {
+                std::cerr << "Invalid retention count, keeping every result" << std::endl;
+            }
+        }
+        else if (arg == "--retain-mb" && i + 1 < argc) {
+            try {
+                retention.maxBytes = std::stoull(argv[++i]) << 20;
+            } catch (...) {
+                std::cerr << "Invalid retention size, keeping every result" << std::endl;
+            }
+        }
+        else if (arg == "--autotune") {
+            autotune = true;
+        }
+        else if (arg == "--autotune-cache" && i + 1 < argc) {
+            autotune = true;
+            autotuneCache = argv[++i];
+        }
+        else if (arg == "--hugepages" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (!pnpl::parseHugePageMode(mode, runnerOptions.hugePages)) {
+                std::cerr << "Error: Unknown huge page mode '" << mode << "' (expected off, thp or explicit)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--hugepages-dir" && i + 1 < argc) {
+            runnerOptions.hugePageDirectory = argv[++i];
+        }
+        else if (arg == "--hugepages-benchmark") {
+            hugePagesBenchmark = true;
+        }
+        else if (arg == "--isolate") {
+            isolate = true;
+        }
+        else if (arg == "--worker-exe" && i + 1 < argc) {
+            isolate = true;
+            workerExecutable = std::filesystem::absolute(argv[++i]).string();
+        }
+        else if (arg == "--read-ahead" && i + 1 < argc) {
+            try {
+                readAhead = std::stoi(argv[++i]);
+            } catch (...) {
+                std::cerr << "Invalid read-ahead depth, using default" << std::endl;
+            }
+        }
+        else if (arg == "--model-cache-mb" && i + 1 < argc) {
+            try {
+                modelCacheBytes = std::stoull(argv[++i]) << 20;
+            } catch (...) {
+                std::cerr << "Invalid model cache size, using unbounded" << std::endl;
+            }
+        }
         else if (arg == "--help" || arg == "-h") {
             printUsage(argv[0]);
             return 0;
@@ -137,8 +327,18 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (hugePagesBenchmark) {
+        std::string error;
+        if (!pnpl::Autotuner::compareHugePages(modelPath, runnerOptions, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     // Set up signal handler for graceful shutdown
     std::signal(SIGINT, signalHandler);
+    std::signal(SIGTERM, signalHandler);
 
     // Create directories if they don't exist
     try {
@@ -155,26 +355,123 @@ int main(int argc, char* argv[]) {
     std::cout << "Input directory: " << inputDir << std::endl;
     std::cout << "Output directory: " << outputDir << std::endl;
     std::cout << "Worker threads: " << numWorkers << std::endl;
+    if (prefillWorkers > 0) {
+        std::cout << "Prefill worker threads: " << prefillWorkers << std::endl;
+    }
+    std::cout << "Context size: "
+              << (runnerOptions.contextSize > 0 ? std::to_string(runnerOptions.contextSize) : "model default")
+              << std::endl;
+    std::cout << "KV cache: K=" << runnerOptions.cacheTypeK << " V=" << runnerOptions.cacheTypeV
+              << (runnerOptions.flashAttention ? " (flash attention)" : "") << std::endl;
+    std::cout << "Result compression: " << (compressResults ? "gzip" : "off") << std::endl;
 
     // Initialize and start inference monitor
-    pnpl::InferenceMonitor monitor(modelPath, inputDir, outputDir, numWorkers);
+    pnpl::InferenceMonitor monitor(modelPath, inputDir, outputDir, numWorkers, runnerOptions);
+    monitor.setModelMemoryBudget(modelCacheBytes);
+    monitor.setEmbeddingBatchSize(embeddingBatchSize);
+    monitor.setMapReduce(mapReduce);
+    monitor.setCompressResults(compressResults);
+    monitor.setRecordTimings(jobTimings);
+    monitor.setRetention(retention);
+    monitor.setPrefillWorkers(prefillWorkers);
+    if (autotune) {
+        monitor.setAutotune(autotuneCache);
+    }
+    if (readAhead >= 0) {
+        monitor.setPrefetchDepth(readAhead);
+    }
+    if (isolate) {
+        if (!std::filesystem::exists(workerExecutable)) {
+            std::cerr << "Error: Worker executable not found: " << workerExecutable << std::endl;
+            return 1;
+        }
+        std::cout << "Worker processes: " << workerExecutable << std::endl;
+        monitor.setIsolation(workerExecutable);
+    }
+    monitor.setNodeId(nodeId, leaseSeconds);
+
+    if (!layoutName.empty()) {
+        pnpl::LayoutMode mode;
+        std::string error;
+        if (!pnpl::JobLayout::parseMode(layoutName, mode)) {
+            std::cerr << "Error: Unknown layout '" << layoutName << "' (expected flat, hashed or date)" << std::endl;
+            return 1;
+        }
+        if (!monitor.setLayout(mode, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+    }
+
+    if (!promptTemplatesFile.empty()) {
+        std::string error;
+        if (!monitor.loadPromptTemplates(promptTemplatesFile, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+        std::cout << "Prompt templates: " << promptTemplatesFile << std::endl;
+    }
+
+    for (const auto& model : extraModels) {
+        if (!std::filesystem::exists(model.second)) {
+            std::cerr << "Error: Model file not found: " << model.second << std::endl;
+            return 1;
+        }
+        std::cout << "Model '" << model.first << "': " << model.second << std::endl;
+        monitor.addModel(model.first, model.second);
+    }
+    for (const auto& route : routes) {
+        std::cout << "Route: " << route.first << " -> " << route.second << std::endl;
+        monitor.addRoute(route.first, route.second);
+    }
+    for (const auto& weight : tenantWeights) {
+        try {
+            monitor.setTenantWeight(weight.first, std::stoi(weight.second));
+            std::cout << "Tenant weight: " << weight.first << " = " << weight.second << std::endl;
+        } catch (...) {
+            std::cerr << "Invalid weight for tenant " << weight.first << ", using 1" << std::endl;
+        }
+    }
+
+    // Tracing covers startup too: model load and worker warm-up
+    if (!traceFile.empty()) {
+        std::string error;
+        if (!pnpl::Tracer::start(traceFile, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+        std::cout << "Tracing to " << traceFile << std::endl;
+    }
 
     if (!monitor.start()) {
         std::cerr << "Failed to start inference monitor" << std::endl;
+        pnpl::Tracer::stop();
         return 1;
     }
 
-    std::cout << "Server started. Press Ctrl+C to stop." << std::endl;
+    // Readiness marker for rollout tooling: only present while jobs can be served
+    if (!readyFile.empty()) {
+        std::ofstream marker(readyFile);
+        marker << "ready" << std::endl;
+    }
+
+    std::cout << "Server ready. Press Ctrl+C to stop." << std::endl;
 
     // Main loop - periodically display status
     while (g_running) {
         std::cout << "Queue size: " << monitor.getQueueSize() << std::endl;
+        std::cout << monitor.getStatus() << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(5));
     }
 
     // Graceful shutdown
     std::cout << "Shutting down server..." << std::endl;
+    if (!readyFile.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(readyFile, ec);
+    }
     monitor.stop();
+    pnpl::Tracer::stop();
     std::cout << "Server stopped" << std::endl;
 
     return 0;
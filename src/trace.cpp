@@ -0,0 +1,216 @@
+#include "pnpl/trace.hpp"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+
+namespace pnpl {
+
+std::atomic<bool> Tracer::enabled_{false};
+
+namespace {
+
+    const size_t JOB_ID_LENGTH = 48;
+    const size_t BUFFER_EVENTS = 16384;   // Per thread; about 1 MB
+    const auto FLUSH_INTERVAL = std::chrono::milliseconds(200);
+
+    struct TraceEvent {
+        const char* name;
+        uint64_t begin;
+        uint64_t end;
+        char job[JOB_ID_LENGTH];
+    };
+
+    // Single-producer (owning thread) / single-consumer (flusher) ring
+    struct ThreadBuffer {
+        std::vector<TraceEvent> events = std::vector<TraceEvent>(BUFFER_EVENTS);
+        std::atomic<size_t> head{0};       // Next slot the owner writes
+        std::atomic<size_t> tail{0};       // Next slot the flusher reads
+        std::atomic<uint64_t> dropped{0};  // Events lost to a full buffer
+        char job[JOB_ID_LENGTH] = {};      // Current job; only touched by the owner
+        uint32_t tid = 0;
+        std::string name;                  // Guarded by the tracer mutex
+        bool nameWritten = false;
+    };
+
+    struct TracerState {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        std::ofstream out;
+        std::thread flusher;
+        bool stopping = false;
+        bool firstEvent = true;
+        uint64_t origin = 0;
+        uint32_t nextTid = 1;
+    };
+
+    TracerState& state() {
+        static TracerState instance;
+        return instance;
+    }
+
+    thread_local std::shared_ptr<ThreadBuffer> threadBuffer;
+
+    ThreadBuffer& currentBuffer() {
+        if (!threadBuffer) {
+            auto buffer = std::make_shared<ThreadBuffer>();
+            TracerState& s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            buffer->tid = s.nextTid++;
+            s.buffers.push_back(buffer);
+            threadBuffer = buffer;
+        }
+        return *threadBuffer;
+    }
+
+    void writeEscaped(std::ostream& out, const char* text) {
+        for (; *text; ++text) {
+            if (*text == '"' || *text == '\\') out << '\\';
+            out << *text;
+        }
+    }
+
+    void beginEvent(TracerState& s) {
+        s.out << (s.firstEvent ? "\n" : ",\n");
+        s.firstEvent = false;
+    }
+
+    // Write everything recorded so far; called with the mutex held
+    void drain(TracerState& s) {
+        for (const auto& buffer : s.buffers) {
+            if (!buffer->nameWritten && !buffer->name.empty()) {
+                beginEvent(s);
+                s.out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                      << ",\"args\":{\"name\":\"";
+                writeEscaped(s.out, buffer->name.c_str());
+                s.out << "\"}}";
+                buffer->nameWritten = true;
+            }
+
+            size_t tail = buffer->tail.load(std::memory_order_relaxed);
+            size_t head = buffer->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail) {
+                const TraceEvent& event = buffer->events[tail % BUFFER_EVENTS];
+                beginEvent(s);
+                s.out << "{\"name\":\"" << event.name << "\",\"cat\":\"pnpl\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                      << buffer->tid << ",\"ts\":" << event.begin - s.origin
+                      << ",\"dur\":" << event.end - event.begin;
+                if (event.job[0] != '\0') {
+                    s.out << ",\"args\":{\"job\":\"";
+                    writeEscaped(s.out, event.job);
+                    s.out << "\"}";
+                }
+                s.out << "}";
+            }
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+        s.out.flush();
+    }
+
+    void flushLoop() {
+        TracerState& s = state();
+        std::unique_lock<std::mutex> lock(s.mutex);
+        while (!s.stopping) {
+            s.wake.wait_for(lock, FLUSH_INTERVAL);
+            drain(s);
+        }
+    }
+
+} // namespace
+
+bool Tracer::start(const std::string& path, std::string& error) {
+    TracerState& s = state();
+    if (enabled()) {
+        return true;
+    }
+
+    s.out.open(path, std::ios::trunc);
+    if (!s.out) {
+        error = "Failed to open trace file: " + path;
+        return false;
+    }
+
+    s.out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    s.origin = now();
+    s.stopping = false;
+    s.flusher = std::thread(flushLoop);
+    enabled_.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void Tracer::stop() {
+    TracerState& s = state();
+    if (!enabled()) {
+        return;
+    }
+    enabled_.store(false, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.stopping = true;
+    }
+    s.wake.notify_all();
+    s.flusher.join();
+
+    // Final drain, then close the JSON document
+    std::lock_guard<std::mutex> lock(s.mutex);
+    drain(s);
+    s.out << "\n]}\n";
+    s.out.close();
+
+    uint64_t dropped = 0;
+    for (const auto& buffer : s.buffers) {
+        dropped += buffer->dropped.load();
+    }
+    if (dropped > 0) {
+        std::cerr << "Warning: Trace dropped " << dropped << " events (buffers full)" << std::endl;
+    }
+}
+
+void Tracer::setThreadName(const std::string& name) {
+    if (!enabled()) return;
+
+    ThreadBuffer& buffer = currentBuffer();
+    std::lock_guard<std::mutex> lock(state().mutex);
+    buffer.name = name;
+    buffer.nameWritten = false;
+}
+
+void Tracer::setThreadJob(const std::string& jobId) {
+    if (!enabled()) return;
+
+    ThreadBuffer& buffer = currentBuffer();
+    std::strncpy(buffer.job, jobId.c_str(), JOB_ID_LENGTH - 1);
+    buffer.job[JOB_ID_LENGTH - 1] = '\0';
+}
+
+uint64_t Tracer::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::record(const char* name, uint64_t begin, uint64_t end) {
+    if (!enabled()) return;
+
+    ThreadBuffer& buffer = currentBuffer();
+    size_t head = buffer.head.load(std::memory_order_relaxed);
+    if (head - buffer.tail.load(std::memory_order_acquire) >= BUFFER_EVENTS) {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent& event = buffer.events[head % BUFFER_EVENTS];
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    std::memcpy(event.job, buffer.job, JOB_ID_LENGTH);
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+} // namespace pnpl
@@ -0,0 +1,29 @@
+#include "pnpl/worker_process.hpp"
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+// Worker process spawned by pnpl_server --isolate: runs the generations of one server
+// worker on the socket the server passes down. Not meant to be started by hand.
+int main(int argc, char* argv[]) {
+    int fd = -1;
+    std::string templatesPath;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--fd" && i + 1 < argc) {
+            fd = std::atoi(argv[++i]);
+        }
+        else if (arg == "--prompt-templates" && i + 1 < argc) {
+            templatesPath = argv[++i];
+        }
+    }
+
+    if (fd < 0) {
+        std::cerr << "Usage: " << argv[0] << " --fd <socket> [--prompt-templates <file>]" << std::endl;
+        std::cerr << "Started by pnpl_server --isolate" << std::endl;
+        return 1;
+    }
+
+    return pnpl::WorkerProcess::serve(fd, templatesPath);
+}
@@ -0,0 +1,550 @@
+#include "pnpl/worker_process.hpp"
+#include "pnpl/prompt_templates.hpp"
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0   // macOS: SO_NOSIGPIPE is set on the socket instead
+#endif
+
+namespace pnpl {
+
+namespace {
+
+    const uint32_t MAX_FRAME_FIELDS = 64;
+
+    // Fields of a "done" reply: done, sequence, success, interrupted, cancelled,
+    // input_too_large, tokens, loop period, loop at, budget left, penalized, stopped, error, output
+    const size_t DONE_FIELDS = 14;
+
+    bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool readAll(int fd, char* data, size_t size) {
+        while (size > 0) {
+            ssize_t received = ::read(fd, data, size);
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (received == 0) {
+                return false;   // Peer closed the connection
+            }
+            data += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    void appendLength(std::string& frame, size_t length) {
+        uint32_t value = static_cast<uint32_t>(length);
+        frame.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // A frame is a field count followed by length-prefixed fields (both ends share the host's byte order)
+    bool writeFrame(int fd, const std::vector<std::string>& fields) {
+        std::string frame;
+        appendLength(frame, fields.size());
+        for (const auto& field : fields) {
+            appendLength(frame, field.size());
+            frame += field;
+        }
+        return writeAll(fd, frame.data(), frame.size());
+    }
+
+    bool readFrame(int fd, std::vector<std::string>& fields) {
+        uint32_t count = 0;
+        if (!readAll(fd, reinterpret_cast<char*>(&count), sizeof(count)) || count > MAX_FRAME_FIELDS) {
+            return false;
+        }
+        fields.assign(count, std::string());
+        for (auto& field : fields) {
+            uint32_t length = 0;
+            if (!readAll(fd, reinterpret_cast<char*>(&length), sizeof(length))) {
+                return false;
+            }
+            field.resize(length);
+            if (length > 0 && !readAll(fd, &field[0], length)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string formatOptions(const RunnerOptions& options) {
+        std::ostringstream text;
+        text << "context_size=" << options.contextSize << "\n"
+             << "cache_type_k=" << options.cacheTypeK << "\n"
+             << "cache_type_v=" << options.cacheTypeV << "\n"
+             << "flash_attn=" << (options.flashAttention ? 1 : 0) << "\n"
+             << "mlock=" << (options.useMlock ? 1 : 0) << "\n"
+             << "prefetch=" << (options.prefetch ? 1 : 0) << "\n"
+             << "gpu_layers=" << options.gpuLayers << "\n"
+             << "threads=" << options.threads << "\n"
+             << "threads_batch=" << options.threadsBatch << "\n"
+             << "ubatch=" << options.ubatchSize << "\n"
+             << "huge_pages=" << hugePageModeName(options.hugePages) << "\n"
+             << "huge_page_dir=" << options.hugePageDirectory << "\n";
+        return text.str();
+    }
+
+    RunnerOptions parseOptions(const std::string& text) {
+        RunnerOptions options;
+        std::istringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = line.substr(0, eq);
+            std::string value = line.substr(eq + 1);
+            int number = std::atoi(value.c_str());
+            if (key == "context_size") options.contextSize = number;
+            else if (key == "cache_type_k") options.cacheTypeK = value;
+            else if (key == "cache_type_v") options.cacheTypeV = value;
+            else if (key == "flash_attn") options.flashAttention = number != 0;
+            else if (key == "mlock") options.useMlock = number != 0;
+            else if (key == "prefetch") options.prefetch = number != 0;
+            else if (key == "gpu_layers") options.gpuLayers = number;
+            else if (key == "threads") options.threads = number;
+            else if (key == "threads_batch") options.threadsBatch = number;
+            else if (key == "ubatch") options.ubatchSize = number;
+            else if (key == "huge_pages") parseHugePageMode(value, options.hugePages);
+            else if (key == "huge_page_dir") options.hugePageDirectory = value;
+        }
+        return options;
+    }
+
+    std::vector<std::string> doneFrame(const std::string& sequence, const RunStatus& status,
+                                       const std::string& output) {
+        auto flag = [](bool value) { return std::string(value ? "1" : "0"); };
+        return {"done", sequence, flag(status.success), flag(status.interrupted), flag(status.cancelled),
+                flag(status.inputTooLarge), std::to_string(status.tokenCount),
+                std::to_string(status.loop.period), std::to_string(status.loop.generatedAt),
+                std::to_string(status.loop.budgetLeft), flag(status.loop.penalized),
+                flag(status.loop.stopped), status.error, output};
+    }
+
+    void parseDone(const std::vector<std::string>& fields, RunStatus& status, std::string& output) {
+        status.success = fields[2] == "1";
+        status.interrupted = fields[3] == "1";
+        status.cancelled = fields[4] == "1";
+        status.inputTooLarge = fields[5] == "1";
+        status.tokenCount = static_cast<size_t>(std::strtoull(fields[6].c_str(), nullptr, 10));
+        status.loop.period = std::atoi(fields[7].c_str());
+        status.loop.generatedAt = std::atoi(fields[8].c_str());
+        status.loop.budgetLeft = std::atoi(fields[9].c_str());
+        status.loop.penalized = fields[10] == "1";
+        status.loop.stopped = fields[11] == "1";
+        status.error = fields[12];
+        output = fields[13];
+    }
+
+    std::string describeExit(int status) {
+        if (WIFSIGNALED(status)) {
+            int signal = WTERMSIG(status);
+            return "was killed by signal " + std::to_string(signal) + " (" + strsignal(signal) + ")";
+        }
+        if (WIFEXITED(status)) {
+            return "exited with status " + std::to_string(WEXITSTATUS(status));
+        }
+        return "stopped";
+    }
+
+    // Child side: requests waiting for the generating thread, and the flags the reader
+    // thread raises while a generation runs
+    struct ChildState {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::vector<std::string>> requests;
+        std::string sequence;              // Latest "run" request
+        bool closed = false;
+        std::atomic<bool> cancel{false};
+        std::atomic<bool> interrupt{false};
+    };
+
+    void readRequests(int fd, ChildState& state) {
+        std::vector<std::string> fields;
+        while (readFrame(fd, fields) && !fields.empty()) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (fields[0] == "cancel") {
+                // A cancel that raced with the end of its run must not hit the next one
+                if (fields.size() > 1 && fields[1] == state.sequence) {
+                    state.cancel = true;
+                }
+            } else if (fields[0] == "interrupt") {
+                state.interrupt = true;
+            } else {
+                if (fields[0] == "run" && fields.size() > 1) {
+                    state.sequence = fields[1];
+                    state.cancel = false;
+                }
+                state.requests.push_back(std::move(fields));
+                state.wake.notify_one();
+            }
+        }
+
+        // The supervisor closed the connection (or died): checkpoint any run and exit
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.closed = true;
+        state.interrupt = true;
+        state.wake.notify_one();
+    }
+
+} // namespace
+
+RunStatus RunStatus::of(const InferenceRunner& runner, bool success) {
+    RunStatus status;
+    status.success = success;
+    status.interrupted = runner.wasInterrupted();
+    status.cancelled = runner.wasCancelled();
+    status.inputTooLarge = runner.wasInputTooLarge();
+    status.tokenCount = runner.lastTokenCount();
+    status.loop = runner.lastLoop();
+    if (!success) {
+        status.error = runner.getLastError();
+    }
+    return status;
+}
+
+WorkerProcess::WorkerProcess(const std::string& executable, const std::string& templatesPath)
+    : executable_(executable), templatesPath_(templatesPath) {
+}
+
+WorkerProcess::~WorkerProcess() {
+    reap();
+}
+
+bool WorkerProcess::spawn(std::string& error) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        error = std::string("Cannot create worker socket: ") + std::strerror(errno);
+        return false;
+    }
+    // Other children must not inherit either end (fds[1] is re-enabled in our child only)
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    // Everything the child needs is built before fork: only exec-safe calls may follow it
+    std::vector<std::string> args = {executable_, "--fd", std::to_string(fds[1])};
+    if (!templatesPath_.empty()) {
+        args.push_back("--prompt-templates");
+        args.push_back(templatesPath_);
+    }
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        error = std::string("Cannot fork worker process: ") + std::strerror(errno);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+#ifdef __linux__
+        // Don't outlive a supervisor that was killed outright
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+        fcntl(fds[1], F_SETFD, 0);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(fds[1]);
+    pid_ = pid;
+    fd_ = fds[0];
+    busy_ = false;
+    return true;
+}
+
+bool WorkerProcess::start(const std::string& modelPath, const RunnerOptions& options, std::string& error) {
+    reap();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!spawn(error)) {
+            return false;
+        }
+        send({"load", modelPath, formatOptions(options)});
+        if (interrupted_) {
+            send({"interrupt"});
+        }
+    }
+
+    // The child answers once the model is loaded and warmed up
+    std::vector<std::string> reply;
+    if (!readFrame(fd_, reply) || reply.empty()) {
+        error = "Worker process " + executable_ + " " + reap();
+        return false;
+    }
+    if (reply[0] != "ready") {
+        error = reply.size() > 1 ? reply[1] : "Worker process failed to load " + modelPath;
+        reap();
+        return false;
+    }
+    return true;
+}
+
+bool WorkerProcess::run(const WorkerRequest& request, std::string& output, RunStatus& status,
+                        const StreamCallback& onText, const std::atomic<bool>* cancelFlag) {
+    status = RunStatus();
+    output.clear();
+
+    JobMetadata metadata;
+    metadata.generation = request.params;
+    std::string tokens(reinterpret_cast<const char*>(request.tokens.data()),
+                       request.tokens.size() * sizeof(int32_t));
+
+    // A child that died while idle is respawned, once
+    for (int attempt = 0; ; ++attempt) {
+        bool alive;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            alive = pid_ > 0;
+        }
+        if (!alive && !start(request.modelPath, request.options, status.error)) {
+            return false;
+        }
+
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++sequence_;
+            sent = send({"run", std::to_string(sequence_), request.modelPath, formatOptions(request.options),
+                         request.checkpointPath.string(), formatJobMetadata(metadata), request.input,
+                         tokens, onText ? "1" : "0"});
+            busy_ = sent;
+        }
+        if (sent) {
+            break;
+        }
+
+        std::string exit = reap();
+        crashes_++;
+        if (attempt > 0) {
+            status.error = "Worker process " + exit;
+            return false;
+        }
+    }
+
+    // A cancel that came in before the request went out
+    if (cancelFlag && *cancelFlag) {
+        cancel();
+    }
+
+    std::vector<std::string> reply;
+    while (readFrame(fd_, reply) && !reply.empty()) {
+        if (reply[0] == "text" && reply.size() > 1) {
+            if (onText) onText(reply[1]);
+        } else if (reply[0] == "done" && reply.size() >= DONE_FIELDS) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                busy_ = false;
+            }
+            parseDone(reply, status, output);
+            return status.success;
+        }
+    }
+
+    // The child died mid-run; the next run() respawns it
+    status.crashed = true;
+    status.error = "Worker process " + reap();
+    crashes_++;
+    return false;
+}
+
+void WorkerProcess::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (busy_) {
+        send({"cancel", std::to_string(sequence_)});
+    }
+}
+
+void WorkerProcess::interrupt() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    interrupted_ = true;
+    send({"interrupt"});
+}
+
+int WorkerProcess::crashes() const {
+    return crashes_;
+}
+
+bool WorkerProcess::send(const std::vector<std::string>& fields) {
+    return fd_ >= 0 && writeFrame(fd_, fields);
+}
+
+std::string WorkerProcess::reap() {
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pid = pid_;
+        if (fd_ >= 0) {
+            close(fd_);   // An idle child sees end of file and exits
+        }
+        pid_ = -1;
+        fd_ = -1;
+        busy_ = false;
+    }
+    if (pid <= 0) {
+        return "";
+    }
+
+    int status = 0;
+    for (int i = 0; i < EXIT_TIMEOUT_SECONDS * 10; ++i) {
+        pid_t result = waitpid(pid, &status, WNOHANG);
+        if (result == pid) {
+            return describeExit(status);
+        }
+        if (result < 0 && errno != EINTR) {
+            return "exited";
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return "did not exit and was killed";
+}
+
+int WorkerProcess::serve(int fd, const std::string& templatesPath) {
+    // Ctrl+C reaches the whole process group; the supervisor decides when children stop
+    std::signal(SIGINT, SIG_IGN);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    auto templates = std::make_shared<PromptTemplates>();
+    if (!templatesPath.empty()) {
+        std::string error;
+        if (!templates->loadFile(templatesPath, error)) {
+            std::cerr << "Worker process: " << error << std::endl;
+            return 1;
+        }
+    }
+
+    ChildState state;
+    std::thread reader(readRequests, fd, std::ref(state));
+
+    InferenceRunner runner;
+    runner.setPromptTemplates(templates);
+    runner.setInterruptFlag(&state.interrupt);
+    runner.setCancelFlag(&state.cancel);
+    std::shared_ptr<llama_model> model;
+    std::string loaded;   // Path and options of the model the runner has
+
+    // Load the model a request names unless it is already loaded with the same settings
+    auto attach = [&](const std::string& path, const std::string& optionsText, std::string& error) {
+        if (model && loaded == path + "\n" + optionsText) {
+            return true;
+        }
+        RunnerOptions options = parseOptions(optionsText);
+        std::shared_ptr<llama_model> next = InferenceRunner::loadModel(path, options, error);
+        if (!next || !runner.init(next, options)) {
+            if (error.empty()) error = runner.getLastError();
+            return false;
+        }
+        model = next;
+        loaded = path + "\n" + optionsText;
+        return true;
+    };
+
+    while (true) {
+        std::vector<std::string> request;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.wake.wait(lock, [&state] { return state.closed || !state.requests.empty(); });
+            if (state.requests.empty()) {
+                break;
+            }
+            request = std::move(state.requests.front());
+            state.requests.pop_front();
+        }
+
+        std::vector<std::string> reply;
+        std::string error;
+        if (request[0] == "load" && request.size() >= 3) {
+            if (attach(request[1], request[2], error) && runner.warmup()) {
+                reply = {"ready"};
+            } else {
+                reply = {"error", error.empty() ? runner.getLastError() : error};
+            }
+        } else if (request[0] == "run" && request.size() >= 9) {
+            RunStatus status;
+            std::string output;
+            if (attach(request[2], request[3], error)) {
+                JobMetadata metadata;
+                parseJobMetadata(request[5], metadata);
+
+                TokenizedInput tokenized;
+                if (!request[7].empty()) {
+                    tokenized.model = model.get();
+                    tokenized.tokens.resize(request[7].size() / sizeof(int32_t));
+                    std::memcpy(tokenized.tokens.data(), request[7].data(),
+                                tokenized.tokens.size() * sizeof(int32_t));
+                }
+                if (request[8] == "1") {
+                    runner.setStreamCallback([fd](const std::string& text) {
+                        writeFrame(fd, {"text", text});
+                    });
+                } else {
+                    runner.setStreamCallback(nullptr);
+                }
+
+                bool success = runner.run(request[6], output, metadata.generation, request[4],
+                                          tokenized.model ? &tokenized : nullptr);
+                status = RunStatus::of(runner, success);
+            } else {
+                status.error = error;
+            }
+            reply = doneFrame(request[1], status, output);
+        } else {
+            reply = {"error", "Unknown request: " + request[0]};
+        }
+
+        if (!writeFrame(fd, reply)) {
+            break;
+        }
+    }
+
+    // Wake the reader if it is still blocked, then leave
+    ::shutdown(fd, SHUT_RDWR);
+    reader.join();
+    close(fd);
+    return 0;
+}
+
+} // namespace pnpl
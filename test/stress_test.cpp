@@ -0,0 +1,474 @@
+// Concurrency and scalability harness for push, monitor and pop, run against the stub
+// llama library (test/stub_llama.cpp) so no model is needed.
+//
+//   pnpl_stress correctness [dir]   Pushers (processes and threads) feed a server that is
+//                                   stopped, killed and restarted under them; every job must
+//                                   finish exactly once with the right result
+//   pnpl_stress disaggregated [dir] The same with prefill workers handing jobs to decode workers
+//   pnpl_stress scale [csv]         Throughput as workers and pushers scale, as CSV
+//
+// serve and push are the child processes the two modes start.
+#include "pnpl/inference_monitor.hpp"
+#include "pnpl/push_manager.hpp"
+#include "pnpl/pop_manager.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <filesystem>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    std::atomic<bool> g_running(true);
+
+    void signalHandler(int) {
+        g_running = false;
+    }
+
+    std::string g_executable;
+
+    struct Layout {
+        std::filesystem::path root;
+        std::string model() const { return (root / "model.gguf").string(); }
+        std::string input() const { return (root / "input").string(); }
+        std::string output() const { return (root / "output").string(); }
+        std::filesystem::path ready() const { return root / "ready"; }
+        std::filesystem::path ledger() const { return root / "ledger.txt"; }
+    };
+
+    Layout makeLayout(const std::filesystem::path& root) {
+        Layout layout{root};
+        std::filesystem::remove_all(root);
+        std::filesystem::create_directories(root);
+        std::ofstream(layout.model()) << "stub model";
+        return layout;
+    }
+
+    // The stub echoes the text between the markers, so each job's result is predictable
+    std::string jobContent(const std::string& payload) {
+        return "Stress job <<" + payload + ">>";
+    }
+
+    // Start this executable with arguments, output going to logPath
+    pid_t spawn(const std::vector<std::string>& args, const std::string& logPath) {
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(g_executable.c_str()));
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        // Only async-signal-safe calls between fork and exec: pusher threads may be running
+        pid_t pid = fork();
+        if (pid == 0) {
+            int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd >= 0) {
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        return pid;
+    }
+
+    bool waitExited(pid_t pid) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    // Start a server and wait until it takes jobs
+    pid_t startServer(const Layout& layout, int workers, int prefillWorkers = 0) {
+        std::error_code ec;
+        std::filesystem::remove(layout.ready(), ec);
+        pid_t pid = spawn({"serve", layout.root.string(), std::to_string(workers), std::to_string(prefillWorkers)},
+                          (layout.root / "server.log").string());
+        auto deadline = Clock::now() + std::chrono::seconds(30);
+        while (!std::filesystem::exists(layout.ready()) && Clock::now() < deadline) {
+            if (waitpid(pid, nullptr, WNOHANG) == pid) {
+                return -1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return pid;
+    }
+
+    // False if a graceful stop didn't end in a clean exit (sanitizer builds exit non-zero
+    // after reporting)
+    bool stopServer(pid_t pid, int signal) {
+        kill(pid, signal);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return signal == SIGKILL || (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // Push count jobs from threads threads, recording "<jobId> <payload>" in pushed-<tag>.txt
+    int pushJobs(const Layout& layout, int count, const std::string& tag, int threads) {
+        pnpl::PushManager pushManager(layout.input());
+        std::mutex mutex;
+        std::vector<std::pair<std::string, std::string>> pushed;
+        std::atomic<int> failures{0};
+        std::atomic<int> next{0};
+
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&] {
+                for (int i = next++; i < count; i = next++) {
+                    std::string payload = tag + "-" + std::to_string(i);
+                    std::string jobId = pushManager.createJob(jobContent(payload));
+                    if (jobId.empty()) {
+                        ++failures;
+                        continue;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pushed.emplace_back(jobId, payload);
+                }
+            });
+        }
+        for (auto& thread : pool) {
+            thread.join();
+        }
+
+        std::ofstream file(layout.root / ("pushed-" + tag + ".txt"));
+        for (const auto& [jobId, payload] : pushed) {
+            file << jobId << " " << payload << "\n";
+        }
+        return failures;
+    }
+
+    std::vector<std::string> jobsIn(const std::string& directory) {
+        std::vector<std::string> jobs;
+        std::error_code ec;
+        if (!std::filesystem::exists(directory, ec)) {
+            return jobs;
+        }
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(directory, ec)) {
+            if (entry.path().extension() == ".txt" && entry.path().filename().string()[0] != '.') {
+                jobs.push_back(entry.path().stem().string());
+            }
+        }
+        return jobs;
+    }
+
+    size_t resultCount(const Layout& layout) {
+        return pnpl::PopManager(layout.output()).listCompleted().size();
+    }
+
+    bool waitForResults(const Layout& layout, size_t expected, std::chrono::seconds timeout) {
+        auto deadline = Clock::now() + timeout;
+        while (resultCount(layout) < expected) {
+            if (Clock::now() > deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        return true;
+    }
+
+    int serve(const std::string& root, int workers, int prefillWorkers) {
+        Layout layout{root};
+        std::signal(SIGTERM, signalHandler);
+        std::signal(SIGINT, signalHandler);
+
+        pnpl::InferenceMonitor monitor(layout.model(), layout.input(), layout.output(), workers);
+        // One node ID across restarts, so a restarted server reclaims its own leases at once
+        monitor.setNodeId("stress", 5);
+        monitor.setPrefillWorkers(prefillWorkers);
+        if (!monitor.start()) {
+            return 1;
+        }
+        std::ofstream(layout.ready()) << getpid();
+
+        while (g_running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        std::cout << monitor.getStatus() << std::endl;
+        monitor.stop();
+        return 0;
+    }
+
+    // Lines of the server log (all runs) that contain text
+    size_t logLines(const Layout& layout, const std::string& text) {
+        std::ifstream log(layout.root / "server.log");
+        size_t count = 0;
+        std::string line;
+        while (std::getline(log, line)) {
+            if (line.find(text) != std::string::npos) ++count;
+        }
+        return count;
+    }
+
+    // prefillWorkers > 0 also checks that jobs went through prefill handoffs
+    int correctness(const std::filesystem::path& root, int prefillWorkers) {
+        const int WORKERS = 4;
+        const int PUSH_PROCESSES = 4;
+        const int THREADS_PER_PROCESS = 4;
+        const int JOBS_PER_PROCESS = 200;
+        const int IN_PROCESS_JOBS = 200;
+
+        Layout layout = makeLayout(root);
+        setenv("PNPL_STUB_LEDGER", layout.ledger().c_str(), 1);
+        setenv("PNPL_STUB_DECODE_US", "3000", 1);
+
+        pid_t server = startServer(layout, WORKERS, prefillWorkers);
+        if (server < 0) {
+            std::cerr << "Server failed to start; see " << (layout.root / "server.log") << std::endl;
+            return 1;
+        }
+
+        std::vector<pid_t> pushers;
+        for (int p = 0; p < PUSH_PROCESSES; ++p) {
+            pushers.push_back(spawn({"push", layout.root.string(), std::to_string(JOBS_PER_PROCESS),
+                                     "p" + std::to_string(p), std::to_string(THREADS_PER_PROCESS)},
+                                    (layout.root / "pushers.log").string()));
+        }
+        std::atomic<int> inProcessFailures{0};
+        std::thread inProcess([&] {
+            inProcessFailures = pushJobs(layout, IN_PROCESS_JOBS, "local", THREADS_PER_PROCESS);
+        });
+
+        // Restart the server under load: gracefully (generations are checkpointed and must
+        // resume, not rerun) and by SIGKILL (jobs it held may run again, nothing else may)
+        bool ok = true;
+        std::set<std::string> atRisk;
+        int restarts = 0;
+        for (int signal : {SIGTERM, SIGKILL, SIGTERM, SIGKILL}) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1200));   // Past the first directory scan
+            if (!stopServer(server, signal)) {
+                std::cerr << "Server exited uncleanly; see " << (layout.root / "server.log") << std::endl;
+                ok = false;
+            }
+            std::vector<std::string> held = jobsIn(layout.input() + "_processing");
+            if (signal == SIGKILL) {
+                atRisk.insert(held.begin(), held.end());
+            }
+            std::cout << (signal == SIGKILL ? "Killed" : "Stopped") << " the server with "
+                      << resultCount(layout) << " results written and " << held.size()
+                      << " jobs claimed" << std::endl;
+            server = startServer(layout, WORKERS, prefillWorkers);
+            if (server < 0) {
+                std::cerr << "Server failed to restart; see " << (layout.root / "server.log") << std::endl;
+                return 1;
+            }
+            ++restarts;
+        }
+
+        for (pid_t pid : pushers) {
+            if (!waitExited(pid)) {
+                std::cerr << "A pusher process failed" << std::endl;
+                ok = false;
+            }
+        }
+        inProcess.join();
+        if (inProcessFailures > 0) {
+            std::cerr << inProcessFailures << " in-process push(es) failed" << std::endl;
+            ok = false;
+        }
+
+        // What was pushed: jobId -> payload
+        std::map<std::string, std::string> pushed;
+        for (const auto& entry : std::filesystem::directory_iterator(layout.root)) {
+            if (entry.path().filename().string().rfind("pushed-", 0) != 0) continue;
+            std::ifstream file(entry.path());
+            std::string jobId, payload;
+            while (file >> jobId >> payload) {
+                if (!pushed.emplace(jobId, payload).second) {
+                    std::cerr << "Job ID " << jobId << " was handed out twice" << std::endl;
+                    ok = false;
+                }
+            }
+        }
+        const size_t expected = static_cast<size_t>(PUSH_PROCESSES * JOBS_PER_PROCESS + IN_PROCESS_JOBS);
+        if (pushed.size() != expected) {
+            std::cerr << "Pushed " << pushed.size() << " jobs, expected " << expected << std::endl;
+            ok = false;
+        }
+
+        if (!waitForResults(layout, pushed.size(), std::chrono::seconds(120))) {
+            std::cerr << "Timed out with " << resultCount(layout) << " of " << pushed.size()
+                      << " results" << std::endl;
+            ok = false;
+        }
+        if (!stopServer(server, SIGTERM)) {
+            std::cerr << "Server exited uncleanly; see " << (layout.root / "server.log") << std::endl;
+            ok = false;
+        }
+
+        // Lost: no result. Wrong: a result that isn't the job's own. Stray: a result nobody pushed.
+        pnpl::PopManager popManager(layout.output());
+        size_t lost = 0, wrong = 0, stray = 0;
+        for (const auto& [jobId, payload] : pushed) {
+            auto result = popManager.popResult(jobId);
+            if (!result) {
+                ++lost;
+            } else if (!result->success || result->outputText != payload) {
+                ++wrong;
+                if (wrong <= 5) {
+                    std::cerr << "Job " << jobId << ": expected \"" << payload << "\", got \""
+                              << result->outputText << "\"" << std::endl;
+                }
+            }
+        }
+        for (const auto& jobId : popManager.listCompleted()) {
+            if (!pushed.count(jobId)) ++stray;
+        }
+        for (const std::string& directory : {layout.input(), layout.input() + "_processing",
+                                             layout.input() + "_failed"}) {
+            size_t left = jobsIn(directory).size();
+            if (left > 0) {
+                std::cerr << left << " job(s) left in " << directory << std::endl;
+                ok = false;
+            }
+        }
+
+        // Processed twice: the stub logs each generation it finishes. Only jobs a killed
+        // server held may have been generated more than once.
+        std::map<std::string, std::string> jobOf;
+        for (const auto& [jobId, payload] : pushed) {
+            jobOf[payload] = jobId;
+        }
+        std::map<std::string, int> generations;
+        std::ifstream ledger(layout.ledger());
+        std::string line;
+        while (std::getline(ledger, line)) {
+            if (jobOf.count(line)) ++generations[line];   // Warm-up generations echo "ok"
+        }
+        size_t duplicated = 0, repeatedAfterKill = 0;
+        for (const auto& [payload, count] : generations) {
+            if (count > 1) {
+                if (atRisk.count(jobOf[payload])) {
+                    ++repeatedAfterKill;
+                } else {
+                    ++duplicated;
+                    if (duplicated <= 5) {
+                        std::cerr << "Job " << jobOf[payload] << " was generated " << count << " times" << std::endl;
+                    }
+                }
+            }
+        }
+
+        size_t handoffs = logLines(layout, "handed off job");
+        if (prefillWorkers > 0 && handoffs == 0) {
+            std::cerr << "No job was handed from a prefill worker to a decode worker" << std::endl;
+            ok = false;
+        }
+
+        ok = ok && lost == 0 && wrong == 0 && stray == 0 && duplicated == 0;
+        std::cout << (ok ? "PASS" : "FAIL") << ": " << pushed.size() << " jobs, " << restarts
+                  << " restarts; lost " << lost << ", wrong " << wrong << ", stray " << stray
+                  << ", processed twice " << duplicated << " (" << repeatedAfterKill
+                  << " rerun after SIGKILL, allowed)";
+        if (prefillWorkers > 0) {
+            std::cout << "; " << prefillWorkers << " prefill workers handed off " << handoffs << " jobs";
+        }
+        std::cout << std::endl;
+        if (ok) {
+            std::filesystem::remove_all(layout.root);
+        } else {
+            std::cerr << "Left " << layout.root << " for inspection" << std::endl;
+        }
+        return ok ? 0 : 1;
+    }
+
+    int scale(const std::filesystem::path& root, const std::string& csvPath) {
+        const int JOBS = 400;
+        setenv("PNPL_STUB_DECODE_US", "1000", 1);
+        unsetenv("PNPL_STUB_LEDGER");
+
+        std::ofstream csv(csvPath);
+        csv << "workers,pushers,jobs,seconds,jobs_per_second\n";
+        std::cout << "workers pushers   jobs/s" << std::endl;
+
+        for (int workers : {1, 2, 4, 8}) {
+            for (int pushers : {1, 2, 4, 8}) {
+                Layout layout = makeLayout(root);
+                pid_t server = startServer(layout, workers);
+                if (server < 0) {
+                    std::cerr << "Server failed to start; see " << (layout.root / "server.log") << std::endl;
+                    return 1;
+                }
+
+                // From the first push to the last result
+                auto started = Clock::now();
+                std::vector<pid_t> pids;
+                for (int p = 0; p < pushers; ++p) {
+                    int count = JOBS / pushers + (p < JOBS % pushers ? 1 : 0);
+                    pids.push_back(spawn({"push", layout.root.string(), std::to_string(count),
+                                          "p" + std::to_string(p), "1"},
+                                         (layout.root / "pushers.log").string()));
+                }
+                for (pid_t pid : pids) {
+                    waitExited(pid);
+                }
+                bool finished = waitForResults(layout, JOBS, std::chrono::seconds(300));
+                double seconds = std::chrono::duration<double>(Clock::now() - started).count();
+                stopServer(server, SIGTERM);
+                if (!finished) {
+                    std::cerr << "Timed out at " << workers << " workers, " << pushers << " pushers" << std::endl;
+                    return 1;
+                }
+
+                double rate = JOBS / seconds;
+                csv << workers << "," << pushers << "," << JOBS << "," << seconds << "," << rate << "\n";
+                std::cout << std::setw(7) << workers << std::setw(8) << pushers
+                          << std::setw(9) << std::fixed << std::setprecision(1) << rate << std::endl;
+            }
+        }
+        std::filesystem::remove_all(root);
+        std::cout << "Wrote " << csvPath << std::endl;
+        return 0;
+    }
+
+    void printUsage(const char* program) {
+        std::cout << "Usage: " << program << " <mode> [args]" << std::endl;
+        std::cout << "  correctness [dir]          Push, restart and check every job finishes exactly once" << std::endl;
+        std::cout << "  disaggregated [dir]        correctness with 2 prefill workers feeding the 4 decode workers" << std::endl;
+        std::cout << "  scale [csv]                Throughput across worker and pusher counts (default: stress_scale.csv)" << std::endl;
+        std::cout << "  serve <dir> <workers> <p>  Run a server with p prefill workers on <dir> (started by the modes above)" << std::endl;
+        std::cout << "  push <dir> <n> <tag> <t>   Push n jobs from t threads (started by the modes above)" << std::endl;
+    }
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    g_executable = std::filesystem::read_symlink("/proc/self/exe").string();
+    std::string mode = argc > 1 ? argv[1] : "";
+    std::filesystem::path scratch = std::filesystem::temp_directory_path() /
+                                    ("pnpl_stress_" + std::to_string(getpid()));
+
+    if (mode == "serve" && argc == 5) {
+        return serve(argv[2], std::atoi(argv[3]), std::atoi(argv[4]));
+    }
+    if (mode == "push" && argc == 6) {
+        return pushJobs(Layout{argv[2]}, std::atoi(argv[3]), argv[4], std::atoi(argv[5])) == 0 ? 0 : 1;
+    }
+    if (mode == "correctness") {
+        return correctness(argc > 2 ? std::filesystem::path(argv[2]) : scratch, 0);
+    }
+    if (mode == "disaggregated") {
+        return correctness(argc > 2 ? std::filesystem::path(argv[2]) : scratch, 2);
+    }
+    if (mode == "scale") {
+        return scale(scratch, argc > 2 ? argv[2] : "stress_scale.csv");
+    }
+
+    printUsage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,435 @@
+// Stand-in for the parts of the llama.cpp API pnpl uses, for tests that exercise the
+// queue, monitor and workers without a model. Tokens are bytes (plus BOS and EOS);
+// generation echoes the text between "<<" and ">>" in the prompt (or "ok"), one token
+// per decode. Knobs, read from the environment:
+//   PNPL_STUB_DECODE_US  time each decode takes, in microseconds (default 200)
+//   PNPL_STUB_LEDGER     file that gets a line with the echoed text per finished generation
+#include "llama.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+    const llama_token BOS = 256;
+    const llama_token EOS = 257;
+    const int32_t N_VOCAB = 258;
+    const int32_t N_EMBD = 8;
+    const int32_t N_CTX_TRAIN = 8192;
+
+    int decodeMicroseconds() {
+        static const int value = [] {
+            const char* env = std::getenv("PNPL_STUB_DECODE_US");
+            return env ? std::atoi(env) : 200;
+        }();
+        return value;
+    }
+
+    void appendLedger(const std::string& line) {
+        const char* path = std::getenv("PNPL_STUB_LEDGER");
+        if (!path) return;
+        // One write per line with O_APPEND: lines from concurrent workers and processes don't interleave
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return;
+        std::string record = line + "\n";
+        ssize_t written = write(fd, record.data(), record.size());
+        (void)written;
+        close(fd);
+    }
+
+} // namespace
+
+struct llama_vocab {
+};
+
+struct llama_model {
+    llama_vocab vocab;
+    uint64_t size = 0;
+};
+
+struct llama_context {
+    llama_model* model = nullptr;
+    llama_context_params params;
+    std::vector<llama_token> history;    // Every token decoded so far
+    size_t promptLength = 0;             // Tokens before the first sample
+    std::string echo;                    // What generation produces
+    std::map<llama_seq_id, std::vector<float>> embeddings;
+};
+
+namespace {
+
+    // Sleep for one decode, in slices so the abort callback is polled like ggml does
+    bool simulateDecode(llama_context* ctx) {
+        int remaining = decodeMicroseconds();
+        do {
+            if (ctx->params.abort_callback && ctx->params.abort_callback(ctx->params.abort_callback_data)) {
+                return false;
+            }
+            int slice = std::min(remaining, 1000);
+            if (slice > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(slice));
+            }
+            remaining -= slice;
+        } while (remaining > 0);
+        return true;
+    }
+
+    std::string echoFor(const std::vector<llama_token>& prompt) {
+        std::string text;
+        for (llama_token token : prompt) {
+            if (token >= 0 && token < 256) text += static_cast<char>(token);
+        }
+        size_t open = text.find("<<");
+        size_t close = open == std::string::npos ? open : text.find(">>", open + 2);
+        if (close == std::string::npos) {
+            return "ok";
+        }
+        return text.substr(open + 2, close - open - 2);
+    }
+
+} // namespace
+
+extern "C" {
+
+void ggml_backend_load_all(void) {
+}
+
+struct llama_model_params llama_model_default_params(void) {
+    llama_model_params params{};
+    params.use_mmap = true;
+    return params;
+}
+
+struct llama_context_params llama_context_default_params(void) {
+    llama_context_params params{};
+    params.n_ctx = 512;
+    params.n_batch = 2048;
+    params.n_ubatch = 512;
+    params.n_seq_max = 1;
+    params.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    params.type_k = GGML_TYPE_F16;
+    params.type_v = GGML_TYPE_F16;
+    return params;
+}
+
+struct llama_sampler_chain_params llama_sampler_chain_default_params(void) {
+    return llama_sampler_chain_params{};
+}
+
+bool llama_supports_mlock(void) {
+    return true;
+}
+
+bool llama_supports_gpu_offload(void) {
+    return false;
+}
+
+struct llama_model* llama_model_load_from_file(const char* path_model, struct llama_model_params) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path_model, ec);
+    if (ec) {
+        return nullptr;
+    }
+    llama_model* model = new llama_model();
+    model->size = size;
+    return model;
+}
+
+void llama_model_free(struct llama_model* model) {
+    delete model;
+}
+
+struct llama_context* llama_init_from_model(struct llama_model* model, struct llama_context_params params) {
+    if (!model || params.n_ctx == 0) {
+        return nullptr;
+    }
+    llama_context* ctx = new llama_context();
+    ctx->model = model;
+    ctx->params = params;
+    return ctx;
+}
+
+void llama_free(struct llama_context* ctx) {
+    delete ctx;
+}
+
+int32_t llama_model_n_ctx_train(const struct llama_model*) {
+    return N_CTX_TRAIN;
+}
+
+int32_t llama_model_n_embd(const struct llama_model*) {
+    return N_EMBD;
+}
+
+uint64_t llama_model_size(const struct llama_model* model) {
+    return model->size;
+}
+
+bool llama_model_has_encoder(const struct llama_model*) {
+    return false;
+}
+
+bool llama_model_has_decoder(const struct llama_model*) {
+    return true;
+}
+
+const struct llama_vocab* llama_model_get_vocab(const struct llama_model* model) {
+    return &model->vocab;
+}
+
+enum llama_pooling_type llama_pooling_type(const struct llama_context* ctx) {
+    return ctx->params.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED ? LLAMA_POOLING_TYPE_NONE
+                                                                      : ctx->params.pooling_type;
+}
+
+int32_t llama_tokenize(const struct llama_vocab*, const char* text, int32_t text_len,
+                       llama_token* tokens, int32_t n_tokens_max, bool add_special, bool) {
+    int32_t needed = text_len + (add_special ? 1 : 0);
+    if (needed > n_tokens_max) {
+        return -needed;
+    }
+    int32_t n = 0;
+    if (add_special) tokens[n++] = BOS;
+    for (int32_t i = 0; i < text_len; ++i) {
+        tokens[n++] = static_cast<unsigned char>(text[i]);
+    }
+    return n;
+}
+
+int32_t llama_token_to_piece(const struct llama_vocab*, llama_token token, char* buf,
+                             int32_t length, int32_t, bool) {
+    if (token >= 256) {
+        return 0;   // Special tokens have no text
+    }
+    if (length < 1) {
+        return -1;
+    }
+    buf[0] = static_cast<char>(token);
+    return 1;
+}
+
+bool llama_vocab_is_eog(const struct llama_vocab*, llama_token token) {
+    return token == EOS;
+}
+
+llama_token llama_vocab_bos(const struct llama_vocab*) {
+    return BOS;
+}
+
+llama_token llama_vocab_eos(const struct llama_vocab*) {
+    return EOS;
+}
+
+int32_t llama_vocab_n_tokens(const struct llama_vocab*) {
+    return N_VOCAB;
+}
+
+struct llama_batch llama_batch_get_one(llama_token* tokens, int32_t n_tokens) {
+    llama_batch batch{};
+    batch.n_tokens = n_tokens;
+    batch.token = tokens;
+    return batch;
+}
+
+struct llama_batch llama_batch_init(int32_t n_tokens, int32_t, int32_t n_seq_max) {
+    llama_batch batch{};
+    batch.token = new llama_token[n_tokens];
+    batch.pos = new llama_pos[n_tokens];
+    batch.n_seq_id = new int32_t[n_tokens];
+    batch.seq_id = new llama_seq_id*[n_tokens + 1];
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        batch.seq_id[i] = new llama_seq_id[n_seq_max];
+    }
+    batch.seq_id[n_tokens] = nullptr;
+    batch.logits = new int8_t[n_tokens];
+    return batch;
+}
+
+void llama_batch_free(struct llama_batch batch) {
+    if (batch.seq_id) {
+        for (int32_t i = 0; batch.seq_id[i]; ++i) {
+            delete[] batch.seq_id[i];
+        }
+    }
+    delete[] batch.token;
+    delete[] batch.pos;
+    delete[] batch.n_seq_id;
+    delete[] batch.seq_id;
+    delete[] batch.logits;
+}
+
+int32_t llama_decode(struct llama_context* ctx, struct llama_batch batch) {
+    if (batch.n_tokens <= 0) {
+        return -1;
+    }
+    if (!simulateDecode(ctx)) {
+        return 2;   // Aborted
+    }
+
+    // Embedding batches: a per-sequence sum of token values, mean-pooled later
+    if (batch.seq_id) {
+        for (int32_t i = 0; i < batch.n_tokens; ++i) {
+            std::vector<float>& sum = ctx->embeddings[batch.seq_id[i][0]];
+            sum.resize(N_EMBD + 1, 0.0f);
+            sum[batch.token[i] % N_EMBD] += 1.0f;
+            sum[N_EMBD] += 1.0f;   // Token count
+        }
+        return 0;
+    }
+
+    if (ctx->history.size() + batch.n_tokens > ctx->params.n_ctx) {
+        return 1;   // No room in the KV cache
+    }
+    ctx->history.insert(ctx->history.end(), batch.token, batch.token + batch.n_tokens);
+    return 0;
+}
+
+int32_t llama_encode(struct llama_context* ctx, struct llama_batch batch) {
+    return llama_decode(ctx, batch);
+}
+
+float* llama_get_embeddings_seq(struct llama_context* ctx, llama_seq_id seq_id) {
+    auto it = ctx->embeddings.find(seq_id);
+    if (it == ctx->embeddings.end()) {
+        return nullptr;
+    }
+    std::vector<float>& sum = it->second;
+    if (sum.size() == N_EMBD + 1) {
+        float count = std::max(1.0f, sum[N_EMBD]);
+        sum.pop_back();
+        for (float& value : sum) value /= count;
+    }
+    return sum.data();
+}
+
+void llama_kv_self_clear(struct llama_context* ctx) {
+    ctx->history.clear();
+    ctx->embeddings.clear();
+    ctx->promptLength = 0;
+}
+
+bool llama_state_save_file(struct llama_context* ctx, const char* path_session,
+                           const llama_token* tokens, size_t n_token_count) {
+    std::ofstream file(path_session, std::ios::binary | std::ios::trunc);
+    uint64_t header[2] = {ctx->promptLength, n_token_count};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(tokens), n_token_count * sizeof(llama_token));
+    return static_cast<bool>(file);
+}
+
+bool llama_state_load_file(struct llama_context* ctx, const char* path_session, llama_token* tokens_out,
+                           size_t n_token_capacity, size_t* n_token_count_out) {
+    std::ifstream file(path_session, std::ios::binary);
+    uint64_t header[2] = {0, 0};
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[1] > n_token_capacity) {
+        return false;
+    }
+    std::vector<llama_token> tokens(header[1]);
+    if (!file.read(reinterpret_cast<char*>(tokens.data()), tokens.size() * sizeof(llama_token))) {
+        return false;
+    }
+    std::copy(tokens.begin(), tokens.end(), tokens_out);
+    *n_token_count_out = tokens.size();
+
+    ctx->history = tokens;
+    ctx->promptLength = header[0];
+    if (ctx->promptLength > 0) {
+        ctx->echo = echoFor(std::vector<llama_token>(tokens.begin(), tokens.begin() + ctx->promptLength));
+    }
+    return true;
+}
+
+// Sequence state: the prompt length and every token decoded so far
+size_t llama_state_seq_get_size(struct llama_context* ctx, llama_seq_id) {
+    return sizeof(uint64_t) + ctx->history.size() * sizeof(llama_token);
+}
+
+size_t llama_state_seq_get_data(struct llama_context* ctx, uint8_t* dst, size_t size, llama_seq_id seq_id) {
+    size_t needed = llama_state_seq_get_size(ctx, seq_id);
+    if (size < needed) {
+        return 0;
+    }
+    uint64_t promptLength = ctx->promptLength;
+    std::memcpy(dst, &promptLength, sizeof(promptLength));
+    std::memcpy(dst + sizeof(promptLength), ctx->history.data(), ctx->history.size() * sizeof(llama_token));
+    return needed;
+}
+
+size_t llama_state_seq_set_data(struct llama_context* ctx, const uint8_t* src, size_t size, llama_seq_id) {
+    uint64_t promptLength = 0;
+    if (size < sizeof(promptLength) || (size - sizeof(promptLength)) % sizeof(llama_token) != 0) {
+        return 0;
+    }
+    std::memcpy(&promptLength, src, sizeof(promptLength));
+    ctx->history.resize((size - sizeof(promptLength)) / sizeof(llama_token));
+    std::memcpy(ctx->history.data(), src + sizeof(promptLength), ctx->history.size() * sizeof(llama_token));
+    ctx->promptLength = promptLength;
+    if (ctx->promptLength > 0) {
+        ctx->echo = echoFor(std::vector<llama_token>(ctx->history.begin(), ctx->history.begin() + ctx->promptLength));
+    }
+    return size;
+}
+
+// Samplers carry no state: the context decides the next token
+struct llama_sampler* llama_sampler_chain_init(struct llama_sampler_chain_params) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+void llama_sampler_chain_add(struct llama_sampler*, struct llama_sampler* smpl) {
+    delete smpl;   // The chain takes ownership
+}
+
+struct llama_sampler* llama_sampler_init_greedy(void) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+struct llama_sampler* llama_sampler_init_dist(uint32_t) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+struct llama_sampler* llama_sampler_init_top_k(int32_t) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+struct llama_sampler* llama_sampler_init_top_p(float, size_t) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+struct llama_sampler* llama_sampler_init_temp(float) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+struct llama_sampler* llama_sampler_init_penalties(int32_t, float, float, float) {
+    return new llama_sampler{nullptr, nullptr};
+}
+
+void llama_sampler_accept(struct llama_sampler*, llama_token) {
+}
+
+void llama_sampler_free(struct llama_sampler* smpl) {
+    delete smpl;
+}
+
+llama_token llama_sampler_sample(struct llama_sampler*, struct llama_context* ctx, int32_t) {
+    if (ctx->promptLength == 0) {
+        ctx->promptLength = ctx->history.size();
+        ctx->echo = echoFor(ctx->history);
+    }
+    size_t generated = ctx->history.size() - ctx->promptLength;
+    if (generated < ctx->echo.size()) {
+        return static_cast<unsigned char>(ctx->echo[generated]);
+    }
+    appendLedger(ctx->echo);
+    return EOS;
+}
+
+} // extern "C"
@@ -0,0 +1,186 @@
+// LeaseManager takeover and loss. Nodes are LeaseManager instances with distinct IDs sharing
+// one directory; threads stand in for servers racing for the same job.
+#include "pnpl/job_lease.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+
+namespace {
+
+    using RenewResult = pnpl::LeaseManager::RenewResult;
+
+    const int NODES = 8;
+    const int ROUNDS = 200;
+
+    bool g_ok = true;
+
+    void check(bool condition, const std::string& message) {
+        if (!condition) {
+            std::cerr << "FAIL: " << message << std::endl;
+            g_ok = false;
+        }
+    }
+
+    // A lease left by a node that died long ago
+    void writeExpired(const std::filesystem::path& path) {
+        std::ofstream(path) << "owner=dead\nexpires=1\n";
+    }
+
+    std::string ownerOf(const std::filesystem::path& path) {
+        pnpl::LeaseInfo lease;
+        return pnpl::LeaseManager::read(path, lease) ? lease.owner : "";
+    }
+
+    void testHoldAndRenew(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "hold.lease";
+        pnpl::LeaseManager a("a", std::chrono::seconds(60));
+        pnpl::LeaseManager b("b", std::chrono::seconds(60));
+
+        check(a.acquire(lease), "a creates a fresh lease");
+        check(!b.acquire(lease), "b cannot take a live lease");
+        check(a.acquire(lease), "a re-acquires its own lease (restart)");
+        check(a.renew(lease) == RenewResult::Renewed, "a renews its lease");
+        check(b.renew(lease) == RenewResult::Lost, "b cannot renew a's lease");
+
+        a.release(lease);
+        check(!std::filesystem::exists(lease), "release removes the lease");
+        check(b.acquire(lease), "b takes a released lease");
+        a.release(lease);
+        check(ownerOf(lease) == "b", "a cannot release b's lease");
+    }
+
+    void testTakeoverAndLoss(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "expire.lease";
+        pnpl::LeaseManager a("a", std::chrono::seconds(1));
+        pnpl::LeaseManager b("b", std::chrono::seconds(60));
+
+        check(a.acquire(lease), "a leases the job");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        check(b.acquire(lease), "b takes over the expired lease");
+        check(ownerOf(lease) == "b", "the lease names b after the takeover");
+        check(a.renew(lease) == RenewResult::Lost, "a sees its lease lost");
+        check(b.renew(lease) == RenewResult::Renewed, "b renews the lease it took");
+    }
+
+    void testUnreadable(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "unreadable.lease";
+        pnpl::LeaseManager a("a", std::chrono::seconds(60));
+        pnpl::LeaseManager b("b", std::chrono::seconds(60));
+
+        check(a.acquire(lease), "a leases the job");
+        std::ofstream(lease, std::ios::trunc).close();
+        check(a.renew(lease) == RenewResult::Failed, "an unreadable lease fails renewal without being lost");
+        check(!b.acquire(lease), "a fresh unreadable lease counts as live");
+
+        std::filesystem::last_write_time(lease, std::filesystem::file_time_type::clock::now() -
+                                                std::chrono::seconds(120));
+        check(b.acquire(lease), "an unreadable lease older than a lease is taken over");
+        check(a.renew(lease) == RenewResult::Lost, "a sees its lease lost after the takeover");
+
+        std::filesystem::remove(lease);
+        check(b.renew(lease) == RenewResult::Lost, "a removed lease is lost");
+    }
+
+    // Every node races for an expired lease: exactly one wins, the rest see it as lost
+    void testContendedTakeover(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "contended.lease";
+        std::vector<pnpl::LeaseManager> nodes;
+        for (int n = 0; n < NODES; ++n) {
+            nodes.emplace_back("node" + std::to_string(n), std::chrono::seconds(60));
+        }
+
+        for (int round = 0; round < ROUNDS; ++round) {
+            writeExpired(lease);
+            std::vector<char> won(NODES, 0);
+            std::vector<std::thread> threads;
+            for (int n = 0; n < NODES; ++n) {
+                threads.emplace_back([&, n] { won[n] = nodes[n].acquire(lease); });
+            }
+            for (auto& thread : threads) thread.join();
+
+            int winners = 0;
+            int renewed = 0;
+            for (int n = 0; n < NODES; ++n) {
+                winners += won[n];
+                RenewResult result = nodes[n].renew(lease);
+                renewed += result == RenewResult::Renewed;
+                if (!won[n]) {
+                    check(result == RenewResult::Lost, "a node that lost the race cannot renew");
+                }
+            }
+            check(winners == 1, "round " + std::to_string(round) + ": " + std::to_string(winners) +
+                                " nodes took over one lease");
+            check(renewed == 1, "round " + std::to_string(round) + ": exactly one node holds the lease");
+            std::filesystem::remove(lease);
+        }
+    }
+
+    // A live lease is never displaced, however many nodes try while its holder renews it
+    void testLiveLeaseKept(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "live.lease";
+        pnpl::LeaseManager holder("holder", std::chrono::seconds(60));
+        check(holder.acquire(lease), "the holder leases the job");
+
+        std::atomic<bool> done{false};
+        std::atomic<int> stolen{0};
+        std::vector<std::thread> threads;
+        for (int n = 0; n < NODES; ++n) {
+            threads.emplace_back([&, n] {
+                pnpl::LeaseManager node("node" + std::to_string(n), std::chrono::seconds(60));
+                while (!done) {
+                    if (node.acquire(lease)) ++stolen;
+                }
+            });
+        }
+        for (int i = 0; i < 2000; ++i) {
+            check(holder.renew(lease) == RenewResult::Renewed, "the holder keeps renewing its lease");
+        }
+        done = true;
+        for (auto& thread : threads) thread.join();
+        check(stolen == 0, std::to_string(stolen.load()) + " acquisitions of a live lease succeeded");
+    }
+
+    // A takeover lock left by a node that died mid-takeover doesn't block the job for good
+    void testAbandonedLock(const std::filesystem::path& directory) {
+        std::filesystem::path lease = directory / "locked.lease";
+        std::filesystem::path lock = lease;
+        lock += ".lock";
+        writeExpired(lease);
+        writeExpired(lock);
+
+        pnpl::LeaseManager a("a", std::chrono::seconds(60));
+        check(!a.acquire(lease), "a takeover waits while the lock is present");
+        check(a.acquire(lease), "the abandoned lock is cleared and the lease taken over");
+        check(!std::filesystem::exists(lock), "the lock is gone after the takeover");
+    }
+
+} // namespace
+
+int main() {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "pnpl_test_lease";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    testHoldAndRenew(directory);
+    testTakeoverAndLoss(directory);
+    testUnreadable(directory);
+    testContendedTakeover(directory);
+    testLiveLeaseKept(directory);
+    testAbandonedLock(directory);
+
+    // Temporary, lock and stale files must all have been cleaned up
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() != ".lease") {
+            check(false, "left behind: " + entry.path().filename().string());
+        }
+    }
+    std::filesystem::remove_all(directory);
+
+    std::cout << (g_ok ? "PASS" : "FAIL") << ": lease creation, renewal, takeover and loss" << std::endl;
+    return g_ok ? 0 : 1;
+}
@@ -0,0 +1,297 @@
+// PopManager consumption under concurrency, incremental export, and result retention sweeps. Several processes,
+// each with several threads, consume from one output directory: every result must go to
+// exactly one of them and leave nothing behind.
+#include "pnpl/pop_manager.hpp"
+#include "pnpl/result_file.hpp"
+#include "pnpl/result_retention.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace {
+
+    const int PROCESSES = 4;
+    const int THREADS = 4;
+    const int RESULTS = 400;
+
+    bool g_ok = true;
+
+    void check(bool condition, const std::string& message) {
+        if (!condition) {
+            std::cerr << "FAIL: " << message << std::endl;
+            g_ok = false;
+        }
+    }
+
+    std::string jobId(int n) {
+        std::stringstream ss;
+        ss << "20261018120000_" << std::setw(6) << std::setfill('0') << n;
+        return ss.str();
+    }
+
+    // Results with a .meta sidecar on every other one; compressed ones too if this build can
+    void writeResults(const std::filesystem::path& directory, int count) {
+        std::filesystem::create_directories(directory);
+        for (int n = 0; n < count; ++n) {
+            std::string ext = (n % 3 == 0 && pnpl::resultCompressionAvailable()) ? ".txt.gz" : ".txt";
+            std::string error;
+            pnpl::writeResultFile(directory / (jobId(n) + ext), "result " + std::to_string(n), error);
+            if (n % 2 == 0) {
+                std::ofstream(directory / (jobId(n) + ".meta")) << "loop=stopped\n";
+            }
+        }
+    }
+
+    size_t filesLeft(const std::filesystem::path& directory) {
+        size_t count = 0;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+            if (entry.is_regular_file()) ++count;
+        }
+        return count;
+    }
+
+    // Consume from THREADS threads until nothing is left, writing "<id> <text>" lines to out
+    void consumeAll(const std::filesystem::path& directory, bool byId, std::ostream& out) {
+        pnpl::PopManager popManager(directory.string());
+        std::mutex mutex;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&, t] {
+                std::vector<int> order(RESULTS);
+                for (int n = 0; n < RESULTS; ++n) order[n] = n;
+                std::shuffle(order.begin(), order.end(), std::mt19937(getpid() * 31 + t));
+
+                for (size_t i = 0;; ++i) {
+                    std::optional<pnpl::JobResult> result;
+                    if (byId) {
+                        if (i == order.size()) break;
+                        result = popManager.consumeResult(jobId(order[i]));
+                        if (!result) continue;
+                    } else {
+                        result = popManager.consumeLatest();
+                        if (!result) break;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    out << result->id << " " << result->outputText << "\n";
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void testConcurrentConsume(const std::filesystem::path& root, bool byId) {
+        std::filesystem::path directory = root / (byId ? "by_id" : "latest");
+        writeResults(directory, RESULTS);
+
+        std::vector<pid_t> children;
+        for (int p = 1; p < PROCESSES; ++p) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                std::ofstream out(root / ("consumed-" + std::to_string(getpid())));
+                consumeAll(directory, byId, out);
+                out.close();
+                _exit(0);
+            }
+            children.push_back(pid);
+        }
+        {
+            std::ofstream out(root / ("consumed-" + std::to_string(getpid())));
+            consumeAll(directory, byId, out);
+        }
+        for (pid_t pid : children) {
+            waitpid(pid, nullptr, 0);
+        }
+
+        std::map<std::string, int> times;
+        bool contentOk = true;
+        for (const auto& entry : std::filesystem::directory_iterator(root)) {
+            if (entry.path().filename().string().rfind("consumed-", 0) != 0) continue;
+            std::ifstream file(entry.path());
+            std::string id, word, n;
+            while (file >> id >> word >> n) {
+                ++times[id];
+                contentOk = contentOk && id == jobId(std::stoi(n));
+            }
+            std::filesystem::remove(entry.path());
+        }
+
+        size_t twice = std::count_if(times.begin(), times.end(), [](const auto& t) { return t.second > 1; });
+        std::string mode = byId ? "consumeResult" : "consumeLatest";
+        check(times.size() == RESULTS, mode + ": " + std::to_string(times.size()) + " of " +
+                                       std::to_string(RESULTS) + " results consumed");
+        check(twice == 0, mode + ": " + std::to_string(twice) + " results consumed more than once");
+        check(contentOk, mode + ": a consumer got another job's text");
+        check(filesLeft(directory) == 0, mode + ": " + std::to_string(filesLeft(directory)) +
+                                         " files left behind");
+    }
+
+    // Export to a file and return the job IDs in the stream, in order
+    std::vector<std::string> exportIds(const std::filesystem::path& directory, const pnpl::ExportRange& range,
+                                       pnpl::ExportSummary& summary) {
+        std::filesystem::path streamPath = directory.parent_path() / "export.pnpl";
+        int fd = ::open(streamPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        std::string error;
+        summary = pnpl::ExportSummary();
+        check(pnpl::PopManager(directory.string()).exportResults(range, fd, summary, error), "export: " + error);
+        ::close(fd);
+
+        std::vector<std::string> ids;
+        std::ifstream stream(streamPath, std::ios::binary);
+        std::string id, encoding;
+        size_t bytes = 0;
+        int64_t completedMs = 0;
+        while (stream >> id >> encoding >> bytes >> completedMs) {
+            ids.push_back(id);
+            stream.ignore(static_cast<std::streamsize>(bytes) + 2);   // Header newline, payload, newline
+        }
+        return ids;
+    }
+
+    // Resuming from the last record exported: picks up a result renamed into place after
+    // a later-written one was exported, and works once the resume point's result is gone
+    void testExportResume(const std::filesystem::path& root) {
+        std::filesystem::path directory = root / "export";
+        std::filesystem::create_directories(directory);
+        auto write = [&](int n) {
+            std::string error;
+            pnpl::writeResultFile(directory / (jobId(n) + ".txt"), "result " + std::to_string(n), error);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        };
+
+        write(0);
+        write(1);
+        pnpl::ExportSummary summary;
+        check(exportIds(directory, pnpl::ExportRange(), summary) == std::vector<std::string>{jobId(0), jobId(1)},
+              "a full export has every result in completion order");
+        pnpl::ExportRange cursor;
+        cursor.afterJobId = summary.lastJobId;
+        cursor.afterMs = summary.lastCompletedMs;
+        check(cursor.afterJobId == jobId(1), "the resume point is the last result exported");
+
+        // Written before job 1 but renamed into place after the export, then one written later
+        std::filesystem::path late = directory / (jobId(2) + ".txt");
+        std::ofstream(late) << "result 2";
+        std::filesystem::last_write_time(late, std::filesystem::last_write_time(directory / (jobId(1) + ".txt")) -
+                                               std::chrono::milliseconds(10));
+        write(3);
+
+        std::vector<std::string> expected{jobId(2), jobId(3)};
+        check(exportIds(directory, cursor, summary) == expected, "resuming skipped a late result or repeated one");
+        check(summary.lastJobId == jobId(3), "a late result moved the resume point back");
+
+        // The resume point's result is consumed: the cursor still works, and so does the bare ID
+        check(pnpl::PopManager(directory.string()).consumeResult(jobId(1)).has_value(), "consume job 1");
+        check(exportIds(directory, cursor, summary) == expected, "resuming after the resume point was consumed");
+        pnpl::ExportRange bare;
+        bare.afterJobId = jobId(1);
+        exportIds(directory, bare, summary);   // Starts from the job's creation; must not fail
+    }
+
+    void setAge(const std::filesystem::path& path, std::chrono::seconds age) {
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now() - age);
+    }
+
+    void testRetention(const std::filesystem::path& root) {
+        std::filesystem::path directory = root / "retention";
+
+        // Ten results, one a minute apart: job 0 is the oldest
+        auto reset = [&] {
+            std::filesystem::remove_all(directory);
+            std::filesystem::create_directories(directory);
+            for (int n = 0; n < 10; ++n) {
+                std::filesystem::path path = directory / (jobId(n) + ".txt");
+                std::ofstream(path) << std::string(1000, 'x');
+                std::ofstream(directory / (jobId(n) + ".meta")) << "loop=stopped\n";
+                setAge(path, std::chrono::minutes(10 - n));
+            }
+        };
+        auto remaining = [&] {
+            return pnpl::PopManager(directory.string()).listCompleted();
+        };
+
+        reset();
+        pnpl::RetentionPolicy age;
+        age.maxAgeSeconds = 5 * 60 + 30;
+        pnpl::RetentionSweep sweep = pnpl::enforceRetention(directory, age);
+        check(sweep.removed == 5 && remaining().front() == jobId(5), "retention by age kept the wrong results");
+        check(!std::filesystem::exists(directory / (jobId(0) + ".meta")), "retention left a removed result's sidecar");
+
+        reset();
+        pnpl::RetentionPolicy count;
+        count.maxResults = 3;
+        sweep = pnpl::enforceRetention(directory, count);
+        check(sweep.kept == 3 && remaining() == std::vector<std::string>{jobId(7), jobId(8), jobId(9)},
+              "retention by count kept the wrong results");
+
+        reset();
+        pnpl::RetentionPolicy bytes;
+        bytes.maxBytes = 4500;
+        sweep = pnpl::enforceRetention(directory, bytes);
+        check(sweep.kept == 4 && sweep.keptBytes == 4000, "retention by size kept the wrong results");
+
+        // A result being consumed right now is not the reaper's
+        reset();
+        std::filesystem::path claimed = pnpl::consumingPath(directory / (jobId(9) + ".txt"));
+        std::filesystem::rename(directory / (jobId(9) + ".txt"), claimed);
+        sweep = pnpl::enforceRetention(directory, count);
+        check(std::filesystem::exists(claimed) && sweep.abandoned == 0, "retention removed a live claim");
+
+        // Sidecars whose result was consumed before they were written are swept once old,
+        // and only then
+        reset();
+        std::filesystem::path orphan = directory / (jobId(20) + ".timing");
+        std::filesystem::path freshOrphan = directory / (jobId(21) + ".meta");
+        std::ofstream(orphan) << "finished_ms=1\n";
+        std::ofstream(freshOrphan) << "loop=stopped\n";
+        setAge(orphan, std::chrono::minutes(20));
+        setAge(directory / (jobId(9) + ".meta"), std::chrono::minutes(20));
+        pnpl::RetentionPolicy lenient;
+        lenient.maxResults = 100;
+        sweep = pnpl::enforceRetention(directory, lenient);
+        check(!std::filesystem::exists(orphan) && sweep.orphaned == 1, "retention left an old orphaned sidecar");
+        check(std::filesystem::exists(freshOrphan), "retention removed a sidecar whose result may be on its way");
+        check(std::filesystem::exists(directory / (jobId(9) + ".meta")), "retention removed a kept result's sidecar");
+
+        int64_t seconds = 0;
+        check(pnpl::parseRetentionAge("7d", seconds) && seconds == 7 * 86400, "parseRetentionAge(7d)");
+        check(pnpl::parseRetentionAge("90", seconds) && seconds == 90, "parseRetentionAge(90)");
+        check(!pnpl::parseRetentionAge("1w", seconds) && !pnpl::parseRetentionAge("h", seconds),
+              "parseRetentionAge accepted junk");
+    }
+
+} // namespace
+
+int main() {
+    std::filesystem::path root = std::filesystem::temp_directory_path() /
+                                 ("pnpl_test_pop_" + std::to_string(getpid()));
+    std::filesystem::create_directories(root);
+
+    testConcurrentConsume(root, false);
+    testConcurrentConsume(root, true);
+    testExportResume(root);
+    testRetention(root);
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    std::cout << (g_ok ? "PASS" : "FAIL") << ": " << PROCESSES << " processes x " << THREADS
+              << " threads consuming " << RESULTS << " results; export resume; retention sweeps" << std::endl;
+    return g_ok ? 0 : 1;
+}
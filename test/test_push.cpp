@@ -0,0 +1,117 @@
+// PushManager under concurrency: several processes, each with several threads, push into
+// one input directory. Every job must get its own ID and arrive intact.
+#include "pnpl/push_manager.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace {
+
+    const int PROCESSES = 4;
+    const int THREADS = 4;
+    const int JOBS_PER_THREAD = 100;
+
+    std::string payload(int process, int thread, int job) {
+        return "process " + std::to_string(process) + " thread " + std::to_string(thread) +
+               " job " + std::to_string(job);
+    }
+
+    // Push this process's share of the jobs from THREADS threads; the number of failed pushes
+    int pushAll(const std::string& inputDir, int process) {
+        pnpl::PushManager pushManager(inputDir);
+        std::atomic<int> failures{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&, t] {
+                for (int j = 0; j < JOBS_PER_THREAD; ++j) {
+                    if (pushManager.createJob(payload(process, t, j)).empty()) {
+                        ++failures;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return failures;
+    }
+
+} // namespace
+
+int main() {
+    std::filesystem::path root = std::filesystem::temp_directory_path() /
+                                 ("pnpl_test_push_" + std::to_string(getpid()));
+    std::string inputDir = (root / "input").string();
+    std::filesystem::create_directories(inputDir);
+
+    // Other processes share only the directory (and its counter file) with this one
+    std::vector<pid_t> children;
+    for (int p = 1; p < PROCESSES; ++p) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(pushAll(inputDir, p) == 0 ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+
+    int failures = pushAll(inputDir, 0);
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ++failures;
+        }
+    }
+
+    std::set<std::string> expected;
+    for (int p = 0; p < PROCESSES; ++p) {
+        for (int t = 0; t < THREADS; ++t) {
+            for (int j = 0; j < JOBS_PER_THREAD; ++j) {
+                expected.insert(payload(p, t, j));
+            }
+        }
+    }
+
+    // A duplicate ID overwrites another job's file, so the contents would come up short
+    pnpl::PushManager pushManager(inputDir);
+    std::vector<std::string> jobs = pushManager.listJobs();
+    std::set<std::string> ids(jobs.begin(), jobs.end());
+    std::multiset<std::string> contents;
+    for (const auto& id : jobs) {
+        std::ifstream file(std::filesystem::path(inputDir) / (id + ".txt"));
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        contents.insert(buffer.str());
+    }
+
+    bool ok = true;
+    if (failures > 0) {
+        std::cerr << failures << " push(es) failed" << std::endl;
+        ok = false;
+    }
+    if (jobs.size() != expected.size() || ids.size() != jobs.size()) {
+        std::cerr << "Expected " << expected.size() << " jobs, found " << jobs.size()
+                  << " (" << ids.size() << " distinct IDs)" << std::endl;
+        ok = false;
+    }
+    if (std::set<std::string>(contents.begin(), contents.end()) != expected || contents.size() != expected.size()) {
+        std::cerr << "Job contents don't match what was pushed" << std::endl;
+        ok = false;
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+
+    std::cout << (ok ? "PASS" : "FAIL") << ": " << PROCESSES << " processes x " << THREADS
+              << " threads x " << JOBS_PER_THREAD << " jobs" << std::endl;
+    return ok ? 0 : 1;
+}
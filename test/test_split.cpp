@@ -0,0 +1,91 @@
+// InferenceRunner::splitInput against the stub tokenizer (one token per byte): a long file
+// with sparse boundary lines and lines nearly a chunk long must split into chunks within the
+// chunk budget, and lose nothing.
+#include "pnpl/inference_runner.hpp"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+namespace {
+
+    const int CONTEXT = 2048;
+    const int MAX_TOKENS = 256;
+
+    bool g_ok = true;
+
+    void check(bool condition, const std::string& message) {
+        if (!condition) {
+            std::cerr << "FAIL: " << message << std::endl;
+            g_ok = false;
+        }
+    }
+
+    std::string line(int n, size_t length) {
+        std::string text = "    statement_" + std::to_string(n) + "();";
+        text.resize(length - 1, ' ');
+        return text + "\n";
+    }
+
+    // Runs of short lines with a blank line past the middle of a chunk, then a few more
+    // short lines and one line nearly a chunk long: cutting at the blank line alone leaves
+    // too little room for the long one
+    std::string sparseBoundaries(int budget) {
+        std::string input;
+        int n = 0;
+        for (int block = 0; block < 12; ++block) {
+            for (int used = 0; used < budget * 3 / 5; used += 40) input += line(n++, 40);
+            input += "\n";
+            for (int used = 0; used < budget / 4; used += 40) input += line(n++, 40);
+            input += line(n++, static_cast<size_t>(budget) * 4 / 5);
+            for (int i = 0; i < block % 4; ++i) input += line(n++, 40);
+        }
+        return input;
+    }
+
+} // namespace
+
+int main() {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "pnpl_test_split";
+    std::filesystem::create_directories(directory);
+    std::filesystem::path model = directory / "model.gguf";
+    std::ofstream(model) << "stub model";
+
+    pnpl::RunnerOptions options;
+    options.contextSize = CONTEXT;
+    pnpl::InferenceRunner runner;
+    if (!runner.init(model.string(), options)) {
+        std::cerr << "FAIL: " << runner.getLastError() << std::endl;
+        return 1;
+    }
+
+    pnpl::GenerationParams params;
+    params.maxTokens = MAX_TOKENS;
+
+    // A line longer than any chunk is cut into pieces of exactly the chunk budget
+    std::vector<std::string> chunks;
+    check(runner.splitInput(std::string(CONTEXT * 2, 'x'), params, chunks) && !chunks.empty(),
+          "splitting one long line");
+    const int budget = chunks.empty() ? 0 : static_cast<int>(chunks[0].size());
+    check(budget > 0 && budget < CONTEXT - MAX_TOKENS - 100, "the chunk budget leaves room for the generation");
+
+    std::string input = sparseBoundaries(budget);
+    check(runner.splitInput(input, params, chunks), "splitInput: " + runner.getLastError());
+    check(chunks.size() > 1, "the input is split");
+
+    std::string joined;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        check(static_cast<int>(chunks[i].size()) <= budget,
+              "chunk " + std::to_string(i) + " has " + std::to_string(chunks[i].size()) +
+              " tokens, more than the budget of " + std::to_string(budget));
+        check(!chunks[i].empty(), "chunk " + std::to_string(i) + " is empty");
+        joined += chunks[i];
+    }
+    check(joined == input, "the chunks add up to the input");
+
+    std::filesystem::remove_all(directory);
+    std::cout << (g_ok ? "PASS" : "FAIL") << ": " << input.size() << " tokens split into "
+              << chunks.size() << " chunks" << std::endl;
+    return g_ok ? 0 : 1;
+}